@@ -4,31 +4,274 @@
  * @brief Definition of libacrypt functions.
  ****************************************************************************/
 
+#ifndef __ACRYPT_H
+#define __ACRYPT_H
+
 /****************************************************************************
  * Included Files
  ****************************************************************************/
 
+#include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
+#ifndef CRYPT_FREESTANDING
+#  include <sys/types.h>
+#endif
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+/* The crypt program encrypts its input in blocks of this size and every
+ * block restarts the keystream, so this is part of its file format.
+ */
+
+#define CRYPT_BLOCK_SIZE 1024
+
+/* Unit decrypted and cached by crypt_cache_pread() */
+
+#define CRYPT_CACHE_PAGE_SIZE (4 * CRYPT_BLOCK_SIZE)
+
+/* Largest packet payload, also the keystream span of one sequence number */
+
+#define CRYPT_PACKET_MAX 65536
+
+/* Largest sequence number, the keystream of a larger one would wrap */
+
+#define CRYPT_PACKET_SEQ_MAX (UINT64_MAX / CRYPT_PACKET_MAX)
+
+/* Big endian sequence number in front of every datagram */
+
+#define CRYPT_PACKET_HEADER 8
+
+/* Share of a job a worker of the pool encrypts at once */
+
+#define CRYPT_POOL_SLICE (256 * 1024)
+
+/* Longest buffer crypt_small_at() encrypts inline */
+
+#define CRYPT_SMALL_MAX 64
+
+/* Largest key of a struct crypt_static, the build may change it */
+
+#ifndef CRYPT_STATIC_KEY_MAX
+#  define CRYPT_STATIC_KEY_MAX 64
+#endif
+
+/* Most engines crypt_engine_register() keeps, built-in ones included */
+
+#define CRYPT_ENGINE_MAX 8
+
+/* Key material of the ChaCha20 engine: the key, optionally the nonce */
+
+#define CRYPT_CHACHA20_KEY   32
+#define CRYPT_CHACHA20_NONCE 8
+
+/* Key material of the AES-256-CTR engine: the key, optionally the
+ * initial counter block
+ */
+
+#define CRYPT_AES256_KEY 32
+#define CRYPT_AES256_IV  16
+
+/* Poly1305 key and tag, the tag also authenticates crypt_aead_seal() */
+
+#define CRYPT_POLY1305_KEY 32
+#define CRYPT_AEAD_TAG     16
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+struct crypt_engine;
+
 /** @struct crypt_context
  *  @brief This structure saves the current context
  *  @var crypt_context::key
  *  Member 'key' contains a pointer to user supplied key
  *  @var crypt_context::keylen
  *  Member 'keylen' contains the length of user key.
+ *  @var crypt_context::engine
+ *  Member 'engine' is the cipher, NULL for the original one ("xor").
  */
 
 struct crypt_context
 {
-  uint8_t *key;    /* Pointer to user supplied key */
-  int      keylen; /* Length of user key */
+  uint8_t *key;                      /* Pointer to user supplied key */
+  int      keylen;                   /* Length of user key */
+  const struct crypt_engine *engine; /* Cipher, NULL for "xor" */
+};
+
+/** @struct crypt_engine
+ *  @brief Cipher of a context, see crypt_engine_find()
+ *  @var crypt_engine::name
+ *  Member 'name' is the unique name of the engine
+ *  @var crypt_engine::crypt
+ *  Member 'crypt' encrypts 'length' bytes from keystream position
+ *  'offset', like crypt_buffer_at(). The context is not NULL and has a
+ *  key, the engine checks its length.
+ */
+
+struct crypt_engine
+{
+  const char *name;                       /* unique name           */
+  int (*crypt)(const struct crypt_context *context, uint8_t *output,
+               const uint8_t *input, size_t length,
+               uint64_t offset);          /* seekable stream cipher */
+};
+
+/* Built-in engines, also found by name */
+
+extern const struct crypt_engine crypt_engine_xor;
+extern const struct crypt_engine crypt_engine_chacha20;
+extern const struct crypt_engine crypt_engine_aes256_ctr;
+
+/** @struct crypt_static
+ *  @brief Context with its own copy of the key, no allocation needed
+ *  @var crypt_static::context
+ *  Member 'context' is the context to pass to the other functions
+ *  @var crypt_static::key
+ *  Member 'key' is the copy of the key 'context' points to
+ */
+
+struct crypt_static
+{
+  struct crypt_context context;       /* points to 'key' */
+  uint8_t key[CRYPT_STATIC_KEY_MAX];  /* copy of the key */
+};
+
+/** @struct crypt_stream
+ *  @brief Fixed size state of an encryption done in pieces
+ *  @var crypt_stream::context
+ *  Member 'context' is the key of the stream
+ *  @var crypt_stream::offset
+ *  Member 'offset' is the keystream position of the next byte
+ */
+
+struct crypt_stream
+{
+  const struct crypt_context *context; /* key of the stream       */
+  uint64_t offset;                     /* position of next byte   */
+};
+
+/** @struct crypt_pingpong
+ *  @brief Two buffers filled in turn by a DMA, see crypt_pingpong_start()
+ *  @var crypt_pingpong::buffer
+ *  Member 'buffer' are the two buffers, encrypted in place
+ *  @var crypt_pingpong::size
+ *  Member 'size' is the size of each buffer
+ *  @var crypt_pingpong::chunk
+ *  Member 'chunk' is the most bytes one poll encrypts, 0 for 'size'
+ *  @var crypt_pingpong::ready
+ *  Member 'ready' receives every buffer once it is encrypted
+ *  @var crypt_pingpong::arg
+ *  Member 'arg' is free for the caller
+ *
+ *  The other members are private.
+ */
+
+struct crypt_pingpong
+{
+  uint8_t *buffer[2];                  /* filled by the DMA in turn */
+  size_t size;                         /* size of each buffer       */
+  size_t chunk;                        /* bytes per poll at most    */
+  void (*ready)(struct crypt_pingpong *pp, uint8_t *data,
+                size_t length);        /* encrypted buffer          */
+  void *arg;                           /* free for the caller       */
+
+  struct crypt_stream stream;          /* keystream of the transfer */
+  size_t length[2];                    /* bytes in each buffer      */
+  size_t pos;                          /* bytes encrypted so far    */
+  unsigned current;                    /* buffer being encrypted    */
+  unsigned full[2];                    /* set by DMA, cleared by us */
+};
+
+/** @struct crypt_poly1305
+ *  @brief State of a Poly1305 MAC, see crypt_poly1305_init()
+ *
+ *  All the members are private. The size does not depend on the limbs
+ *  the library was built with.
+ */
+
+struct crypt_poly1305
+{
+  union
+  {
+    uint64_t l44[3];                   /* three 44-bit limbs        */
+    uint32_t l26[5];                   /* or five 26-bit limbs      */
+  } r, h;                              /* key part r, accumulator   */
+  uint32_t power[4][5];                /* r to r^4 for the vectors  */
+  uint32_t pad[4];                     /* key part s                */
+  uint8_t buffer[16];                  /* partial block             */
+  unsigned leftover;                   /* bytes in 'buffer'         */
+};
+
+/** @struct crypt_aead
+ *  @brief Authenticated encryption done in pieces, see crypt_aead_init()
+ *
+ *  All the members are private.
+ */
+
+struct crypt_aead
+{
+  const struct crypt_context *context; /* ChaCha20 key of message   */
+  uint64_t offset;                     /* position of next byte     */
+  uint64_t adlen;                      /* bytes of associated data  */
+  uint64_t length;                     /* bytes of text so far      */
+  struct crypt_poly1305 poly;          /* MAC of the ciphertext     */
+};
+
+#ifndef CRYPT_FREESTANDING
+
+/** @struct crypt_job
+ *  @brief Encryption run by the worker pool, see crypt_pool_submit()
+ *  @var crypt_job::context
+ *  Member 'context' is the key, it must stay valid until 'done' is called
+ *  @var crypt_job::output
+ *  Member 'output' is the output buffer, may be equal to 'input'
+ *  @var crypt_job::input
+ *  Member 'input' is the input buffer
+ *  @var crypt_job::length
+ *  Member 'length' is the size of input and output buffers
+ *  @var crypt_job::offset
+ *  Member 'offset' is the keystream position of the first byte
+ *  @var crypt_job::done
+ *  Member 'done' is called on a worker thread once the job is finished
+ *  @var crypt_job::arg
+ *  Member 'arg' is free for the caller
+ *
+ *  The other members are private to the pool.
+ */
+
+struct crypt_job
+{
+  const struct crypt_context *context;   /* key of the job              */
+  uint8_t *output;                       /* output buffer               */
+  const uint8_t *input;                  /* input buffer                */
+  size_t length;                         /* size of both buffers        */
+  uint64_t offset;                       /* keystream position          */
+  void (*done)(struct crypt_job *job, int result); /* completion        */
+  void *arg;                             /* free for the caller         */
+
+  struct crypt_job *next;                /* next job in the queue       */
+  size_t claimed;                        /* bytes given to workers      */
+  unsigned pending;                      /* slices still being run      */
+  int result;                            /* first error of a slice      */
 };
 
+/** @struct crypt_cache
+ *  @brief Opaque cache of decrypted pages, see crypt_cache_open()
+ */
+
+struct crypt_cache;
+
+/* From <sys/socket.h>, only used through pointers here */
+
+struct mmsghdr;
+
+#endif /* CRYPT_FREESTANDING */
+
 /**
  * @brief Encrypts an input string of size length with a predefined key.
  *
@@ -44,6 +287,495 @@ struct crypt_context
 int crypt_buffer(struct crypt_context *context, uint8_t *output,
                  const uint8_t *input, unsigned length);
 
+/**
+ * @brief Encrypts a buffer starting at a given keystream position.
+ *
+ * Produces the same bytes crypt_buffer() would produce for the range
+ * [offset, offset + length) of a single longer buffer, without having
+ * to process the bytes before it.
+ *
+ * @param context current context state pointer
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset keystream position of the first byte
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_buffer_at(const struct crypt_context *context, uint8_t *output,
+                    const uint8_t *input, size_t length, uint64_t offset);
+
+/**
+ * @brief Encrypts a window of a file produced by the crypt program.
+ *
+ * Applies the CRYPT_BLOCK_SIZE keystream restart used by the crypt
+ * program, so any part of its output can be decrypted in isolation.
+ * Other engines than "xor" never reuse their keystream, the file offset
+ * is their keystream position.
+ *
+ * @param context current context state pointer
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset file offset of the first byte
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_file_at(const struct crypt_context *context, uint8_t *output,
+                  const uint8_t *input, size_t length, uint64_t offset);
+
+/**
+ * @brief Finds an engine by name.
+ *
+ * @param name name of the engine, "xor", "chacha20" and "aes256-ctr"
+ *        are built in
+ *
+ * @return The engine, or NULL if no engine has this name.
+ *
+ */
+
+const struct crypt_engine *crypt_engine_find(const char *name);
+
+/**
+ * @brief Adds an engine to those crypt_engine_find() knows.
+ *
+ * Not thread safe, engines are meant to be registered at startup. The
+ * engine must stay valid as long as it may be used.
+ *
+ * @param engine engine with a name and a crypt function
+ *
+ * @return 0 indicating success, -EEXIST if the name is taken, -ENOSPC
+ *         past CRYPT_ENGINE_MAX engines, or -EINVAL.
+ *
+ */
+
+int crypt_engine_register(const struct crypt_engine *engine);
+
+/**
+ * @brief Copies a key into a statically sized context.
+ *
+ * Nothing is allocated, the context can be a static variable. Use
+ * &ctx->context with the other functions, its engine is "xor" until
+ * ctx->context.engine is set.
+ *
+ * @param ctx context to fill
+ * @param key key bytes
+ * @param keylen length of the key, 1 to CRYPT_STATIC_KEY_MAX
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_static_init(struct crypt_static *ctx, const uint8_t *key,
+                      size_t keylen);
+
+/**
+ * @brief Wipes the key of a statically sized context.
+ *
+ * @param ctx context filled by crypt_static_init()
+ *
+ */
+
+void crypt_static_wipe(struct crypt_static *ctx);
+
+/**
+ * @brief Starts a stream at a given keystream position.
+ *
+ * @param stream stream state to fill
+ * @param context key of the stream, valid while the stream is used
+ * @param offset keystream position of the first byte
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_stream_init(struct crypt_stream *stream,
+                      const struct crypt_context *context, uint64_t offset);
+
+/**
+ * @brief Encrypts the next bytes of a stream.
+ *
+ * Pieces of any size give the same bytes as one crypt_buffer_at() call
+ * over all of them.
+ *
+ * @param stream stream state, moved past the bytes
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_stream_update(struct crypt_stream *stream, uint8_t *output,
+                        const uint8_t *input, size_t length);
+
+/**
+ * @brief Starts the encryption of buffers filled in turn by a DMA.
+ *
+ * Fill 'buffer', 'size', 'ready' and optionally 'chunk' and 'arg' first.
+ * The DMA fills buffer 0 first, then 1, then 0 again and so on, the
+ * keystream goes on from one buffer to the next.
+ *
+ * @param pp ping-pong state, can be a static variable
+ * @param context key of the transfer, valid while it runs
+ * @param offset keystream position of the first byte of buffer 0
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_pingpong_start(struct crypt_pingpong *pp,
+                         const struct crypt_context *context,
+                         uint64_t offset);
+
+/**
+ * @brief Hands a buffer the DMA has filled over, from its interrupt.
+ *
+ * @param pp ping-pong state
+ * @param index buffer filled, 0 or 1
+ * @param length bytes in the buffer, at most 'size'
+ *
+ * @return 0 indicating success, -EBUSY if the buffer was not given back
+ *         to the DMA yet (overrun), or -EINVAL.
+ *
+ */
+
+int crypt_pingpong_complete(struct crypt_pingpong *pp, unsigned index,
+                            size_t length);
+
+/**
+ * @brief Tells whether the DMA may fill a buffer.
+ *
+ * @param pp ping-pong state
+ * @param index buffer, 0 or 1
+ *
+ * @return 1 if the buffer is free, 0 if it is filled or being encrypted.
+ *
+ */
+
+int crypt_pingpong_idle(const struct crypt_pingpong *pp, unsigned index);
+
+/**
+ * @brief Encrypts the next chunk of the filled buffers.
+ *
+ * At most 'chunk' bytes per call, so the time of a call is bounded. A
+ * buffer is passed to 'ready' once encrypted and given back to the DMA
+ * when 'ready' returns.
+ *
+ * @param pp ping-pong state
+ *
+ * @return Bytes encrypted, 0 if no buffer is filled, or negative POSIX
+ *         errno.
+ *
+ */
+
+int crypt_pingpong_poll(struct crypt_pingpong *pp);
+
+/**
+ * @brief Starts a Poly1305 MAC.
+ *
+ * A key must authenticate a single message, crypt_aead_init() derives
+ * one per message from the keystream.
+ *
+ * @param poly MAC state to fill
+ * @param key one-time key
+ *
+ */
+
+void crypt_poly1305_init(struct crypt_poly1305 *poly,
+                         const uint8_t key[CRYPT_POLY1305_KEY]);
+
+/**
+ * @brief Adds the next bytes of the message to a MAC.
+ *
+ * Pieces of any size give the same tag as the whole message at once.
+ *
+ * @param poly MAC state
+ * @param data next bytes of the message
+ * @param length size of data
+ *
+ */
+
+void crypt_poly1305_update(struct crypt_poly1305 *poly, const uint8_t *data,
+                           size_t length);
+
+/**
+ * @brief Ends a MAC and wipes its state.
+ *
+ * @param poly MAC state
+ * @param tag buffer receiving the tag
+ *
+ */
+
+void crypt_poly1305_final(struct crypt_poly1305 *poly,
+                          uint8_t tag[CRYPT_AEAD_TAG]);
+
+/**
+ * @brief Starts an authenticated encryption or decryption.
+ *
+ * ChaCha20-Poly1305 as in RFC 8439: the one-time Poly1305 key is the
+ * keystream block at 'offset', the text uses the keystream from the next
+ * block on. The RFC nonce is the high word of the block counter (below
+ * 2^26, offsets being 64-bit) followed by the nonce of the key material.
+ * A message must never reuse the keystream of another one.
+ *
+ * @param aead state to fill
+ * @param context key of the message, its engine must be ChaCha20
+ * @param offset keystream position, a multiple of 64
+ * @param ad associated data, authenticated but not encrypted
+ * @param adlen size of ad
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_aead_init(struct crypt_aead *aead,
+                    const struct crypt_context *context, uint64_t offset,
+                    const uint8_t *ad, size_t adlen);
+
+/**
+ * @brief Encrypts the next bytes of a message and authenticates them.
+ *
+ * Both are done in one pass over the data, cache-sized stripes at a time.
+ *
+ * @param aead state, moved past the bytes
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer, may be output
+ * @param length size of input and output buffers
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_aead_seal_update(struct crypt_aead *aead, uint8_t *output,
+                           const uint8_t *input, size_t length);
+
+/**
+ * @brief Authenticates the next bytes of a message and decrypts them.
+ *
+ * The plaintext must not be trusted before crypt_aead_open_final()
+ * succeeds.
+ *
+ * @param aead state, moved past the bytes
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer, may be output
+ * @param length size of input and output buffers
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_aead_open_update(struct crypt_aead *aead, uint8_t *output,
+                           const uint8_t *input, size_t length);
+
+/**
+ * @brief Ends an encryption and gives its tag.
+ *
+ * @param aead state, its MAC key wiped
+ * @param tag buffer receiving the tag
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_aead_seal_final(struct crypt_aead *aead,
+                          uint8_t tag[CRYPT_AEAD_TAG]);
+
+/**
+ * @brief Ends a decryption and checks its tag in constant time.
+ *
+ * @param aead state, its MAC key wiped
+ * @param tag tag received with the message
+ *
+ * @return 0 if the message is authentic, -EBADMSG if not.
+ *
+ */
+
+int crypt_aead_open_final(struct crypt_aead *aead,
+                          const uint8_t tag[CRYPT_AEAD_TAG]);
+
+/**
+ * @brief Encrypts and authenticates a whole message.
+ *
+ * @param context key of the message, its engine must be ChaCha20
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer, may be output
+ * @param length size of input and output buffers
+ * @param offset keystream position, a multiple of 64
+ * @param ad associated data, authenticated but not encrypted
+ * @param adlen size of ad
+ * @param tag buffer receiving the tag
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_aead_seal(const struct crypt_context *context, uint8_t *output,
+                    const uint8_t *input, size_t length, uint64_t offset,
+                    const uint8_t *ad, size_t adlen,
+                    uint8_t tag[CRYPT_AEAD_TAG]);
+
+/**
+ * @brief Checks and decrypts a whole message.
+ *
+ * @param context key of the message, its engine must be ChaCha20
+ * @param output pointer to output buffer, zeroed if the tag is wrong
+ * @param input pointer to input buffer, may be output
+ * @param length size of input and output buffers
+ * @param offset keystream position, a multiple of 64
+ * @param ad associated data, authenticated but not encrypted
+ * @param adlen size of ad
+ * @param tag tag received with the message
+ *
+ * @return 0 indicating success, -EBADMSG if the message is not authentic
+ *         or negative POSIX errno.
+ *
+ */
+
+int crypt_aead_open(const struct crypt_context *context, uint8_t *output,
+                    const uint8_t *input, size_t length, uint64_t offset,
+                    const uint8_t *ad, size_t adlen,
+                    const uint8_t tag[CRYPT_AEAD_TAG]);
+
+/* The freestanding profile has no files, sockets or threads */
+
+#ifndef CRYPT_FREESTANDING
+
+/**
+ * @brief Creates a cache of decrypted pages for an encrypted file.
+ *
+ * The file must be in the crypt program format and must not change
+ * while the cache is open. The cache is safe to use from many threads.
+ *
+ * @param cache pointer to save the new cache
+ * @param context key context used to decrypt, it is copied
+ * @param fd file descriptor of the encrypted file, not owned by the cache
+ * @param maxpages maximum amount of CRYPT_CACHE_PAGE_SIZE pages in memory
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+int crypt_cache_open(struct crypt_cache **cache,
+                     const struct crypt_context *context, int fd,
+                     size_t maxpages);
+
+/**
+ * @brief Reads decrypted data from the file, like pread().
+ *
+ * @param cache pointer to the cache
+ * @param buf buffer to save the decrypted data
+ * @param count amount of bytes to read
+ * @param offset file offset of the first byte
+ *
+ * @return Amount of read bytes, less than count at EOF, or negative errno.
+ *
+ */
+
+ssize_t crypt_cache_pread(struct crypt_cache *cache, void *buf,
+                          size_t count, uint64_t offset);
+
+/**
+ * @brief Releases the cache and wipes the decrypted pages.
+ *
+ * @param cache pointer to the cache, the file descriptor is not closed
+ *
+ */
+
+void crypt_cache_close(struct crypt_cache *cache);
+
+/**
+ * @brief Encrypts the payload of the packet with sequence number 'seq'.
+ *
+ * The keystream starts at seq * CRYPT_PACKET_MAX, so each packet can be
+ * decrypted on its own, in any order. 'seq' goes up to
+ * CRYPT_PACKET_SEQ_MAX, 2^48 - 1: past it the keystream position would
+ * wrap and reuse the keystream of another packet.
+ *
+ * @param context current context state pointer
+ * @param seq sequence number of the packet
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output, up to CRYPT_PACKET_MAX
+ *
+ * @return 0 indicating success or negative POSIX errno, -EOVERFLOW
+ *         if 'seq' is above CRYPT_PACKET_SEQ_MAX.
+ *
+ */
+
+int crypt_packet(const struct crypt_context *context, uint64_t seq,
+                 uint8_t *output, const uint8_t *input, size_t length);
+
+/**
+ * @brief Encrypts or decrypts in place a vector of datagrams.
+ *
+ * Each datagram starts with a CRYPT_PACKET_HEADER big endian sequence
+ * number followed by the payload processed like crypt_packet(). The
+ * msg_len of datagrams too short or too long, or with a sequence number
+ * above CRYPT_PACKET_SEQ_MAX, is set to 0.
+ *
+ * @param context current context state pointer
+ * @param msgs datagrams as filled by recvmmsg()
+ * @param vlen amount of datagrams
+ *
+ * @return Amount of processed datagrams or negative POSIX errno.
+ *
+ */
+
+int crypt_packet_mmsg(const struct crypt_context *context,
+                      struct mmsghdr *msgs, unsigned int vlen);
+
+/**
+ * @brief Starts the worker pool with a given amount of threads.
+ *
+ * Optional: the first crypt_pool_submit() starts one worker per online
+ * CPU. The workers live until the process exits.
+ *
+ * @param nthreads amount of workers, 0 for one per online CPU
+ *
+ * @return 0 indicating success, -EBUSY if the pool already runs, or
+ *         negative POSIX errno.
+ *
+ */
+
+int crypt_pool_start(unsigned nthreads);
+
+/**
+ * @brief Queues jobs for the worker pool, all at once.
+ *
+ * Large jobs are split in CRYPT_POOL_SLICE bytes shared by the workers,
+ * the 'done' callback of a job is called by the worker finishing its
+ * last slice. The jobs must stay valid until then.
+ *
+ * @param jobs array of jobs to queue
+ * @param njobs amount of jobs
+ *
+ * @return 0 indicating success or negative POSIX errno, then no job of
+ *         the array is queued.
+ *
+ */
+
+int crypt_pool_submit(struct crypt_job **jobs, unsigned njobs);
+
+/**
+ * @brief Removes from the queue a job no worker started yet.
+ *
+ * @param job job given to crypt_pool_submit()
+ *
+ * @return 0 if the job was removed and 'done' won't be called, or -EBUSY
+ *         if it already started or finished and 'done' is or was called.
+ *
+ */
+
+int crypt_pool_cancel(struct crypt_job *job);
+
+#endif /* CRYPT_FREESTANDING */
+
 /**
  * @brief Get the cryptolib version number
  *
@@ -53,7 +785,95 @@ int crypt_buffer(struct crypt_context *context, uint8_t *output,
 
 const char *crypt_version(void);
 
+/****************************************************************************
+ * Inline Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypts a small buffer at a given keystream position, inline.
+ *
+ * Same result as crypt_buffer_at(). Up to CRYPT_SMALL_MAX bytes the loop
+ * runs at the call site, without a call into the shared library, and a
+ * constant length lets the compiler unroll it. Longer buffers are passed
+ * to crypt_buffer_at(), as are all buffers of other engines than "xor".
+ *
+ * @param context current context state pointer
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset keystream position of the first byte
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+static inline int crypt_small_at(const struct crypt_context *context,
+                                 uint8_t *output, const uint8_t *input,
+                                 size_t length, uint64_t offset)
+{
+  const uint8_t *k;
+  unsigned keylen;
+  unsigned i;
+  unsigned n;
+  uint8_t step;
+
+  if (length > CRYPT_SMALL_MAX ||
+      (context != NULL && context->engine != NULL))
+    {
+      return crypt_buffer_at(context, output, input, length, offset);
+    }
+
+  if (context == NULL || context->key == NULL || context->keylen <= 0)
+    {
+      return -EINVAL;
+    }
+
+  k      = context->key;
+  keylen = context->keylen;
+  i      = offset % keylen;
+  step   = offset / keylen + 1;
+
+  /* One pass over the key at a time, the inner loop has no branch */
+
+  while (length > 0)
+    {
+      n = keylen - i < length ? keylen - i : length;
+
+      for (; n > 0; n--, i++, length--)
+        {
+          *output++ = *input++ ^ (uint8_t)(k[i] + step * i);
+        }
+
+      i = 0;
+      step++;
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Encrypts a small buffer like crypt_buffer(), inline.
+ *
+ * See crypt_small_at(), the keystream starts at position 0.
+ *
+ * @param context current context state pointer
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ *
+ * @return 0 indicating success or negative POSIX errno.
+ *
+ */
+
+static inline int crypt_small(const struct crypt_context *context,
+                              uint8_t *output, const uint8_t *input,
+                              size_t length)
+{
+  return crypt_small_at(context, output, input, length, 0);
+}
+
 #ifdef __cplusplus
 }
 #endif
 
+#endif /* __ACRYPT_H */
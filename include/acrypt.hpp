@@ -0,0 +1,717 @@
+/****************************************************************************
+ * @file  include/acrypt.hpp
+ *
+ * @brief Header-only C++20 interface of libacrypt.
+ *
+ * acrypt::context owns a copy of the key and wipes it when destroyed. It
+ * can be moved but not copied, so a key has one owner. Contexts and the
+ * buffers of acrypt::encrypted() are allocator aware, they can live in a
+ * std::pmr arena and be released with it. Encryption works
+ * on std::span of std::byte and is inlined here, it produces the same
+ * bytes as crypt_buffer(), crypt_buffer_at() and crypt_file_at().
+ *
+ * acrypt::cipher<KeyLen> takes the key length as a template parameter and
+ * gets a kernel compiled for it. A context dispatches the common lengths
+ * (6, 16, 32, 64 and 256 bytes) to the same kernels.
+ ****************************************************************************/
+
+#ifndef __ACRYPT_HPP
+#define __ACRYPT_HPP
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <numeric>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "acrypt.h"
+
+namespace acrypt
+{
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+namespace detail
+{
+
+/**
+ * @brief Encrypt 'length' bytes starting at keystream position 'offset'.
+ *
+ * Same result as crypt_buffer_at(), the key is walked one pass at a time
+ * so the inner loop has no branch and the compiler can vectorize it. It
+ * is constexpr, acrypt_sealed.hpp runs it at compile time.
+ *
+ * @param key key bytes
+ * @param keylen length of the key, not 0
+ * @param out pointer to output buffer, may be equal to 'in'
+ * @param in pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset keystream position of the first byte
+ */
+
+constexpr void crypt_at(const std::uint8_t *key, std::size_t keylen,
+                        std::uint8_t *out, const std::uint8_t *in,
+                        std::size_t length, std::uint64_t offset) noexcept
+{
+  std::size_t i = offset % keylen;
+  std::uint8_t step = offset / keylen + 1;
+
+  while (length > 0)
+    {
+      std::size_t run = keylen - i < length ? keylen - i : length;
+
+      for (std::size_t j = 0; j < run; j++)
+        {
+          out[j] = in[j] ^ std::uint8_t(key[i + j] + step * (i + j));
+        }
+
+      out    += run;
+      in     += run;
+      length -= run;
+      i       = 0;
+      step++;
+    }
+}
+
+/* Passes of a fixed length key are grouped in stripes of a multiple of 64
+ * bytes when that stays small, so whatever the key length the loop over a
+ * stripe has a constant trip count and vectorizes.
+ */
+
+template <std::size_t KeyLen>
+inline constexpr std::size_t stripe_passes =
+  std::lcm(KeyLen, std::size_t(64)) <= 1024 ?
+  std::lcm(KeyLen, std::size_t(64)) / KeyLen : 1;
+
+/**
+ * @brief Encrypt with a key of 'KeyLen' bytes, see crypt_at().
+ *
+ * The key length being a constant, the index wrap and the divisions are
+ * folded, and whole stripes of passes are processed with one add per byte
+ * to move the keystream to the next stripe.
+ *
+ * @param key key bytes
+ * @param out pointer to output buffer, may be equal to 'in'
+ * @param in pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset keystream position of the first byte
+ */
+
+template <std::size_t KeyLen>
+constexpr void crypt_fixed(const std::uint8_t *key, std::uint8_t *out,
+                           const std::uint8_t *in, std::size_t length,
+                           std::uint64_t offset) noexcept
+{
+  constexpr std::size_t passes = stripe_passes<KeyLen>;
+  constexpr std::size_t stripe = passes * KeyLen;
+  std::size_t head = (KeyLen - offset % KeyLen) % KeyLen;
+  std::uint8_t ks[stripe] {};
+  std::uint8_t delta[stripe] {};
+  std::uint8_t block[stripe] {};
+
+  /* Up to the start of a pass, then whole stripes, then what is left */
+
+  if (head > length)
+    {
+      head = length;
+    }
+
+  crypt_at(key, KeyLen, out, in, head, offset);
+  out    += head;
+  in     += head;
+  offset += head;
+  length -= head;
+
+  if (length >= 2 * stripe)
+    {
+      std::uint8_t step = offset / KeyLen + 1;
+
+      for (std::size_t k = 0; k < stripe; k++)
+        {
+          std::size_t j = k % KeyLen;
+
+          ks[k]    = key[j] + std::uint8_t(step + k / KeyLen) * j;
+          delta[k] = passes * j;
+        }
+
+      while (length >= stripe)
+        {
+          /* Through a local block: the compiler can't tell 'in' and
+           * 'out' from the keystream, it knows the locals don't overlap.
+           */
+
+          for (std::size_t k = 0; k < stripe; k++)
+            {
+              block[k] = in[k];
+            }
+
+          for (std::size_t k = 0; k < stripe; k++)
+            {
+              block[k] ^= ks[k];
+              ks[k]     = std::uint8_t(ks[k] + delta[k]);
+            }
+
+          for (std::size_t k = 0; k < stripe; k++)
+            {
+              out[k] = block[k];
+            }
+
+          out    += stripe;
+          in     += stripe;
+          offset += stripe;
+          length -= stripe;
+        }
+    }
+
+  crypt_at(key, KeyLen, out, in, length, offset);
+}
+
+/**
+ * @brief Encrypt with a key of any length, see crypt_at().
+ *
+ * The common key lengths go to their crypt_fixed() kernel.
+ *
+ * @param key key bytes
+ * @param keylen length of the key, not 0
+ * @param out pointer to output buffer, may be equal to 'in'
+ * @param in pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset keystream position of the first byte
+ */
+
+constexpr void crypt_keyed(const std::uint8_t *key, std::size_t keylen,
+                           std::uint8_t *out, const std::uint8_t *in,
+                           std::size_t length, std::uint64_t offset) noexcept
+{
+  switch (keylen)
+    {
+      case 6:
+        crypt_fixed<6>(key, out, in, length, offset);
+        break;
+
+      case 16:
+        crypt_fixed<16>(key, out, in, length, offset);
+        break;
+
+      case 32:
+        crypt_fixed<32>(key, out, in, length, offset);
+        break;
+
+      case 64:
+        crypt_fixed<64>(key, out, in, length, offset);
+        break;
+
+      case 256:
+        crypt_fixed<256>(key, out, in, length, offset);
+        break;
+
+      default:
+        crypt_at(key, keylen, out, in, length, offset);
+        break;
+    }
+}
+
+/**
+ * @brief Encrypt a window of a crypt file starting at file 'offset'.
+ *
+ * Same result as crypt_file_at().
+ *
+ * @param key key bytes
+ * @param keylen length of the key, not 0
+ * @param out pointer to output buffer, may be equal to 'in'
+ * @param in pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset file offset of the first byte
+ */
+
+constexpr void crypt_file_at(const std::uint8_t *key, std::size_t keylen,
+                             std::uint8_t *out, const std::uint8_t *in,
+                             std::size_t length,
+                             std::uint64_t offset) noexcept
+{
+  while (length > 0)
+    {
+      std::size_t pos = offset % CRYPT_BLOCK_SIZE;
+      std::size_t n = CRYPT_BLOCK_SIZE - pos < length ?
+                      CRYPT_BLOCK_SIZE - pos : length;
+
+      crypt_keyed(key, keylen, out, in, n, pos);
+
+      out    += n;
+      in     += n;
+      offset += n;
+      length -= n;
+    }
+}
+
+/**
+ * @brief Check at compile time, when possible, the output is big enough.
+ *
+ * @param in input span
+ * @param out output span
+ */
+
+template <std::size_t InExtent, std::size_t OutExtent>
+constexpr void check_extents(std::span<const std::byte, InExtent> in,
+                             std::span<std::byte, OutExtent> out)
+{
+  if constexpr (InExtent != std::dynamic_extent &&
+                OutExtent != std::dynamic_extent)
+    {
+      static_assert(OutExtent >= InExtent,
+                    "acrypt: output span is smaller than the input span");
+    }
+  else if (out.size() < in.size())
+    {
+      throw std::length_error("acrypt: output is smaller than the input");
+    }
+}
+
+} /* namespace detail */
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/** @class context
+ *  @brief Owner of a key, usable where a struct crypt_context is expected
+ *
+ *  The key is allocated from a std::pmr::memory_resource, the default one
+ *  unless an allocator is given, so std::pmr containers of contexts pass
+ *  theirs. The resource must outlive the context.
+ */
+
+class context
+{
+public:
+  using allocator_type = std::pmr::polymorphic_allocator<std::byte>;
+
+  /**
+   * @brief Copy the key into a new context.
+   *
+   * @param key key bytes, 1 to INT_MAX of them
+   * @param alloc allocator of the copy
+   * @throw std::invalid_argument if the key is empty or too long
+   */
+
+  explicit context(std::span<const std::byte> key,
+                   const allocator_type &alloc = {})
+    : m_resource(alloc.resource())
+  {
+    adopt(key);
+  }
+
+  /**
+   * @brief Copy a text key into a new context, like 'crypt -k'.
+   *
+   * @param key key text, without its terminating NUL
+   * @param alloc allocator of the copy
+   */
+
+  explicit context(std::string_view key, const allocator_type &alloc = {})
+    : context(std::as_bytes(std::span(key.data(), key.size())), alloc)
+  {
+  }
+
+  /* A key has one owner: contexts move but never copy */
+
+  context(const context &) = delete;
+  context &operator=(const context &) = delete;
+
+  /* A moved key keeps its resource */
+
+  context(context &&other) noexcept
+    : m_resource(other.m_resource), m_ctx(std::exchange(other.m_ctx, {}))
+  {
+  }
+
+  /**
+   * @brief Move a key into the resource of 'alloc'.
+   *
+   * It is copied, and wiped from 'other', when the resources differ.
+   */
+
+  context(context &&other, const allocator_type &alloc)
+    : m_resource(alloc.resource())
+  {
+    if (*m_resource == *other.m_resource)
+      {
+        m_ctx = std::exchange(other.m_ctx, {});
+      }
+    else if (other)
+      {
+        adopt(std::as_bytes(std::span(other.m_ctx.key,
+                                      other.key_size())));
+        other.release();
+      }
+  }
+
+  context &operator=(context &&other) noexcept
+  {
+    if (this != &other)
+      {
+        release();
+        m_resource = other.m_resource;
+        m_ctx      = std::exchange(other.m_ctx, {});
+      }
+
+    return *this;
+  }
+
+  ~context()
+  {
+    release();
+  }
+
+  /**
+   * @brief Get the allocator of the key.
+   */
+
+  allocator_type get_allocator() const noexcept
+  {
+    return allocator_type(m_resource);
+  }
+
+  /**
+   * @brief Tell whether the context holds a key, it doesn't once moved.
+   */
+
+  explicit operator bool() const noexcept
+  {
+    return m_ctx.key != nullptr;
+  }
+
+  /**
+   * @brief Get the C context, for the functions of acrypt.h.
+   *
+   * The pointer is valid while this context is alive and not moved.
+   */
+
+  [[nodiscard]] const struct crypt_context *get() const & noexcept
+  {
+    return &m_ctx;
+  }
+
+  /* A temporary context dies at the end of the statement */
+
+  const struct crypt_context *get() const && = delete;
+
+  /**
+   * @brief Get the length of the key.
+   */
+
+  [[nodiscard]] std::size_t key_size() const noexcept
+  {
+    return m_ctx.keylen;
+  }
+
+  /**
+   * @brief Encrypt 'in' into 'out', like crypt_buffer() or, given an
+   *        offset, like crypt_buffer_at().
+   *
+   * Decryption is the same operation. 'out' may be 'in' itself.
+   *
+   * @param in input bytes
+   * @param out output bytes, at least as many as the input
+   * @param offset keystream position of the first byte
+   * @throw std::length_error if 'out' is smaller than 'in'
+   * @throw std::logic_error if the context was moved
+   */
+
+  template <std::size_t InExtent, std::size_t OutExtent>
+  void encrypt(std::span<const std::byte, InExtent> in,
+               std::span<std::byte, OutExtent> out,
+               std::uint64_t offset = 0) const
+  {
+    detail::check_extents(in, out);
+    detail::crypt_keyed(key(), m_ctx.keylen, bytes(out), bytes(in),
+                        in.size(), offset);
+  }
+
+  void encrypt(std::span<const std::byte> in, std::span<std::byte> out,
+               std::uint64_t offset = 0) const
+  {
+    encrypt<std::dynamic_extent, std::dynamic_extent>(in, out, offset);
+  }
+
+  /**
+   * @brief Encrypt 'data' in place, see encrypt().
+   */
+
+  void encrypt(std::span<std::byte> data, std::uint64_t offset = 0) const
+  {
+    detail::crypt_keyed(key(), m_ctx.keylen, bytes(data), bytes(data),
+                        data.size(), offset);
+  }
+
+  /**
+   * @brief Encrypt a window of a file written by the crypt program, like
+   *        crypt_file_at().
+   *
+   * @param in input bytes
+   * @param out output bytes, at least as many as the input
+   * @param offset file offset of the first byte
+   */
+
+  void encrypt_file(std::span<const std::byte> in, std::span<std::byte> out,
+                    std::uint64_t offset) const
+  {
+    detail::check_extents(in, out);
+    detail::crypt_file_at(key(), m_ctx.keylen, bytes(out), bytes(in),
+                          in.size(), offset);
+  }
+
+private:
+  std::pmr::memory_resource *m_resource; /* where the key is allocated */
+  struct crypt_context m_ctx {};         /* owned copy of the key      */
+
+  /* Copy 'key' into the resource, the context must hold none */
+
+  void adopt(std::span<const std::byte> key)
+  {
+    if (key.empty() || key.size() > INT32_MAX)
+      {
+        throw std::invalid_argument("acrypt: invalid key length");
+      }
+
+    m_ctx.key    = static_cast<std::uint8_t *>(
+                     m_resource->allocate(key.size(), 1));
+    m_ctx.keylen = static_cast<int>(key.size());
+    std::memcpy(m_ctx.key, key.data(), key.size());
+  }
+
+  const std::uint8_t *key() const
+  {
+    if (m_ctx.key == nullptr)
+      {
+        throw std::logic_error("acrypt: context was moved");
+      }
+
+    return m_ctx.key;
+  }
+
+  template <std::size_t Extent>
+  static std::uint8_t *bytes(std::span<std::byte, Extent> s) noexcept
+  {
+    return reinterpret_cast<std::uint8_t *>(s.data());
+  }
+
+  template <std::size_t Extent>
+  static const std::uint8_t *bytes(std::span<const std::byte, Extent> s)
+    noexcept
+  {
+    return reinterpret_cast<const std::uint8_t *>(s.data());
+  }
+
+  /* Wipe and free the key */
+
+  void release() noexcept
+  {
+    if (m_ctx.key != nullptr)
+      {
+        volatile std::uint8_t *p = m_ctx.key;
+
+        for (int i = 0; i < m_ctx.keylen; i++)
+          {
+            p[i] = 0;
+          }
+
+        m_resource->deallocate(m_ctx.key, m_ctx.keylen, 1);
+      }
+
+    m_ctx = {};
+  }
+};
+
+/** @class cipher
+ *  @brief Key of exactly 'KeyLen' bytes, with kernels specialized for it
+ *
+ *  Same bytes as a context with the same key. The key is held inline and
+ *  wiped when destroyed; like the key of a context it has one owner, so a
+ *  cipher is neither copied nor moved.
+ */
+
+template <std::size_t KeyLen>
+class cipher
+{
+  static_assert(KeyLen > 0 && KeyLen <= INT32_MAX,
+                "acrypt: invalid key length");
+
+public:
+  static constexpr std::size_t key_size = KeyLen;
+
+  /**
+   * @brief Copy the key into a new cipher.
+   *
+   * @param key key bytes, exactly KeyLen of them
+   * @throw std::invalid_argument if the key has another length
+   */
+
+  explicit cipher(std::span<const std::byte> key)
+  {
+    if (key.size() != KeyLen)
+      {
+        throw std::invalid_argument("acrypt: invalid key length");
+      }
+
+    std::memcpy(m_key, key.data(), KeyLen);
+    m_ctx.key    = m_key;
+    m_ctx.keylen = static_cast<int>(KeyLen);
+  }
+
+  /**
+   * @brief Copy a text key into a new cipher, like 'crypt -k'.
+   */
+
+  explicit cipher(std::string_view key)
+    : cipher(std::as_bytes(std::span(key.data(), key.size())))
+  {
+  }
+
+  /**
+   * @brief Copy the key of a context into a new cipher.
+   *
+   * @throw std::invalid_argument if its key has another length
+   * @throw std::logic_error if the context was moved
+   */
+
+  explicit cipher(const context &ctx)
+    : cipher(key_of(ctx))
+  {
+  }
+
+  cipher(const cipher &) = delete;
+  cipher &operator=(const cipher &) = delete;
+
+  ~cipher()
+  {
+    volatile std::uint8_t *p = m_key;
+
+    for (std::size_t i = 0; i < KeyLen; i++)
+      {
+        p[i] = 0;
+      }
+  }
+
+  /**
+   * @brief Get the C context, for the functions of acrypt.h.
+   */
+
+  [[nodiscard]] const struct crypt_context *get() const & noexcept
+  {
+    return &m_ctx;
+  }
+
+  const struct crypt_context *get() const && = delete;
+
+  /**
+   * @brief Encrypt 'in' into 'out', see context::encrypt().
+   */
+
+  template <std::size_t InExtent, std::size_t OutExtent>
+  void encrypt(std::span<const std::byte, InExtent> in,
+               std::span<std::byte, OutExtent> out,
+               std::uint64_t offset = 0) const
+  {
+    detail::check_extents(in, out);
+    detail::crypt_fixed<KeyLen>(m_key,
+                                reinterpret_cast<std::uint8_t *>(out.data()),
+                                reinterpret_cast<const std::uint8_t *>(
+                                  in.data()),
+                                in.size(), offset);
+  }
+
+  void encrypt(std::span<const std::byte> in, std::span<std::byte> out,
+               std::uint64_t offset = 0) const
+  {
+    encrypt<std::dynamic_extent, std::dynamic_extent>(in, out, offset);
+  }
+
+  /**
+   * @brief Encrypt 'data' in place, see encrypt().
+   */
+
+  void encrypt(std::span<std::byte> data, std::uint64_t offset = 0) const
+    noexcept
+  {
+    auto *p = reinterpret_cast<std::uint8_t *>(data.data());
+
+    detail::crypt_fixed<KeyLen>(m_key, p, p, data.size(), offset);
+  }
+
+private:
+  std::uint8_t m_key[KeyLen];    /* the key                  */
+  struct crypt_context m_ctx {}; /* C view of the same key   */
+
+  static std::span<const std::byte> key_of(const context &ctx)
+  {
+    const struct crypt_context *c = ctx.get();
+
+    if (c->key == nullptr)
+      {
+        throw std::logic_error("acrypt: context was moved");
+      }
+
+    return std::as_bytes(std::span(c->key, ctx.key_size()));
+  }
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypt 'in' into 'out' with 'ctx', see context::encrypt().
+ */
+
+inline void encrypt(const context &ctx, std::span<const std::byte> in,
+                    std::span<std::byte> out, std::uint64_t offset = 0)
+{
+  ctx.encrypt(in, out, offset);
+}
+
+/**
+ * @brief Decrypt 'in' into 'out' with 'ctx', the same as encrypt().
+ */
+
+inline void decrypt(const context &ctx, std::span<const std::byte> in,
+                    std::span<std::byte> out, std::uint64_t offset = 0)
+{
+  ctx.encrypt(in, out, offset);
+}
+
+/**
+ * @brief Encrypt 'in' into a new buffer, see context::encrypt().
+ *
+ * @param ctx key context
+ * @param in input bytes
+ * @param offset keystream position of the first byte
+ * @param alloc allocator of the buffer, from an arena for instance
+ * @return The encrypted bytes
+ */
+
+[[nodiscard]] inline std::pmr::vector<std::byte>
+encrypted(const context &ctx, std::span<const std::byte> in,
+          std::uint64_t offset = 0, const context::allocator_type &alloc = {})
+{
+  std::pmr::vector<std::byte> out(in.size(), alloc);
+
+  ctx.encrypt(in, out, offset);
+
+  return out;
+}
+
+} /* namespace acrypt */
+
+#endif /* __ACRYPT_HPP */
@@ -0,0 +1,428 @@
+/****************************************************************************
+ * @file  include/acrypt_async.hpp
+ *
+ * @brief C++20 coroutine interface of the libacrypt worker pool.
+ *
+ *   co_await acrypt::encrypt_async(ctx, in, out);
+ *
+ * The encryption runs on the worker pool of crypt_pool_submit(), the
+ * coroutine resumes through the executor given, or on the worker that
+ * finished the job when there is none. A std::stop_token cancels a job
+ * no worker started yet. Awaits sharing an acrypt::async_batch are queued
+ * together by async_batch::submit(), with one wake-up of the workers.
+ *
+ * The context and both buffers must stay valid until the await resumes.
+ ****************************************************************************/
+
+#ifndef __ACRYPT_ASYNC_HPP
+#define __ACRYPT_ASYNC_HPP
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <atomic>
+#include <cerrno>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
+#include <system_error>
+#include <vector>
+
+#include "acrypt.hpp"
+
+namespace acrypt
+{
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/* Resumes a coroutine handle, on a thread of its choice */
+
+template <class E>
+concept executor = std::copy_constructible<E> &&
+  requires(E &e, std::coroutine_handle<> h)
+  {
+    e.execute(h);
+  };
+
+/** @struct inline_executor
+ *  @brief Executor resuming on the worker thread that finished the job
+ */
+
+struct inline_executor
+{
+  void execute(std::coroutine_handle<> h) const
+  {
+    h.resume();
+  }
+};
+
+class async_batch;
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+namespace detail
+{
+
+/** @class async_op
+ *  @brief Pool job and completion state shared by all awaitables
+ *
+ *  The job finishes when the pool calls 'done', when it is cancelled or
+ *  when a batch drops it. The coroutine is resumed once both the finish
+ *  and await_suspend() happened, by whichever comes last.
+ */
+
+class async_op
+{
+protected:
+  enum : int
+  {
+    SETUP,                    /* await_suspend() still running */
+    ARMED,                    /* waiting for the job           */
+    DONE                      /* job finished                  */
+  };
+
+  struct canceller
+  {
+    async_op *op;
+
+    void operator()() const noexcept
+    {
+      if (crypt_pool_cancel(&op->m_job) == 0)
+        {
+          op->finish(-ECANCELED);
+        }
+    }
+  };
+
+  async_op(const context &ctx, std::span<const std::byte> in,
+           std::span<std::byte> out, std::uint64_t offset,
+           std::stop_token stop, void (*resume)(async_op *))
+    : m_stop(std::move(stop)), m_resume(resume)
+  {
+    if (ctx.get()->key == nullptr)
+      {
+        throw std::logic_error("acrypt: context was moved");
+      }
+
+    detail::check_extents(in, out);
+
+    m_job.context = ctx.get();
+    m_job.output  = reinterpret_cast<std::uint8_t *>(out.data());
+    m_job.input   = reinterpret_cast<const std::uint8_t *>(in.data());
+    m_job.length  = in.size();
+    m_job.offset  = offset;
+    m_job.done    = on_done;
+    m_job.arg     = this;
+  }
+
+  async_op(const async_op &) = delete;
+  async_op &operator=(const async_op &) = delete;
+
+  /**
+   * @brief Record the result, resume if await_suspend() is over.
+   */
+
+  void finish(int result) noexcept
+  {
+    m_result = result;
+    if (m_state.exchange(DONE, std::memory_order_acq_rel) == ARMED)
+      {
+        m_resume(this);
+      }
+  }
+
+  /**
+   * @brief End await_suspend(), resume if the job already finished.
+   */
+
+  void arm() noexcept
+  {
+    if (m_state.exchange(ARMED, std::memory_order_acq_rel) == DONE)
+      {
+        m_resume(this);
+      }
+  }
+
+  void check() const
+  {
+    if (m_result < 0)
+      {
+        throw std::system_error(-m_result, std::generic_category(),
+                                "acrypt: async encryption");
+      }
+  }
+
+  struct crypt_job m_job {};
+  std::coroutine_handle<> m_handle;
+  std::stop_token m_stop;
+  std::atomic<int> m_state {SETUP};
+  int m_result = 0;
+
+private:
+  static void on_done(struct crypt_job *job, int result)
+  {
+    static_cast<async_op *>(job->arg)->finish(result);
+  }
+
+  void (*m_resume)(async_op *);
+
+  friend class acrypt::async_batch;
+};
+
+} /* namespace detail */
+
+/** @class async_batch
+ *  @brief Awaits queued to the pool together by submit()
+ *
+ *  Coroutines awaiting with the same batch are only suspended until
+ *  submit() queues all their jobs at once. A batch destroyed with jobs
+ *  left submits them, so no coroutine waits forever.
+ */
+
+class async_batch
+{
+public:
+  async_batch() = default;
+  async_batch(const async_batch &) = delete;
+  async_batch &operator=(const async_batch &) = delete;
+
+  ~async_batch()
+  {
+    submit();
+  }
+
+  /**
+   * @brief Queue the jobs of the batch, those cancelled meanwhile finish
+   *        with ECANCELED and the others with the error, if any.
+   */
+
+  void submit() noexcept
+  {
+    std::vector<detail::async_op *> ops;
+    std::vector<struct crypt_job *> jobs;
+    int ret;
+
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      ops.swap(m_ops);
+    }
+
+    try
+      {
+        jobs.reserve(ops.size());
+      }
+    catch (const std::bad_alloc &)
+      {
+        for (detail::async_op *op : ops)
+          {
+            op->finish(-ENOMEM);
+          }
+
+        return;
+      }
+
+    for (detail::async_op *op : ops)
+      {
+        if (op->m_stop.stop_requested())
+          {
+            op->finish(-ECANCELED);
+          }
+        else
+          {
+            jobs.push_back(&op->m_job);
+          }
+      }
+
+    ret = crypt_pool_submit(jobs.data(), jobs.size());
+    if (ret < 0)
+      {
+        for (struct crypt_job *job : jobs)
+          {
+            static_cast<detail::async_op *>(job->arg)->finish(ret);
+          }
+      }
+  }
+
+  /**
+   * @brief Get the amount of jobs waiting for submit().
+   */
+
+  [[nodiscard]] std::size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    return m_ops.size();
+  }
+
+private:
+  template <executor> friend class async_crypt;
+
+  void add(detail::async_op *op)
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    m_ops.push_back(op);
+  }
+
+  mutable std::mutex m_lock;
+  std::vector<detail::async_op *> m_ops;
+};
+
+/** @class async_crypt
+ *  @brief Awaitable encryption, see encrypt_async()
+ */
+
+template <executor Executor>
+class async_crypt : private detail::async_op
+{
+public:
+  async_crypt(const context &ctx, std::span<const std::byte> in,
+              std::span<std::byte> out, std::uint64_t offset,
+              Executor exec, std::stop_token stop, async_batch *batch)
+    : async_op(ctx, in, out, offset, std::move(stop), resume),
+      m_exec(std::move(exec)), m_batch(batch)
+  {
+  }
+
+  bool await_ready() noexcept
+  {
+    if (m_stop.stop_requested())
+      {
+        m_result = -ECANCELED;
+        return true;
+      }
+
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> h)
+  {
+    int ret;
+
+    m_handle = h;
+
+    if (m_batch != nullptr)
+      {
+        m_batch->add(this);
+      }
+    else
+      {
+        struct crypt_job *job = &m_job;
+
+        ret = crypt_pool_submit(&job, 1);
+        if (ret < 0)
+          {
+            finish(ret);
+            arm();
+            return;
+          }
+      }
+
+    /* Registered last: if the stop is already requested it runs now */
+
+    if (m_stop.stop_possible())
+      {
+        m_cancel.emplace(m_stop, canceller {this});
+      }
+
+    arm();
+  }
+
+  void await_resume()
+  {
+    m_cancel.reset();
+    check();
+  }
+
+private:
+  static void resume(async_op *op)
+  {
+    auto *self = static_cast<async_crypt *>(op);
+
+    /* Resuming can destroy the awaitable, with the executor in it */
+
+    Executor exec = self->m_exec;
+
+    exec.execute(self->m_handle);
+  }
+
+  Executor m_exec;
+  async_batch *m_batch;
+  std::optional<std::stop_callback<canceller>> m_cancel;
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypt 'in' into 'out' on the worker pool, see
+ *        context::encrypt().
+ *
+ *   co_await acrypt::encrypt_async(ctx, in, out, 0, strand, token);
+ *
+ * @param ctx key, alive until the await resumes
+ * @param in input bytes
+ * @param out output bytes, at least as many as the input
+ * @param offset keystream position of the first byte
+ * @param exec executor resuming the coroutine
+ * @param stop token cancelling the job until a worker starts it
+ * @return Awaitable throwing std::system_error on errors, ECANCELED if
+ *         the job was cancelled
+ * @throw std::length_error if 'out' is smaller than 'in'
+ * @throw std::logic_error if the context was moved
+ */
+
+template <executor Executor = inline_executor>
+[[nodiscard]] async_crypt<Executor>
+encrypt_async(const context &ctx, std::span<const std::byte> in,
+              std::span<std::byte> out, std::uint64_t offset = 0,
+              Executor exec = {}, std::stop_token stop = {})
+{
+  return async_crypt<Executor>(ctx, in, out, offset, std::move(exec),
+                               std::move(stop), nullptr);
+}
+
+/**
+ * @brief Encrypt on the worker pool once 'batch' is submitted, see
+ *        encrypt_async().
+ */
+
+template <executor Executor = inline_executor>
+[[nodiscard]] async_crypt<Executor>
+encrypt_async(async_batch &batch, const context &ctx,
+              std::span<const std::byte> in, std::span<std::byte> out,
+              std::uint64_t offset = 0, Executor exec = {},
+              std::stop_token stop = {})
+{
+  return async_crypt<Executor>(ctx, in, out, offset, std::move(exec),
+                               std::move(stop), &batch);
+}
+
+/* A temporary context dies before the job runs */
+
+template <executor Executor = inline_executor>
+void encrypt_async(const context &&, std::span<const std::byte>,
+                   std::span<std::byte>, std::uint64_t = 0,
+                   Executor = {}, std::stop_token = {}) = delete;
+
+template <executor Executor = inline_executor>
+void encrypt_async(async_batch &, const context &&,
+                   std::span<const std::byte>, std::span<std::byte>,
+                   std::uint64_t = 0, Executor = {},
+                   std::stop_token = {}) = delete;
+
+} /* namespace acrypt */
+
+#endif /* __ACRYPT_ASYNC_HPP */
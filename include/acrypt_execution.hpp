@@ -0,0 +1,244 @@
+/****************************************************************************
+ * @file  include/acrypt_execution.hpp
+ *
+ * @brief Encryption taking a standard execution policy.
+ *
+ *   acrypt::transform(std::execution::par_unseq, ctx, in, out);
+ *
+ * The policy picks the kernel and the threads:
+ *
+ *   seq        generic kernel of detail::crypt_at(), calling thread
+ *   unseq      kernels compiled per key length, calling thread
+ *   par        generic kernel, split over threads
+ *   par_unseq  kernels per key length, split over threads
+ *
+ * Every part of a split starts at its own keystream position, on a
+ * multiple of EXEC_ALIGN bytes, so the parts are independent and the
+ * result is the same as context::encrypt() for every policy.
+ *
+ * With libstdc++, <execution> may need -ltbb when TBB is installed.
+ ****************************************************************************/
+
+#ifndef __ACRYPT_EXECUTION_HPP
+#define __ACRYPT_EXECUTION_HPP
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <execution>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "acrypt.hpp"
+
+namespace acrypt
+{
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+namespace detail
+{
+
+inline constexpr std::size_t EXEC_MIN_PART = 256 * 1024; /* per thread */
+inline constexpr std::size_t EXEC_ALIGN    = 4096;       /* part starts */
+
+template <class Policy>
+inline constexpr bool exec_parallel =
+  std::is_same_v<Policy, std::execution::parallel_policy> ||
+  std::is_same_v<Policy, std::execution::parallel_unsequenced_policy>;
+
+template <class Policy>
+inline constexpr bool exec_vector =
+  std::is_same_v<Policy, std::execution::unsequenced_policy> ||
+  std::is_same_v<Policy, std::execution::parallel_unsequenced_policy>;
+
+/**
+ * @brief Get the amount of threads a split may use.
+ *
+ * Asked once, reading it goes through sysfs on every call.
+ */
+
+inline unsigned exec_threads() noexcept
+{
+  static const unsigned nthreads = std::thread::hardware_concurrency();
+
+  return nthreads;
+}
+
+/**
+ * @brief Encrypt 'length' bytes with 'kernel' on the threads the policy
+ *        allows, see transform().
+ *
+ * The calling thread runs the first part itself.
+ *
+ * @param kernel callable as kernel(out, in, length, offset)
+ */
+
+template <class Policy, class Kernel>
+void exec_crypt(Kernel kernel, std::uint8_t *out, const std::uint8_t *in,
+                std::size_t length, std::uint64_t offset)
+{
+  std::vector<std::jthread> threads;
+  std::size_t nparts = 1;
+  std::size_t part;
+  std::size_t pos;
+  std::size_t end;
+
+  if constexpr (exec_parallel<Policy>)
+    {
+      if (length >= 2 * EXEC_MIN_PART)
+        {
+          nparts = std::min<std::size_t>(length / EXEC_MIN_PART,
+                                         exec_threads());
+        }
+    }
+
+  if (nparts <= 1)
+    {
+      kernel(out, in, length, offset);
+      return;
+    }
+
+  /* Cut on keystream positions multiple of EXEC_ALIGN */
+
+  part = (length / nparts + EXEC_ALIGN - 1) / EXEC_ALIGN * EXEC_ALIGN;
+  end  = std::min<std::size_t>(length, part - offset % EXEC_ALIGN);
+
+  threads.reserve(nparts);
+
+  for (pos = end; pos < length; pos += part)
+    {
+      std::size_t n = std::min(part, length - pos);
+
+      threads.emplace_back([=]
+        {
+          kernel(out + pos, in + pos, n, offset + pos);
+        });
+    }
+
+  /* jthread joins the others on the way out, even if one failed */
+
+  kernel(out, in, end, offset);
+}
+
+} /* namespace detail */
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypt 'in' into 'out' with the kernel and the threads of an
+ *        execution policy, like context::encrypt().
+ *
+ * @param policy std::execution::seq, unseq, par or par_unseq
+ * @param ctx key
+ * @param in input bytes
+ * @param out output bytes, at least as many as the input, may be 'in'
+ * @param offset keystream position of the first byte
+ * @throw std::length_error if 'out' is smaller than 'in'
+ * @throw std::logic_error if the context was moved
+ * @throw std::system_error if a thread can't be started
+ */
+
+template <class Policy>
+  requires std::is_execution_policy_v<std::remove_cvref_t<Policy>>
+void transform(Policy &&policy, const context &ctx,
+               std::span<const std::byte> in, std::span<std::byte> out,
+               std::uint64_t offset = 0)
+{
+  using policy_type = std::remove_cvref_t<Policy>;
+
+  const struct crypt_context *c = ctx.get();
+
+  (void)policy;
+
+  if (c->key == nullptr)
+    {
+      throw std::logic_error("acrypt: context was moved");
+    }
+
+  detail::check_extents(in, out);
+  detail::exec_crypt<policy_type>(
+    [c](std::uint8_t *o, const std::uint8_t *i, std::size_t n,
+        std::uint64_t pos)
+      {
+        if constexpr (detail::exec_vector<policy_type>)
+          {
+            detail::crypt_keyed(c->key, c->keylen, o, i, n, pos);
+          }
+        else
+          {
+            detail::crypt_at(c->key, c->keylen, o, i, n, pos);
+          }
+      },
+    reinterpret_cast<std::uint8_t *>(out.data()),
+    reinterpret_cast<const std::uint8_t *>(in.data()), in.size(), offset);
+}
+
+/**
+ * @brief Encrypt 'data' in place, see transform().
+ */
+
+template <class Policy>
+  requires std::is_execution_policy_v<std::remove_cvref_t<Policy>>
+void transform(Policy &&policy, const context &ctx,
+               std::span<std::byte> data, std::uint64_t offset = 0)
+{
+  transform(std::forward<Policy>(policy), ctx, data, data, offset);
+}
+
+/**
+ * @brief Encrypt with a cipher<KeyLen>, see transform().
+ *
+ * unseq and par_unseq run the kernel compiled for KeyLen.
+ */
+
+template <class Policy, std::size_t KeyLen>
+  requires std::is_execution_policy_v<std::remove_cvref_t<Policy>>
+void transform(Policy &&policy, const cipher<KeyLen> &key,
+               std::span<const std::byte> in, std::span<std::byte> out,
+               std::uint64_t offset = 0)
+{
+  using policy_type = std::remove_cvref_t<Policy>;
+
+  const std::uint8_t *k = key.get()->key;
+
+  (void)policy;
+
+  detail::check_extents(in, out);
+  detail::exec_crypt<policy_type>(
+    [k](std::uint8_t *o, const std::uint8_t *i, std::size_t n,
+        std::uint64_t pos)
+      {
+        if constexpr (detail::exec_vector<policy_type>)
+          {
+            detail::crypt_fixed<KeyLen>(k, o, i, n, pos);
+          }
+        else
+          {
+            detail::crypt_at(k, KeyLen, o, i, n, pos);
+          }
+      },
+    reinterpret_cast<std::uint8_t *>(out.data()),
+    reinterpret_cast<const std::uint8_t *>(in.data()), in.size(), offset);
+}
+
+/* A temporary key dies while the threads run */
+
+template <class Policy>
+void transform(Policy &&, const context &&, std::span<const std::byte>,
+               std::span<std::byte>, std::uint64_t = 0) = delete;
+
+} /* namespace acrypt */
+
+#endif /* __ACRYPT_EXECUTION_HPP */
@@ -0,0 +1,856 @@
+/****************************************************************************
+ * @file  include/acrypt_pipe.hpp
+ *
+ * @brief Static pipelines from a source through stages to sinks.
+ *
+ *   std::uint32_t crc = 0;
+ *
+ *   (acrypt::pipe::file_source("in") | acrypt::pipe::encrypt(ctx) |
+ *    acrypt::pipe::crc32(crc) | acrypt::pipe::file_sink("out")).run();
+ *
+ * The source fills one tile, small enough to stay in the L1 or L2 cache,
+ * then every stage runs on that tile before the next one is read, so the
+ * stages are fused per tile and a byte is touched by all of them while it
+ * is still in cache. The stages are template parameters: there is no
+ * virtual call and the compiler sees the whole chain.
+ *
+ * A source has a read(std::span<std::byte>) member returning the amount of
+ * bytes it put in the tile, 0 at the end. A stage is anything callable on
+ * a std::span<std::byte>: returning void it works in place, returning a
+ * std::span<std::byte> it hands that to the next stages instead, which is
+ * how a stage can compress or buffer. A sink is a stage keeping the data.
+ * A stage with a finish() member has it called at the end; when finish()
+ * returns a span, it goes through the next stages too.
+ ****************************************************************************/
+
+#ifndef __ACRYPT_PIPE_HPP
+#define __ACRYPT_PIPE_HPP
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <concepts>
+#include <cstring>
+#include <memory_resource>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "acrypt.hpp"
+
+namespace acrypt::pipe
+{
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+inline constexpr std::size_t default_tile = 32 * 1024; /* Fits L1/L2    */
+inline constexpr std::size_t tile_align = 4096;        /* Bytes         */
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+namespace detail
+{
+
+[[noreturn]] inline void fail(const char *what)
+{
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+/* Fill 'tile' as much as the fd can, like read_full() of the crypt tool */
+
+inline std::size_t read_full(int fd, std::span<std::byte> tile)
+{
+  std::size_t total = 0;
+
+  while (total < tile.size())
+    {
+      ssize_t ret = ::read(fd, tile.data() + total, tile.size() - total);
+
+      if (ret < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+      if (ret < 0)
+        {
+          fail("acrypt: read");
+        }
+
+      if (ret == 0)
+        {
+          break;
+        }
+
+      total += ret;
+    }
+
+  return total;
+}
+
+inline void write_full(int fd, std::span<const std::byte> data)
+{
+  while (!data.empty())
+    {
+      ssize_t ret = ::write(fd, data.data(), data.size());
+
+      if (ret < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+      if (ret < 0)
+        {
+          fail("acrypt: write");
+        }
+
+      data = data.subspan(ret);
+    }
+}
+
+/** @class unique_fd
+ *  @brief File descriptor closed when destroyed
+ */
+
+class unique_fd
+{
+public:
+  unique_fd(const char *path, int flags)
+    : m_fd(::open(path, flags | O_CLOEXEC, 0666))
+  {
+    if (m_fd < 0)
+      {
+        fail("acrypt: open");
+      }
+  }
+
+  unique_fd(unique_fd &&other) noexcept
+    : m_fd(std::exchange(other.m_fd, -1))
+  {
+  }
+
+  unique_fd &operator=(unique_fd &&) = delete;
+
+  ~unique_fd()
+  {
+    if (m_fd >= 0)
+      {
+        ::close(m_fd);
+      }
+  }
+
+  int get() const noexcept
+  {
+    return m_fd;
+  }
+
+private:
+  int m_fd;
+};
+
+/* Same table as crc32_update() of the crypt tool */
+
+inline constexpr std::array<std::uint32_t, 256> crc32_table = []
+  {
+    std::array<std::uint32_t, 256> table {};
+
+    for (std::uint32_t i = 0; i < 256; i++)
+      {
+        std::uint32_t crc = i;
+
+        for (int j = 0; j < 8; j++)
+          {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+          }
+
+        table[i] = crc;
+      }
+
+    return table;
+  }();
+
+} /* namespace detail */
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/**
+ * @brief A source of bytes for a pipeline.
+ */
+
+template <class S>
+concept source = requires(S &s, std::span<std::byte> tile)
+  {
+    { s.read(tile) } -> std::convertible_to<std::size_t>;
+  };
+
+/**
+ * @brief A stage of a pipeline, working in place or passing on a span.
+ */
+
+template <class T>
+concept stage = std::invocable<T &, std::span<std::byte>> &&
+                (std::is_void_v<std::invoke_result_t<T &,
+                                                     std::span<std::byte>>> ||
+                 std::same_as<std::invoke_result_t<T &,
+                                                   std::span<std::byte>>,
+                              std::span<std::byte>>);
+
+/** @class pipeline
+ *  @brief A source and the stages its tiles go through, in order
+ */
+
+template <source Source, stage... Stages>
+class pipeline
+{
+public:
+  pipeline(Source source, std::tuple<Stages...> stages)
+    : m_source(std::move(source)), m_stages(std::move(stages))
+  {
+  }
+
+  /**
+   * @brief Move every byte of the source through the stages.
+   *
+   * @param tile size of the tile in bytes, not 0
+   * @param alloc allocator of the tile
+   * @return The amount of bytes read from the source
+   * @throw std::system_error on I/O errors, or what the stages throw
+   */
+
+  std::uint64_t run(std::size_t tile = default_tile,
+                    const context::allocator_type &alloc = {})
+  {
+    std::uint64_t total = 0;
+    std::size_t n;
+
+    if (tile == 0)
+      {
+        throw std::invalid_argument("acrypt: invalid tile size");
+      }
+
+    tile_buffer buf(tile, alloc.resource());
+
+    while ((n = m_source.read(std::span(buf.data, tile))) > 0)
+      {
+        buf.used = std::max(buf.used, n);
+        flow<0>(std::span(buf.data, n));
+        total += n;
+      }
+
+    finish<0>();
+
+    return total;
+  }
+
+  /**
+   * @brief Add a stage at the end of the pipeline.
+   */
+
+  template <class S>
+    requires stage<std::decay_t<S>>
+  friend pipeline<Source, Stages..., std::decay_t<S>>
+  operator|(pipeline &&p, S &&s)
+  {
+    return pipeline<Source, Stages..., std::decay_t<S>>(
+             std::move(p.m_source),
+             std::tuple_cat(std::move(p.m_stages),
+                            std::tuple<std::decay_t<S>>(
+                              std::forward<S>(s))));
+  }
+
+private:
+  /** @struct tile_buffer
+   *  @brief Aligned tile, wiped when freed since it held plaintext
+   */
+
+  struct tile_buffer
+  {
+    std::pmr::memory_resource *resource;
+    std::byte *data;
+    std::size_t size;
+    std::size_t used = 0; /* bytes ever filled, the ones to wipe */
+
+    tile_buffer(std::size_t n, std::pmr::memory_resource *mr)
+      : resource(mr),
+        data(static_cast<std::byte *>(mr->allocate(n, tile_align))),
+        size(n)
+    {
+    }
+
+    ~tile_buffer()
+    {
+      volatile std::byte *p = data;
+
+      for (std::size_t i = 0; i < used; i++)
+        {
+          p[i] = std::byte(0);
+        }
+
+      resource->deallocate(data, size, tile_align);
+    }
+  };
+
+  Source m_source;               /* where the tiles come from        */
+  std::tuple<Stages...> m_stages; /* what they go through, in order   */
+
+  /* Run stage I and the ones after it on 'data' */
+
+  template <std::size_t I>
+  void flow(std::span<std::byte> data)
+  {
+    if constexpr (I < sizeof...(Stages))
+      {
+        auto &s = std::get<I>(m_stages);
+
+        if constexpr (std::is_void_v<std::invoke_result_t<decltype(s),
+                                                          decltype(data)>>)
+          {
+            s(data);
+            flow<I + 1>(data);
+          }
+        else
+          {
+            flow<I + 1>(s(data));
+          }
+      }
+  }
+
+  /* Finish the stages in order, what one flushes goes through the next */
+
+  template <std::size_t I>
+  void finish()
+  {
+    if constexpr (I < sizeof...(Stages))
+      {
+        auto &s = std::get<I>(m_stages);
+
+        if constexpr (requires { { s.finish() } ->
+                                   std::same_as<std::span<std::byte>>; })
+          {
+            flow<I + 1>(s.finish());
+          }
+        else if constexpr (requires { s.finish(); })
+          {
+            s.finish();
+          }
+
+        finish<I + 1>();
+      }
+  }
+};
+
+/**
+ * @brief Start a pipeline from a source of this namespace.
+ */
+
+template <class Src, class S>
+  requires source<std::decay_t<Src>> && stage<std::decay_t<S>>
+pipeline<std::decay_t<Src>, std::decay_t<S>> operator|(Src &&src, S &&s)
+{
+  return pipeline<std::decay_t<Src>, std::decay_t<S>>(
+           std::forward<Src>(src),
+           std::tuple<std::decay_t<S>>(std::forward<S>(s)));
+}
+
+/* Sources ******************************************************************/
+
+/** @class memory_source
+ *  @brief Bytes already in memory
+ */
+
+class memory_source
+{
+public:
+  explicit memory_source(std::span<const std::byte> data) noexcept
+    : m_data(data)
+  {
+  }
+
+  std::size_t read(std::span<std::byte> tile) noexcept
+  {
+    std::size_t n = std::min(tile.size(), m_data.size());
+
+    if (n > 0)
+      {
+        std::memcpy(tile.data(), m_data.data(), n);
+        m_data = m_data.subspan(n);
+      }
+
+    return n;
+  }
+
+private:
+  std::span<const std::byte> m_data; /* what is left to read */
+};
+
+/** @class fd_source
+ *  @brief File descriptor read up to its end, not owned
+ */
+
+class fd_source
+{
+public:
+  explicit fd_source(int fd) noexcept
+    : m_fd(fd)
+  {
+  }
+
+  std::size_t read(std::span<std::byte> tile)
+  {
+    return detail::read_full(m_fd, tile);
+  }
+
+private:
+  int m_fd;
+};
+
+/** @class file_source
+ *  @brief File opened by name and read up to its end
+ */
+
+class file_source
+{
+public:
+  explicit file_source(const char *path)
+    : m_fd(path, O_RDONLY)
+  {
+    posix_fadvise(m_fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  std::size_t read(std::span<std::byte> tile)
+  {
+    return detail::read_full(m_fd.get(), tile);
+  }
+
+private:
+  detail::unique_fd m_fd;
+};
+
+/** @class mmap_source
+ *  @brief File mapped in memory, read without system calls
+ */
+
+class mmap_source
+{
+public:
+  explicit mmap_source(const char *path)
+    : m_fd(path, O_RDONLY)
+  {
+    struct stat sb;
+
+    if (fstat(m_fd.get(), &sb) < 0)
+      {
+        detail::fail("acrypt: fstat");
+      }
+
+    m_size = sb.st_size;
+    if (m_size == 0)
+      {
+        return;
+      }
+
+    m_map = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd.get(), 0);
+    if (m_map == MAP_FAILED)
+      {
+        m_map = nullptr;
+        detail::fail("acrypt: mmap");
+      }
+
+    madvise(m_map, m_size, MADV_SEQUENTIAL);
+  }
+
+  mmap_source(mmap_source &&other) noexcept
+    : m_fd(std::move(other.m_fd)),
+      m_map(std::exchange(other.m_map, nullptr)),
+      m_size(std::exchange(other.m_size, 0)),
+      m_pos(std::exchange(other.m_pos, 0))
+  {
+  }
+
+  ~mmap_source()
+  {
+    if (m_map != nullptr)
+      {
+        ::munmap(m_map, m_size);
+      }
+  }
+
+  std::size_t read(std::span<std::byte> tile) noexcept
+  {
+    std::size_t n = std::min(tile.size(), m_size - m_pos);
+
+    if (n > 0)
+      {
+        std::memcpy(tile.data(), static_cast<std::byte *>(m_map) + m_pos,
+                    n);
+        m_pos += n;
+      }
+
+    return n;
+  }
+
+private:
+  detail::unique_fd m_fd;
+  void *m_map = nullptr;   /* the mapping, none for an empty file */
+  std::size_t m_size = 0;  /* size of the file                    */
+  std::size_t m_pos = 0;   /* next byte to read                   */
+};
+
+/* Stages *******************************************************************/
+
+/** @class crypt_stage
+ *  @brief Encrypt or decrypt the tiles with the key of 'Key'
+ *
+ *  When 'File' is true the keystream restarts every CRYPT_BLOCK_SIZE
+ *  bytes, as in the files of the crypt program.
+ */
+
+template <class Key, bool File>
+class crypt_stage
+{
+public:
+  crypt_stage(const Key &key, std::uint64_t offset) noexcept
+    : m_key(&key), m_pos(offset)
+  {
+  }
+
+  void operator()(std::span<std::byte> data)
+  {
+    if constexpr (File)
+      {
+        m_key->encrypt_file(data, data, m_pos);
+      }
+    else
+      {
+        m_key->encrypt(data, m_pos);
+      }
+
+    m_pos += data.size();
+  }
+
+private:
+  const Key *m_key;     /* key, it must outlive the pipeline   */
+  std::uint64_t m_pos;  /* keystream position of the next tile */
+};
+
+/**
+ * @brief Encrypt from keystream position 'offset', like crypt_buffer_at().
+ */
+
+inline crypt_stage<context, false> encrypt(const context &ctx,
+                                           std::uint64_t offset = 0)
+{
+  return crypt_stage<context, false>(ctx, offset);
+}
+
+template <std::size_t KeyLen>
+crypt_stage<cipher<KeyLen>, false> encrypt(const cipher<KeyLen> &key,
+                                           std::uint64_t offset = 0)
+{
+  return crypt_stage<cipher<KeyLen>, false>(key, offset);
+}
+
+/**
+ * @brief Decrypt, the same as encrypt().
+ */
+
+inline crypt_stage<context, false> decrypt(const context &ctx,
+                                           std::uint64_t offset = 0)
+{
+  return crypt_stage<context, false>(ctx, offset);
+}
+
+template <std::size_t KeyLen>
+crypt_stage<cipher<KeyLen>, false> decrypt(const cipher<KeyLen> &key,
+                                           std::uint64_t offset = 0)
+{
+  return crypt_stage<cipher<KeyLen>, false>(key, offset);
+}
+
+/**
+ * @brief Encrypt or decrypt from file 'offset', like crypt_file_at().
+ */
+
+inline crypt_stage<context, true> crypt_file(const context &ctx,
+                                             std::uint64_t offset = 0)
+{
+  return crypt_stage<context, true>(ctx, offset);
+}
+
+/* The key must outlive the pipeline, a temporary doesn't */
+
+void encrypt(const context &&, std::uint64_t = 0) = delete;
+void decrypt(const context &&, std::uint64_t = 0) = delete;
+void crypt_file(const context &&, std::uint64_t = 0) = delete;
+
+template <std::size_t KeyLen>
+void encrypt(const cipher<KeyLen> &&, std::uint64_t = 0) = delete;
+
+template <std::size_t KeyLen>
+void decrypt(const cipher<KeyLen> &&, std::uint64_t = 0) = delete;
+
+/** @class crc32
+ *  @brief Update a CRC-32 with the tiles, as crc32_update() of the tool
+ */
+
+class crc32
+{
+public:
+  explicit crc32(std::uint32_t &crc) noexcept
+    : m_crc(&crc)
+  {
+  }
+
+  void operator()(std::span<std::byte> data) noexcept
+  {
+    std::uint32_t crc = ~*m_crc;
+
+    for (std::byte b : data)
+      {
+        crc = detail::crc32_table[(crc ^ std::uint8_t(b)) & 0xff] ^
+              (crc >> 8);
+      }
+
+    *m_crc = ~crc;
+  }
+
+private:
+  std::uint32_t *m_crc;
+};
+
+/* Sinks ********************************************************************/
+
+/** @class memory_sink
+ *  @brief Copy the tiles to a buffer
+ */
+
+class memory_sink
+{
+public:
+  explicit memory_sink(std::span<std::byte> buffer) noexcept
+    : m_buffer(buffer)
+  {
+  }
+
+  /**
+   * @throw std::length_error if the buffer is full
+   */
+
+  void operator()(std::span<std::byte> data)
+  {
+    if (data.empty())
+      {
+        return;
+      }
+
+    if (data.size() > m_buffer.size() - m_size)
+      {
+        throw std::length_error("acrypt: memory sink is full");
+      }
+
+    std::memcpy(m_buffer.data() + m_size, data.data(), data.size());
+    m_size += data.size();
+  }
+
+  std::size_t size() const noexcept
+  {
+    return m_size;
+  }
+
+private:
+  std::span<std::byte> m_buffer;  /* where the tiles go   */
+  std::size_t m_size = 0;         /* bytes written so far */
+};
+
+/** @class vector_sink
+ *  @brief Append the tiles to a vector
+ */
+
+class vector_sink
+{
+public:
+  explicit vector_sink(std::vector<std::byte> &out) noexcept
+    : m_out(&out)
+  {
+  }
+
+  void operator()(std::span<std::byte> data)
+  {
+    m_out->insert(m_out->end(), data.begin(), data.end());
+  }
+
+private:
+  std::vector<std::byte> *m_out;
+};
+
+/** @class fd_sink
+ *  @brief Write the tiles to a file descriptor, not owned
+ */
+
+class fd_sink
+{
+public:
+  explicit fd_sink(int fd) noexcept
+    : m_fd(fd)
+  {
+  }
+
+  void operator()(std::span<std::byte> data)
+  {
+    detail::write_full(m_fd, data);
+  }
+
+private:
+  int m_fd;
+};
+
+/** @class file_sink
+ *  @brief Write the tiles to a file created or truncated by name
+ */
+
+class file_sink
+{
+public:
+  explicit file_sink(const char *path)
+    : m_fd(path, O_WRONLY | O_CREAT | O_TRUNC)
+  {
+  }
+
+  void operator()(std::span<std::byte> data)
+  {
+    detail::write_full(m_fd.get(), data);
+  }
+
+private:
+  detail::unique_fd m_fd;
+};
+
+/** @class mmap_sink
+ *  @brief Copy the tiles to a file created by name and mapped in memory
+ *
+ *  The file grows in large steps while mapped and is cut to the size of
+ *  the data by finish(), or at the latest when the sink is destroyed.
+ */
+
+class mmap_sink
+{
+public:
+  static constexpr std::size_t min_grow = 1024 * 1024; /* Bytes */
+
+  explicit mmap_sink(const char *path)
+    : m_fd(path, O_RDWR | O_CREAT | O_TRUNC)
+  {
+  }
+
+  mmap_sink(mmap_sink &&other) noexcept
+    : m_fd(std::move(other.m_fd)),
+      m_map(std::exchange(other.m_map, nullptr)),
+      m_mapped(std::exchange(other.m_mapped, 0)),
+      m_size(std::exchange(other.m_size, 0))
+  {
+  }
+
+  ~mmap_sink()
+  {
+    unmap();
+  }
+
+  void operator()(std::span<std::byte> data)
+  {
+    if (data.empty())
+      {
+        return;
+      }
+
+    if (data.size() > m_mapped - m_size)
+      {
+        grow(m_size + data.size());
+      }
+
+    std::memcpy(static_cast<std::byte *>(m_map) + m_size, data.data(),
+                data.size());
+    m_size += data.size();
+  }
+
+  /**
+   * @brief Unmap the file and cut it to the size of the data.
+   *
+   * @throw std::system_error if the file can't be cut
+   */
+
+  void finish()
+  {
+    if (!unmap())
+      {
+        detail::fail("acrypt: ftruncate");
+      }
+  }
+
+private:
+  detail::unique_fd m_fd;
+  void *m_map = nullptr;    /* the mapping                */
+  std::size_t m_mapped = 0; /* size of the mapping        */
+  std::size_t m_size = 0;   /* bytes written so far       */
+
+  void grow(std::size_t need)
+  {
+    std::size_t size = std::max({need, 2 * m_mapped, min_grow});
+    void *map;
+
+    if (ftruncate(m_fd.get(), size) < 0)
+      {
+        detail::fail("acrypt: ftruncate");
+      }
+
+    if (m_map == nullptr)
+      {
+        map = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     m_fd.get(), 0);
+      }
+    else
+      {
+        map = ::mremap(m_map, m_mapped, size, MREMAP_MAYMOVE);
+      }
+
+    if (map == MAP_FAILED)
+      {
+        detail::fail("acrypt: mmap");
+      }
+
+    m_map    = map;
+    m_mapped = size;
+  }
+
+  bool unmap() noexcept
+  {
+    if (m_map == nullptr)
+      {
+        return true;
+      }
+
+    ::munmap(m_map, m_mapped);
+    m_map    = nullptr;
+    m_mapped = 0;
+
+    return ftruncate(m_fd.get(), m_size) == 0;
+  }
+};
+
+} /* namespace acrypt::pipe */
+
+#endif /* __ACRYPT_PIPE_HPP */
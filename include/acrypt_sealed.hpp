@@ -0,0 +1,271 @@
+/****************************************************************************
+ * @file  include/acrypt_sealed.hpp
+ *
+ * @brief String literals encrypted at compile time.
+ *
+ *   using password = ACRYPT_SEALED("hunter2", "build key");
+ *
+ *   connect(password::view());
+ *
+ * The ciphertext is computed by the compiler with the constexpr kernel of
+ * acrypt.hpp, so only the ciphertext and the key are in the binary, the
+ * plaintext never is and there is nothing to encrypt at startup. Neither
+ * is a template argument: the type is named after the lambda the macro
+ * expands to, so they don't show up in symbol names either. view()
+ * decrypts on first use into a static buffer kept for the whole process,
+ * open() decrypts into a buffer on the stack that is wiped when it goes
+ * out of scope.
+ ****************************************************************************/
+
+#ifndef __ACRYPT_SEALED_HPP
+#define __ACRYPT_SEALED_HPP
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "acrypt.hpp"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+/* Type of a string literal sealed with a key literal. Each use is a type
+ * of its own, declare it once and use the alias.
+ */
+
+#define ACRYPT_SEALED(text, key) \
+  ::acrypt::sealed<decltype([] \
+    { \
+      return ::acrypt::seal_text(text, key); \
+    })>
+
+namespace acrypt
+{
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+namespace detail
+{
+
+/**
+ * @brief Hide a pointer from the optimizer.
+ *
+ * Without it the compiler can fold the decryption of constant data and
+ * put the plaintext back into the binary.
+ *
+ * @param p pointer to hide
+ * @return The same pointer
+ */
+
+template <class T>
+inline const T *opaque(const T *p) noexcept
+{
+  const T *volatile hidden = p;
+
+  return hidden;
+}
+
+} /* namespace detail */
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/** @struct sealed_text
+ *  @brief Ciphertext of a string and the key to open it, see seal_text()
+ */
+
+template <std::size_t N, std::size_t K>
+struct sealed_text
+{
+  std::array<std::uint8_t, N> cipher;
+  std::array<std::uint8_t, K> key;
+};
+
+/** @class unsealed
+ *  @brief Decrypted copy of a sealed literal, wiped when destroyed
+ *
+ *  It can't be copied or moved, so the plaintext stays in one place.
+ */
+
+template <std::size_t N>
+class unsealed
+{
+public:
+  unsealed(const std::uint8_t *cipher, const std::uint8_t *key,
+           std::size_t keylen) noexcept
+  {
+    detail::crypt_at(detail::opaque(key), keylen,
+                     reinterpret_cast<std::uint8_t *>(m_data),
+                     detail::opaque(cipher), N, 0);
+    m_data[N] = '\0';
+  }
+
+  unsealed(const unsealed &) = delete;
+  unsealed &operator=(const unsealed &) = delete;
+
+  ~unsealed()
+  {
+    volatile char *p = m_data;
+
+    for (std::size_t i = 0; i < N; i++)
+      {
+        p[i] = 0;
+      }
+  }
+
+  [[nodiscard]] const char *c_str() const & noexcept
+  {
+    return m_data;
+  }
+
+  [[nodiscard]] std::string_view view() const & noexcept
+  {
+    return std::string_view(m_data, N);
+  }
+
+  /* The plaintext of a temporary is wiped at the end of the statement */
+
+  const char *c_str() const && = delete;
+  std::string_view view() const && = delete;
+
+  static constexpr std::size_t size() noexcept
+  {
+    return N;
+  }
+
+private:
+  char m_data[N + 1];
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypt a string literal at compile time, like crypt_buffer().
+ *
+ * The terminating NULs of 'text' and 'key' are not part of them.
+ *
+ * @param text string to encrypt
+ * @param key key text, at least one character
+ * @return The ciphertext
+ */
+
+template <std::size_t N, std::size_t K>
+consteval std::array<std::uint8_t, N - 1> seal(const char (&text)[N],
+                                               const char (&key)[K])
+{
+  static_assert(K > 1, "acrypt: empty key");
+
+  std::array<std::uint8_t, N - 1> out {};
+  std::uint8_t plain[N] {};
+  std::uint8_t bytes[K] {};
+
+  for (std::size_t i = 0; i < N; i++)
+    {
+      plain[i] = static_cast<std::uint8_t>(text[i]);
+    }
+
+  for (std::size_t i = 0; i < K; i++)
+    {
+      bytes[i] = static_cast<std::uint8_t>(key[i]);
+    }
+
+  detail::crypt_at(bytes, K - 1, out.data(), plain, N - 1, 0);
+
+  return out;
+}
+
+/**
+ * @brief Encrypt a string literal at compile time and keep the key.
+ *
+ * @param text string to encrypt
+ * @param key key text, at least one character
+ * @return The ciphertext and the key, without their NULs
+ */
+
+template <std::size_t N, std::size_t K>
+consteval sealed_text<N - 1, K - 1> seal_text(const char (&text)[N],
+                                              const char (&key)[K])
+{
+  sealed_text<N - 1, K - 1> out {};
+
+  out.cipher = seal(text, key);
+
+  for (std::size_t i = 0; i < K - 1; i++)
+    {
+      out.key[i] = static_cast<std::uint8_t>(key[i]);
+    }
+
+  return out;
+}
+
+/** @class sealed
+ *  @brief String literal stored encrypted, see ACRYPT_SEALED()
+ *
+ *  'Source' is a lambda type returning the seal_text() of the literal.
+ */
+
+template <class Source>
+class sealed
+{
+  static constexpr auto s_text = Source {}();
+
+public:
+  static constexpr std::size_t size = s_text.cipher.size();
+
+  /* The only form of the text in the binary */
+
+  static constexpr std::array<std::uint8_t, size> ciphertext =
+    s_text.cipher;
+
+  /**
+   * @brief Get the text, decrypted on the first call of any thread.
+   *
+   * The plaintext stays in a static buffer until the process exits.
+   */
+
+  static std::string_view view()
+  {
+    static const unsealed<size> plain = open();
+
+    return plain.view();
+  }
+
+  /**
+   * @brief Get the text as a NUL terminated string, see view().
+   */
+
+  static const char *c_str()
+  {
+    return view().data();
+  }
+
+  /**
+   * @brief Decrypt the text into a buffer wiped at the end of its scope.
+   *
+   *   auto pw = password::open();
+   *   login(pw.c_str());
+   */
+
+  static unsealed<size> open() noexcept
+  {
+    return unsealed<size>(ciphertext.data(), s_key.data(), s_key.size());
+  }
+
+private:
+  static constexpr auto s_key = s_text.key;
+};
+
+} /* namespace acrypt */
+
+#endif /* __ACRYPT_SEALED_HPP */
@@ -0,0 +1,472 @@
+/****************************************************************************
+ * @file  include/acrypt_stream.hpp
+ *
+ * @brief std::streambuf and iostreams that encrypt or decrypt on the fly.
+ *
+ * acrypt::crypt_streambuf sits on top of another streambuf or of a file
+ * descriptor. Data goes through one large aligned block: a whole block is
+ * encrypted before it is written, or decrypted after it is read, so the
+ * per character cost is the one of a memcpy. The keystream position is
+ * the stream position, which makes seekg()/seekp() work on anything the
+ * underlying streambuf or fd can seek.
+ *
+ *   acrypt::crypt_ostream out(fd, ctx);
+ *   out << "secret " << 42 << '\n';
+ ****************************************************************************/
+
+#ifndef __ACRYPT_STREAM_HPP
+#define __ACRYPT_STREAM_HPP
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <cerrno>
+#include <istream>
+#include <memory_resource>
+#include <ostream>
+#include <streambuf>
+
+#include <unistd.h>
+
+#include "acrypt.hpp"
+
+namespace acrypt
+{
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/** @class crypt_streambuf
+ *  @brief Stream buffer encrypting what is written to an underlying
+ *         streambuf or fd, and decrypting what is read from it
+ */
+
+class crypt_streambuf : public std::streambuf
+{
+public:
+  using allocator_type = context::allocator_type;
+
+  static constexpr std::size_t default_block = 64 * 1024; /* Bytes */
+  static constexpr std::size_t block_align = 4096;        /* Bytes */
+
+  /**
+   * @brief Encrypt through another stream buffer.
+   *
+   * @param sink underlying stream buffer, not owned
+   * @param ctx key context, it must outlive this buffer
+   * @param file follow the CRYPT_BLOCK_SIZE restarts of the crypt program
+   * @param block size of the buffer in bytes
+   * @param alloc allocator of the buffer
+   */
+
+  crypt_streambuf(std::streambuf *sink, const context &ctx,
+                  bool file = false, std::size_t block = default_block,
+                  const allocator_type &alloc = {})
+    : crypt_streambuf(ctx, file, block, alloc)
+  {
+    m_sink = sink;
+  }
+
+  /**
+   * @brief Encrypt through a file descriptor.
+   *
+   * @param fd underlying file descriptor, not owned
+   * @param ctx key context, it must outlive this buffer
+   * @param file follow the CRYPT_BLOCK_SIZE restarts of the crypt program
+   * @param block size of the buffer in bytes
+   * @param alloc allocator of the buffer
+   */
+
+  crypt_streambuf(int fd, const context &ctx, bool file = false,
+                  std::size_t block = default_block,
+                  const allocator_type &alloc = {})
+    : crypt_streambuf(ctx, file, block, alloc)
+  {
+    m_fd = fd;
+  }
+
+  /* The key must outlive the buffer, a temporary context doesn't */
+
+  crypt_streambuf(std::streambuf *, const context &&, bool = false,
+                  std::size_t = default_block,
+                  const allocator_type & = {}) = delete;
+  crypt_streambuf(int, const context &&, bool = false,
+                  std::size_t = default_block,
+                  const allocator_type & = {}) = delete;
+
+  crypt_streambuf(const crypt_streambuf &) = delete;
+  crypt_streambuf &operator=(const crypt_streambuf &) = delete;
+
+  ~crypt_streambuf() override
+  {
+    flush();
+
+    volatile char *p = m_buf;
+
+    for (std::size_t i = 0; i < m_block; i++)
+      {
+        p[i] = 0;
+      }
+
+    m_resource->deallocate(m_buf, m_block, block_align);
+  }
+
+protected:
+  int_type overflow(int_type c) override
+  {
+    if (!writing() && !start_writing())
+      {
+        return traits_type::eof();
+      }
+
+    if (pptr() == epptr() && !flush())
+      {
+        return traits_type::eof();
+      }
+
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+      {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+      }
+
+    return traits_type::not_eof(c);
+  }
+
+  int_type underflow() override
+  {
+    std::size_t n;
+
+    if (writing())
+      {
+        if (!flush())
+          {
+            return traits_type::eof();
+          }
+
+        setp(nullptr, nullptr);
+      }
+
+    /* The next block starts where the last one ended */
+
+    m_pos += egptr() - eback();
+    setg(m_buf, m_buf, m_buf);
+
+    n = raw_read(m_buf, m_block);
+    if (n == 0)
+      {
+        return traits_type::eof();
+      }
+
+    crypt(n);
+    setg(m_buf, m_buf, m_buf + n);
+
+    return traits_type::to_int_type(*gptr());
+  }
+
+  int sync() override
+  {
+    if (writing() && !flush())
+      {
+        return -1;
+      }
+
+    return m_sink != nullptr ? m_sink->pubsync() : 0;
+  }
+
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override
+  {
+    off_type base;
+
+    switch (dir)
+      {
+        case std::ios_base::beg:
+          base = 0;
+          break;
+
+        case std::ios_base::cur:
+          base = position();
+          if (off == 0)
+            {
+              return pos_type(base); /* tellg() and tellp() */
+            }
+          break;
+
+        default:
+          if ((writing() && !flush()) || (base = raw_seek(0, dir)) < 0)
+            {
+              return pos_type(off_type(-1));
+            }
+
+          /* The underlying position moved, the read block is stale */
+
+          m_pos = base;
+          setg(nullptr, nullptr, nullptr);
+          break;
+      }
+
+    return seekpos(pos_type(base + off), which);
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode) override
+  {
+    off_type target = pos;
+
+    if (target < 0 || (writing() && !flush()))
+      {
+        return pos_type(off_type(-1));
+      }
+
+    /* Still inside the decrypted block: no I/O at all */
+
+    if (eback() != nullptr && target >= m_pos &&
+        target <= m_pos + (egptr() - eback()))
+      {
+        setg(eback(), eback() + (target - m_pos), egptr());
+        return pos;
+      }
+
+    if (raw_seek(target, std::ios_base::beg) != target)
+      {
+        return pos_type(off_type(-1));
+      }
+
+    m_pos = target;
+    setg(nullptr, nullptr, nullptr);
+
+    return pos;
+  }
+
+private:
+  std::streambuf *m_sink {};             /* underlying stream buffer, or */
+  int m_fd = -1;                         /* underlying file descriptor   */
+  const std::uint8_t *m_key;             /* key bytes of the context     */
+  std::size_t m_keylen;                  /* length of the key            */
+  bool m_file;                           /* keystream of the crypt tool  */
+  std::size_t m_block;                   /* size of the buffer           */
+  std::pmr::memory_resource *m_resource; /* allocator of the buffer      */
+  char *m_buf;                           /* aligned block buffer         */
+  off_type m_pos = 0;                    /* stream position of m_buf     */
+
+  crypt_streambuf(const context &ctx, bool file, std::size_t block,
+                  const allocator_type &alloc)
+    : m_key(ctx.get()->key), m_keylen(ctx.key_size()), m_file(file),
+      m_block(block), m_resource(alloc.resource())
+  {
+    if (m_key == nullptr)
+      {
+        throw std::logic_error("acrypt: context was moved");
+      }
+
+    if (block == 0)
+      {
+        throw std::invalid_argument("acrypt: invalid stream block size");
+      }
+
+    m_buf = static_cast<char *>(m_resource->allocate(block, block_align));
+  }
+
+  bool writing() const
+  {
+    return pbase() != nullptr;
+  }
+
+  off_type position() const
+  {
+    if (writing())
+      {
+        return m_pos + (pptr() - pbase());
+      }
+
+    return m_pos + (gptr() - eback());
+  }
+
+  /* Leaving the read mode, the underlying position is ahead of ours */
+
+  bool start_writing()
+  {
+    off_type pos = position();
+
+    if (egptr() != gptr() && raw_seek(pos, std::ios_base::beg) != pos)
+      {
+        return false;
+      }
+
+    m_pos = pos;
+    setg(nullptr, nullptr, nullptr);
+    setp(m_buf, m_buf + m_block);
+
+    return true;
+  }
+
+  /* Encrypt or decrypt the first 'n' bytes of the buffer in place */
+
+  void crypt(std::size_t n)
+  {
+    auto *p = reinterpret_cast<std::uint8_t *>(m_buf);
+
+    if (m_file)
+      {
+        detail::crypt_file_at(m_key, m_keylen, p, p, n, m_pos);
+      }
+    else
+      {
+        detail::crypt_keyed(m_key, m_keylen, p, p, n, m_pos);
+      }
+  }
+
+  /* Encrypt and write what was put, back to an empty put area */
+
+  bool flush()
+  {
+    std::size_t n;
+
+    if (!writing())
+      {
+        return true;
+      }
+
+    n = pptr() - pbase();
+    crypt(n);
+    setp(nullptr, nullptr);
+
+    if (!raw_write(m_buf, n))
+      {
+        return false;
+      }
+
+    m_pos += n;
+    setp(m_buf, m_buf + m_block);
+
+    return true;
+  }
+
+  /* What one read() gives: waiting for a full block would hang on a pipe
+   * or a socket whose writer waits for an answer
+   */
+
+  std::size_t raw_read(char *buf, std::size_t size)
+  {
+    ssize_t ret;
+
+    if (m_sink != nullptr)
+      {
+        return m_sink->sgetn(buf, size);
+      }
+
+    do
+      {
+        ret = ::read(m_fd, buf, size);
+      }
+    while (ret < 0 && errno == EINTR);
+
+    return ret > 0 ? ret : 0;
+  }
+
+  bool raw_write(const char *buf, std::size_t size)
+  {
+    if (m_sink != nullptr)
+      {
+        return m_sink->sputn(buf, size) == std::streamsize(size);
+      }
+
+    while (size > 0)
+      {
+        ssize_t ret = ::write(m_fd, buf, size);
+
+        if (ret < 0 && errno == EINTR)
+          {
+            continue;
+          }
+
+        if (ret <= 0)
+          {
+            return false;
+          }
+
+        buf  += ret;
+        size -= ret;
+      }
+
+    return true;
+  }
+
+  off_type raw_seek(off_type off, std::ios_base::seekdir dir)
+  {
+    if (m_sink != nullptr)
+      {
+        return m_sink->pubseekoff(off, dir);
+      }
+
+    return ::lseek(m_fd, off, dir == std::ios_base::beg ? SEEK_SET :
+                              dir == std::ios_base::cur ? SEEK_CUR :
+                              SEEK_END);
+  }
+};
+
+/** @class crypt_istream
+ *  @brief Input stream decrypting an underlying streambuf or fd
+ */
+
+class crypt_istream : public std::istream
+{
+public:
+  template <class Source>
+  crypt_istream(Source source, const context &ctx, bool file = false,
+                std::size_t block = crypt_streambuf::default_block,
+                const crypt_streambuf::allocator_type &alloc = {})
+    : std::istream(nullptr), m_buf(source, ctx, file, block, alloc)
+  {
+    init(&m_buf);
+  }
+
+  template <class Source>
+  crypt_istream(Source, const context &&, bool = false,
+                std::size_t = crypt_streambuf::default_block,
+                const crypt_streambuf::allocator_type & = {}) = delete;
+
+  crypt_streambuf *rdbuf() const
+  {
+    return const_cast<crypt_streambuf *>(&m_buf);
+  }
+
+private:
+  crypt_streambuf m_buf;
+};
+
+/** @class crypt_ostream
+ *  @brief Output stream encrypting into an underlying streambuf or fd
+ */
+
+class crypt_ostream : public std::ostream
+{
+public:
+  template <class Sink>
+  crypt_ostream(Sink sink, const context &ctx, bool file = false,
+                std::size_t block = crypt_streambuf::default_block,
+                const crypt_streambuf::allocator_type &alloc = {})
+    : std::ostream(nullptr), m_buf(sink, ctx, file, block, alloc)
+  {
+    init(&m_buf);
+  }
+
+  template <class Sink>
+  crypt_ostream(Sink, const context &&, bool = false,
+                std::size_t = crypt_streambuf::default_block,
+                const crypt_streambuf::allocator_type & = {}) = delete;
+
+  crypt_streambuf *rdbuf() const
+  {
+    return const_cast<crypt_streambuf *>(&m_buf);
+  }
+
+private:
+  crypt_streambuf m_buf;
+};
+
+} /* namespace acrypt */
+
+#endif /* __ACRYPT_STREAM_HPP */
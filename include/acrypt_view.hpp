@@ -0,0 +1,545 @@
+/****************************************************************************
+ * @file  include/acrypt_view.hpp
+ *
+ * @brief Lazy C++20 range adaptor that encrypts or decrypts on the fly.
+ *
+ *   for (std::byte b : data | acrypt::views::crypt(ctx)) ...
+ *
+ * The iterators compute every keystream byte when it is read, nothing is
+ * staged. They keep the category of the underlying range up to random
+ * access, since any keystream position can be computed directly.
+ * views::crypt_file() follows the CRYPT_BLOCK_SIZE restarts of the crypt
+ * program instead, like crypt_file_at().
+ *
+ * Elements are computed, so the iterators can't be contiguous, and
+ * std::copy() and std::ranges::copy() have no hook a view can use: they
+ * always go byte by byte, away from the vectorized kernel. The fast path
+ * is acrypt::copy() instead, a drop-in for std::ranges::copy() that
+ * encrypts a contiguous view into a contiguous output a whole span at a
+ * time with the kernel of acrypt::context::encrypt(), and falls back to
+ * std::ranges::copy() otherwise.
+ ****************************************************************************/
+
+#ifndef __ACRYPT_VIEW_HPP
+#define __ACRYPT_VIEW_HPP
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <algorithm>
+#include <compare>
+#include <concepts>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <type_traits>
+
+#include "acrypt.hpp"
+
+namespace acrypt
+{
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/**
+ * @brief Element types the views and acrypt::copy() work on.
+ */
+
+template <class T>
+concept byte_like = std::same_as<std::remove_cv_t<T>, std::byte> ||
+                    std::same_as<std::remove_cv_t<T>, char> ||
+                    std::same_as<std::remove_cv_t<T>, signed char> ||
+                    std::same_as<std::remove_cv_t<T>, unsigned char>;
+
+/** @class crypt_view
+ *  @brief View of 'V' encrypted from keystream position 'offset'
+ *
+ *  When 'File' is true the keystream restarts every CRYPT_BLOCK_SIZE
+ *  bytes, as in the files written by the crypt program, and 'offset' is
+ *  a file offset.
+ */
+
+template <std::ranges::input_range V, bool File>
+  requires std::ranges::view<V> && byte_like<std::ranges::range_value_t<V>>
+class crypt_view : public std::ranges::view_interface<crypt_view<V, File>>
+{
+private:
+  template <bool Const>
+  using base_t = std::conditional_t<Const, const V, V>;
+
+  template <bool Const>
+  class sentinel;
+
+  /** @class iterator
+   *  @brief Iterator computing the keystream of its position
+   */
+
+  template <bool Const>
+  class iterator
+  {
+  private:
+    using base_iter = std::ranges::iterator_t<base_t<Const>>;
+
+    base_iter m_it {};               /* position in the underlying range */
+    const std::uint8_t *m_key {};    /* key bytes                        */
+    std::size_t m_keylen {};         /* length of the key                */
+    std::uint64_t m_pos {};          /* keystream position of m_it       */
+    std::size_t m_i {};              /* key byte used at m_pos           */
+    std::uint8_t m_step {};          /* times it was bumped, plus 1      */
+
+    friend class crypt_view;
+    friend class iterator<!Const>;
+
+    iterator(base_iter it, const std::uint8_t *key, std::size_t keylen,
+             std::uint64_t pos)
+      : m_it(std::move(it)), m_key(key), m_keylen(keylen)
+    {
+      seek(pos);
+    }
+
+    /* Random access: compute the key byte and step of any position */
+
+    void seek(std::uint64_t pos)
+    {
+      std::uint64_t kpos = File ? pos % CRYPT_BLOCK_SIZE : pos;
+
+      m_pos  = pos;
+      m_i    = kpos % m_keylen;
+      m_step = kpos / m_keylen + 1;
+    }
+
+  public:
+    using value_type      = std::remove_cv_t<
+                              std::ranges::range_value_t<base_t<Const>>>;
+    using difference_type = std::ranges::range_difference_t<base_t<Const>>;
+    using iterator_concept = std::conditional_t<
+      std::ranges::random_access_range<base_t<Const>>,
+      std::random_access_iterator_tag,
+      std::conditional_t<
+        std::ranges::bidirectional_range<base_t<Const>>,
+        std::bidirectional_iterator_tag,
+        std::conditional_t<std::ranges::forward_range<base_t<Const>>,
+                           std::forward_iterator_tag,
+                           std::input_iterator_tag>>>;
+
+    /* Elements are computed, so for the C++17 algorithms it's an input */
+
+    using iterator_category = std::input_iterator_tag;
+
+    iterator() requires std::default_initializable<base_iter> = default;
+
+    iterator(iterator<!Const> other)
+      requires Const && std::convertible_to<
+        std::ranges::iterator_t<V>, base_iter>
+      : m_it(std::move(other.m_it)), m_key(other.m_key),
+        m_keylen(other.m_keylen), m_pos(other.m_pos), m_i(other.m_i),
+        m_step(other.m_step)
+    {
+    }
+
+    const base_iter &base() const & noexcept
+    {
+      return m_it;
+    }
+
+    base_iter base() &&
+    {
+      return std::move(m_it);
+    }
+
+    value_type operator*() const
+    {
+      std::uint8_t ks = m_key[m_i] + m_step * m_i;
+
+      return value_type(static_cast<std::uint8_t>(*m_it) ^ ks);
+    }
+
+    value_type operator[](difference_type n) const
+      requires std::ranges::random_access_range<base_t<Const>>
+    {
+      return *(*this + n);
+    }
+
+    iterator &operator++()
+    {
+      ++m_it;
+      ++m_pos;
+
+      if (File && m_pos % CRYPT_BLOCK_SIZE == 0)
+        {
+          m_i    = 0;
+          m_step = 1;
+        }
+      else if (++m_i == m_keylen)
+        {
+          m_i = 0;
+          m_step++;
+        }
+
+      return *this;
+    }
+
+    void operator++(int)
+      requires (!std::ranges::forward_range<base_t<Const>>)
+    {
+      ++*this;
+    }
+
+    iterator operator++(int)
+      requires std::ranges::forward_range<base_t<Const>>
+    {
+      iterator tmp = *this;
+
+      ++*this;
+      return tmp;
+    }
+
+    iterator &operator--()
+      requires std::ranges::bidirectional_range<base_t<Const>>
+    {
+      --m_it;
+      seek(m_pos - 1);
+      return *this;
+    }
+
+    iterator operator--(int)
+      requires std::ranges::bidirectional_range<base_t<Const>>
+    {
+      iterator tmp = *this;
+
+      --*this;
+      return tmp;
+    }
+
+    iterator &operator+=(difference_type n)
+      requires std::ranges::random_access_range<base_t<Const>>
+    {
+      m_it += n;
+      seek(m_pos + n);
+      return *this;
+    }
+
+    iterator &operator-=(difference_type n)
+      requires std::ranges::random_access_range<base_t<Const>>
+    {
+      return *this += -n;
+    }
+
+    friend iterator operator+(iterator it, difference_type n)
+      requires std::ranges::random_access_range<base_t<Const>>
+    {
+      return it += n;
+    }
+
+    friend iterator operator+(difference_type n, iterator it)
+      requires std::ranges::random_access_range<base_t<Const>>
+    {
+      return it += n;
+    }
+
+    friend iterator operator-(iterator it, difference_type n)
+      requires std::ranges::random_access_range<base_t<Const>>
+    {
+      return it -= n;
+    }
+
+    friend difference_type operator-(const iterator &a, const iterator &b)
+      requires std::sized_sentinel_for<base_iter, base_iter>
+    {
+      return a.m_it - b.m_it;
+    }
+
+    friend bool operator==(const iterator &a, const iterator &b)
+      requires std::equality_comparable<base_iter>
+    {
+      return a.m_it == b.m_it;
+    }
+
+    friend auto operator<=>(const iterator &a, const iterator &b)
+      requires std::ranges::random_access_range<base_t<Const>> &&
+               std::three_way_comparable<base_iter>
+    {
+      return a.m_it <=> b.m_it;
+    }
+  };
+
+  /** @class sentinel
+   *  @brief End of a view whose end can't be an iterator
+   */
+
+  template <bool Const>
+  class sentinel
+  {
+  private:
+    using base_sent = std::ranges::sentinel_t<base_t<Const>>;
+
+    base_sent m_end {};
+
+    friend class crypt_view;
+
+    explicit sentinel(base_sent end)
+      : m_end(std::move(end))
+    {
+    }
+
+  public:
+    sentinel() = default;
+
+    sentinel(sentinel<!Const> other)
+      requires Const && std::convertible_to<
+        std::ranges::sentinel_t<V>, base_sent>
+      : m_end(std::move(other.m_end))
+    {
+    }
+
+    template <bool OtherConst>
+      requires std::sentinel_for<base_sent,
+        std::ranges::iterator_t<base_t<OtherConst>>>
+    friend bool operator==(const iterator<OtherConst> &it,
+                           const sentinel &s)
+    {
+      return it.base() == s.m_end;
+    }
+
+    template <bool OtherConst>
+      requires std::sized_sentinel_for<base_sent,
+        std::ranges::iterator_t<base_t<OtherConst>>>
+    friend auto operator-(const iterator<OtherConst> &it, const sentinel &s)
+    {
+      return it.base() - s.m_end;
+    }
+
+    template <bool OtherConst>
+      requires std::sized_sentinel_for<base_sent,
+        std::ranges::iterator_t<base_t<OtherConst>>>
+    friend auto operator-(const sentinel &s, const iterator<OtherConst> &it)
+    {
+      return s.m_end - it.base();
+    }
+  };
+
+  V m_base {};                       /* underlying range           */
+  const std::uint8_t *m_key {};      /* key bytes of the context   */
+  std::size_t m_keylen {};           /* length of the key          */
+  std::uint64_t m_offset {};         /* position of the first byte */
+
+  template <bool Const>
+  auto make_end(base_t<Const> &base) const
+  {
+    if constexpr (std::ranges::common_range<base_t<Const>> &&
+                  std::ranges::sized_range<base_t<Const>>)
+      {
+        return iterator<Const>(std::ranges::end(base), m_key, m_keylen,
+                               m_offset + std::ranges::size(base));
+      }
+    else
+      {
+        return sentinel<Const>(std::ranges::end(base));
+      }
+  }
+
+public:
+  crypt_view() requires std::default_initializable<V> = default;
+
+  /**
+   * @brief Create the view, see views::crypt() and views::crypt_file().
+   *
+   * @param base underlying range
+   * @param ctx key context, it must outlive the view
+   * @param offset keystream position, or file offset, of the first byte
+   */
+
+  crypt_view(V base, const context &ctx, std::uint64_t offset = 0)
+    : m_base(std::move(base)), m_key(ctx.get()->key),
+      m_keylen(ctx.key_size()), m_offset(offset)
+  {
+    if (m_key == nullptr)
+      {
+        throw std::logic_error("acrypt: context was moved");
+      }
+  }
+
+  V base() const & requires std::copy_constructible<V>
+  {
+    return m_base;
+  }
+
+  V base() &&
+  {
+    return std::move(m_base);
+  }
+
+  std::uint64_t offset() const noexcept
+  {
+    return m_offset;
+  }
+
+  auto begin()
+  {
+    return iterator<false>(std::ranges::begin(m_base), m_key, m_keylen,
+                           m_offset);
+  }
+
+  auto begin() const requires std::ranges::input_range<const V>
+  {
+    return iterator<true>(std::ranges::begin(m_base), m_key, m_keylen,
+                          m_offset);
+  }
+
+  auto end()
+  {
+    return make_end<false>(m_base);
+  }
+
+  auto end() const requires std::ranges::input_range<const V>
+  {
+    return make_end<true>(m_base);
+  }
+
+  auto size() requires std::ranges::sized_range<V>
+  {
+    return std::ranges::size(m_base);
+  }
+
+  auto size() const requires std::ranges::sized_range<const V>
+  {
+    return std::ranges::size(m_base);
+  }
+
+  /**
+   * @brief Encrypt a contiguous view into 'out' with the inlined kernel.
+   *
+   * @param out pointer to at least size() bytes
+   */
+
+  void copy_to(std::uint8_t *out) const
+    requires std::ranges::contiguous_range<const V> &&
+             std::ranges::sized_range<const V>
+  {
+    auto in = reinterpret_cast<const std::uint8_t *>(
+                std::ranges::data(m_base));
+
+    if constexpr (File)
+      {
+        detail::crypt_file_at(m_key, m_keylen, out, in,
+                              std::ranges::size(m_base), m_offset);
+      }
+    else
+      {
+        detail::crypt_keyed(m_key, m_keylen, out, in,
+                            std::ranges::size(m_base), m_offset);
+      }
+  }
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Copy an encrypted view to 'out', a whole span at a time when the
+ *        view and the output are contiguous, like std::ranges::copy().
+ *
+ * @param view view to copy
+ * @param out beginning of the destination
+ * @return The end of the copied elements in the destination
+ */
+
+template <class V, bool File, std::weakly_incrementable O>
+  requires std::indirectly_writable<O,
+             std::ranges::range_value_t<crypt_view<V, File>>>
+O copy(const crypt_view<V, File> &view, O out)
+{
+  /* Output iterators like std::back_insert_iterator have no value type */
+
+  if constexpr (std::ranges::contiguous_range<const V> &&
+                std::ranges::sized_range<const V> &&
+                requires { requires std::contiguous_iterator<O> &&
+                                    byte_like<std::iter_value_t<O>>; })
+    {
+      view.copy_to(reinterpret_cast<std::uint8_t *>(std::to_address(out)));
+      return out + view.size();
+    }
+  else
+    {
+      return std::ranges::copy(view, std::move(out)).out;
+    }
+}
+
+/** @namespace views
+ *  @brief Range adaptors of libacrypt
+ */
+
+namespace views
+{
+
+/** @struct crypt_closure
+ *  @brief Pipeable 'views::crypt(ctx)', applied to a range with '|'
+ */
+
+template <bool File>
+struct crypt_closure
+{
+  const context *ctx;     /* key context, outlives the view */
+  std::uint64_t offset;   /* position of the first byte     */
+
+  template <std::ranges::viewable_range R>
+  auto operator()(R &&r) const
+  {
+    return crypt_view<std::views::all_t<R>, File>(
+             std::views::all(std::forward<R>(r)), *ctx, offset);
+  }
+
+  template <std::ranges::viewable_range R>
+  friend auto operator|(R &&r, const crypt_closure &closure)
+  {
+    return closure(std::forward<R>(r));
+  }
+};
+
+/**
+ * @brief Encrypt or decrypt a range lazily, from keystream 'offset'.
+ *
+ * @param ctx key context, it must outlive the view
+ * @param offset keystream position of the first byte, as crypt_buffer_at()
+ */
+
+inline crypt_closure<false> crypt(const context &ctx,
+                                  std::uint64_t offset = 0)
+{
+  return { &ctx, offset };
+}
+
+/**
+ * @brief Encrypt or decrypt lazily a part of a file of the crypt program.
+ *
+ * @param ctx key context, it must outlive the view
+ * @param offset file offset of the first byte, as crypt_file_at()
+ */
+
+inline crypt_closure<true> crypt_file(const context &ctx,
+                                      std::uint64_t offset = 0)
+{
+  return { &ctx, offset };
+}
+
+/* A temporary context would die before the view is used */
+
+crypt_closure<false> crypt(const context &&, std::uint64_t = 0) = delete;
+crypt_closure<true> crypt_file(const context &&, std::uint64_t = 0) = delete;
+
+} /* namespace views */
+
+} /* namespace acrypt */
+
+/* The view only points to the key, it dangles only if its range does */
+
+template <class V, bool File>
+inline constexpr bool
+  std::ranges::enable_borrowed_range<acrypt::crypt_view<V, File>> =
+    std::ranges::enable_borrowed_range<V>;
+
+#endif /* __ACRYPT_VIEW_HPP */
@@ -0,0 +1,1568 @@
+/****************************************************************************
+ * @file  lib/acrypt_preload.c
+ *
+ * @brief LD_PRELOAD shim to transparently encrypt selected files.
+ *
+ * Files whose path matches ACRYPT_PRELOAD_PATTERN (a fnmatch() glob, or
+ * a list of globs separated by ':') are encrypted on write and decrypted
+ * on read, using the crypt program file format. The key is given by
+ * ACRYPT_PRELOAD_KEYFILE or ACRYPT_PRELOAD_KEY.
+ *
+ * The keystream is addressed by the kernel file offset, so lseek() and
+ * the file position need no special handling. Duplicated fds (dup(),
+ * dup2(), F_DUPFD), as used by shell redirections, stay selected, and
+ * selected fds inherited through exec() are found by matching their
+ * absolute path. Vectored I/O is split into single reads and writes.
+ *
+ * glibc stdio does its I/O with internal calls the shim can't see, so
+ * every stream on a selected file is made with fopencookie() on top of
+ * the intercepted read() and write(): fopen() and fdopen() build one,
+ * and stdin, stdout or stderr is replaced by one as soon as its fd gets
+ * selected, inherited or redirected. The original FILE is detached from
+ * the fd, so C++ streams bound to it before fail instead of writing
+ * plaintext. freopen() of a selected file fails, dprintf() formats in
+ * memory and calls write(). Both the detaching and the fileno() of those
+ * streams rely on the glibc FILE layout, so with another C library stdio
+ * on a selected file fails, and a selected file can't be a standard fd.
+ *
+ * In kernel copies (sendfile(), splice(), copy_file_range(), FICLONE)
+ * of a selected file fail, so callers fall back to read() and write().
+ * Memory mapping of a selected file and direct system calls are not
+ * supported.
+ *
+ *   $ ACRYPT_PRELOAD_PATTERN='*.secret' ACRYPT_PRELOAD_KEYFILE=key.bin \
+ *     LD_PRELOAD=libacrypt_preload.so legacy_program
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <errno.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#include "acrypt.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define PRELOAD_MAX_FDS   65536 /* Selected files must have a lower fd  */
+#define PRELOAD_MAX_KEY   256   /* Same limit as the crypt program      */
+#define PRELOAD_CHUNK     16384 /* Encrypted on the stack before write  */
+
+/* Third argument of a fcntl() or ioctl() command */
+
+#define PRELOAD_ARG_NONE  0     /* No argument, none may be read        */
+#define PRELOAD_ARG_INT   1     /* An int                               */
+#define PRELOAD_ARG_PTR   2     /* A pointer, or an unknown command     */
+
+/* Only glibc lets the standard streams be swapped, see preload_std() */
+
+#ifdef __GLIBC__
+#  define PRELOAD_STD_OK(fd) true
+#else
+#  define PRELOAD_STD_OK(fd) ((fd) > STDERR_FILENO)
+#endif
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+typedef int (*open_t)(const char *, int, ...);
+typedef int (*openat_t)(int, const char *, int, ...);
+typedef FILE *(*fopen_t)(const char *, const char *);
+typedef FILE *(*fdopen_t)(int, const char *);
+typedef FILE *(*freopen_t)(const char *, const char *, FILE *);
+typedef int (*vdprintf_t)(int, const char *, va_list);
+typedef int (*vdprintf_chk_t)(int, int, const char *, va_list);
+typedef int (*close_t)(int);
+typedef int (*dup_t)(int);
+typedef int (*dup2_t)(int, int);
+typedef int (*dup3_t)(int, int, int);
+typedef int (*fcntl_t)(int, int, ...);
+typedef ssize_t (*read_t)(int, void *, size_t);
+typedef ssize_t (*write_t)(int, const void *, size_t);
+typedef ssize_t (*pread_t)(int, void *, size_t, off_t);
+typedef ssize_t (*pwrite_t)(int, const void *, size_t, off_t);
+typedef ssize_t (*pread64_t)(int, void *, size_t, off64_t);
+typedef ssize_t (*pwrite64_t)(int, const void *, size_t, off64_t);
+typedef ssize_t (*readv_t)(int, const struct iovec *, int);
+typedef ssize_t (*preadv_t)(int, const struct iovec *, int, off_t);
+typedef ssize_t (*preadv64_t)(int, const struct iovec *, int, off64_t);
+typedef ssize_t (*preadv2_t)(int, const struct iovec *, int, off_t, int);
+typedef ssize_t (*preadv64v2_t)(int, const struct iovec *, int, off64_t,
+                                int);
+typedef int (*ioctl_t)(int, unsigned long, ...);
+typedef ssize_t (*sendfile_t)(int, int, off_t *, size_t);
+typedef ssize_t (*sendfile64_t)(int, int, off64_t *, size_t);
+typedef ssize_t (*splice_t)(int, off64_t *, int, off64_t *, size_t,
+                            unsigned int);
+typedef ssize_t (*copy_file_range_t)(int, off64_t *, int, off64_t *,
+                                     size_t, unsigned int);
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static open_t     real_open;
+static open_t     real_open64;
+static openat_t   real_openat;
+static openat_t   real_openat64;
+static fopen_t    real_fopen;
+static fopen_t    real_fopen64;
+static fdopen_t   real_fdopen;
+static freopen_t  real_freopen;
+static freopen_t  real_freopen64;
+static vdprintf_t real_vdprintf;
+static vdprintf_chk_t real_vdprintf_chk;
+static close_t    real_close;
+static dup_t      real_dup;
+static dup2_t     real_dup2;
+static dup3_t     real_dup3;
+static fcntl_t    real_fcntl;
+static fcntl_t    real_fcntl64;
+static read_t     real_read;
+static write_t    real_write;
+static pread_t    real_pread;
+static pwrite_t   real_pwrite;
+static pread64_t  real_pread64;
+static pwrite64_t real_pwrite64;
+static readv_t    real_readv;
+static readv_t    real_writev;
+static preadv_t   real_preadv;
+static preadv_t   real_pwritev;
+static preadv64_t real_preadv64;
+static preadv64_t real_pwritev64;
+static preadv2_t  real_preadv2;
+static preadv2_t  real_pwritev2;
+static preadv64v2_t real_preadv64v2;
+static preadv64v2_t real_pwritev64v2;
+static ioctl_t    real_ioctl;
+static sendfile_t real_sendfile;
+static sendfile64_t real_sendfile64;
+static splice_t   real_splice;
+static copy_file_range_t real_copy_file_range;
+
+static bool g_ready;                        /* preload_init() done    */
+static char *g_patterns;                    /* ':' separated globs    */
+static uint8_t g_key[PRELOAD_MAX_KEY];
+static struct crypt_context g_context;      /* key of selected files  */
+static uint8_t g_tracked[PRELOAD_MAX_FDS];  /* fd is a selected file  */
+static FILE *g_std[3];                      /* our stdin, stdout...   */
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static bool preload_match(const char *path);
+static int preload_track(int fd);
+static void preload_std(int fd);
+static FILE *preload_stream(int fd, const char *mode);
+
+/**
+ * @brief Track the selected files inherited from the parent process.
+ */
+
+static void preload_inherited(void)
+{
+  struct dirent *entry;
+  char link[64];
+  char path[PATH_MAX];
+  ssize_t len;
+  DIR *dir;
+  int fd;
+
+  dir = opendir("/proc/self/fd");
+  if (dir == NULL)
+    {
+      return;
+    }
+
+  while ((entry = readdir(dir)) != NULL)
+    {
+      fd = atoi(entry->d_name);
+      if (entry->d_name[0] == '.' || fd == dirfd(dir))
+        {
+          continue;
+        }
+
+      snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+      len = readlink(link, path, sizeof(path) - 1);
+      if (len > 0)
+        {
+          path[len] = '\0';
+          if (preload_match(path))
+            {
+              preload_track(fd);
+            }
+        }
+    }
+
+  closedir(dir);
+}
+
+/**
+ * @brief Resolve the libc functions and load the configuration.
+ *
+ * Other libraries can call the intercepted functions from their own
+ * constructors, before ours, so every entry point calls it on demand.
+ */
+
+static void __attribute__((constructor)) preload_init(void)
+{
+  const char *keyfile;
+  const char *key;
+
+  if (g_ready)
+    {
+      return;
+    }
+
+  g_ready = true;
+
+  real_open     = (open_t)dlsym(RTLD_NEXT, "open");
+  real_open64   = (open_t)dlsym(RTLD_NEXT, "open64");
+  real_openat   = (openat_t)dlsym(RTLD_NEXT, "openat");
+  real_openat64 = (openat_t)dlsym(RTLD_NEXT, "openat64");
+  real_fopen    = (fopen_t)dlsym(RTLD_NEXT, "fopen");
+  real_fopen64  = (fopen_t)dlsym(RTLD_NEXT, "fopen64");
+  real_fdopen   = (fdopen_t)dlsym(RTLD_NEXT, "fdopen");
+  real_freopen  = (freopen_t)dlsym(RTLD_NEXT, "freopen");
+  real_freopen64 = (freopen_t)dlsym(RTLD_NEXT, "freopen64");
+  real_vdprintf = (vdprintf_t)dlsym(RTLD_NEXT, "vdprintf");
+  real_vdprintf_chk = (vdprintf_chk_t)dlsym(RTLD_NEXT, "__vdprintf_chk");
+  real_close    = (close_t)dlsym(RTLD_NEXT, "close");
+  real_dup      = (dup_t)dlsym(RTLD_NEXT, "dup");
+  real_dup2     = (dup2_t)dlsym(RTLD_NEXT, "dup2");
+  real_dup3     = (dup3_t)dlsym(RTLD_NEXT, "dup3");
+  real_fcntl    = (fcntl_t)dlsym(RTLD_NEXT, "fcntl");
+  real_fcntl64  = (fcntl_t)dlsym(RTLD_NEXT, "fcntl64");
+  real_read     = (read_t)dlsym(RTLD_NEXT, "read");
+  real_write    = (write_t)dlsym(RTLD_NEXT, "write");
+  real_pread    = (pread_t)dlsym(RTLD_NEXT, "pread");
+  real_pwrite   = (pwrite_t)dlsym(RTLD_NEXT, "pwrite");
+  real_pread64  = (pread64_t)dlsym(RTLD_NEXT, "pread64");
+  real_pwrite64 = (pwrite64_t)dlsym(RTLD_NEXT, "pwrite64");
+  real_readv    = (readv_t)dlsym(RTLD_NEXT, "readv");
+  real_writev   = (readv_t)dlsym(RTLD_NEXT, "writev");
+  real_preadv   = (preadv_t)dlsym(RTLD_NEXT, "preadv");
+  real_pwritev  = (preadv_t)dlsym(RTLD_NEXT, "pwritev");
+  real_preadv64 = (preadv64_t)dlsym(RTLD_NEXT, "preadv64");
+  real_pwritev64 = (preadv64_t)dlsym(RTLD_NEXT, "pwritev64");
+  real_preadv2  = (preadv2_t)dlsym(RTLD_NEXT, "preadv2");
+  real_pwritev2 = (preadv2_t)dlsym(RTLD_NEXT, "pwritev2");
+  real_preadv64v2 = (preadv64v2_t)dlsym(RTLD_NEXT, "preadv64v2");
+  real_pwritev64v2 = (preadv64v2_t)dlsym(RTLD_NEXT, "pwritev64v2");
+  real_ioctl    = (ioctl_t)dlsym(RTLD_NEXT, "ioctl");
+  real_sendfile = (sendfile_t)dlsym(RTLD_NEXT, "sendfile");
+  real_sendfile64 = (sendfile64_t)dlsym(RTLD_NEXT, "sendfile64");
+  real_splice   = (splice_t)dlsym(RTLD_NEXT, "splice");
+  real_copy_file_range =
+    (copy_file_range_t)dlsym(RTLD_NEXT, "copy_file_range");
+
+  if (getenv("ACRYPT_PRELOAD_PATTERN") == NULL)
+    {
+      return;
+    }
+
+  keyfile = getenv("ACRYPT_PRELOAD_KEYFILE");
+  key     = getenv("ACRYPT_PRELOAD_KEY");
+
+  if (keyfile != NULL)
+    {
+      int fd = real_open(keyfile, O_RDONLY);
+
+      if (fd >= 0)
+        {
+          g_context.keylen = real_read(fd, g_key, sizeof(g_key));
+          real_close(fd);
+        }
+    }
+  else if (key != NULL)
+    {
+      g_context.keylen = strnlen(key, sizeof(g_key));
+      memcpy(g_key, key, g_context.keylen);
+    }
+
+  /* Without a key, never let the selected files be touched */
+
+  if (g_context.keylen <= 0)
+    {
+      fprintf(stderr, "acrypt_preload: no key, selected files are "
+                      "not accessible\n");
+      g_context.keylen = 0;
+    }
+
+  g_context.key = g_key;
+  g_patterns = strdup(getenv("ACRYPT_PRELOAD_PATTERN"));
+
+  preload_inherited();
+}
+
+/**
+ * @brief Check if a path matches one of the configured patterns.
+ *
+ * @param path path given to open()
+ * @return true if the file must be encrypted
+ */
+
+static bool preload_match(const char *path)
+{
+  const char *p = g_patterns;
+
+  if (p == NULL || path == NULL)
+    {
+      return false;
+    }
+
+  while (*p != '\0')
+    {
+      const char *end = strchrnul(p, ':');
+      char glob[PATH_MAX];
+      size_t len = end - p;
+
+      if (len > 0 && len < sizeof(glob))
+        {
+          memcpy(glob, p, len);
+          glob[len] = '\0';
+
+          if (fnmatch(glob, path, 0) == 0)
+            {
+              return true;
+            }
+        }
+
+      p = *end == ':' ? end + 1 : end;
+    }
+
+  return false;
+}
+
+/**
+ * @brief Start tracking a fd just opened for a selected path.
+ *
+ * Plaintext must never reach a selected file, so if the fd can't be
+ * tracked, its standard stream can't be replaced or there is no key, it
+ * is closed and the open() fails.
+ *
+ * @param fd file descriptor returned by the real open()
+ * @return The fd or -1 with errno set
+ */
+
+static int preload_track(int fd)
+{
+  if (fd < 0)
+    {
+      return fd;
+    }
+
+  if (fd >= PRELOAD_MAX_FDS || g_context.keylen <= 0 || !PRELOAD_STD_OK(fd))
+    {
+      real_close(fd);
+      errno = fd >= PRELOAD_MAX_FDS ? EMFILE : EACCES;
+      return -1;
+    }
+
+  __atomic_store_n(&g_tracked[fd], 1, __ATOMIC_RELAXED);
+  preload_std(fd);
+
+  return fd;
+}
+
+/**
+ * @brief Check if a fd belongs to a selected file.
+ *
+ * @param fd file descriptor
+ * @return true if the data must be encrypted
+ */
+
+static bool preload_tracked(int fd)
+{
+  return fd >= 0 && fd < PRELOAD_MAX_FDS &&
+         __atomic_load_n(&g_tracked[fd], __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Replace the standard stream of a fd that just got selected.
+ *
+ * The original FILE does its I/O with internal calls the shim can't see,
+ * so it is also detached from the fd: whatever still holds it, such as
+ * C++ streams bound to it earlier, gets EBADF instead of plaintext.
+ *
+ * @param fd selected file descriptor
+ */
+
+static void preload_std(int fd)
+{
+  static const char *const modes[3] = { "r", "w", "w" };
+  FILE **stream;
+  FILE *fp;
+
+  switch (fd)
+    {
+      case STDIN_FILENO:
+        stream = &stdin;
+        break;
+      case STDOUT_FILENO:
+        stream = &stdout;
+        break;
+      case STDERR_FILENO:
+        stream = &stderr;
+        break;
+      default:
+        return;
+    }
+
+  if (*stream == g_std[fd] || fileno(*stream) != fd)
+    {
+      return;
+    }
+
+  fp = preload_stream(fd, modes[fd]);
+#ifdef __GLIBC__
+  (*stream)->_fileno = -1;
+#endif
+
+  if (fp != NULL)
+    {
+      if (fd == STDERR_FILENO)
+        {
+          setvbuf(fp, NULL, _IONBF, 0);
+        }
+
+      g_std[fd] = fp;
+      *stream = fp;
+    }
+}
+
+/**
+ * @brief Make a new fd inherit the selection state of the old one.
+ *
+ * @param oldfd duplicated file descriptor
+ * @param newfd result of the real dup call
+ * @return newfd
+ */
+
+static int preload_dup(int oldfd, int newfd)
+{
+  if (newfd >= 0 && newfd != oldfd)
+    {
+      if (preload_tracked(oldfd))
+        {
+          return preload_track(newfd);
+        }
+
+      if (preload_tracked(newfd))
+        {
+          __atomic_store_n(&g_tracked[newfd], 0, __ATOMIC_RELAXED);
+        }
+    }
+
+  return newfd;
+}
+
+/**
+ * @brief Get the type of the third argument of a fcntl() command.
+ *
+ * Reading an argument the caller did not pass is undefined, so commands
+ * taking none or an int are told apart. Others are taken as pointers.
+ *
+ * @param cmd fcntl() command
+ * @return PRELOAD_ARG_NONE, PRELOAD_ARG_INT or PRELOAD_ARG_PTR
+ */
+
+static int preload_fcntl_arg(int cmd)
+{
+  switch (cmd)
+    {
+      case F_GETFD:
+      case F_GETFL:
+      case F_GETOWN:
+      case F_GETSIG:
+      case F_GETLEASE:
+#ifdef F_GETPIPE_SZ
+      case F_GETPIPE_SZ:
+#endif
+#ifdef F_GET_SEALS
+      case F_GET_SEALS:
+#endif
+        return PRELOAD_ARG_NONE;
+
+      case F_DUPFD:
+      case F_DUPFD_CLOEXEC:
+      case F_SETFD:
+      case F_SETFL:
+      case F_SETOWN:
+      case F_SETSIG:
+      case F_SETLEASE:
+      case F_NOTIFY:
+#ifdef F_SETPIPE_SZ
+      case F_SETPIPE_SZ:
+#endif
+#ifdef F_ADD_SEALS
+      case F_ADD_SEALS:
+#endif
+        return PRELOAD_ARG_INT;
+
+      default:
+        return PRELOAD_ARG_PTR;
+    }
+}
+
+/**
+ * @brief Get the type of the third argument of an ioctl() request.
+ *
+ * See preload_fcntl_arg(), most requests take a pointer.
+ *
+ * @param request ioctl() request
+ * @return PRELOAD_ARG_NONE, PRELOAD_ARG_INT or PRELOAD_ARG_PTR
+ */
+
+static int preload_ioctl_arg(unsigned long request)
+{
+  switch (request)
+    {
+      case FIOCLEX:
+      case FIONCLEX:
+      case TIOCEXCL:
+      case TIOCNXCL:
+      case TIOCNOTTY:
+      case TIOCCONS:
+      case TIOCSBRK:
+      case TIOCCBRK:
+        return PRELOAD_ARG_NONE;
+
+      case FICLONE:
+      case TIOCSCTTY:
+        return PRELOAD_ARG_INT;
+
+      default:
+        return PRELOAD_ARG_PTR;
+    }
+}
+
+/**
+ * @brief Common part of fcntl() and fcntl64().
+ *
+ * @param fn the real function
+ * @param fd file descriptor
+ * @param cmd fcntl() command
+ * @param ap its argument, if it takes one
+ * @return Result of the real function
+ */
+
+static int preload_fcntl(fcntl_t fn, int fd, int cmd, va_list ap)
+{
+  int ret;
+
+  switch (preload_fcntl_arg(cmd))
+    {
+      case PRELOAD_ARG_NONE:
+        ret = fn(fd, cmd);
+        break;
+      case PRELOAD_ARG_INT:
+        ret = fn(fd, cmd, va_arg(ap, int));
+        break;
+      default:
+        ret = fn(fd, cmd, va_arg(ap, void *));
+        break;
+    }
+
+  if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC)
+    {
+      ret = preload_dup(fd, ret);
+    }
+
+  return ret;
+}
+
+/**
+ * @brief Get the file offset the next write() will use.
+ *
+ * @param fd file descriptor
+ * @return File offset or -1 with errno set
+ */
+
+static off_t preload_write_offset(int fd)
+{
+  struct stat sb;
+
+  if ((real_fcntl(fd, F_GETFL) & O_APPEND) != 0)
+    {
+      if (fstat(fd, &sb) < 0)
+        {
+          return -1;
+        }
+
+      return sb.st_size;
+    }
+
+  return lseek(fd, 0, SEEK_CUR);
+}
+
+/**
+ * @brief Encrypt and write a buffer in chunks.
+ *
+ * @param fd file descriptor
+ * @param buf plaintext buffer
+ * @param count amount of bytes to write
+ * @param offset file offset of the first byte
+ * @param positional true to use pwrite(), false to use write()
+ * @return Amount of written bytes or -1 with errno set
+ */
+
+static ssize_t preload_write(int fd, const void *buf, size_t count,
+                             off_t offset, bool positional)
+{
+  uint8_t chunk[PRELOAD_CHUNK];
+  const uint8_t *in = buf;
+  size_t done = 0;
+  ssize_t ret;
+
+  while (done < count)
+    {
+      size_t n = count - done;
+
+      if (n > sizeof(chunk))
+        {
+          n = sizeof(chunk);
+        }
+
+      crypt_file_at(&g_context, chunk, in + done, n, offset + done);
+
+      if (positional)
+        {
+          ret = real_pwrite64(fd, chunk, n, offset + done);
+        }
+      else
+        {
+          ret = real_write(fd, chunk, n);
+        }
+
+      if (ret <= 0)
+        {
+          return done > 0 ? (ssize_t)done : ret;
+        }
+
+      done += ret;
+      if ((size_t)ret < n)
+        {
+          break;
+        }
+    }
+
+  return done;
+}
+
+/**
+ * @brief Common part of all the open() flavours.
+ *
+ * @param path path of the file
+ * @param fd result of the real open()
+ * @return The fd or -1 with errno set
+ */
+
+static int preload_opened(const char *path, int fd)
+{
+  if (fd >= 0 && preload_match(path))
+    {
+      return preload_track(fd);
+    }
+
+  return fd;
+}
+
+/**
+ * @brief Make sure the real functions are resolved before using them.
+ */
+
+#define PRELOAD_INIT() \
+  do \
+    { \
+      if (!g_ready) \
+        { \
+          preload_init(); \
+        } \
+    } \
+  while (0)
+
+/**
+ * @brief Get the mode argument of open() if the flags need it.
+ */
+
+#define OPEN_MODE(flags, mode) \
+  do \
+    { \
+      if (((flags) & O_CREAT) != 0 || \
+          ((flags) & O_TMPFILE) == O_TMPFILE) \
+        { \
+          va_list ap; \
+          va_start(ap, flags); \
+          mode = va_arg(ap, mode_t); \
+          va_end(ap); \
+        } \
+    } \
+  while (0)
+
+/**
+ * @brief fopencookie() read callback of a selected stdio file.
+ */
+
+static ssize_t cookie_read(void *cookie, char *buf, size_t size)
+{
+  return read((int)(intptr_t)cookie, buf, size);
+}
+
+/**
+ * @brief fopencookie() write callback of a selected stdio file.
+ */
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size)
+{
+  ssize_t ret = write((int)(intptr_t)cookie, buf, size);
+
+  /* stdio expects 0 on error from a cookie write function */
+
+  return ret < 0 ? 0 : ret;
+}
+
+/**
+ * @brief fopencookie() seek callback of a selected stdio file.
+ */
+
+static int cookie_seek(void *cookie, off64_t *offset, int whence)
+{
+  off64_t ret = lseek64((int)(intptr_t)cookie, *offset, whence);
+
+  if (ret < 0)
+    {
+      return -1;
+    }
+
+  *offset = ret;
+
+  return 0;
+}
+
+/**
+ * @brief fopencookie() close callback of a selected stdio file.
+ */
+
+static int cookie_close(void *cookie)
+{
+  return close((int)(intptr_t)cookie);
+}
+
+/**
+ * @brief Make a stdio stream doing its I/O through the intercepted calls.
+ *
+ * @param fd selected file descriptor, closed by fclose()
+ * @param mode fopen() mode string
+ * @return Stream or NULL with errno set
+ */
+
+static FILE *preload_stream(int fd, const char *mode)
+{
+  static const cookie_io_functions_t io =
+  {
+    cookie_read, cookie_write, cookie_seek, cookie_close
+  };
+
+  FILE *fp;
+
+#ifdef __GLIBC__
+  fp = fopencookie((void *)(intptr_t)fd, mode, io);
+  if (fp != NULL)
+    {
+      /* Only for fileno(), the cookie functions do the I/O */
+
+      fp->_fileno = fd;
+    }
+#else
+  (void)io;
+  (void)fd;
+  (void)mode;
+  fp = NULL;
+  errno = ENOTSUP;
+#endif
+
+  return fp;
+}
+
+/**
+ * @brief Open a selected file for stdio through the intercepted calls.
+ *
+ * @param path path of the file
+ * @param mode fopen() mode string
+ * @return Stream or NULL with errno set
+ */
+
+static FILE *preload_fopen(const char *path, const char *mode)
+{
+  int flags;
+  int fd;
+  FILE *fp;
+
+  switch (mode[0])
+    {
+      case 'r':
+        flags = 0;
+        break;
+      case 'w':
+        flags = O_CREAT | O_TRUNC;
+        break;
+      case 'a':
+        flags = O_CREAT | O_APPEND;
+        break;
+      default:
+        errno = EINVAL;
+        return NULL;
+    }
+
+  if (strchr(mode, '+') != NULL)
+    {
+      flags |= O_RDWR;
+    }
+  else
+    {
+      flags |= mode[0] == 'r' ? O_RDONLY : O_WRONLY;
+    }
+
+  if (strchr(mode, 'x') != NULL)
+    {
+      flags |= O_EXCL;
+    }
+
+  if (strchr(mode, 'e') != NULL)
+    {
+      flags |= O_CLOEXEC;
+    }
+
+  fd = preload_track(real_open(path, flags, 0666));
+  if (fd < 0)
+    {
+      return NULL;
+    }
+
+  fp = preload_stream(fd, mode);
+  if (fp == NULL)
+    {
+      close(fd);
+    }
+
+  return fp;
+}
+
+/**
+ * @brief Split vectored I/O on a selected file in single reads or writes.
+ *
+ * @param fd selected file descriptor
+ * @param iov buffers
+ * @param iovcnt amount of buffers
+ * @param offset file offset, -1 to use and update the file position
+ * @param writing true to write the buffers, false to read them
+ * @return Amount of transferred bytes or -1 with errno set
+ */
+
+static ssize_t preload_vector(int fd, const struct iovec *iov, int iovcnt,
+                              off64_t offset, bool writing)
+{
+  size_t done = 0;
+  ssize_t ret;
+  int i;
+
+  if (iovcnt < 0 || iovcnt > IOV_MAX)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  for (i = 0; i < iovcnt; i++)
+    {
+      void *base = iov[i].iov_base;
+      size_t len = iov[i].iov_len;
+
+      if (offset < 0)
+        {
+          ret = writing ? write(fd, base, len) : read(fd, base, len);
+        }
+      else if (writing)
+        {
+          ret = pwrite64(fd, base, len, offset + done);
+        }
+      else
+        {
+          ret = pread64(fd, base, len, offset + done);
+        }
+
+      if (ret < 0)
+        {
+          return done > 0 ? (ssize_t)done : ret;
+        }
+
+      done += ret;
+      if ((size_t)ret < len)
+        {
+          break;
+        }
+    }
+
+  return done;
+}
+
+/**
+ * @brief Write a whole buffer formatted by dprintf() to a selected fd.
+ *
+ * @param fd selected file descriptor
+ * @param format printf() format
+ * @param ap arguments of the format
+ * @return Amount of written bytes or -1 with errno set
+ */
+
+static int preload_dprintf(int fd, const char *format, va_list ap)
+{
+  char *text;
+  ssize_t ret;
+  int done = 0;
+  int len;
+
+  len = vasprintf(&text, format, ap);
+  if (len < 0)
+    {
+      return -1;
+    }
+
+  while (done < len)
+    {
+      ret = write(fd, text + done, len - done);
+      if (ret <= 0)
+        {
+          done = -1;
+          break;
+        }
+
+      done += ret;
+    }
+
+  free(text);
+
+  return done;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int open(const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+
+  PRELOAD_INIT();
+
+  OPEN_MODE(flags, mode);
+
+  return preload_opened(path, real_open(path, flags, mode));
+}
+
+int open64(const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+
+  PRELOAD_INIT();
+
+  OPEN_MODE(flags, mode);
+
+  return preload_opened(path, real_open64(path, flags, mode));
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+
+  PRELOAD_INIT();
+
+  OPEN_MODE(flags, mode);
+
+  return preload_opened(path, real_openat(dirfd, path, flags, mode));
+}
+
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+
+  PRELOAD_INIT();
+
+  OPEN_MODE(flags, mode);
+
+  return preload_opened(path, real_openat64(dirfd, path, flags, mode));
+}
+
+int creat(const char *path, mode_t mode)
+{
+  PRELOAD_INIT();
+
+  return open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+int creat64(const char *path, mode_t mode)
+{
+  PRELOAD_INIT();
+
+  return open64(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+  PRELOAD_INIT();
+
+  if (preload_match(path))
+    {
+      return preload_fopen(path, mode);
+    }
+
+  return real_fopen(path, mode);
+}
+
+FILE *fopen64(const char *path, const char *mode)
+{
+  PRELOAD_INIT();
+
+  if (preload_match(path))
+    {
+      return preload_fopen(path, mode);
+    }
+
+  return real_fopen64(path, mode);
+}
+
+FILE *fdopen(int fd, const char *mode)
+{
+  PRELOAD_INIT();
+
+  if (preload_tracked(fd))
+    {
+      return preload_stream(fd, mode);
+    }
+
+  return real_fdopen(fd, mode);
+}
+
+FILE *freopen(const char *path, const char *mode, FILE *stream)
+{
+  PRELOAD_INIT();
+
+  if (path != NULL ? preload_match(path) : preload_tracked(fileno(stream)))
+    {
+      fclose(stream);
+      errno = EACCES;
+      return NULL;
+    }
+
+  return real_freopen(path, mode, stream);
+}
+
+FILE *freopen64(const char *path, const char *mode, FILE *stream)
+{
+  PRELOAD_INIT();
+
+  if (path != NULL ? preload_match(path) : preload_tracked(fileno(stream)))
+    {
+      fclose(stream);
+      errno = EACCES;
+      return NULL;
+    }
+
+  return real_freopen64(path, mode, stream);
+}
+
+int close(int fd)
+{
+  PRELOAD_INIT();
+
+  if (preload_tracked(fd))
+    {
+      __atomic_store_n(&g_tracked[fd], 0, __ATOMIC_RELAXED);
+    }
+
+  return real_close(fd);
+}
+
+int dup(int oldfd)
+{
+  PRELOAD_INIT();
+
+  return preload_dup(oldfd, real_dup(oldfd));
+}
+
+int dup2(int oldfd, int newfd)
+{
+  PRELOAD_INIT();
+
+  /* What stdout buffered belongs to the file it is leaving */
+
+  if (newfd == STDOUT_FILENO && preload_tracked(oldfd))
+    {
+      fflush(stdout);
+    }
+
+  return preload_dup(oldfd, real_dup2(oldfd, newfd));
+}
+
+int dup3(int oldfd, int newfd, int flags)
+{
+  PRELOAD_INIT();
+
+  /* What stdout buffered belongs to the file it is leaving */
+
+  if (newfd == STDOUT_FILENO && preload_tracked(oldfd))
+    {
+      fflush(stdout);
+    }
+
+  return preload_dup(oldfd, real_dup3(oldfd, newfd, flags));
+}
+
+int fcntl(int fd, int cmd, ...)
+{
+  va_list ap;
+  int ret;
+
+  PRELOAD_INIT();
+
+  va_start(ap, cmd);
+  ret = preload_fcntl(real_fcntl, fd, cmd, ap);
+  va_end(ap);
+
+  return ret;
+}
+
+int fcntl64(int fd, int cmd, ...)
+{
+  va_list ap;
+  int ret;
+
+  PRELOAD_INIT();
+
+  va_start(ap, cmd);
+  ret = preload_fcntl(real_fcntl64, fd, cmd, ap);
+  va_end(ap);
+
+  return ret;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+  off_t offset;
+  ssize_t ret;
+
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_read(fd, buf, count);
+    }
+
+  offset = lseek(fd, 0, SEEK_CUR);
+  if (offset < 0)
+    {
+      return -1;
+    }
+
+  ret = real_read(fd, buf, count);
+  if (ret > 0)
+    {
+      crypt_file_at(&g_context, buf, buf, ret, offset);
+    }
+
+  return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+  off_t offset;
+
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_write(fd, buf, count);
+    }
+
+  offset = preload_write_offset(fd);
+  if (offset < 0)
+    {
+      return -1;
+    }
+
+  return preload_write(fd, buf, count, offset, false);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+  ssize_t ret;
+
+  PRELOAD_INIT();
+
+  ret = real_pread(fd, buf, count, offset);
+  if (ret > 0 && preload_tracked(fd))
+    {
+      crypt_file_at(&g_context, buf, buf, ret, offset);
+    }
+
+  return ret;
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+  ssize_t ret;
+
+  PRELOAD_INIT();
+
+  ret = real_pread64(fd, buf, count, offset);
+  if (ret > 0 && preload_tracked(fd))
+    {
+      crypt_file_at(&g_context, buf, buf, ret, offset);
+    }
+
+  return ret;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_pwrite(fd, buf, count, offset);
+    }
+
+  return preload_write(fd, buf, count, offset, true);
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_pwrite64(fd, buf, count, offset);
+    }
+
+  return preload_write(fd, buf, count, offset, true);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_readv(fd, iov, iovcnt);
+    }
+
+  return preload_vector(fd, iov, iovcnt, -1, false);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_writev(fd, iov, iovcnt);
+    }
+
+  return preload_vector(fd, iov, iovcnt, -1, true);
+}
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_preadv(fd, iov, iovcnt, offset);
+    }
+
+  return preload_vector(fd, iov, iovcnt, offset, false);
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_pwritev(fd, iov, iovcnt, offset);
+    }
+
+  return preload_vector(fd, iov, iovcnt, offset, true);
+}
+
+ssize_t preadv64(int fd, const struct iovec *iov, int iovcnt, off64_t offset)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_preadv64(fd, iov, iovcnt, offset);
+    }
+
+  return preload_vector(fd, iov, iovcnt, offset, false);
+}
+
+ssize_t pwritev64(int fd, const struct iovec *iov, int iovcnt, off64_t offset)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_pwritev64(fd, iov, iovcnt, offset);
+    }
+
+  return preload_vector(fd, iov, iovcnt, offset, true);
+}
+
+ssize_t preadv2(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                int flags)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_preadv2(fd, iov, iovcnt, offset, flags);
+    }
+
+  if (flags != 0)
+    {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+
+  return preload_vector(fd, iov, iovcnt, offset, false);
+}
+
+ssize_t pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                 int flags)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_pwritev2(fd, iov, iovcnt, offset, flags);
+    }
+
+  if (flags != 0)
+    {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+
+  return preload_vector(fd, iov, iovcnt, offset, true);
+}
+
+ssize_t preadv64v2(int fd, const struct iovec *iov, int iovcnt,
+                   off64_t offset, int flags)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_preadv64v2(fd, iov, iovcnt, offset, flags);
+    }
+
+  if (flags != 0)
+    {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+
+  return preload_vector(fd, iov, iovcnt, offset, false);
+}
+
+ssize_t pwritev64v2(int fd, const struct iovec *iov, int iovcnt,
+                    off64_t offset, int flags)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_pwritev64v2(fd, iov, iovcnt, offset, flags);
+    }
+
+  if (flags != 0)
+    {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+
+  return preload_vector(fd, iov, iovcnt, offset, true);
+}
+
+int vdprintf(int fd, const char *format, va_list ap)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_vdprintf(fd, format, ap);
+    }
+
+  return preload_dprintf(fd, format, ap);
+}
+
+int dprintf(int fd, const char *format, ...)
+{
+  va_list ap;
+  int ret;
+
+  va_start(ap, format);
+  ret = vdprintf(fd, format, ap);
+  va_end(ap);
+
+  return ret;
+}
+
+int __vdprintf_chk(int fd, int flag, const char *format, va_list ap)
+{
+  PRELOAD_INIT();
+
+  if (!preload_tracked(fd))
+    {
+      return real_vdprintf_chk(fd, flag, format, ap);
+    }
+
+  return preload_dprintf(fd, format, ap);
+}
+
+int __dprintf_chk(int fd, int flag, const char *format, ...)
+{
+  va_list ap;
+  int ret;
+
+  va_start(ap, format);
+  ret = __vdprintf_chk(fd, flag, format, ap);
+  va_end(ap);
+
+  return ret;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+  PRELOAD_INIT();
+
+  if (preload_tracked(out_fd) || preload_tracked(in_fd))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  return real_sendfile(out_fd, in_fd, offset, count);
+}
+
+ssize_t sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count)
+{
+  PRELOAD_INIT();
+
+  if (preload_tracked(out_fd) || preload_tracked(in_fd))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  return real_sendfile64(out_fd, in_fd, offset, count);
+}
+
+ssize_t splice(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out,
+               size_t len, unsigned int flags)
+{
+  PRELOAD_INIT();
+
+  if (preload_tracked(fd_in) || preload_tracked(fd_out))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  return real_splice(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+ssize_t copy_file_range(int fd_in, off64_t *off_in, int fd_out,
+                        off64_t *off_out, size_t len, unsigned int flags)
+{
+  PRELOAD_INIT();
+
+  if (preload_tracked(fd_in) || preload_tracked(fd_out))
+    {
+      errno = EXDEV;
+      return -1;
+    }
+
+  return real_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+  int type = preload_ioctl_arg(request);
+  va_list ap;
+  void *arg = NULL;
+  int val = 0;
+
+  PRELOAD_INIT();
+
+  va_start(ap, request);
+  if (type == PRELOAD_ARG_INT)
+    {
+      val = va_arg(ap, int);
+    }
+  else if (type == PRELOAD_ARG_PTR)
+    {
+      arg = va_arg(ap, void *);
+    }
+
+  va_end(ap);
+
+  /* A reflink shares the blocks of one file with the other as they are */
+
+  if (request == FICLONE || request == FICLONERANGE)
+    {
+      int src = request == FICLONE ? val :
+                arg != NULL ? (int)((struct file_clone_range *)
+                                    arg)->src_fd : -1;
+
+      if (preload_tracked(fd) || preload_tracked(src))
+        {
+          errno = EXDEV;
+          return -1;
+        }
+    }
+
+  switch (type)
+    {
+      case PRELOAD_ARG_NONE:
+        return real_ioctl(fd, request);
+      case PRELOAD_ARG_INT:
+        return real_ioctl(fd, request, val);
+      default:
+        return real_ioctl(fd, request, arg);
+    }
+}
@@ -0,0 +1,1035 @@
+/****************************************************************************
+ * @file  lib/crypt_aead.c
+ *
+ * @brief Poly1305 and ChaCha20-Poly1305 authenticated encryption.
+ *
+ * The scalar Poly1305 keeps the accumulator in three 44-bit limbs where
+ * the compiler has 64x64 -> 128-bit products, in five 26-bit limbs
+ * otherwise (CRYPT_POLY1305_LIMB). On x86-64 with AVX2 long inputs go
+ * through a kernel hashing 4 blocks at once, one per 64-bit lane in
+ * 26-bit limbs: every lane is multiplied by r^4 and the last group by
+ * r^4, r^3, r^2 and r, so the sum of the lanes is the scalar result.
+ *
+ * Encryption and authentication are fused a stripe at a time, small
+ * enough that the MAC reads the ciphertext the cipher just wrote from
+ * the L1 cache instead of a second pass over memory. Part of the
+ * freestanding profile.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdint.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+#  include <immintrin.h>
+#endif
+
+#include "acrypt.h"
+#include "crypt_internal.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define POLY_BLOCK 16
+
+/* Bytes encrypted, then authenticated, at a time */
+
+#define AEAD_STRIPE 4096
+
+/* Limbs of the scalar Poly1305: 44 bits where the compiler has 128-bit
+ * products, 26 bits otherwise. The state has room for either, so the
+ * build may pick 26 without its users noticing.
+ */
+
+#ifndef CRYPT_POLY1305_LIMB
+#  ifdef __SIZEOF_INT128__
+#    define CRYPT_POLY1305_LIMB 44
+#  else
+#    define CRYPT_POLY1305_LIMB 26
+#  endif
+#endif
+
+#define MASK26 0x3ffffff
+#define MASK42 (((uint64_t)1 << 42) - 1)
+#define MASK44 (((uint64_t)1 << 44) - 1)
+
+#if defined(__x86_64__) && (!defined(CRYPT_FREESTANDING) || \
+                            defined(__AVX2__))
+#  define POLY_X86
+#  define POLY_AVX2 __attribute__((target("avx2")))
+
+/* Fewer blocks than this are hashed faster by the scalar code */
+
+#  define POLY_VECTOR_MIN 16
+#endif
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static inline uint32_t load32_le(const uint8_t *p)
+{
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static inline void store32_le(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static inline void store64_le(uint8_t *p, uint64_t v)
+{
+  store32_le(p, v);
+  store32_le(p + 4, v >> 32);
+}
+
+#if CRYPT_POLY1305_LIMB != 44 || defined(POLY_X86)
+
+/**
+ * @brief Multiply two numbers in 26-bit limbs modulo 2^130 - 5.
+ *
+ * The limbs of the result are below 2^26, but the number may still be
+ * above the modulus.
+ */
+
+static void poly26_mul(uint32_t out[5], const uint32_t a[5],
+                       const uint32_t b[5])
+{
+  uint32_t s1 = b[1] * 5;
+  uint32_t s2 = b[2] * 5;
+  uint32_t s3 = b[3] * 5;
+  uint32_t s4 = b[4] * 5;
+  uint64_t d0;
+  uint64_t d1;
+  uint64_t d2;
+  uint64_t d3;
+  uint64_t d4;
+  uint32_t c;
+
+  d0 = (uint64_t)a[0] * b[0] + (uint64_t)a[1] * s4 +
+       (uint64_t)a[2] * s3 + (uint64_t)a[3] * s2 + (uint64_t)a[4] * s1;
+  d1 = (uint64_t)a[0] * b[1] + (uint64_t)a[1] * b[0] +
+       (uint64_t)a[2] * s4 + (uint64_t)a[3] * s3 + (uint64_t)a[4] * s2;
+  d2 = (uint64_t)a[0] * b[2] + (uint64_t)a[1] * b[1] +
+       (uint64_t)a[2] * b[0] + (uint64_t)a[3] * s4 + (uint64_t)a[4] * s3;
+  d3 = (uint64_t)a[0] * b[3] + (uint64_t)a[1] * b[2] +
+       (uint64_t)a[2] * b[1] + (uint64_t)a[3] * b[0] + (uint64_t)a[4] * s4;
+  d4 = (uint64_t)a[0] * b[4] + (uint64_t)a[1] * b[3] +
+       (uint64_t)a[2] * b[2] + (uint64_t)a[3] * b[1] + (uint64_t)a[4] * b[0];
+
+  c = d0 >> 26; out[0] = d0 & MASK26; d1 += c;
+  c = d1 >> 26; out[1] = d1 & MASK26; d2 += c;
+  c = d2 >> 26; out[2] = d2 & MASK26; d3 += c;
+  c = d3 >> 26; out[3] = d3 & MASK26; d4 += c;
+  c = d4 >> 26; out[4] = d4 & MASK26;
+  out[0] += c * 5;
+  c = out[0] >> 26;
+  out[0] &= MASK26;
+  out[1] += c;
+}
+
+/**
+ * @brief Load 'r' of a key into 26-bit limbs, clamped.
+ */
+
+static void poly26_key(uint32_t r[5], const uint8_t *key)
+{
+  r[0] = load32_le(key) & 0x3ffffff;
+  r[1] = (load32_le(key + 3) >> 2) & 0x3ffff03;
+  r[2] = (load32_le(key + 6) >> 4) & 0x3ffc0ff;
+  r[3] = (load32_le(key + 9) >> 6) & 0x3f03fff;
+  r[4] = (load32_le(key + 12) >> 8) & 0x00fffff;
+}
+
+#endif
+
+#if CRYPT_POLY1305_LIMB == 44
+
+/**
+ * @brief Hash blocks of 16 bytes, 'hibit' is the bit 2^128 in limb 2.
+ */
+
+static void poly_blocks(struct crypt_poly1305 *poly, const uint8_t *m,
+                        size_t nblocks, uint64_t hibit)
+{
+  typedef unsigned __int128 u128;
+  const uint64_t r0 = poly->r.l44[0];
+  const uint64_t r1 = poly->r.l44[1];
+  const uint64_t r2 = poly->r.l44[2];
+  const uint64_t s1 = r1 * (5 << 2);
+  const uint64_t s2 = r2 * (5 << 2);
+  uint64_t h0 = poly->h.l44[0];
+  uint64_t h1 = poly->h.l44[1];
+  uint64_t h2 = poly->h.l44[2];
+  uint64_t t0;
+  uint64_t t1;
+  uint64_t c;
+  u128 d0;
+  u128 d1;
+  u128 d2;
+
+  while (nblocks-- > 0)
+    {
+      t0 = load32_le(m) | (uint64_t)load32_le(m + 4) << 32;
+      t1 = load32_le(m + 8) | (uint64_t)load32_le(m + 12) << 32;
+
+      h0 += t0 & MASK44;
+      h1 += ((t0 >> 44) | (t1 << 20)) & MASK44;
+      h2 += ((t1 >> 24) & MASK42) | hibit;
+
+      d0 = (u128)h0 * r0 + (u128)h1 * s2 + (u128)h2 * s1;
+      d1 = (u128)h0 * r1 + (u128)h1 * r0 + (u128)h2 * s2;
+      d2 = (u128)h0 * r2 + (u128)h1 * r1 + (u128)h2 * r0;
+
+      c = (uint64_t)(d0 >> 44); h0 = (uint64_t)d0 & MASK44;
+      d1 += c;
+      c = (uint64_t)(d1 >> 44); h1 = (uint64_t)d1 & MASK44;
+      d2 += c;
+      c = (uint64_t)(d2 >> 42); h2 = (uint64_t)d2 & MASK42;
+      h0 += c * 5;
+      c = h0 >> 44;
+      h0 &= MASK44;
+      h1 += c;
+
+      m += POLY_BLOCK;
+    }
+
+  poly->h.l44[0] = h0;
+  poly->h.l44[1] = h1;
+  poly->h.l44[2] = h2;
+}
+
+static void poly_key(struct crypt_poly1305 *poly, const uint8_t *key)
+{
+  uint64_t t0 = load32_le(key) | (uint64_t)load32_le(key + 4) << 32;
+  uint64_t t1 = load32_le(key + 8) | (uint64_t)load32_le(key + 12) << 32;
+
+  poly->r.l44[0] = t0 & 0xffc0fffffff;
+  poly->r.l44[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+  poly->r.l44[2] = (t1 >> 24) & 0x00ffffffc0f;
+  poly->h.l44[0] = 0;
+  poly->h.l44[1] = 0;
+  poly->h.l44[2] = 0;
+}
+
+/**
+ * @brief Reduce the accumulator, add 's' and store the low 128 bits.
+ */
+
+static void poly_finish(struct crypt_poly1305 *poly, uint8_t *tag)
+{
+  uint64_t h0 = poly->h.l44[0];
+  uint64_t h1 = poly->h.l44[1];
+  uint64_t h2 = poly->h.l44[2];
+  uint64_t g0;
+  uint64_t g1;
+  uint64_t g2;
+  uint64_t t0;
+  uint64_t t1;
+  uint64_t c;
+
+  c = h1 >> 44; h1 &= MASK44; h2 += c;
+  c = h2 >> 42; h2 &= MASK42; h0 += c * 5;
+  c = h0 >> 44; h0 &= MASK44; h1 += c;
+  c = h1 >> 44; h1 &= MASK44; h2 += c;
+  c = h2 >> 42; h2 &= MASK42; h0 += c * 5;
+  c = h0 >> 44; h0 &= MASK44; h1 += c;
+
+  /* h - p, kept when it does not borrow */
+
+  g0 = h0 + 5; c = g0 >> 44; g0 &= MASK44;
+  g1 = h1 + c; c = g1 >> 44; g1 &= MASK44;
+  g2 = h2 + c - ((uint64_t)1 << 42);
+
+  c = (g2 >> 63) - 1;
+  h0 = (h0 & ~c) | (g0 & c);
+  h1 = (h1 & ~c) | (g1 & c);
+  h2 = (h2 & ~c) | (g2 & c);
+
+  t0 = poly->pad[0] | (uint64_t)poly->pad[1] << 32;
+  t1 = poly->pad[2] | (uint64_t)poly->pad[3] << 32;
+
+  h0 += t0 & MASK44; c = h0 >> 44; h0 &= MASK44;
+  h1 += (((t0 >> 44) | (t1 << 20)) & MASK44) + c;
+  c = h1 >> 44; h1 &= MASK44;
+  h2 += ((t1 >> 24) & MASK42) + c;
+
+  store64_le(tag, h0 | h1 << 44);
+  store64_le(tag + 8, (h1 >> 20) | h2 << 24);
+}
+
+#ifdef POLY_X86
+
+/**
+ * @brief Convert the accumulator to 26-bit limbs for the vectors.
+ *
+ * Limbs are added rather than or-ed, the accumulator is only partly
+ * carried and the results stay below 2^27.
+ */
+
+static void poly_get26(const struct crypt_poly1305 *poly, uint32_t h[5])
+{
+  uint64_t h0 = poly->h.l44[0];
+  uint64_t h1 = poly->h.l44[1];
+  uint64_t h2 = poly->h.l44[2];
+
+  h[0] = h0 & MASK26;
+  h[1] = (h0 >> 26) + ((h1 & 0xff) << 18);
+  h[2] = (h1 >> 8) & MASK26;
+  h[3] = (h1 >> 34) + ((h2 & 0xffff) << 10);
+  h[4] = h2 >> 16;
+}
+
+/**
+ * @brief Convert 26-bit limbs back to the accumulator.
+ */
+
+static void poly_set26(struct crypt_poly1305 *poly, const uint32_t h[5])
+{
+  poly->h.l44[0] = h[0] + ((uint64_t)(h[1] & 0x3ffff) << 26);
+  poly->h.l44[1] = (h[1] >> 18) + ((uint64_t)h[2] << 8) +
+               ((uint64_t)(h[3] & 0x3ff) << 34);
+  poly->h.l44[2] = (h[3] >> 10) + ((uint64_t)h[4] << 16);
+}
+
+#endif /* POLY_X86 */
+
+#else /* CRYPT_POLY1305_LIMB == 44 */
+
+/**
+ * @brief Hash blocks of 16 bytes, 'hibit' is the bit 2^128 in limb 4.
+ */
+
+static void poly_blocks(struct crypt_poly1305 *poly, const uint8_t *m,
+                        size_t nblocks, uint32_t hibit)
+{
+  uint32_t h[5];
+  int i;
+
+  for (i = 0; i < 5; i++)
+    {
+      h[i] = poly->h.l26[i];
+    }
+
+  while (nblocks-- > 0)
+    {
+      h[0] += load32_le(m) & MASK26;
+      h[1] += (load32_le(m + 3) >> 2) & MASK26;
+      h[2] += (load32_le(m + 6) >> 4) & MASK26;
+      h[3] += (load32_le(m + 9) >> 6) & MASK26;
+      h[4] += (load32_le(m + 12) >> 8) | hibit;
+
+      poly26_mul(h, h, poly->r.l26);
+
+      m += POLY_BLOCK;
+    }
+
+  for (i = 0; i < 5; i++)
+    {
+      poly->h.l26[i] = h[i];
+    }
+}
+
+static void poly_key(struct crypt_poly1305 *poly, const uint8_t *key)
+{
+  int i;
+
+  poly26_key(poly->r.l26, key);
+  for (i = 0; i < 5; i++)
+    {
+      poly->h.l26[i] = 0;
+    }
+}
+
+/**
+ * @brief Reduce the accumulator, add 's' and store the low 128 bits.
+ */
+
+static void poly_finish(struct crypt_poly1305 *poly, uint8_t *tag)
+{
+  uint32_t h0 = poly->h.l26[0];
+  uint32_t h1 = poly->h.l26[1];
+  uint32_t h2 = poly->h.l26[2];
+  uint32_t h3 = poly->h.l26[3];
+  uint32_t h4 = poly->h.l26[4];
+  uint32_t g0;
+  uint32_t g1;
+  uint32_t g2;
+  uint32_t g3;
+  uint32_t g4;
+  uint32_t c;
+  uint64_t f;
+
+  c = h1 >> 26; h1 &= MASK26; h2 += c;
+  c = h2 >> 26; h2 &= MASK26; h3 += c;
+  c = h3 >> 26; h3 &= MASK26; h4 += c;
+  c = h4 >> 26; h4 &= MASK26; h0 += c * 5;
+  c = h0 >> 26; h0 &= MASK26; h1 += c;
+
+  /* h - p, kept when it does not borrow */
+
+  g0 = h0 + 5; c = g0 >> 26; g0 &= MASK26;
+  g1 = h1 + c; c = g1 >> 26; g1 &= MASK26;
+  g2 = h2 + c; c = g2 >> 26; g2 &= MASK26;
+  g3 = h3 + c; c = g3 >> 26; g3 &= MASK26;
+  g4 = h4 + c - (1 << 26);
+
+  c = (g4 >> 31) - 1;
+  h0 = (h0 & ~c) | (g0 & c);
+  h1 = (h1 & ~c) | (g1 & c);
+  h2 = (h2 & ~c) | (g2 & c);
+  h3 = (h3 & ~c) | (g3 & c);
+  h4 = (h4 & ~c) | (g4 & c);
+
+  h0 = h0 | h1 << 26;
+  h1 = (h1 >> 6) | h2 << 20;
+  h2 = (h2 >> 12) | h3 << 14;
+  h3 = (h3 >> 18) | h4 << 8;
+
+  f = (uint64_t)h0 + poly->pad[0];
+  store32_le(tag, f);
+  f = (uint64_t)h1 + poly->pad[1] + (f >> 32);
+  store32_le(tag + 4, f);
+  f = (uint64_t)h2 + poly->pad[2] + (f >> 32);
+  store32_le(tag + 8, f);
+  f = (uint64_t)h3 + poly->pad[3] + (f >> 32);
+  store32_le(tag + 12, f);
+}
+
+#ifdef POLY_X86
+
+static void poly_get26(const struct crypt_poly1305 *poly, uint32_t h[5])
+{
+  int i;
+
+  for (i = 0; i < 5; i++)
+    {
+      h[i] = poly->h.l26[i];
+    }
+}
+
+static void poly_set26(struct crypt_poly1305 *poly, const uint32_t h[5])
+{
+  int i;
+
+  for (i = 0; i < 5; i++)
+    {
+      poly->h.l26[i] = h[i];
+    }
+}
+
+#endif /* POLY_X86 */
+
+#endif /* CRYPT_POLY1305_LIMB == 44 */
+
+#ifdef POLY_X86
+
+/**
+ * @brief Tell whether the CPU runs the AVX2 kernel.
+ */
+
+static int poly_avx2_supported(void)
+{
+#ifndef CRYPT_FREESTANDING
+  __builtin_cpu_init();
+
+  return __builtin_cpu_supports("avx2");
+#else
+  return 1;
+#endif
+}
+
+/**
+ * @brief Multiply 4 lanes of 26-bit limbs by 'r' and carry.
+ */
+
+#define POLY_MUL4(h, r, s)                                              \
+  do                                                                    \
+    {                                                                   \
+      __m256i d0;                                                       \
+      __m256i d1;                                                       \
+      __m256i d2;                                                       \
+      __m256i d3;                                                       \
+      __m256i d4;                                                       \
+      __m256i c;                                                        \
+                                                                        \
+      d0 = _mm256_add_epi64(                                            \
+             _mm256_add_epi64(_mm256_mul_epu32(h[0], r[0]),             \
+                              _mm256_mul_epu32(h[1], s[4])),            \
+             _mm256_add_epi64(                                          \
+               _mm256_add_epi64(_mm256_mul_epu32(h[2], s[3]),           \
+                                _mm256_mul_epu32(h[3], s[2])),          \
+               _mm256_mul_epu32(h[4], s[1])));                          \
+      d1 = _mm256_add_epi64(                                            \
+             _mm256_add_epi64(_mm256_mul_epu32(h[0], r[1]),             \
+                              _mm256_mul_epu32(h[1], r[0])),            \
+             _mm256_add_epi64(                                          \
+               _mm256_add_epi64(_mm256_mul_epu32(h[2], s[4]),           \
+                                _mm256_mul_epu32(h[3], s[3])),          \
+               _mm256_mul_epu32(h[4], s[2])));                          \
+      d2 = _mm256_add_epi64(                                            \
+             _mm256_add_epi64(_mm256_mul_epu32(h[0], r[2]),             \
+                              _mm256_mul_epu32(h[1], r[1])),            \
+             _mm256_add_epi64(                                          \
+               _mm256_add_epi64(_mm256_mul_epu32(h[2], r[0]),           \
+                                _mm256_mul_epu32(h[3], s[4])),          \
+               _mm256_mul_epu32(h[4], s[3])));                          \
+      d3 = _mm256_add_epi64(                                            \
+             _mm256_add_epi64(_mm256_mul_epu32(h[0], r[3]),             \
+                              _mm256_mul_epu32(h[1], r[2])),            \
+             _mm256_add_epi64(                                          \
+               _mm256_add_epi64(_mm256_mul_epu32(h[2], r[1]),           \
+                                _mm256_mul_epu32(h[3], r[0])),          \
+               _mm256_mul_epu32(h[4], s[4])));                          \
+      d4 = _mm256_add_epi64(                                            \
+             _mm256_add_epi64(_mm256_mul_epu32(h[0], r[4]),             \
+                              _mm256_mul_epu32(h[1], r[3])),            \
+             _mm256_add_epi64(                                          \
+               _mm256_add_epi64(_mm256_mul_epu32(h[2], r[2]),           \
+                                _mm256_mul_epu32(h[3], r[1])),          \
+               _mm256_mul_epu32(h[4], r[0])));                          \
+                                                                        \
+      c = _mm256_srli_epi64(d0, 26); h[0] = _mm256_and_si256(d0, mask); \
+      d1 = _mm256_add_epi64(d1, c);                                     \
+      c = _mm256_srli_epi64(d1, 26); h[1] = _mm256_and_si256(d1, mask); \
+      d2 = _mm256_add_epi64(d2, c);                                     \
+      c = _mm256_srli_epi64(d2, 26); h[2] = _mm256_and_si256(d2, mask); \
+      d3 = _mm256_add_epi64(d3, c);                                     \
+      c = _mm256_srli_epi64(d3, 26); h[3] = _mm256_and_si256(d3, mask); \
+      d4 = _mm256_add_epi64(d4, c);                                     \
+      c = _mm256_srli_epi64(d4, 26); h[4] = _mm256_and_si256(d4, mask); \
+      h[0] = _mm256_add_epi64(h[0],                                     \
+               _mm256_add_epi64(c, _mm256_slli_epi64(c, 2)));           \
+      c = _mm256_srli_epi64(h[0], 26);                                  \
+      h[0] = _mm256_and_si256(h[0], mask);                              \
+      h[1] = _mm256_add_epi64(h[1], c);                                 \
+    }                                                                   \
+  while (0)
+
+/**
+ * @brief Hash groups of 4 full blocks, 'h' in 26-bit limbs.
+ *
+ * The unpack of a group puts blocks 0, 2, 1, 3 in lanes 0 to 3, so the
+ * last group is multiplied by r^4, r^2, r^3 and r in that order.
+ *
+ * @param h accumulator, in and out
+ * @param power r, r^2, r^3 and r^4
+ * @param m blocks to hash
+ * @param ngroups groups of 4 blocks, at least 1
+ */
+
+POLY_AVX2
+static void poly_x4(uint32_t h[5], const uint32_t power[4][5],
+                    const uint8_t *m, size_t ngroups)
+{
+  const __m256i mask = _mm256_set1_epi64x(MASK26);
+  const __m256i hibit = _mm256_set1_epi64x(1 << 24);
+  __m256i r4[5];
+  __m256i s4[5];
+  __m256i rl[5];
+  __m256i sl[5];
+  __m256i acc[5];
+  __m256i lo;
+  __m256i hi;
+  __m256i a;
+  __m256i b;
+  __m128i x;
+  uint64_t d[5];
+  uint64_t c;
+  int k;
+
+  for (k = 0; k < 5; k++)
+    {
+      r4[k]  = _mm256_set1_epi64x(power[3][k]);
+      s4[k]  = _mm256_add_epi64(r4[k], _mm256_slli_epi64(r4[k], 2));
+      rl[k]  = _mm256_set_epi64x(power[0][k], power[2][k], power[1][k],
+                                 power[3][k]);
+      sl[k]  = _mm256_add_epi64(rl[k], _mm256_slli_epi64(rl[k], 2));
+      acc[k] = _mm256_set_epi64x(0, 0, 0, h[k]);
+    }
+
+  for (; ngroups > 0; ngroups--, m += 4 * POLY_BLOCK)
+    {
+      lo = _mm256_loadu_si256((const __m256i *)m);
+      hi = _mm256_loadu_si256((const __m256i *)(m + 32));
+      a  = _mm256_unpacklo_epi64(lo, hi);
+      b  = _mm256_unpackhi_epi64(lo, hi);
+
+      acc[0] = _mm256_add_epi64(acc[0], _mm256_and_si256(a, mask));
+      acc[1] = _mm256_add_epi64(acc[1],
+                 _mm256_and_si256(_mm256_srli_epi64(a, 26), mask));
+      acc[2] = _mm256_add_epi64(acc[2],
+                 _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(a, 52),
+                                                  _mm256_slli_epi64(b, 12)),
+                                  mask));
+      acc[3] = _mm256_add_epi64(acc[3],
+                 _mm256_and_si256(_mm256_srli_epi64(b, 14), mask));
+      acc[4] = _mm256_add_epi64(acc[4],
+                 _mm256_or_si256(_mm256_srli_epi64(b, 40), hibit));
+
+      if (ngroups > 1)
+        {
+          POLY_MUL4(acc, r4, s4);
+        }
+      else
+        {
+          POLY_MUL4(acc, rl, sl);
+        }
+    }
+
+  /* Sum the lanes, then carry back to limbs below 2^26 */
+
+  for (k = 0; k < 5; k++)
+    {
+      x = _mm_add_epi64(_mm256_castsi256_si128(acc[k]),
+                        _mm256_extracti128_si256(acc[k], 1));
+      x = _mm_add_epi64(x, _mm_unpackhi_epi64(x, x));
+      d[k] = _mm_cvtsi128_si64(x);
+    }
+
+  c = d[0] >> 26; d[0] &= MASK26; d[1] += c;
+  c = d[1] >> 26; d[1] &= MASK26; d[2] += c;
+  c = d[2] >> 26; d[2] &= MASK26; d[3] += c;
+  c = d[3] >> 26; d[3] &= MASK26; d[4] += c;
+  c = d[4] >> 26; d[4] &= MASK26; d[0] += c * 5;
+  c = d[0] >> 26; d[0] &= MASK26; d[1] += c;
+
+  for (k = 0; k < 5; k++)
+    {
+      h[k] = d[k];
+    }
+}
+
+#endif /* POLY_X86 */
+
+/**
+ * @brief Hash full blocks, the vectors take the long runs.
+ */
+
+static void poly_full_blocks(struct crypt_poly1305 *poly, const uint8_t *m,
+                             size_t nblocks)
+{
+#ifdef POLY_X86
+  uint32_t h[5];
+  size_t ngroups;
+
+  if (nblocks >= POLY_VECTOR_MIN && poly->power[3][0] != UINT32_MAX)
+    {
+      ngroups = nblocks / 4;
+
+      poly_get26(poly, h);
+      poly_x4(h, (const uint32_t (*)[5])poly->power, m, ngroups);
+      poly_set26(poly, h);
+
+      m       += ngroups * 4 * POLY_BLOCK;
+      nblocks -= ngroups * 4;
+    }
+#endif
+
+#if CRYPT_POLY1305_LIMB == 44
+  poly_blocks(poly, m, nblocks, (uint64_t)1 << 40);
+#else
+  poly_blocks(poly, m, nblocks, 1 << 24);
+#endif
+}
+
+/**
+ * @brief Add the zeros padding 'length' bytes to a multiple of 16.
+ */
+
+static void aead_pad16(struct crypt_poly1305 *poly, uint64_t length)
+{
+  static const uint8_t zero[POLY_BLOCK];
+
+  if (length % POLY_BLOCK != 0)
+    {
+      crypt_poly1305_update(poly, zero, POLY_BLOCK - length % POLY_BLOCK);
+    }
+}
+
+/**
+ * @brief Compute the tag of a message: pad, then both lengths.
+ */
+
+static void aead_tag(struct crypt_aead *aead, uint8_t *tag)
+{
+  uint8_t lengths[16];
+
+  aead_pad16(&aead->poly, aead->length);
+  store64_le(lengths, aead->adlen);
+  store64_le(lengths + 8, aead->length);
+  crypt_poly1305_update(&aead->poly, lengths, sizeof(lengths));
+  crypt_poly1305_final(&aead->poly, tag);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Start a MAC, r and s come from the one-time key.
+ *
+ * @param poly MAC state to fill
+ * @param key one-time key
+ */
+
+void crypt_poly1305_init(struct crypt_poly1305 *poly,
+                         const uint8_t key[CRYPT_POLY1305_KEY])
+{
+  int i;
+
+  poly_key(poly, key);
+  for (i = 0; i < 4; i++)
+    {
+      poly->pad[i] = load32_le(key + 16 + 4 * i);
+    }
+
+  poly->leftover = 0;
+
+#ifdef POLY_X86
+
+  /* All ones marks a CPU without AVX2, limbs never have that value */
+
+  if (poly_avx2_supported())
+    {
+      poly26_key(poly->power[0], key);
+      poly26_mul(poly->power[1], poly->power[0], poly->power[0]);
+      poly26_mul(poly->power[2], poly->power[1], poly->power[0]);
+      poly26_mul(poly->power[3], poly->power[2], poly->power[0]);
+    }
+  else
+    {
+      poly->power[3][0] = UINT32_MAX;
+    }
+#endif
+}
+
+/**
+ * @brief Hash the next bytes of the message.
+ *
+ * @param poly MAC state
+ * @param data next bytes of the message
+ * @param length size of data
+ */
+
+void crypt_poly1305_update(struct crypt_poly1305 *poly, const uint8_t *data,
+                           size_t length)
+{
+  size_t n;
+
+  /* Complete a block left partial by the previous call */
+
+  if (poly->leftover > 0)
+    {
+      while (poly->leftover < POLY_BLOCK && length > 0)
+        {
+          poly->buffer[poly->leftover++] = *data++;
+          length--;
+        }
+
+      if (poly->leftover < POLY_BLOCK)
+        {
+          return;
+        }
+
+      poly_full_blocks(poly, poly->buffer, 1);
+      poly->leftover = 0;
+    }
+
+  n = length / POLY_BLOCK;
+  if (n > 0)
+    {
+      poly_full_blocks(poly, data, n);
+      data   += n * POLY_BLOCK;
+      length -= n * POLY_BLOCK;
+    }
+
+  while (length-- > 0)
+    {
+      poly->buffer[poly->leftover++] = *data++;
+    }
+}
+
+/**
+ * @brief End a MAC, the last partial block has its 1 bit after the data.
+ *
+ * @param poly MAC state, wiped
+ * @param tag buffer receiving the tag
+ */
+
+void crypt_poly1305_final(struct crypt_poly1305 *poly,
+                          uint8_t tag[CRYPT_AEAD_TAG])
+{
+  unsigned i;
+
+  if (poly->leftover > 0)
+    {
+      i = poly->leftover;
+      poly->buffer[i++] = 1;
+      while (i < POLY_BLOCK)
+        {
+          poly->buffer[i++] = 0;
+        }
+
+      poly_blocks(poly, poly->buffer, 1, 0);
+    }
+
+  poly_finish(poly, tag);
+  crypt_wipe(poly, sizeof(*poly));
+}
+
+/**
+ * @brief Start a message, the first keystream block keys its MAC.
+ *
+ * @param aead state to fill
+ * @param context key of the message, its engine must be ChaCha20
+ * @param offset keystream position, a multiple of 64
+ * @param ad associated data
+ * @param adlen size of ad
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_aead_init(struct crypt_aead *aead,
+                    const struct crypt_context *context, uint64_t offset,
+                    const uint8_t *ad, size_t adlen)
+{
+  uint32_t blockw[16];
+  uint8_t *block = (uint8_t *)blockw;
+  int ret;
+  int i;
+
+  if (aead == NULL || context == NULL ||
+      context->engine != &crypt_engine_chacha20 || offset % 64 != 0 ||
+      (ad == NULL && adlen > 0))
+    {
+      return -EINVAL;
+    }
+
+  for (i = 0; i < 16; i++)
+    {
+      blockw[i] = 0;
+    }
+
+  ret = crypt_buffer_at(context, block, block, sizeof(blockw), offset);
+  if (ret < 0)
+    {
+      return ret;
+    }
+
+  crypt_poly1305_init(&aead->poly, block);
+  crypt_wipe(blockw, sizeof(blockw));
+
+  aead->context = context;
+  aead->offset  = offset + sizeof(blockw);
+  aead->adlen   = adlen;
+  aead->length  = 0;
+
+  crypt_poly1305_update(&aead->poly, ad, adlen);
+  aead_pad16(&aead->poly, adlen);
+
+  return 0;
+}
+
+/**
+ * @brief Encrypt a stripe, then hash its ciphertext while it is cached.
+ *
+ * @param aead state, moved past the bytes
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_aead_seal_update(struct crypt_aead *aead, uint8_t *output,
+                           const uint8_t *input, size_t length)
+{
+  size_t n;
+  int ret;
+
+  while (length > 0)
+    {
+      n = length < AEAD_STRIPE ? length : AEAD_STRIPE;
+
+      ret = crypt_buffer_at(aead->context, output, input, n, aead->offset);
+      if (ret < 0)
+        {
+          return ret;
+        }
+
+      crypt_poly1305_update(&aead->poly, output, n);
+
+      aead->offset += n;
+      aead->length += n;
+      output += n;
+      input  += n;
+      length -= n;
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Hash a stripe of ciphertext, then decrypt it while it is cached.
+ *
+ * @param aead state, moved past the bytes
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_aead_open_update(struct crypt_aead *aead, uint8_t *output,
+                           const uint8_t *input, size_t length)
+{
+  size_t n;
+  int ret;
+
+  while (length > 0)
+    {
+      n = length < AEAD_STRIPE ? length : AEAD_STRIPE;
+
+      crypt_poly1305_update(&aead->poly, input, n);
+
+      ret = crypt_buffer_at(aead->context, output, input, n, aead->offset);
+      if (ret < 0)
+        {
+          return ret;
+        }
+
+      aead->offset += n;
+      aead->length += n;
+      output += n;
+      input  += n;
+      length -= n;
+    }
+
+  return 0;
+}
+
+/**
+ * @brief End an encryption.
+ *
+ * @param aead state, its MAC key wiped
+ * @param tag buffer receiving the tag
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_aead_seal_final(struct crypt_aead *aead,
+                          uint8_t tag[CRYPT_AEAD_TAG])
+{
+  aead_tag(aead, tag);
+
+  return 0;
+}
+
+/**
+ * @brief End a decryption, all the tag bytes are compared whatever the
+ *        first difference.
+ *
+ * @param aead state, its MAC key wiped
+ * @param tag tag received with the message
+ *
+ * @return Success (OK = 0), -EBADMSG if the tags differ.
+ */
+
+int crypt_aead_open_final(struct crypt_aead *aead,
+                          const uint8_t tag[CRYPT_AEAD_TAG])
+{
+  uint32_t expectw[CRYPT_AEAD_TAG / 4];
+  uint8_t *expect = (uint8_t *)expectw;
+  unsigned diff = 0;
+  int i;
+
+  aead_tag(aead, expect);
+
+  for (i = 0; i < CRYPT_AEAD_TAG; i++)
+    {
+      diff |= expect[i] ^ tag[i];
+    }
+
+  crypt_wipe(expectw, sizeof(expectw));
+
+  return diff == 0 ? 0 : -EBADMSG;
+}
+
+/**
+ * @brief Encrypt and authenticate a whole message.
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_aead_seal(const struct crypt_context *context, uint8_t *output,
+                    const uint8_t *input, size_t length, uint64_t offset,
+                    const uint8_t *ad, size_t adlen,
+                    uint8_t tag[CRYPT_AEAD_TAG])
+{
+  struct crypt_aead aead;
+  int ret;
+
+  ret = crypt_aead_init(&aead, context, offset, ad, adlen);
+  if (ret < 0)
+    {
+      return ret;
+    }
+
+  ret = crypt_aead_seal_update(&aead, output, input, length);
+  if (ret < 0)
+    {
+      crypt_wipe(&aead.poly, sizeof(aead.poly));
+      return ret;
+    }
+
+  return crypt_aead_seal_final(&aead, tag);
+}
+
+/**
+ * @brief Check and decrypt a whole message, a forged one leaves zeros.
+ *
+ * @return Success (OK = 0), -EBADMSG or negative POSIX errno.
+ */
+
+int crypt_aead_open(const struct crypt_context *context, uint8_t *output,
+                    const uint8_t *input, size_t length, uint64_t offset,
+                    const uint8_t *ad, size_t adlen,
+                    const uint8_t tag[CRYPT_AEAD_TAG])
+{
+  struct crypt_aead aead;
+  size_t i;
+  int ret;
+
+  ret = crypt_aead_init(&aead, context, offset, ad, adlen);
+  if (ret < 0)
+    {
+      return ret;
+    }
+
+  ret = crypt_aead_open_update(&aead, output, input, length);
+  if (ret < 0)
+    {
+      crypt_wipe(&aead.poly, sizeof(aead.poly));
+      return ret;
+    }
+
+  ret = crypt_aead_open_final(&aead, tag);
+  if (ret < 0)
+    {
+      for (i = 0; i < length; i++)
+        {
+          output[i] = 0;
+        }
+    }
+
+  return ret;
+}
@@ -0,0 +1,1002 @@
+/****************************************************************************
+ * @file  lib/crypt_aes.c
+ *
+ * @brief AES-256-CTR engine, see crypt_engine_aes256_ctr.
+ *
+ * AES-256 in counter mode as in NIST SP 800-38A: the 16-byte counter
+ * block is a 128-bit big endian number incremented once per block, so
+ * keystream position 'offset' is byte offset % 16 of the block whose
+ * counter is the initial one plus offset / 16. The key material of the
+ * context is the 32-byte key, optionally followed by the 16-byte initial
+ * counter block (0 when missing).
+ *
+ * With AES-NI, 8 blocks go through the rounds side by side, so the
+ * latency of one AESENC is hidden behind the 7 others. With VAES and
+ * AVX-512, 4 registers of 4 blocks run 16 at a time. Other CPUs use a
+ * bitsliced AES with no table and no secret dependent branch, 4 blocks
+ * in 8 words of 64 bits. On x86-64 the kernel is picked at run time, in
+ * the freestanding profile at build time.
+ *
+ * An engine has nowhere to keep state between calls, so aes_crypt()
+ * expands the key, and on the bitsliced path packs its 15 round keys,
+ * every time. That is kept short, AESKEYGENASSIST in registers or 4
+ * round keys per aes_pack(), but small calls still pay for it, and
+ * crypt_bench prints how much.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+#  include <immintrin.h>
+#endif
+
+#include "acrypt.h"
+#include "crypt_internal.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define AES_BLOCK  16
+#define AES_ROUNDS 14
+#define AES_WORDS  (4 * (AES_ROUNDS + 1))
+
+#if defined(__x86_64__)
+#  define AES_X86
+#  define AES_NI   __attribute__((target("aes,ssse3")))
+#  define AES_VAES __attribute__((target("vaes,avx512f,avx512bw")))
+#endif
+
+/* 16-bit pattern repeated in the 4 blocks of a bit plane */
+
+#define AES_LANES(v) ((uint64_t)(v) * 0x0001000100010001ull)
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/* Round keys: words for AES-NI, bit planes for the bitsliced kernel */
+
+struct aes_schedule
+{
+  uint32_t w[AES_WORDS];                 /* expanded key, little endian */
+  uint64_t q[AES_ROUNDS + 1][8];         /* bit planes of each round    */
+};
+
+/****************************************************************************
+ * Private Function Prototypes
+ ****************************************************************************/
+
+static int aes_crypt(const struct crypt_context *context,
+                     uint8_t *output, const uint8_t *input,
+                     size_t length, uint64_t offset);
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+const struct crypt_engine crypt_engine_aes256_ctr =
+{
+  "aes256-ctr",
+  aes_crypt
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static inline uint32_t load32_le(const uint8_t *p)
+{
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t load64_le(const uint8_t *p)
+{
+  return load32_le(p) | (uint64_t)load32_le(p + 4) << 32;
+}
+
+static inline void store64_le(uint8_t *p, uint64_t v)
+{
+  unsigned i;
+
+  for (i = 0; i < 8; i++)
+    {
+      p[i] = v >> (8 * i);
+    }
+}
+
+static inline uint64_t load64_be(const uint8_t *p)
+{
+  uint64_t v = 0;
+  unsigned i;
+
+  for (i = 0; i < 8; i++)
+    {
+      v = v << 8 | p[i];
+    }
+
+  return v;
+}
+
+static inline void store64_be(uint8_t *p, uint64_t v)
+{
+  unsigned i;
+
+  for (i = 0; i < 8; i++)
+    {
+      p[i] = v >> (56 - 8 * i);
+    }
+}
+
+/* Add to the 128-bit counter 'hi':'lo' */
+
+static inline void aes_add(uint64_t *hi, uint64_t *lo, uint64_t n)
+{
+  *lo += n;
+  *hi += *lo < n;
+}
+
+/**
+ * @brief Transpose the 8x8 bit matrix of a word, byte i being row i.
+ *
+ * Bit j of byte i goes to bit i of byte j.
+ */
+
+static uint64_t aes_transpose8(uint64_t x)
+{
+  uint64_t t;
+
+  t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaull;
+  x ^= t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000cccc0000ccccull;
+  x ^= t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ull;
+  x ^= t ^ (t << 28);
+
+  return x;
+}
+
+/**
+ * @brief Split 4 blocks in 8 bit planes.
+ *
+ * Bit i of plane b is bit b of byte i, so plane bits 16 * k to 16 * k + 15
+ * hold block k and, the state being stored by column, row r of column c
+ * is bit 4 * c + r of the block.
+ *
+ * @param q the bit planes
+ * @param in 64 bytes
+ */
+
+static void aes_pack(uint64_t q[8], const uint8_t *in)
+{
+  uint64_t w[8];
+  unsigned b;
+  unsigned k;
+
+  for (k = 0; k < 8; k++)
+    {
+      w[k] = aes_transpose8(load64_le(in + 8 * k));
+    }
+
+  for (b = 0; b < 8; b++)
+    {
+      q[b] = 0;
+      for (k = 0; k < 8; k++)
+        {
+          q[b] |= (w[k] >> (8 * b) & 0xff) << (8 * k);
+        }
+    }
+}
+
+/**
+ * @brief Join 8 bit planes back into 4 blocks, see aes_pack().
+ *
+ * @param out 64 bytes
+ * @param q the bit planes
+ */
+
+static void aes_unpack(uint8_t *out, const uint64_t q[8])
+{
+  uint64_t w;
+  unsigned b;
+  unsigned k;
+
+  for (k = 0; k < 8; k++)
+    {
+      w = 0;
+      for (b = 0; b < 8; b++)
+        {
+          w |= (q[b] >> (8 * k) & 0xff) << (8 * b);
+        }
+
+      store64_le(out + 8 * k, aes_transpose8(w));
+    }
+}
+
+/**
+ * @brief SubBytes of every byte of the planes, in logic gates only.
+ *
+ * The circuit of J. Boyar and R. Peralta: a linear map to GF(2^4)^2, the
+ * inversion there in 32 AND, then a linear map back with the affine
+ * constant. q[7] holds the most significant bits.
+ */
+
+static void aes_sbox(uint64_t q[8])
+{
+  uint64_t x0, x1, x2, x3, x4, x5, x6, x7;
+  uint64_t y1, y2, y3, y4, y5, y6, y7, y8, y9, y10, y11;
+  uint64_t y12, y13, y14, y15, y16, y17, y18, y19, y20, y21;
+  uint64_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+  uint64_t z10, z11, z12, z13, z14, z15, z16, z17;
+  uint64_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+  uint64_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+  uint64_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+  uint64_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+  uint64_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+  uint64_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+  uint64_t t60, t61, t62, t63, t64, t65, t66, t67;
+  uint64_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+  x0 = q[7];
+  x1 = q[6];
+  x2 = q[5];
+  x3 = q[4];
+  x4 = q[3];
+  x5 = q[2];
+  x6 = q[1];
+  x7 = q[0];
+
+  /* Top linear transformation */
+
+  y14 = x3 ^ x5;
+  y13 = x0 ^ x6;
+  y9  = x0 ^ x3;
+  y8  = x0 ^ x5;
+  t0  = x1 ^ x2;
+  y1  = t0 ^ x7;
+  y4  = y1 ^ x3;
+  y12 = y13 ^ y14;
+  y2  = y1 ^ x0;
+  y5  = y1 ^ x6;
+  y3  = y5 ^ y8;
+  t1  = x4 ^ y12;
+  y15 = t1 ^ x5;
+  y20 = t1 ^ x1;
+  y6  = y15 ^ x7;
+  y10 = y15 ^ t0;
+  y11 = y20 ^ y9;
+  y7  = x7 ^ y11;
+  y17 = y10 ^ y11;
+  y19 = y10 ^ y8;
+  y16 = t0 ^ y11;
+  y21 = y13 ^ y16;
+  y18 = x0 ^ y16;
+
+  /* Inversion in GF(2^4)^2 */
+
+  t2  = y12 & y15;
+  t3  = y3 & y6;
+  t4  = t3 ^ t2;
+  t5  = y4 & x7;
+  t6  = t5 ^ t2;
+  t7  = y13 & y16;
+  t8  = y5 & y1;
+  t9  = t8 ^ t7;
+  t10 = y2 & y7;
+  t11 = t10 ^ t7;
+  t12 = y9 & y11;
+  t13 = y14 & y17;
+  t14 = t13 ^ t12;
+  t15 = y8 & y10;
+  t16 = t15 ^ t12;
+  t17 = t4 ^ t14;
+  t18 = t6 ^ t16;
+  t19 = t9 ^ t14;
+  t20 = t11 ^ t16;
+  t21 = t17 ^ y20;
+  t22 = t18 ^ y19;
+  t23 = t19 ^ y21;
+  t24 = t20 ^ y18;
+
+  t25 = t21 ^ t22;
+  t26 = t21 & t23;
+  t27 = t24 ^ t26;
+  t28 = t25 & t27;
+  t29 = t28 ^ t22;
+  t30 = t23 ^ t24;
+  t31 = t22 ^ t26;
+  t32 = t31 & t30;
+  t33 = t32 ^ t24;
+  t34 = t23 ^ t33;
+  t35 = t27 ^ t33;
+  t36 = t24 & t35;
+  t37 = t36 ^ t34;
+  t38 = t27 ^ t36;
+  t39 = t29 & t38;
+  t40 = t25 ^ t39;
+
+  t41 = t40 ^ t37;
+  t42 = t29 ^ t33;
+  t43 = t29 ^ t40;
+  t44 = t33 ^ t37;
+  t45 = t42 ^ t41;
+  z0  = t44 & y15;
+  z1  = t37 & y6;
+  z2  = t33 & x7;
+  z3  = t43 & y16;
+  z4  = t40 & y1;
+  z5  = t29 & y7;
+  z6  = t42 & y11;
+  z7  = t45 & y17;
+  z8  = t41 & y10;
+  z9  = t44 & y12;
+  z10 = t37 & y3;
+  z11 = t33 & y4;
+  z12 = t43 & y13;
+  z13 = t40 & y5;
+  z14 = t29 & y2;
+  z15 = t42 & y9;
+  z16 = t45 & y14;
+  z17 = t41 & y8;
+
+  /* Bottom linear transformation */
+
+  t46 = z15 ^ z16;
+  t47 = z10 ^ z11;
+  t48 = z5 ^ z13;
+  t49 = z9 ^ z10;
+  t50 = z2 ^ z12;
+  t51 = z2 ^ z5;
+  t52 = z7 ^ z8;
+  t53 = z0 ^ z3;
+  t54 = z6 ^ z7;
+  t55 = z16 ^ z17;
+  t56 = z12 ^ t48;
+  t57 = t50 ^ t53;
+  t58 = z4 ^ t46;
+  t59 = z3 ^ t54;
+  t60 = t46 ^ t57;
+  t61 = z14 ^ t57;
+  t62 = t52 ^ t58;
+  t63 = t49 ^ t58;
+  t64 = z4 ^ t59;
+  t65 = t61 ^ t62;
+  t66 = z1 ^ t63;
+  s0  = t59 ^ t63;
+  s6  = t56 ^ ~t62;
+  s7  = t48 ^ ~t60;
+  t67 = t64 ^ t65;
+  s3  = t53 ^ t66;
+  s4  = t51 ^ t66;
+  s5  = t47 ^ t65;
+  s1  = t64 ^ ~s3;
+  s2  = t55 ^ ~t67;
+
+  q[7] = s0;
+  q[6] = s1;
+  q[5] = s2;
+  q[4] = s3;
+  q[3] = s4;
+  q[2] = s5;
+  q[1] = s6;
+  q[0] = s7;
+}
+
+/**
+ * @brief ShiftRows: row r of each block turns left by r columns.
+ */
+
+static void aes_shift_rows(uint64_t q[8])
+{
+  uint64_t x;
+  unsigned b;
+
+  for (b = 0; b < 8; b++)
+    {
+      x = q[b];
+      q[b] = (x & AES_LANES(0x1111)) |
+             (x >> 4 & AES_LANES(0x0222)) | (x << 12 & AES_LANES(0x2000)) |
+             (x >> 8 & AES_LANES(0x0044)) | (x << 8 & AES_LANES(0x4400)) |
+             (x >> 12 & AES_LANES(0x0008)) | (x << 4 & AES_LANES(0x8880));
+    }
+}
+
+/* Row r + 1, or r + 2, of the same column in place of row r */
+
+static inline uint64_t aes_rot1(uint64_t x)
+{
+  return (x >> 1 & AES_LANES(0x7777)) | (x << 3 & AES_LANES(0x8888));
+}
+
+static inline uint64_t aes_rot2(uint64_t x)
+{
+  return (x >> 2 & AES_LANES(0x3333)) | (x << 2 & AES_LANES(0xcccc));
+}
+
+/**
+ * @brief MixColumns: 2 * (a_r ^ a_r+1) ^ a_r+1 ^ a_r+2 ^ a_r+3.
+ */
+
+static void aes_mix_columns(uint64_t q[8])
+{
+  uint64_t r[8];
+  uint64_t t[8];
+  unsigned b;
+
+  for (b = 0; b < 8; b++)
+    {
+      r[b] = aes_rot1(q[b]);
+      t[b] = q[b] ^ r[b];
+    }
+
+  /* Doubling in GF(2^8) is a shift with 0x1b folded into bits 0,1,3,4 */
+
+  q[0] = t[7]        ^ r[0] ^ aes_rot2(t[0]);
+  q[1] = t[0] ^ t[7] ^ r[1] ^ aes_rot2(t[1]);
+  q[2] = t[1]        ^ r[2] ^ aes_rot2(t[2]);
+  q[3] = t[2] ^ t[7] ^ r[3] ^ aes_rot2(t[3]);
+  q[4] = t[3] ^ t[7] ^ r[4] ^ aes_rot2(t[4]);
+  q[5] = t[4]        ^ r[5] ^ aes_rot2(t[5]);
+  q[6] = t[5]        ^ r[6] ^ aes_rot2(t[6]);
+  q[7] = t[6]        ^ r[7] ^ aes_rot2(t[7]);
+}
+
+static inline void aes_add_key(uint64_t q[8], const uint64_t k[8])
+{
+  unsigned b;
+
+  for (b = 0; b < 8; b++)
+    {
+      q[b] ^= k[b];
+    }
+}
+
+/**
+ * @brief SubWord of the key schedule, bitsliced.
+ */
+
+static uint32_t aes_subword_ct(uint32_t w)
+{
+  uint64_t q[8];
+  uint64_t x;
+  unsigned b;
+
+  x = aes_transpose8(w);
+  for (b = 0; b < 8; b++)
+    {
+      q[b] = x >> (8 * b) & 0xff;
+    }
+
+  aes_sbox(q);
+
+  for (x = 0, b = 0; b < 8; b++)
+    {
+      x |= (q[b] & 0xff) << (8 * b);
+    }
+
+  return aes_transpose8(x) & 0xffffffff;
+}
+
+/**
+ * @brief Compute the keystream of 4 blocks, bitsliced.
+ *
+ * @param q round keys as bit planes, see aes_setup()
+ * @param hi high half of the counter of the first block
+ * @param lo low half of the counter of the first block
+ * @param ks the 64 keystream bytes
+ */
+
+static void aes_x4_ct(const uint64_t q[AES_ROUNDS + 1][8], uint64_t hi,
+                      uint64_t lo, uint8_t ks[4 * AES_BLOCK])
+{
+  uint64_t s[8];
+  unsigned i;
+
+  for (i = 0; i < 4; i++)
+    {
+      store64_be(ks + AES_BLOCK * i, hi);
+      store64_be(ks + AES_BLOCK * i + 8, lo);
+      aes_add(&hi, &lo, 1);
+    }
+
+  aes_pack(s, ks);
+  aes_add_key(s, q[0]);
+
+  for (i = 1; i < AES_ROUNDS; i++)
+    {
+      aes_sbox(s);
+      aes_shift_rows(s);
+      aes_mix_columns(s);
+      aes_add_key(s, q[i]);
+    }
+
+  aes_sbox(s);
+  aes_shift_rows(s);
+  aes_add_key(s, q[AES_ROUNDS]);
+
+  aes_unpack(ks, s);
+}
+
+#ifdef AES_X86
+
+/**
+ * @brief One round key of the expansion: the prefix xor of the 4 words
+ *        of 'a', xored with the word broadcast in 't'.
+ */
+
+AES_NI
+static inline __m128i aes_expand_step(__m128i a, __m128i t)
+{
+  a = _mm_xor_si128(a, _mm_slli_si128(a, 4));
+  a = _mm_xor_si128(a, _mm_slli_si128(a, 8));
+
+  return _mm_xor_si128(a, t);
+}
+
+/* The round keys 2 * i and 2 * i + 1, in 'a' and 'b'. AESKEYGENASSIST
+ * gives SubWord, and RotWord xor 'rcon', of words 1 and 3 of its input.
+ */
+
+#define AES_EXPAND_A(i, rcon) \
+  a = aes_expand_step(a, _mm_shuffle_epi32( \
+        _mm_aeskeygenassist_si128(b, rcon), 0xff)); \
+  _mm_storeu_si128((__m128i *)(w + 8 * (i)), a);
+
+#define AES_EXPAND_B(i) \
+  b = aes_expand_step(b, _mm_shuffle_epi32( \
+        _mm_aeskeygenassist_si128(a, 0), 0xaa)); \
+  _mm_storeu_si128((__m128i *)(w + 8 * (i) + 4), b);
+
+/**
+ * @brief Expand the key, AES-NI.
+ *
+ * The round keys stay in registers from one to the next, where the word
+ * by word loop of aes_setup() costs more than a short message.
+ *
+ * @param w the round keys to fill
+ * @param key the 32-byte key
+ */
+
+AES_NI
+static void aes_expand_ni(uint32_t w[AES_WORDS], const uint8_t *key)
+{
+  __m128i a = _mm_loadu_si128((const __m128i *)key);
+  __m128i b = _mm_loadu_si128((const __m128i *)(key + AES_BLOCK));
+
+  _mm_storeu_si128((__m128i *)w, a);
+  _mm_storeu_si128((__m128i *)(w + 4), b);
+
+  AES_EXPAND_A(1, 0x01) AES_EXPAND_B(1)
+  AES_EXPAND_A(2, 0x02) AES_EXPAND_B(2)
+  AES_EXPAND_A(3, 0x04) AES_EXPAND_B(3)
+  AES_EXPAND_A(4, 0x08) AES_EXPAND_B(4)
+  AES_EXPAND_A(5, 0x10) AES_EXPAND_B(5)
+  AES_EXPAND_A(6, 0x20) AES_EXPAND_B(6)
+  AES_EXPAND_A(7, 0x40)
+}
+
+/* Statement 'f' for blocks 0 to 3, or 0 to 7. Written out, the block
+ * indices are constants, so each block stays in a register and the CPU
+ * sees the AESENC of all of them back to back.
+ */
+
+#define AES_EACH4(f, i) f(i) f((i) + 1) f((i) + 2) f((i) + 3)
+#define AES_EACH8(f)    AES_EACH4(f, 0) AES_EACH4(f, 4)
+
+/* Counter block of 'hi':'lo', byte swapped to big endian */
+
+#define AES_COUNTER(hi, lo, rev) \
+  _mm_shuffle_epi8(_mm_set_epi64x(hi, lo), rev)
+
+/**
+ * @brief Compute the keystream of 1 block, AES-NI.
+ *
+ * @param w round keys
+ * @param hi high half of the counter
+ * @param lo low half of the counter
+ * @param ks the 16 keystream bytes
+ */
+
+AES_NI
+static void aes_x1_ni(const uint32_t w[AES_WORDS], uint64_t hi,
+                      uint64_t lo, uint8_t ks[AES_BLOCK])
+{
+  const __m128i *rk = (const __m128i *)w;
+  const __m128i rev = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                    7, 6, 5, 4, 3, 2, 1, 0);
+  __m128i b;
+  unsigned i;
+
+  b = _mm_xor_si128(AES_COUNTER(hi, lo, rev), _mm_loadu_si128(rk));
+  for (i = 1; i < AES_ROUNDS; i++)
+    {
+      b = _mm_aesenc_si128(b, _mm_loadu_si128(rk + i));
+    }
+
+  b = _mm_aesenclast_si128(b, _mm_loadu_si128(rk + AES_ROUNDS));
+  _mm_storeu_si128((__m128i *)ks, b);
+}
+
+/* Steps of aes_x8_ni() for block i */
+
+#define AES_NI_FIRST(i) \
+  b[i] = _mm_xor_si128(AES_COUNTER(hi + (lo + (i) < lo), lo + (i), rev), k);
+#define AES_NI_ROUND(i) \
+  b[i] = _mm_aesenc_si128(b[i], k);
+#define AES_NI_LAST(i)                                                     \
+  b[i] = _mm_aesenclast_si128(b[i], k);                                    \
+  _mm_storeu_si128((__m128i *)(output + AES_BLOCK * (i)),                  \
+    _mm_xor_si128(b[i],                                                    \
+      _mm_loadu_si128((const __m128i *)(input + AES_BLOCK * (i)))));
+
+/**
+ * @brief Encrypt 8 whole blocks, AES-NI.
+ *
+ * The 8 blocks are independent, each round issues 8 AESENC back to back
+ * and the CPU pipelines them.
+ *
+ * @param w round keys
+ * @param hi high half of the counter of the first block
+ * @param lo low half of the counter of the first block
+ * @param output 128 output bytes
+ * @param input 128 input bytes
+ */
+
+AES_NI
+static void aes_x8_ni(const uint32_t w[AES_WORDS], uint64_t hi,
+                      uint64_t lo, uint8_t *output, const uint8_t *input)
+{
+  const __m128i *rk = (const __m128i *)w;
+  const __m128i rev = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                    7, 6, 5, 4, 3, 2, 1, 0);
+  __m128i k = _mm_loadu_si128(rk);
+  __m128i b[8];
+  unsigned r;
+
+  AES_EACH8(AES_NI_FIRST)
+
+  for (r = 1; r < AES_ROUNDS; r++)
+    {
+      k = _mm_loadu_si128(rk + r);
+      AES_EACH8(AES_NI_ROUND)
+    }
+
+  k = _mm_loadu_si128(rk + AES_ROUNDS);
+  AES_EACH8(AES_NI_LAST)
+}
+
+/* Steps of aes_x16_vaes() for register i, blocks 4 * i to 4 * i + 3.
+ * Only the low counter words, the even lanes, move.
+ */
+
+#define AES_VAES_FIRST(i)                                                  \
+  b[i] = _mm512_xor_si512(_mm512_shuffle_epi8(                             \
+           _mm512_add_epi64(c, _mm512_maskz_set1_epi64(0x55, 4 * (i))),    \
+           rev), k);
+#define AES_VAES_ROUND(i) \
+  b[i] = _mm512_aesenc_epi128(b[i], k);
+#define AES_VAES_LAST(i)                                                   \
+  b[i] = _mm512_aesenclast_epi128(b[i], k);                                \
+  _mm512_storeu_si512(output + 4 * AES_BLOCK * (i),                        \
+    _mm512_xor_si512(b[i],                                                 \
+      _mm512_loadu_si512(input + 4 * AES_BLOCK * (i))));
+
+/**
+ * @brief Encrypt 16 whole blocks, VAES on 4 registers of 4 blocks.
+ *
+ * The low counter word must not wrap within the 16 blocks.
+ *
+ * @param w round keys
+ * @param hi high half of the counter of the first block
+ * @param lo low half of the counter of the first block
+ * @param output 256 output bytes
+ * @param input 256 input bytes
+ */
+
+AES_VAES
+static void aes_x16_vaes(const uint32_t w[AES_WORDS], uint64_t hi,
+                         uint64_t lo, uint8_t *output,
+                         const uint8_t *input)
+{
+  const __m128i *rk = (const __m128i *)w;
+  const __m512i rev = _mm512_broadcast_i32x4(
+                        _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                      7, 6, 5, 4, 3, 2, 1, 0));
+  const __m512i c = _mm512_set_epi64(hi, lo + 3, hi, lo + 2,
+                                     hi, lo + 1, hi, lo);
+  __m512i k = _mm512_broadcast_i32x4(_mm_loadu_si128(rk));
+  __m512i b[4];
+  unsigned r;
+
+  AES_EACH4(AES_VAES_FIRST, 0)
+
+  for (r = 1; r < AES_ROUNDS; r++)
+    {
+      k = _mm512_broadcast_i32x4(_mm_loadu_si128(rk + r));
+      AES_EACH4(AES_VAES_ROUND, 0)
+    }
+
+  k = _mm512_broadcast_i32x4(_mm_loadu_si128(rk + AES_ROUNDS));
+  AES_EACH4(AES_VAES_LAST, 0)
+}
+
+#endif /* AES_X86 */
+
+/**
+ * @brief Get the most blocks the CPU computes at once: 16 with VAES, 8
+ *        with AES-NI, 4 with the bitsliced kernel.
+ */
+
+static unsigned aes_lanes(void)
+{
+#if defined(AES_X86) && !defined(CRYPT_FREESTANDING)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("aes"))
+    {
+      return 16;
+    }
+
+  if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3"))
+    {
+      return 8;
+    }
+
+  return 4;
+#elif defined(AES_X86) && defined(__VAES__) && defined(__AVX512BW__)
+  return 16;
+#elif defined(AES_X86) && defined(__AES__) && defined(__SSSE3__)
+  return 8;
+#else
+  return 4;
+#endif
+}
+
+/**
+ * @brief Expand the key, and split the round keys in bit planes for the
+ *        bitsliced kernel.
+ *
+ * Run on every call, see the top of the file.
+ *
+ * @param sched round keys to fill
+ * @param key the 32-byte key
+ * @param lanes result of aes_lanes()
+ */
+
+static void aes_setup(struct aes_schedule *sched, const uint8_t *key,
+                      unsigned lanes)
+{
+  uint8_t rk[4 * AES_BLOCK];
+  uint64_t q[8];
+  uint32_t rcon = 1;
+  uint32_t t;
+  unsigned i;
+  unsigned n;
+  unsigned k;
+  unsigned b;
+
+#ifdef AES_X86
+  if (lanes > 4)
+    {
+      aes_expand_ni(sched->w, key);
+      return;
+    }
+#else
+  (void)lanes;
+#endif
+
+  for (i = 0; i < 8; i++)
+    {
+      sched->w[i] = load32_le(key + 4 * i);
+    }
+
+  /* RotWord of a little endian word is a right rotation */
+
+  for (i = 8; i < AES_WORDS; i++)
+    {
+      t = sched->w[i - 1];
+      if (i % 8 == 0)
+        {
+          t = aes_subword_ct(t >> 8 | t << 24) ^ rcon;
+          rcon <<= 1;
+        }
+      else if (i % 8 == 4)
+        {
+          t = aes_subword_ct(t);
+        }
+
+      sched->w[i] = sched->w[i - 8] ^ t;
+    }
+
+  /* 4 round keys split at once, then each one copied to the 4 blocks of
+   * its planes
+   */
+
+  for (i = 0; i <= AES_ROUNDS; i += 4)
+    {
+      n = AES_ROUNDS + 1 - i < 4 ? AES_ROUNDS + 1 - i : 4;
+
+      memset(rk, 0, sizeof(rk));
+      memcpy(rk, sched->w + 4 * i, n * AES_BLOCK);
+      aes_pack(q, rk);
+
+      for (k = 0; k < n; k++)
+        {
+          for (b = 0; b < 8; b++)
+            {
+              sched->q[i + k][b] = AES_LANES(q[b] >> (16 * k) & 0xffff);
+            }
+        }
+    }
+
+  crypt_wipe(rk, sizeof(rk));
+  crypt_wipe(q, sizeof(q));
+}
+
+/**
+ * @brief Compute the keystream of 'nblocks' blocks, up to 4.
+ *
+ * @param sched round keys
+ * @param lanes result of aes_lanes()
+ * @param hi high half of the counter of the first block
+ * @param lo low half of the counter of the first block
+ * @param ks 64 bytes, the first 16 * nblocks are the keystream
+ * @param nblocks amount of blocks
+ */
+
+static void aes_keystream(const struct aes_schedule *sched, unsigned lanes,
+                          uint64_t hi, uint64_t lo,
+                          uint8_t ks[4 * AES_BLOCK], unsigned nblocks)
+{
+#ifdef AES_X86
+  unsigned i;
+
+  if (lanes > 4)
+    {
+      for (i = 0; i < nblocks; i++)
+        {
+          aes_x1_ni(sched->w, hi, lo, ks + AES_BLOCK * i);
+          aes_add(&hi, &lo, 1);
+        }
+
+      return;
+    }
+#else
+  (void)lanes;
+#endif
+
+  (void)nblocks;
+  aes_x4_ct(sched->q, hi, lo, ks);
+}
+
+/**
+ * @brief Encrypt 'length' bytes from keystream position 'offset'.
+ *
+ * @param context context with the key and optional initial counter
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset keystream position of the first byte
+ *
+ * @return Success (OK = 0), -EINVAL for another key length.
+ */
+
+static int aes_crypt(const struct crypt_context *context,
+                     uint8_t *output, const uint8_t *input,
+                     size_t length, uint64_t offset)
+{
+  struct aes_schedule sched;
+  uint32_t ksw[4 * AES_BLOCK / 4];
+  uint8_t *ks = (uint8_t *)ksw;
+  uint64_t hi = 0;
+  uint64_t lo = 0;
+  unsigned pos = offset % AES_BLOCK;
+  unsigned lanes;
+  size_t n;
+  size_t i;
+
+  if (context->keylen != CRYPT_AES256_KEY &&
+      context->keylen != CRYPT_AES256_KEY + CRYPT_AES256_IV)
+    {
+      return -EINVAL;
+    }
+
+  if (context->keylen == CRYPT_AES256_KEY + CRYPT_AES256_IV)
+    {
+      hi = load64_be(context->key + CRYPT_AES256_KEY);
+      lo = load64_be(context->key + CRYPT_AES256_KEY + 8);
+    }
+
+  aes_add(&hi, &lo, offset / AES_BLOCK);
+
+  lanes = aes_lanes();
+  aes_setup(&sched, context->key, lanes);
+
+  /* The rest of a block entered in the middle */
+
+  if (pos > 0 && length > 0)
+    {
+      n = AES_BLOCK - pos < length ? AES_BLOCK - pos : length;
+
+      aes_keystream(&sched, lanes, hi, lo, ks, 1);
+      aes_add(&hi, &lo, 1);
+      for (i = 0; i < n; i++)
+        {
+          output[i] = input[i] ^ ks[pos + i];
+        }
+
+      output += n;
+      input  += n;
+      length -= n;
+    }
+
+#ifdef AES_X86
+  if (lanes >= 16)
+    {
+      for (; length >= 16 * AES_BLOCK; length -= 16 * AES_BLOCK)
+        {
+          /* The wrap of the low word is left to the AES-NI kernel */
+
+          if (lo > UINT64_MAX - 16)
+            {
+              aes_x8_ni(sched.w, hi, lo, output, input);
+              aes_add(&hi, &lo, 8);
+              aes_x8_ni(sched.w, hi, lo, output + 8 * AES_BLOCK,
+                        input + 8 * AES_BLOCK);
+              aes_add(&hi, &lo, 8);
+            }
+          else
+            {
+              aes_x16_vaes(sched.w, hi, lo, output, input);
+              lo += 16;
+            }
+
+          output += 16 * AES_BLOCK;
+          input  += 16 * AES_BLOCK;
+        }
+    }
+
+  if (lanes >= 8)
+    {
+      for (; length >= 8 * AES_BLOCK; length -= 8 * AES_BLOCK)
+        {
+          aes_x8_ni(sched.w, hi, lo, output, input);
+          aes_add(&hi, &lo, 8);
+          output += 8 * AES_BLOCK;
+          input  += 8 * AES_BLOCK;
+        }
+    }
+#endif
+
+  /* Up to 4 blocks at a time, the last one maybe partial */
+
+  while (length > 0)
+    {
+      n = length < 4 * AES_BLOCK ? length : 4 * AES_BLOCK;
+
+      aes_keystream(&sched, lanes, hi, lo, ks, (n + AES_BLOCK - 1) /
+                    AES_BLOCK);
+      aes_add(&hi, &lo, (n + AES_BLOCK - 1) / AES_BLOCK);
+      for (i = 0; i < n; i++)
+        {
+          output[i] = input[i] ^ ks[i];
+        }
+
+      output += n;
+      input  += n;
+      length -= n;
+    }
+
+  crypt_wipe(&sched, lanes > 4 ? sizeof(sched.w) : sizeof(sched));
+  crypt_wipe(ksw, sizeof(ksw));
+
+  return 0;
+}
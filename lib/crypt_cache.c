@@ -0,0 +1,557 @@
+/****************************************************************************
+ * @file  lib/crypt_cache.c
+ *
+ * @brief Cache of decrypted pages for random reads of encrypted files.
+ *
+ * Pages are decrypted once with crypt_file_at() and kept in a LRU cache
+ * split in shards, each one with its own lock, so concurrent readers of
+ * different pages don't serialize. Sequential access is detected and
+ * served with a larger readahead.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "acrypt.h"
+#include "crypt_internal.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define CACHE_SHARDS     16 /* Independent locks, must be a power of two */
+#define CACHE_READAHEAD  8  /* Pages read at once on sequential access   */
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @struct cache_page_s
+ *  @brief One decrypted page of the file
+ *  @var cache_page_s::index
+ *  Member 'index' is the page number inside the file
+ *  @var cache_page_s::len
+ *  Member 'len' is the amount of valid bytes, less than a page at EOF
+ *  @var cache_page_s::hnext
+ *  Member 'hnext' is the next page in the same hash bucket
+ *  @var cache_page_s::prev
+ *  Member 'prev' is the more recently used page
+ *  @var cache_page_s::next
+ *  Member 'next' is the less recently used page
+ *  @var cache_page_s::data
+ *  Member 'data' is the decrypted content
+ */
+
+struct cache_page_s
+{
+  uint64_t index;               /* page number inside the file  */
+  size_t len;                   /* valid bytes, short at EOF    */
+  struct cache_page_s *hnext;   /* next page in the hash bucket */
+  struct cache_page_s *prev;    /* more recently used page      */
+  struct cache_page_s *next;    /* less recently used page      */
+  uint8_t data[CRYPT_CACHE_PAGE_SIZE];
+};
+
+/** @struct cache_shard_s
+ *  @brief A slice of the cache protected by its own lock
+ *  @var cache_shard_s::lock
+ *  Member 'lock' protects all the other members
+ *  @var cache_shard_s::buckets
+ *  Member 'buckets' is the hash table of cached pages
+ *  @var cache_shard_s::mask
+ *  Member 'mask' is the amount of buckets minus one
+ *  @var cache_shard_s::pages
+ *  Member 'pages' is the preallocated array of pages
+ *  @var cache_shard_s::npages
+ *  Member 'npages' is the capacity of the shard
+ *  @var cache_shard_s::nused
+ *  Member 'nused' is the amount of pages already in use
+ *  @var cache_shard_s::head
+ *  Member 'head' is the most recently used page
+ *  @var cache_shard_s::tail
+ *  Member 'tail' is the least recently used page
+ */
+
+struct cache_shard_s
+{
+  pthread_mutex_t lock;           /* protects all the members below  */
+  struct cache_page_s **buckets;  /* hash table of cached pages      */
+  unsigned mask;                  /* amount of buckets minus one     */
+  struct cache_page_s *pages;     /* preallocated array of pages     */
+  unsigned npages;                /* capacity of the shard           */
+  unsigned nused;                 /* pages already in use            */
+  struct cache_page_s *head;      /* most recently used page         */
+  struct cache_page_s *tail;      /* least recently used page        */
+};
+
+/** @struct crypt_cache
+ *  @brief Decrypted page cache of an encrypted file
+ *  @var crypt_cache::context
+ *  Member 'context' is a private copy of the user context
+ *  @var crypt_cache::fd
+ *  Member 'fd' is the file descriptor of the encrypted file
+ *  @var crypt_cache::last
+ *  Member 'last' is the last page read, used to detect sequential access
+ *  @var crypt_cache::shards
+ *  Member 'shards' are the independently locked parts of the cache
+ */
+
+struct crypt_cache
+{
+  struct crypt_context context;
+  int fd;
+  uint64_t last;
+  struct cache_shard_s shards[CACHE_SHARDS];
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Get the shard of a page and its hash bucket.
+ *
+ * @param cache pointer to the cache
+ * @param index page number inside the file
+ * @param bucket pointer to save the hash bucket
+ * @return Pointer to the shard
+ */
+
+static struct cache_shard_s *cache_shard(struct crypt_cache *cache,
+                                         uint64_t index,
+                                         struct cache_page_s ***bucket)
+{
+  struct cache_shard_s *shard = &cache->shards[index & (CACHE_SHARDS - 1)];
+
+  *bucket = &shard->buckets[(index / CACHE_SHARDS) & shard->mask];
+
+  return shard;
+}
+
+/**
+ * @brief Move a page to the head of the LRU list. Shard must be locked.
+ *
+ * @param shard pointer to the shard owning the page
+ * @param page pointer to the page
+ * @param linked true if the page is already in the list
+ */
+
+static void cache_touch(struct cache_shard_s *shard,
+                        struct cache_page_s *page, bool linked)
+{
+  if (linked)
+    {
+      if (shard->head == page)
+        {
+          return;
+        }
+
+      page->prev->next = page->next;
+      if (page->next != NULL)
+        {
+          page->next->prev = page->prev;
+        }
+      else
+        {
+          shard->tail = page->prev;
+        }
+    }
+
+  page->prev = NULL;
+  page->next = shard->head;
+  if (shard->head != NULL)
+    {
+      shard->head->prev = page;
+    }
+  else
+    {
+      shard->tail = page;
+    }
+
+  shard->head = page;
+}
+
+/**
+ * @brief Find a page in a bucket. Shard must be locked.
+ *
+ * @param bucket hash bucket of the page
+ * @param index page number inside the file
+ * @return Pointer to the page or NULL if not cached
+ */
+
+static struct cache_page_s *cache_find(struct cache_page_s **bucket,
+                                       uint64_t index)
+{
+  struct cache_page_s *page;
+
+  for (page = *bucket; page != NULL; page = page->hnext)
+    {
+      if (page->index == index)
+        {
+          return page;
+        }
+    }
+
+  return NULL;
+}
+
+/**
+ * @brief Copy bytes of a cached page to the user buffer.
+ *
+ * @param cache pointer to the cache
+ * @param index page number inside the file
+ * @param pos first byte to copy inside the page
+ * @param buf user buffer
+ * @param count maximum amount of bytes to copy
+ * @param eof pointer set to true if the page ends the file
+ * @return Amount of copied bytes or -ENOENT if the page isn't cached
+ */
+
+static ssize_t cache_copy(struct crypt_cache *cache, uint64_t index,
+                          size_t pos, uint8_t *buf, size_t count,
+                          bool *eof)
+{
+  struct cache_shard_s *shard;
+  struct cache_page_s **bucket;
+  struct cache_page_s *page;
+  ssize_t n = -ENOENT;
+
+  shard = cache_shard(cache, index, &bucket);
+
+  pthread_mutex_lock(&shard->lock);
+
+  page = cache_find(bucket, index);
+  if (page != NULL)
+    {
+      size_t len = page->len > pos ? page->len - pos : 0;
+
+      n = len < count ? len : count;
+
+      memcpy(buf, page->data + pos, n);
+      *eof = page->len < CRYPT_CACHE_PAGE_SIZE;
+
+      cache_touch(shard, page, true);
+    }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  return n;
+}
+
+/**
+ * @brief Decrypt a page into the cache, evicting the LRU if full.
+ *
+ * @param cache pointer to the cache
+ * @param index page number inside the file
+ * @param cipher encrypted content of the page
+ * @param len amount of valid bytes in the page
+ */
+
+static void cache_insert(struct crypt_cache *cache, uint64_t index,
+                         const uint8_t *cipher, size_t len)
+{
+  struct cache_shard_s *shard;
+  struct cache_page_s **bucket;
+  struct cache_page_s **pp;
+  struct cache_page_s *page;
+
+  shard = cache_shard(cache, index, &bucket);
+
+  pthread_mutex_lock(&shard->lock);
+
+  /* Another reader could have cached it in the meantime */
+
+  if (cache_find(bucket, index) != NULL)
+    {
+      pthread_mutex_unlock(&shard->lock);
+      return;
+    }
+
+  if (shard->nused < shard->npages)
+    {
+      page = &shard->pages[shard->nused++];
+    }
+  else
+    {
+      /* Evict the least recently used page */
+
+      page = shard->tail;
+      shard->tail = page->prev;
+      if (shard->tail != NULL)
+        {
+          shard->tail->next = NULL;
+        }
+      else
+        {
+          shard->head = NULL;
+        }
+
+      cache_shard(cache, page->index, &pp);
+      while (*pp != page)
+        {
+          pp = &(*pp)->hnext;
+        }
+
+      *pp = page->hnext;
+    }
+
+  page->index = index;
+  page->len   = len;
+  crypt_file_at(&cache->context, page->data, cipher, len,
+                index * CRYPT_CACHE_PAGE_SIZE);
+
+  page->hnext = *bucket;
+  *bucket = page;
+
+  cache_touch(shard, page, false);
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Read pages from the file and add them to the cache.
+ *
+ * @param cache pointer to the cache
+ * @param index first page to read
+ * @param npages amount of pages to read
+ * @return Amount of read bytes (0 at EOF) or a negative error
+ */
+
+static ssize_t cache_fill(struct crypt_cache *cache, uint64_t index,
+                          unsigned npages)
+{
+  size_t size = (size_t)npages * CRYPT_CACHE_PAGE_SIZE;
+  size_t total = 0;
+  uint8_t *cipher;
+  ssize_t ret;
+  size_t i;
+
+  cipher = malloc(size);
+  if (cipher == NULL)
+    {
+      return -ENOMEM;
+    }
+
+  /* I/O is done without holding any lock */
+
+  while (total < size)
+    {
+      ret = pread(cache->fd, cipher + total, size - total,
+                  index * CRYPT_CACHE_PAGE_SIZE + total);
+      if (ret < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+      if (ret < 0)
+        {
+          free(cipher);
+          return -errno;
+        }
+
+      if (ret == 0)
+        {
+          break;
+        }
+
+      total += ret;
+    }
+
+  for (i = 0; i < total; i += CRYPT_CACHE_PAGE_SIZE)
+    {
+      size_t len = total - i;
+
+      if (len > CRYPT_CACHE_PAGE_SIZE)
+        {
+          len = CRYPT_CACHE_PAGE_SIZE;
+        }
+
+      cache_insert(cache, index + i / CRYPT_CACHE_PAGE_SIZE,
+                   cipher + i, len);
+    }
+
+  free(cipher);
+
+  return total;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Create a decrypted page cache for an encrypted file.
+ *
+ * @param cache pointer to save the new cache
+ * @param context key context used to decrypt, it is copied
+ * @param fd file descriptor of the encrypted file, not owned by the cache
+ * @param maxpages maximum amount of pages kept in memory
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_cache_open(struct crypt_cache **cache,
+                     const struct crypt_context *context, int fd,
+                     size_t maxpages)
+{
+  struct crypt_cache *c;
+  unsigned npages;
+  unsigned nbuckets;
+  int i;
+
+  if (cache == NULL || context == NULL || context->key == NULL ||
+      context->keylen <= 0 || fd < 0)
+    {
+      return -EINVAL;
+    }
+
+  c = calloc(1, sizeof(struct crypt_cache));
+  if (c == NULL)
+    {
+      return -ENOMEM;
+    }
+
+  /* Keep our own copy of the key, user context could go away */
+
+  c->context.key = malloc(context->keylen);
+  if (c->context.key == NULL)
+    {
+      free(c);
+      return -ENOMEM;
+    }
+
+  memcpy(c->context.key, context->key, context->keylen);
+  c->context.keylen = context->keylen;
+  c->context.engine = context->engine;
+  c->fd   = fd;
+  c->last = UINT64_MAX - 1;
+
+  npages = maxpages / CACHE_SHARDS > 0 ? maxpages / CACHE_SHARDS : 1;
+  for (nbuckets = 1; nbuckets < npages; nbuckets <<= 1);
+
+  for (i = 0; i < CACHE_SHARDS; i++)
+    {
+      struct cache_shard_s *shard = &c->shards[i];
+
+      pthread_mutex_init(&shard->lock, NULL);
+      shard->npages  = npages;
+      shard->mask    = nbuckets - 1;
+      shard->buckets = calloc(nbuckets, sizeof(struct cache_page_s *));
+      shard->pages   = malloc(npages * sizeof(struct cache_page_s));
+    }
+
+  for (i = 0; i < CACHE_SHARDS; i++)
+    {
+      if (c->shards[i].buckets == NULL || c->shards[i].pages == NULL)
+        {
+          crypt_cache_close(c);
+          return -ENOMEM;
+        }
+    }
+
+  *cache = c;
+
+  return 0;
+}
+
+/**
+ * @brief Read decrypted data of the file at a given offset.
+ *
+ * @param cache pointer to the cache
+ * @param buf buffer to save the decrypted data
+ * @param count amount of bytes to read
+ * @param offset file offset of the first byte
+ *
+ * @return Amount of read bytes, less than count at EOF, or negative errno.
+ */
+
+ssize_t crypt_cache_pread(struct crypt_cache *cache, void *buf,
+                          size_t count, uint64_t offset)
+{
+  uint8_t *out = buf;
+  size_t done = 0;
+
+  while (done < count)
+    {
+      uint64_t index = (offset + done) / CRYPT_CACHE_PAGE_SIZE;
+      size_t pos = (offset + done) % CRYPT_CACHE_PAGE_SIZE;
+      uint64_t prev;
+      bool eof = false;
+      ssize_t n;
+
+      prev = __atomic_exchange_n(&cache->last, index, __ATOMIC_RELAXED);
+
+      n = cache_copy(cache, index, pos, out + done, count - done, &eof);
+      if (n == -ENOENT)
+        {
+          /* Miss: read ahead more pages if the access is sequential */
+
+          n = cache_fill(cache, index,
+                         index == prev + 1 ? CACHE_READAHEAD : 1);
+          if (n < 0)
+            {
+              return done > 0 ? (ssize_t)done : n;
+            }
+
+          if (n == 0)
+            {
+              break;
+            }
+
+          continue;
+        }
+
+      done += n;
+      if (eof || n == 0)
+        {
+          break;
+        }
+    }
+
+  return done;
+}
+
+/**
+ * @brief Release the cache and wipe the decrypted pages.
+ *
+ * @param cache pointer to the cache, the file descriptor is not closed
+ */
+
+void crypt_cache_close(struct crypt_cache *cache)
+{
+  int i;
+
+  if (cache == NULL)
+    {
+      return;
+    }
+
+  for (i = 0; i < CACHE_SHARDS; i++)
+    {
+      struct cache_shard_s *shard = &cache->shards[i];
+
+      if (shard->pages != NULL)
+        {
+          crypt_wipe(shard->pages,
+                     shard->npages * sizeof(struct cache_page_s));
+          free(shard->pages);
+        }
+
+      free(shard->buckets);
+      pthread_mutex_destroy(&shard->lock);
+    }
+
+  crypt_wipe(cache->context.key, cache->context.keylen);
+  free(cache->context.key);
+  free(cache);
+}
@@ -0,0 +1,603 @@
+/****************************************************************************
+ * @file  lib/crypt_chacha.c
+ *
+ * @brief ChaCha20 engine, see crypt_engine_chacha20.
+ *
+ * The original ChaCha20 of D. J. Bernstein: 64-bit block counter and
+ * 64-bit nonce, so keystream position 'offset' is byte offset % 64 of
+ * block offset / 64 and any position is reached without computing the
+ * ones before it. The key material of the context is the 32-byte key,
+ * optionally followed by the 8-byte nonce (0 when missing).
+ *
+ * Blocks are computed 4, 8 or 16 at a time, one per 32-bit lane of a
+ * vector: SSE2, AVX2 and AVX-512 on x86-64, 4 lanes of the generic GCC
+ * vectors elsewhere. On x86-64 the widest kernel the CPU runs is picked
+ * at run time, in the freestanding profile at build time.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+#  include <immintrin.h>
+#endif
+
+#include "acrypt.h"
+#include "crypt_internal.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define CHACHA_BLOCK  64
+#define CHACHA_ROUNDS 20
+
+#if defined(__x86_64__)
+#  define CHACHA_X86
+#  define CHACHA_AVX2   __attribute__((target("avx2")))
+#  define CHACHA_AVX512 __attribute__((target("avx512f")))
+#endif
+
+#define CHACHA_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_ROT16(v)   CHACHA_ROTL(v, 16)
+#define CHACHA_ROT8(v)    CHACHA_ROTL(v, 8)
+
+/* Works the same on words and on vectors of words, 'rot16' and 'rot8'
+ * let a kernel use a byte shuffle for those two.
+ */
+
+#define CHACHA_QUARTER(a, b, c, d, rot16, rot8) \
+  a += b; d ^= a; d = rot16(d);                 \
+  c += d; b ^= c; b = CHACHA_ROTL(b, 12);       \
+  a += b; d ^= a; d = rot8(d);                  \
+  c += d; b ^= c; b = CHACHA_ROTL(b, 7);
+
+#define CHACHA_DOUBLE(x, rot16, rot8)                        \
+  CHACHA_QUARTER(x[0], x[4], x[8],  x[12], rot16, rot8)      \
+  CHACHA_QUARTER(x[1], x[5], x[9],  x[13], rot16, rot8)      \
+  CHACHA_QUARTER(x[2], x[6], x[10], x[14], rot16, rot8)      \
+  CHACHA_QUARTER(x[3], x[7], x[11], x[15], rot16, rot8)      \
+  CHACHA_QUARTER(x[0], x[5], x[10], x[15], rot16, rot8)      \
+  CHACHA_QUARTER(x[1], x[6], x[11], x[12], rot16, rot8)      \
+  CHACHA_QUARTER(x[2], x[7], x[8],  x[13], rot16, rot8)      \
+  CHACHA_QUARTER(x[3], x[4], x[9],  x[14], rot16, rot8)
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/* Vectors of 4, 8 and 16 words, lane i works on block counter + i */
+
+typedef uint32_t chacha_v4 __attribute__((vector_size(16)));
+typedef uint32_t chacha_v8 __attribute__((vector_size(32)));
+typedef uint32_t chacha_v16 __attribute__((vector_size(64)));
+
+/****************************************************************************
+ * Private Function Prototypes
+ ****************************************************************************/
+
+static int chacha_crypt(const struct crypt_context *context,
+                        uint8_t *output, const uint8_t *input,
+                        size_t length, uint64_t offset);
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+const struct crypt_engine crypt_engine_chacha20 =
+{
+  "chacha20",
+  chacha_crypt
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static inline uint32_t load32_le(const uint8_t *p)
+{
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static inline void store32_le(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+/**
+ * @brief Fill the state of a key, words 12 and 13 are the block counter.
+ *
+ * @param state state to fill
+ * @param key key, then the nonce if 'keylen' has room for it
+ * @param keylen CRYPT_CHACHA20_KEY, with or without CRYPT_CHACHA20_NONCE
+ */
+
+static void chacha_setup(uint32_t state[16], const uint8_t *key,
+                         unsigned keylen)
+{
+  unsigned i;
+
+  /* "expand 32-byte k" */
+
+  state[0] = 0x61707865;
+  state[1] = 0x3320646e;
+  state[2] = 0x79622d32;
+  state[3] = 0x6b206574;
+
+  for (i = 0; i < 8; i++)
+    {
+      state[4 + i] = load32_le(key + 4 * i);
+    }
+
+  state[12] = 0;
+  state[13] = 0;
+  state[14] = 0;
+  state[15] = 0;
+
+  if (keylen == CRYPT_CHACHA20_KEY + CRYPT_CHACHA20_NONCE)
+    {
+      state[14] = load32_le(key + CRYPT_CHACHA20_KEY);
+      state[15] = load32_le(key + CRYPT_CHACHA20_KEY + 4);
+    }
+}
+
+/**
+ * @brief Compute one keystream block.
+ *
+ * @param state state of the key
+ * @param counter block counter
+ * @param ks the 64 keystream bytes
+ */
+
+static void chacha_block(const uint32_t state[16], uint64_t counter,
+                         uint8_t ks[CHACHA_BLOCK])
+{
+  uint32_t s[16];
+  uint32_t x[16];
+  unsigned i;
+
+  memcpy(s, state, sizeof(s));
+  s[12] = counter;
+  s[13] = counter >> 32;
+  memcpy(x, s, sizeof(x));
+
+  for (i = 0; i < CHACHA_ROUNDS; i += 2)
+    {
+      CHACHA_DOUBLE(x, CHACHA_ROT16, CHACHA_ROT8)
+    }
+
+  for (i = 0; i < 16; i++)
+    {
+      store32_le(ks + 4 * i, x[i] + s[i]);
+    }
+}
+
+#ifdef CHACHA_X86
+
+/* 4x4 transpose within each 128-bit lane: row k of the result holds
+ * words 0 to 3 of 'a', 'b', 'c', 'd' ... of block k, k + 4 and so on.
+ */
+
+#define CHACHA_TRANSPOSE(t, x, j, pfx)                                   \
+  do                                                                     \
+    {                                                                    \
+      __typeof__(t[0]) t0 = pfx##_unpacklo_epi32(x[j], x[j + 1]);        \
+      __typeof__(t[0]) t1 = pfx##_unpackhi_epi32(x[j], x[j + 1]);        \
+      __typeof__(t[0]) t2 = pfx##_unpacklo_epi32(x[j + 2], x[j + 3]);    \
+      __typeof__(t[0]) t3 = pfx##_unpackhi_epi32(x[j + 2], x[j + 3]);    \
+                                                                         \
+      t[0] = pfx##_unpacklo_epi64(t0, t2);                               \
+      t[1] = pfx##_unpackhi_epi64(t0, t2);                               \
+      t[2] = pfx##_unpacklo_epi64(t1, t3);                               \
+      t[3] = pfx##_unpackhi_epi64(t1, t3);                               \
+    }                                                                    \
+  while (0)
+
+/**
+ * @brief Encrypt 4 whole blocks, SSE2.
+ *
+ * @param state state of the key
+ * @param counter block counter of the first block
+ * @param output 256 output bytes
+ * @param input 256 input bytes
+ */
+
+static void chacha_x4(const uint32_t state[16], uint64_t counter,
+                      uint8_t *output, const uint8_t *input)
+{
+  const chacha_v4 lane = { 0, 1, 2, 3 };
+  chacha_v4 s[16];
+  chacha_v4 x[16];
+  __m128i w[16];
+  __m128i t[4];
+  unsigned i;
+  unsigned k;
+
+  for (i = 0; i < 16; i++)
+    {
+      s[i] = (chacha_v4){ } + state[i];
+    }
+
+  /* The carry of the low counter words goes to the high ones */
+
+  s[12] = (uint32_t)counter + lane;
+  s[13] = (uint32_t)(counter >> 32) - (chacha_v4)(s[12] < lane);
+
+  memcpy(x, s, sizeof(x));
+  for (i = 0; i < CHACHA_ROUNDS; i += 2)
+    {
+      CHACHA_DOUBLE(x, CHACHA_ROT16, CHACHA_ROT8)
+    }
+
+  for (i = 0; i < 16; i++)
+    {
+      w[i] = (__m128i)(x[i] + s[i]);
+    }
+
+  for (i = 0; i < 16; i += 4)
+    {
+      CHACHA_TRANSPOSE(t, w, i, _mm);
+
+      for (k = 0; k < 4; k++)
+        {
+          __m128i *o = (__m128i *)(output + 64 * k + 4 * i);
+          const __m128i *in = (const __m128i *)(input + 64 * k + 4 * i);
+
+          _mm_storeu_si128(o, _mm_xor_si128(t[k], _mm_loadu_si128(in)));
+        }
+    }
+}
+
+/* AVX2 has no rotate, but rotating by 16 or 8 bits is a byte shuffle */
+
+#define CHACHA_ROT16_AVX2(v) \
+  ((chacha_v8)_mm256_shuffle_epi8((__m256i)(v), rot16))
+#define CHACHA_ROT8_AVX2(v) \
+  ((chacha_v8)_mm256_shuffle_epi8((__m256i)(v), rot8))
+
+/**
+ * @brief Encrypt 8 whole blocks, AVX2.
+ *
+ * @param state state of the key
+ * @param counter block counter of the first block
+ * @param output 512 output bytes
+ * @param input 512 input bytes
+ */
+
+CHACHA_AVX2
+static void chacha_x8(const uint32_t state[16], uint64_t counter,
+                      uint8_t *output, const uint8_t *input)
+{
+  const chacha_v8 lane = { 0, 1, 2, 3, 4, 5, 6, 7 };
+  const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5,
+                                         10, 11, 8, 9, 14, 15, 12, 13,
+                                         2, 3, 0, 1, 6, 7, 4, 5,
+                                         10, 11, 8, 9, 14, 15, 12, 13);
+  const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6,
+                                        11, 8, 9, 10, 15, 12, 13, 14,
+                                        3, 0, 1, 2, 7, 4, 5, 6,
+                                        11, 8, 9, 10, 15, 12, 13, 14);
+  chacha_v8 s[16];
+  chacha_v8 x[16];
+  __m256i w[16];
+  __m256i t[4][4];
+  unsigned i;
+  unsigned k;
+
+  for (i = 0; i < 16; i++)
+    {
+      s[i] = (chacha_v8){ } + state[i];
+    }
+
+  s[12] = (uint32_t)counter + lane;
+  s[13] = (uint32_t)(counter >> 32) - (chacha_v8)(s[12] < lane);
+
+  memcpy(x, s, sizeof(x));
+  for (i = 0; i < CHACHA_ROUNDS; i += 2)
+    {
+      CHACHA_DOUBLE(x, CHACHA_ROT16_AVX2, CHACHA_ROT8_AVX2)
+    }
+
+  for (i = 0; i < 16; i++)
+    {
+      w[i] = (__m256i)(x[i] + s[i]);
+    }
+
+  for (i = 0; i < 4; i++)
+    {
+      CHACHA_TRANSPOSE(t[i], w, 4 * i, _mm256);
+    }
+
+  /* Lane 0 of t[i][k] is quarter i of block k, lane 1 of block k + 4 */
+
+  for (k = 0; k < 4; k++)
+    {
+      for (i = 0; i < 2; i++)
+        {
+          __m256i lo = _mm256_permute2x128_si256(t[2 * i][k],
+                                                 t[2 * i + 1][k], 0x20);
+          __m256i hi = _mm256_permute2x128_si256(t[2 * i][k],
+                                                 t[2 * i + 1][k], 0x31);
+          size_t pos = 64 * k + 32 * i;
+
+          _mm256_storeu_si256((__m256i *)(output + pos),
+            _mm256_xor_si256(lo,
+              _mm256_loadu_si256((const __m256i *)(input + pos))));
+          _mm256_storeu_si256((__m256i *)(output + pos + 256),
+            _mm256_xor_si256(hi,
+              _mm256_loadu_si256((const __m256i *)(input + pos + 256))));
+        }
+    }
+}
+
+/**
+ * @brief Encrypt 16 whole blocks, AVX-512.
+ *
+ * @param state state of the key
+ * @param counter block counter of the first block
+ * @param output 1024 output bytes
+ * @param input 1024 input bytes
+ */
+
+CHACHA_AVX512
+static void chacha_x16(const uint32_t state[16], uint64_t counter,
+                       uint8_t *output, const uint8_t *input)
+{
+  const chacha_v16 lane = { 0, 1, 2, 3, 4, 5, 6, 7,
+                            8, 9, 10, 11, 12, 13, 14, 15 };
+  chacha_v16 s[16];
+  chacha_v16 x[16];
+  __m512i w[16];
+  __m512i t[4][4];
+  unsigned i;
+  unsigned k;
+
+  for (i = 0; i < 16; i++)
+    {
+      s[i] = (chacha_v16){ } + state[i];
+    }
+
+  s[12] = (uint32_t)counter + lane;
+  s[13] = (uint32_t)(counter >> 32) - (chacha_v16)(s[12] < lane);
+
+  /* The shifts and or of CHACHA_ROTL become one vprold */
+
+  memcpy(x, s, sizeof(x));
+  for (i = 0; i < CHACHA_ROUNDS; i += 2)
+    {
+      CHACHA_DOUBLE(x, CHACHA_ROT16, CHACHA_ROT8)
+    }
+
+  for (i = 0; i < 16; i++)
+    {
+      w[i] = (__m512i)(x[i] + s[i]);
+    }
+
+  for (i = 0; i < 4; i++)
+    {
+      CHACHA_TRANSPOSE(t[i], w, 4 * i, _mm512);
+    }
+
+  /* Lane l of t[i][k] is quarter i of block k + 4 * l, a 4x4 transpose
+   * of the lanes gathers each block.
+   */
+
+  for (k = 0; k < 4; k++)
+    {
+      __m512i p0 = _mm512_shuffle_i32x4(t[0][k], t[1][k], 0x44);
+      __m512i p1 = _mm512_shuffle_i32x4(t[0][k], t[1][k], 0xee);
+      __m512i p2 = _mm512_shuffle_i32x4(t[2][k], t[3][k], 0x44);
+      __m512i p3 = _mm512_shuffle_i32x4(t[2][k], t[3][k], 0xee);
+      __m512i b[4];
+
+      b[0] = _mm512_shuffle_i32x4(p0, p2, 0x88);
+      b[1] = _mm512_shuffle_i32x4(p0, p2, 0xdd);
+      b[2] = _mm512_shuffle_i32x4(p1, p3, 0x88);
+      b[3] = _mm512_shuffle_i32x4(p1, p3, 0xdd);
+
+      for (i = 0; i < 4; i++)
+        {
+          size_t pos = 64 * (k + 4 * i);
+
+          _mm512_storeu_si512(output + pos,
+            _mm512_xor_si512(b[i], _mm512_loadu_si512(input + pos)));
+        }
+    }
+}
+
+#else /* CHACHA_X86 */
+
+/**
+ * @brief Encrypt 4 whole blocks, generic vectors.
+ *
+ * @param state state of the key
+ * @param counter block counter of the first block
+ * @param output 256 output bytes
+ * @param input 256 input bytes
+ */
+
+static void chacha_x4(const uint32_t state[16], uint64_t counter,
+                      uint8_t *output, const uint8_t *input)
+{
+  const chacha_v4 lane = { 0, 1, 2, 3 };
+  chacha_v4 s[16];
+  chacha_v4 x[16];
+  unsigned i;
+  unsigned k;
+
+  for (i = 0; i < 16; i++)
+    {
+      s[i] = (chacha_v4){ } + state[i];
+    }
+
+  s[12] = (uint32_t)counter + lane;
+  s[13] = (uint32_t)(counter >> 32) - (chacha_v4)(s[12] < lane);
+
+  memcpy(x, s, sizeof(x));
+  for (i = 0; i < CHACHA_ROUNDS; i += 2)
+    {
+      CHACHA_DOUBLE(x, CHACHA_ROT16, CHACHA_ROT8)
+    }
+
+  for (i = 0; i < 16; i++)
+    {
+      x[i] += s[i];
+    }
+
+  for (k = 0; k < 4; k++)
+    {
+      for (i = 0; i < 16; i++)
+        {
+          store32_le(output + 64 * k + 4 * i,
+                     load32_le(input + 64 * k + 4 * i) ^ x[i][k]);
+        }
+    }
+}
+
+#endif /* CHACHA_X86 */
+
+/**
+ * @brief Get the most blocks the CPU computes at once, 4, 8 or 16.
+ */
+
+static unsigned chacha_lanes(void)
+{
+#if defined(CHACHA_X86) && !defined(CRYPT_FREESTANDING)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f"))
+    {
+      return 16;
+    }
+
+  if (__builtin_cpu_supports("avx2"))
+    {
+      return 8;
+    }
+
+  return 4;
+#elif defined(CHACHA_X86) && defined(__AVX512F__)
+  return 16;
+#elif defined(CHACHA_X86) && defined(__AVX2__)
+  return 8;
+#else
+  return 4;
+#endif
+}
+
+/**
+ * @brief Encrypt 'length' bytes from keystream position 'offset'.
+ *
+ * @param context context with the key and optional nonce
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset keystream position of the first byte
+ *
+ * @return Success (OK = 0), -EINVAL for another key length.
+ */
+
+static int chacha_crypt(const struct crypt_context *context,
+                        uint8_t *output, const uint8_t *input,
+                        size_t length, uint64_t offset)
+{
+  uint32_t state[16];
+  uint32_t ksw[CHACHA_BLOCK / 4];
+  uint8_t *ks = (uint8_t *)ksw;
+  uint64_t counter = offset / CHACHA_BLOCK;
+  unsigned pos = offset % CHACHA_BLOCK;
+  unsigned lanes;
+  size_t n;
+  size_t i;
+
+  if (context->keylen != CRYPT_CHACHA20_KEY &&
+      context->keylen != CRYPT_CHACHA20_KEY + CRYPT_CHACHA20_NONCE)
+    {
+      return -EINVAL;
+    }
+
+  chacha_setup(state, context->key, context->keylen);
+  lanes = chacha_lanes();
+
+  /* The rest of a block entered in the middle */
+
+  if (pos > 0 && length > 0)
+    {
+      n = CHACHA_BLOCK - pos < length ? CHACHA_BLOCK - pos : length;
+
+      chacha_block(state, counter++, ks);
+      for (i = 0; i < n; i++)
+        {
+          output[i] = input[i] ^ ks[pos + i];
+        }
+
+      output += n;
+      input  += n;
+      length -= n;
+    }
+
+#ifdef CHACHA_X86
+  if (lanes >= 16)
+    {
+      for (; length >= 16 * CHACHA_BLOCK; length -= 16 * CHACHA_BLOCK)
+        {
+          chacha_x16(state, counter, output, input);
+          counter += 16;
+          output  += 16 * CHACHA_BLOCK;
+          input   += 16 * CHACHA_BLOCK;
+        }
+    }
+
+  if (lanes >= 8)
+    {
+      for (; length >= 8 * CHACHA_BLOCK; length -= 8 * CHACHA_BLOCK)
+        {
+          chacha_x8(state, counter, output, input);
+          counter += 8;
+          output  += 8 * CHACHA_BLOCK;
+          input   += 8 * CHACHA_BLOCK;
+        }
+    }
+#else
+  (void)lanes;
+#endif
+
+  for (; length >= 4 * CHACHA_BLOCK; length -= 4 * CHACHA_BLOCK)
+    {
+      chacha_x4(state, counter, output, input);
+      counter += 4;
+      output  += 4 * CHACHA_BLOCK;
+      input   += 4 * CHACHA_BLOCK;
+    }
+
+  /* Up to 3 blocks, the last one maybe partial */
+
+  while (length > 0)
+    {
+      n = length < CHACHA_BLOCK ? length : CHACHA_BLOCK;
+
+      chacha_block(state, counter++, ks);
+      for (i = 0; i < n; i++)
+        {
+          output[i] = input[i] ^ ks[i];
+        }
+
+      output += n;
+      input  += n;
+      length -= n;
+    }
+
+  crypt_wipe(state, sizeof(state));
+  crypt_wipe(ksw, sizeof(ksw));
+
+  return 0;
+}
@@ -0,0 +1,29 @@
+/****************************************************************************
+ * @file  lib/crypt_internal.h
+ *
+ * @brief Helpers shared by the libacrypt modules, not part of the API.
+ ****************************************************************************/
+
+#ifndef __CRYPT_INTERNAL_H
+#define __CRYPT_INTERNAL_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stddef.h>
+
+/****************************************************************************
+ * Public Function Prototypes
+ ****************************************************************************/
+
+/**
+ * @brief Clear key material or plaintext that must not outlive its use.
+ *
+ * @param buf buffer to clear, any alignment
+ * @param size amount of bytes, any length
+ */
+
+void crypt_wipe(void *buf, size_t size);
+
+#endif /* __CRYPT_INTERNAL_H */
@@ -0,0 +1,189 @@
+/****************************************************************************
+ * @file  lib/crypt_packet.c
+ *
+ * @brief Datagram encryption addressed by sequence number.
+ *
+ * Every packet uses the keystream at seq * CRYPT_PACKET_MAX, so packets
+ * can be decrypted independently, lost or reordered.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "acrypt.h"
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypt in place the part of an iovec array after 'skip' bytes.
+ *
+ * @param context current context state pointer
+ * @param iov array of buffers holding the datagram
+ * @param iovlen amount of buffers
+ * @param skip bytes to leave untouched at the start (the header)
+ * @param length total amount of valid bytes in the buffers
+ * @param offset keystream position of the first encrypted byte
+ */
+
+static void packet_iov(const struct crypt_context *context,
+                       struct iovec *iov, size_t iovlen, size_t skip,
+                       size_t length, uint64_t offset)
+{
+  size_t i;
+
+  for (i = 0; i < iovlen && length > 0; i++)
+    {
+      uint8_t *base = iov[i].iov_base;
+      size_t len = iov[i].iov_len < length ? iov[i].iov_len : length;
+
+      length -= len;
+
+      if (skip >= len)
+        {
+          skip -= len;
+          continue;
+        }
+
+      crypt_buffer_at(context, base + skip, base + skip, len - skip,
+                      offset);
+      offset += len - skip;
+      skip = 0;
+    }
+}
+
+/**
+ * @brief Gather the header of a datagram spread in an iovec array.
+ *
+ * @param iov array of buffers holding the datagram
+ * @param iovlen amount of buffers
+ * @param header buffer to save the CRYPT_PACKET_HEADER bytes
+ */
+
+static void packet_header(const struct iovec *iov, size_t iovlen,
+                          uint8_t *header)
+{
+  size_t done = 0;
+  size_t i;
+
+  for (i = 0; i < iovlen && done < CRYPT_PACKET_HEADER; i++)
+    {
+      size_t len = CRYPT_PACKET_HEADER - done;
+
+      if (len > iov[i].iov_len)
+        {
+          len = iov[i].iov_len;
+        }
+
+      memcpy(header + done, iov[i].iov_base, len);
+      done += len;
+    }
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypt the payload of the packet with sequence number 'seq'.
+ *
+ * @param context current context state pointer
+ * @param seq sequence number of the packet
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output, up to CRYPT_PACKET_MAX
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno,
+ *         -EOVERFLOW if 'seq' is above CRYPT_PACKET_SEQ_MAX.
+ */
+
+int crypt_packet(const struct crypt_context *context, uint64_t seq,
+                 uint8_t *output, const uint8_t *input, size_t length)
+{
+  if (length > CRYPT_PACKET_MAX)
+    {
+      return -EMSGSIZE;
+    }
+
+  /* Past it seq * CRYPT_PACKET_MAX wraps onto the keystream of another */
+
+  if (seq > CRYPT_PACKET_SEQ_MAX)
+    {
+      return -EOVERFLOW;
+    }
+
+  return crypt_buffer_at(context, output, input, length,
+                         seq * CRYPT_PACKET_MAX);
+}
+
+/**
+ * @brief Encrypt or decrypt in place a vector of datagrams.
+ *
+ * @param context current context state pointer
+ * @param msgs datagrams as filled by recvmmsg()
+ * @param vlen amount of datagrams
+ *
+ * @return Amount of processed datagrams or negative POSIX errno.
+ */
+
+int crypt_packet_mmsg(const struct crypt_context *context,
+                      struct mmsghdr *msgs, unsigned int vlen)
+{
+  uint8_t header[CRYPT_PACKET_HEADER];
+  unsigned int done = 0;
+  unsigned int i;
+  uint64_t seq;
+  int j;
+
+  if (context == NULL || context->key == NULL || context->keylen <= 0)
+    {
+      return -EINVAL;
+    }
+
+  for (i = 0; i < vlen; i++)
+    {
+      struct msghdr *hdr = &msgs[i].msg_hdr;
+      size_t length = msgs[i].msg_len;
+
+      /* Drop what can't be one of our packets */
+
+      if (length < CRYPT_PACKET_HEADER ||
+          length - CRYPT_PACKET_HEADER > CRYPT_PACKET_MAX)
+        {
+          msgs[i].msg_len = 0;
+          continue;
+        }
+
+      packet_header(hdr->msg_iov, hdr->msg_iovlen, header);
+
+      for (seq = 0, j = 0; j < CRYPT_PACKET_HEADER; j++)
+        {
+          seq = (seq << 8) | header[j];
+        }
+
+      /* Its keystream would wrap, see crypt_packet() */
+
+      if (seq > CRYPT_PACKET_SEQ_MAX)
+        {
+          msgs[i].msg_len = 0;
+          continue;
+        }
+
+      packet_iov(context, hdr->msg_iov, hdr->msg_iovlen,
+                 CRYPT_PACKET_HEADER, length, seq * CRYPT_PACKET_MAX);
+      done++;
+    }
+
+  return done;
+}
@@ -0,0 +1,167 @@
+/****************************************************************************
+ * @file  lib/crypt_pingpong.c
+ *
+ * @brief In place encryption of two buffers filled in turn by a DMA.
+ *
+ * The DMA interrupt calls crypt_pingpong_complete() for the buffer it
+ * just filled and goes on with the other one, the main loop or a task
+ * calls crypt_pingpong_poll() to encrypt it a chunk at a time. The two
+ * sides only share a 'full' flag per buffer, set by the first and cleared
+ * by the second with plain atomic stores, so there is no lock, no atomic
+ * read-modify-write that small cores lack, and nothing to allocate. Part
+ * of the freestanding profile.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdint.h>
+#include <errno.h>
+
+#include "acrypt.h"
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Check the public members and reset the private ones.
+ *
+ * @param pp ping-pong state, public members filled by the caller
+ * @param context key of the transfer
+ * @param offset keystream position of the first byte of buffer 0
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_pingpong_start(struct crypt_pingpong *pp,
+                         const struct crypt_context *context,
+                         uint64_t offset)
+{
+  int ret;
+
+  if (pp == NULL || pp->buffer[0] == NULL || pp->buffer[1] == NULL ||
+      pp->size == 0 || pp->ready == NULL)
+    {
+      return -EINVAL;
+    }
+
+  ret = crypt_stream_init(&pp->stream, context, offset);
+  if (ret < 0)
+    {
+      return ret;
+    }
+
+  if (pp->chunk == 0 || pp->chunk > pp->size)
+    {
+      pp->chunk = pp->size;
+    }
+
+  pp->length[0] = 0;
+  pp->length[1] = 0;
+  pp->pos       = 0;
+  pp->current   = 0;
+  __atomic_store_n(&pp->full[0], 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&pp->full[1], 0, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/**
+ * @brief Hand a filled buffer over, from the DMA interrupt.
+ *
+ * @param pp ping-pong state
+ * @param index buffer filled, 0 or 1
+ * @param length bytes in the buffer, at most 'size'
+ *
+ * @return Success (OK = 0), -EBUSY if the buffer was not given back yet
+ *         (overrun, it was filled while still in use) or -EINVAL.
+ */
+
+int crypt_pingpong_complete(struct crypt_pingpong *pp, unsigned index,
+                            size_t length)
+{
+  if (index > 1 || length > pp->size)
+    {
+      return -EINVAL;
+    }
+
+  /* Only this side sets the flag, only crypt_pingpong_poll() clears it */
+
+  if (__atomic_load_n(&pp->full[index], __ATOMIC_ACQUIRE))
+    {
+      return -EBUSY;
+    }
+
+  pp->length[index] = length;
+  __atomic_store_n(&pp->full[index], 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/**
+ * @brief Check whether the DMA may fill a buffer.
+ *
+ * @param pp ping-pong state
+ * @param index buffer, 0 or 1
+ *
+ * @return 1 if the buffer is free, 0 if it waits or is being encrypted.
+ */
+
+int crypt_pingpong_idle(const struct crypt_pingpong *pp, unsigned index)
+{
+  return !__atomic_load_n(&pp->full[index & 1], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Encrypt the next chunk of the filled buffers.
+ *
+ * Buffers are taken in turn, 0 first, so the keystream goes on from one
+ * to the next. Once a buffer is encrypted it is passed to 'ready' and
+ * given back to the DMA when 'ready' returns.
+ *
+ * @param pp ping-pong state
+ *
+ * @return Bytes encrypted, 0 if no buffer is filled, or negative errno.
+ */
+
+int crypt_pingpong_poll(struct crypt_pingpong *pp)
+{
+  unsigned cur = pp->current;
+  uint8_t *data = pp->buffer[cur];
+  size_t length;
+  size_t n;
+  int ret;
+
+  if (!__atomic_load_n(&pp->full[cur], __ATOMIC_ACQUIRE))
+    {
+      return 0;
+    }
+
+  length = pp->length[cur];
+  n = length - pp->pos;
+  if (n > pp->chunk)
+    {
+      n = pp->chunk;
+    }
+
+  ret = crypt_stream_update(&pp->stream, data + pp->pos, data + pp->pos,
+                            n);
+  if (ret < 0)
+    {
+      return ret;
+    }
+
+  pp->pos += n;
+  if (pp->pos == length)
+    {
+      pp->ready(pp, data, length);
+
+      pp->pos     = 0;
+      pp->current = cur ^ 1;
+      __atomic_store_n(&pp->full[cur], 0, __ATOMIC_RELEASE);
+    }
+
+  return n;
+}
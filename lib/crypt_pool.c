@@ -0,0 +1,304 @@
+/****************************************************************************
+ * @file  lib/crypt_pool.c
+ *
+ * @brief Worker pool running encryptions off the calling thread.
+ *
+ * Jobs wait in one FIFO queue. A worker takes the next CRYPT_POOL_SLICE
+ * bytes of the job at its head, which leaves the queue once all its bytes
+ * are given out, so several workers share a large job and small jobs are
+ * not stuck behind it for long. The keystream of a slice only depends on
+ * its position, the slices of a job can finish in any order.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "acrypt.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define POOL_MAX_THREADS  256 /* Upper bound of the default size */
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_work = PTHREAD_COND_INITIALIZER;
+static struct crypt_job *g_head;     /* next job to take slices from */
+static struct crypt_job *g_tail;     /* last queued job              */
+static unsigned g_nthreads;          /* running workers, 0 before    */
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Worker loop: run slices of the queued jobs forever.
+ *
+ * @param arg unused
+ * @return Never returns
+ */
+
+static void *pool_worker(void *arg)
+{
+  struct crypt_job *job;
+  size_t pos;
+  size_t len;
+  bool last;
+  int ret;
+
+  (void)arg;
+
+  for (; ; )
+    {
+      pthread_mutex_lock(&g_lock);
+
+      while (g_head == NULL)
+        {
+          pthread_cond_wait(&g_work, &g_lock);
+        }
+
+      /* Claim the next slice, the job leaves the queue with its last one */
+
+      job = g_head;
+      pos = job->claimed;
+      len = job->length - pos;
+      if (len > CRYPT_POOL_SLICE)
+        {
+          len = CRYPT_POOL_SLICE;
+        }
+
+      job->claimed += len;
+      job->pending++;
+
+      if (job->claimed == job->length)
+        {
+          g_head = job->next;
+          if (g_head == NULL)
+            {
+              g_tail = NULL;
+            }
+        }
+
+      pthread_mutex_unlock(&g_lock);
+
+      ret = crypt_buffer_at(job->context, job->output + pos,
+                            job->input + pos, len, job->offset + pos);
+
+      pthread_mutex_lock(&g_lock);
+
+      if (ret < 0 && job->result == 0)
+        {
+          job->result = ret;
+        }
+
+      last = --job->pending == 0 && job->claimed == job->length;
+
+      pthread_mutex_unlock(&g_lock);
+
+      /* Nobody else touches the job now, 'done' may free it */
+
+      if (last)
+        {
+          job->done(job, job->result);
+        }
+    }
+
+  return NULL;
+}
+
+/**
+ * @brief Start the workers, with the lock held.
+ *
+ * @param nthreads amount of workers, 0 for one per online CPU
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int pool_start_locked(unsigned nthreads)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  long ncpus;
+  int ret = 0;
+
+  if (nthreads == 0)
+    {
+      ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+      nthreads = ncpus < 1 ? 1 :
+                 ncpus > POOL_MAX_THREADS ? POOL_MAX_THREADS : ncpus;
+    }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  while (g_nthreads < nthreads)
+    {
+      ret = pthread_create(&thread, &attr, pool_worker, NULL);
+      if (ret != 0)
+        {
+          fprintf(stderr, "Error: failed to start a pool worker\n");
+          break;
+        }
+
+      g_nthreads++;
+    }
+
+  pthread_attr_destroy(&attr);
+
+  /* Some workers are enough to make progress */
+
+  return g_nthreads > 0 ? 0 : -ret;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Start the worker pool with a given amount of threads.
+ *
+ * @param nthreads amount of workers, 0 for one per online CPU
+ * @return Success (OK = 0), -EBUSY if the pool runs or a negative error
+ */
+
+int crypt_pool_start(unsigned nthreads)
+{
+  int ret = -EBUSY;
+
+  pthread_mutex_lock(&g_lock);
+
+  if (g_nthreads == 0)
+    {
+      ret = pool_start_locked(nthreads);
+    }
+
+  pthread_mutex_unlock(&g_lock);
+
+  return ret;
+}
+
+/**
+ * @brief Queue jobs for the worker pool, waking the workers once.
+ *
+ * @param jobs array of jobs to queue
+ * @param njobs amount of jobs
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_pool_submit(struct crypt_job **jobs, unsigned njobs)
+{
+  const struct crypt_context *context;
+  unsigned i;
+  int ret = 0;
+
+  for (i = 0; i < njobs; i++)
+    {
+      context = jobs[i]->context;
+      if (context == NULL || context->key == NULL || context->keylen <= 0 ||
+          jobs[i]->done == NULL)
+        {
+          return -EINVAL;
+        }
+    }
+
+  if (njobs == 0)
+    {
+      return 0;
+    }
+
+  pthread_mutex_lock(&g_lock);
+
+  if (g_nthreads == 0)
+    {
+      ret = pool_start_locked(0);
+    }
+
+  if (ret == 0)
+    {
+      for (i = 0; i < njobs; i++)
+        {
+          jobs[i]->next    = NULL;
+          jobs[i]->claimed = 0;
+          jobs[i]->pending = 0;
+          jobs[i]->result  = 0;
+
+          if (g_tail != NULL)
+            {
+              g_tail->next = jobs[i];
+            }
+          else
+            {
+              g_head = jobs[i];
+            }
+
+          g_tail = jobs[i];
+        }
+
+      pthread_cond_broadcast(&g_work);
+    }
+
+  pthread_mutex_unlock(&g_lock);
+
+  return ret;
+}
+
+/**
+ * @brief Remove from the queue a job no worker started yet.
+ *
+ * @param job job given to crypt_pool_submit()
+ * @return Success (OK = 0) or -EBUSY if it started or finished
+ */
+
+int crypt_pool_cancel(struct crypt_job *job)
+{
+  struct crypt_job *prev = NULL;
+  struct crypt_job *cur;
+  int ret = -EBUSY;
+
+  pthread_mutex_lock(&g_lock);
+
+  for (cur = g_head; cur != NULL; prev = cur, cur = cur->next)
+    {
+      if (cur != job)
+        {
+          continue;
+        }
+
+      if (job->claimed == 0 && job->pending == 0)
+        {
+          if (prev != NULL)
+            {
+              prev->next = job->next;
+            }
+          else
+            {
+              g_head = job->next;
+            }
+
+          if (g_tail == job)
+            {
+              g_tail = prev;
+            }
+
+          ret = 0;
+        }
+
+      break;
+    }
+
+  pthread_mutex_unlock(&g_lock);
+
+  return ret;
+}
@@ -2,25 +2,268 @@
  * @file  src/crypt.c
  *
  * @brief Implementation of libacrypt functions.
+ *
+ * Nothing here allocates memory or prints, so this file, with the engines
+ * and the ping-pong buffers, is also the freestanding profile of the
+ * library (-DCRYPT_FREESTANDING), for MCUs.
  ****************************************************************************/
 
 /****************************************************************************
  * Included Files
  ****************************************************************************/
 
-#include <stdio.h>
-#include <stdlib.h>
+#ifndef CRYPT_FREESTANDING
+#  include <stdio.h>
+#endif
 #include <string.h>
-#include <unistd.h>
 #include <stdint.h>
 #include <errno.h>
 
 #include "acrypt.h"
+#include "crypt_internal.h"
 
 #define X(v) #v
 #define VERSION(a,b,c) X(a) "." X(b) "." X(c)
 #define LIBACRYPT_VERSION  VERSION(0,0,1)
 
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+/* Longest run of whole key passes the word kernel keeps on the stack,
+ * twice. Keys longer than this use the byte loop.
+ */
+
+#ifndef CRYPT_SWAR_STRIPE
+#  define CRYPT_SWAR_STRIPE 256
+#endif
+
+/* Bytes of a machine word, 4 or 8, and their low 7 and high bits */
+
+#define SWAR_SIZE  sizeof(uintptr_t)
+#define SWAR_LOW   ((uintptr_t)-1 / 0xff * 0x7f)
+#define SWAR_HIGH  ((uintptr_t)-1 / 0xff * 0x80)
+
+/****************************************************************************
+ * Private Function Prototypes
+ ****************************************************************************/
+
+static int crypt_xor(const struct crypt_context *context, uint8_t *output,
+                     const uint8_t *input, size_t length, uint64_t offset);
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+/* The original cipher, also used when a context has no engine */
+
+const struct crypt_engine crypt_engine_xor =
+{
+  "xor",
+  crypt_xor
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* Engines known by crypt_engine_find(), the built-in ones first */
+
+static const struct crypt_engine *g_engines[CRYPT_ENGINE_MAX] =
+{
+  &crypt_engine_xor,
+  &crypt_engine_chacha20,
+  &crypt_engine_aes256_ctr
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Add two words byte by byte, without carry between the bytes.
+ *
+ * @param a first word
+ * @param b second word
+ * @return Every byte of 'a' plus the same byte of 'b', modulo 256
+ */
+
+static inline uintptr_t swar_add(uintptr_t a, uintptr_t b)
+{
+  return ((a & SWAR_LOW) + (b & SWAR_LOW)) ^ ((a ^ b) & SWAR_HIGH);
+}
+
+/**
+ * @brief Encrypt 'length' bytes one at a time from keystream 'offset'.
+ *
+ * @param k key bytes
+ * @param keylen length of the key
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset keystream position of the first byte
+ */
+
+static void crypt_bytes(const uint8_t *k, unsigned keylen, uint8_t *output,
+                        const uint8_t *input, size_t length, uint64_t offset)
+{
+  unsigned i;
+  uint8_t step;
+  size_t cnt;
+
+  /* crypt_buffer() adds the index to a key byte every time it is used,
+   * so at 'offset' key byte i was already bumped (offset / keylen + 1)
+   * times. Only the low 8 bits of that count matter.
+   */
+
+  i    = offset % keylen;
+  step = offset / keylen + 1;
+
+  for (cnt = 0; cnt < length; cnt++)
+    {
+      output[cnt] = input[cnt] ^ (uint8_t)(k[i] + step * i);
+      if (++i == keylen)
+        {
+          i = 0;
+          step++;
+        }
+    }
+}
+
+/**
+ * @brief Encrypt 'length' bytes a machine word at a time.
+ *
+ * The keystream of a stripe of m whole key passes is built once. The next
+ * stripe is the same plus m times the key index of each byte, which is
+ * one byte-wise add per word, so the loop does no multiplication, no
+ * index wrap and no branch. Cores without SIMD still process 4 or 8
+ * bytes per step.
+ *
+ * @param k key bytes
+ * @param keylen length of the key, at most CRYPT_SWAR_STRIPE
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset keystream position of the first byte
+ */
+
+static void crypt_swar(const uint8_t *k, unsigned keylen, uint8_t *output,
+                       const uint8_t *input, size_t length, uint64_t offset)
+{
+  uintptr_t ks[CRYPT_SWAR_STRIPE / SWAR_SIZE + 1];
+  uintptr_t delta[CRYPT_SWAR_STRIPE / SWAR_SIZE + 1];
+  uint8_t *ksb = (uint8_t *)ks;
+  uint8_t *deltab = (uint8_t *)delta;
+  unsigned passes = CRYPT_SWAR_STRIPE / keylen;
+  unsigned stripe = passes * keylen;
+  unsigned words = stripe / SWAR_SIZE;
+  unsigned head = (keylen - offset % keylen) % keylen;
+  unsigned p;
+  unsigned i;
+  uintptr_t in;
+  uint8_t step;
+
+  /* Bytes up to the start of the next key pass */
+
+  if (head > length)
+    {
+      head = length;
+    }
+
+  crypt_bytes(k, keylen, output, input, head, offset);
+  output += head;
+  input  += head;
+  offset += head;
+  length -= head;
+
+  step = offset / keylen + 1;
+  for (p = 0, i = 0; p < stripe; p++)
+    {
+      ksb[p]    = k[i] + (uint8_t)(step + p / keylen) * i;
+      deltab[p] = passes * i;
+      if (++i == keylen)
+        {
+          i = 0;
+        }
+    }
+
+  while (length >= stripe)
+    {
+      for (p = 0; p < words; p++)
+        {
+          memcpy(&in, input + p * SWAR_SIZE, SWAR_SIZE);
+          in ^= ks[p];
+          memcpy(output + p * SWAR_SIZE, &in, SWAR_SIZE);
+          ks[p] = swar_add(ks[p], delta[p]);
+        }
+
+      for (p = words * SWAR_SIZE; p < stripe; p++)
+        {
+          output[p] = input[p] ^ ksb[p];
+          ksb[p] += deltab[p];
+        }
+
+      output += stripe;
+      input  += stripe;
+      length -= stripe;
+    }
+
+  /* The keystream of what is left is already at the front of 'ks' */
+
+  for (p = 0; p < length; p++)
+    {
+      output[p] = input[p] ^ ksb[p];
+    }
+}
+
+/**
+ * @brief Encrypt with the original cipher, see crypt_buffer_at().
+ *
+ * @param context context with a key
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset keystream position of the first byte
+ *
+ * @return Always 0, every key length is valid.
+ */
+
+static int crypt_xor(const struct crypt_context *context, uint8_t *output,
+                     const uint8_t *input, size_t length, uint64_t offset)
+{
+  unsigned keylen = context->keylen;
+
+  /* Building the stripe costs about two stripes of the byte loop */
+
+  if (keylen <= CRYPT_SWAR_STRIPE && length >= 2 * CRYPT_SWAR_STRIPE)
+    {
+      crypt_swar(context->key, keylen, output, input, length, offset);
+    }
+  else
+    {
+      crypt_bytes(context->key, keylen, output, input, length, offset);
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Compare two engine names.
+ *
+ * @return 1 if they are the same, 0 otherwise.
+ */
+
+static int engine_name_eq(const char *a, const char *b)
+{
+  while (*a != '\0' && *a == *b)
+    {
+      a++;
+      b++;
+    }
+
+  return *a == *b;
+}
+
 /****************************************************************************
  * Public Functions
  ****************************************************************************/
@@ -28,6 +271,8 @@
 /**
  * @brief Encrypt an 'input' data of 'length' bytes with a predefined key.
  *
+ * The same as crypt_buffer_at() from offset 0, the key is not copied.
+ *
  * @param context current context state pointer
  * @param output pointer to output buffer
  * @param input pointer to input buffer
@@ -39,54 +284,289 @@
 int crypt_buffer(struct crypt_context *context, uint8_t *output,
                  const uint8_t *input, unsigned int length)
 {
-  int i = 0;
-  int cnt;
-  uint8_t *k;
-  struct crypt_context *ctx;
+  int ret;
 
-  /* Create a new context to make our code reentrant */
+  ret = crypt_buffer_at(context, output, input, length, 0);
 
-  ctx = malloc(sizeof(struct crypt_context));
-  if (ctx == NULL)
+#if defined(LIB_DEBUG) && !defined(CRYPT_FREESTANDING)
+  for (unsigned cnt = 0; ret == 0 && cnt < length; cnt++)
     {
-      fprintf(stderr, "Error: failed to allocate context struct\n");
-      return -ENOMEM;
+      printf("input[%d] => output[%d]\n", input[cnt], output[cnt]);
     }
+#endif
 
-  /* Allocate memory to the key */
+  return ret;
+}
 
-  ctx->key = malloc(context->keylen);
-  if (ctx->key == NULL)
+/**
+ * @brief Encrypt 'length' bytes starting at keystream position 'offset'.
+ *
+ * @param context current context state pointer
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset keystream position of the first byte
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_buffer_at(const struct crypt_context *context, uint8_t *output,
+                    const uint8_t *input, size_t length, uint64_t offset)
+{
+  if (context == NULL || context->key == NULL || context->keylen <= 0)
     {
-      fprintf(stderr, "Error: failed to allocate memory to the key\n");
-      return -ENOMEM;
+      return -EINVAL;
     }
 
-  /* Copy the user key */
+  if (context->engine != NULL)
+    {
+      return context->engine->crypt(context, output, input, length,
+                                    offset);
+    }
 
-  memcpy(ctx->key, context->key, context->keylen);
-  ctx->keylen = context->keylen;
+  return crypt_xor(context, output, input, length, offset);
+}
+
+/**
+ * @brief Encrypt a window of a crypt file starting at file 'offset'.
+ *
+ * @param context current context state pointer
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ * @param offset file offset of the first byte
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_file_at(const struct crypt_context *context, uint8_t *output,
+                  const uint8_t *input, size_t length, uint64_t offset)
+{
+  int ret;
 
-  k = ctx->key;
+  /* Restarting the keystream is only the format of the original cipher */
 
-  for (cnt = 0; cnt < length; cnt++)
+  if (context != NULL && context->engine != NULL &&
+      context->engine != &crypt_engine_xor)
     {
-      k[i] = (k[i] + i) % 256;
-      output[cnt] = input[cnt] ^ k[i];
-#ifdef LIB_DEBUG
-      printf("input[%d] => output[%d]\n", input[cnt], output[cnt]);
-#endif
-      i = ++i % ctx->keylen;
+      return crypt_buffer_at(context, output, input, length, offset);
+    }
+
+  while (length > 0)
+    {
+      size_t pos = offset % CRYPT_BLOCK_SIZE;
+      size_t n = CRYPT_BLOCK_SIZE - pos;
+
+      if (n > length)
+        {
+          n = length;
+        }
+
+      /* Each block of the file starts again from keystream position 0 */
+
+      ret = crypt_buffer_at(context, output, input, n, pos);
+      if (ret < 0)
+        {
+          return ret;
+        }
+
+      output += n;
+      input  += n;
+      offset += n;
+      length -= n;
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Find an engine by name.
+ *
+ * @param name name of the engine
+ *
+ * @return The engine, or NULL if no engine has this name.
+ */
+
+const struct crypt_engine *crypt_engine_find(const char *name)
+{
+  unsigned i;
+
+  if (name == NULL)
+    {
+      return NULL;
+    }
+
+  for (i = 0; i < CRYPT_ENGINE_MAX && g_engines[i] != NULL; i++)
+    {
+      if (engine_name_eq(g_engines[i]->name, name))
+        {
+          return g_engines[i];
+        }
+    }
+
+  return NULL;
+}
+
+/**
+ * @brief Add an engine to those crypt_engine_find() knows.
+ *
+ * @param engine engine with a name and a crypt function
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_engine_register(const struct crypt_engine *engine)
+{
+  unsigned i;
+
+  if (engine == NULL || engine->name == NULL || engine->crypt == NULL)
+    {
+      return -EINVAL;
+    }
+
+  for (i = 0; i < CRYPT_ENGINE_MAX && g_engines[i] != NULL; i++)
+    {
+      if (engine_name_eq(g_engines[i]->name, engine->name))
+        {
+          return -EEXIST;
+        }
+    }
+
+  if (i == CRYPT_ENGINE_MAX)
+    {
+      return -ENOSPC;
+    }
+
+  g_engines[i] = engine;
+
+  return 0;
+}
+
+/**
+ * @brief Copy a key into a statically sized context.
+ *
+ * @param ctx context to fill, its 'context' member points to its copy
+ * @param key key bytes
+ * @param keylen length of the key, 1 to CRYPT_STATIC_KEY_MAX
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_static_init(struct crypt_static *ctx, const uint8_t *key,
+                      size_t keylen)
+{
+  if (ctx == NULL || key == NULL || keylen == 0 ||
+      keylen > CRYPT_STATIC_KEY_MAX)
+    {
+      return -EINVAL;
+    }
+
+  memcpy(ctx->key, key, keylen);
+  ctx->context.key    = ctx->key;
+  ctx->context.keylen = keylen;
+  ctx->context.engine = NULL;
+
+  return 0;
+}
+
+/**
+ * @brief Clear key material or plaintext that must not outlive its use.
+ *
+ * Through a volatile pointer, so the stores are not dropped even when the
+ * memory is freed or goes out of scope right after. A word at a time
+ * where aligned, as the engines wipe their state on every call.
+ *
+ * @param buf buffer to clear, any alignment
+ * @param size amount of bytes, any length
+ */
+
+void crypt_wipe(void *buf, size_t size)
+{
+  volatile uint8_t *p = buf;
+  volatile uint32_t *w;
+
+  while (size > 0 && ((uintptr_t)p & 3) != 0)
+    {
+      *p++ = 0;
+      size--;
+    }
+
+  for (w = (volatile uint32_t *)p; size >= 4; size -= 4)
+    {
+      *w++ = 0;
     }
 
-  /* Free allocated memory */
+  for (p = (volatile uint8_t *)w; size > 0; size--)
+    {
+      *p++ = 0;
+    }
+}
 
-  free(ctx->key);
-  free(ctx);
+/**
+ * @brief Wipe the key of a statically sized context.
+ *
+ * @param ctx context filled by crypt_static_init()
+ */
+
+void crypt_static_wipe(struct crypt_static *ctx)
+{
+  crypt_wipe(ctx->key, sizeof(ctx->key));
+
+  ctx->context.key    = NULL;
+  ctx->context.keylen = 0;
+}
+
+/**
+ * @brief Start a stream at a keystream position.
+ *
+ * @param stream stream state to fill
+ * @param context key of the stream, valid while the stream is used
+ * @param offset keystream position of the first byte
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_stream_init(struct crypt_stream *stream,
+                      const struct crypt_context *context, uint64_t offset)
+{
+  if (stream == NULL || context == NULL || context->key == NULL ||
+      context->keylen <= 0)
+    {
+      return -EINVAL;
+    }
+
+  stream->context = context;
+  stream->offset  = offset;
 
   return 0;
 }
 
+/**
+ * @brief Encrypt the next 'length' bytes of a stream.
+ *
+ * @param stream stream state, moved past the bytes
+ * @param output pointer to output buffer
+ * @param input pointer to input buffer
+ * @param length size of input and output buffers
+ *
+ * @return Success (OK = 0) indicating success or negative POSIX errno.
+ */
+
+int crypt_stream_update(struct crypt_stream *stream, uint8_t *output,
+                        const uint8_t *input, size_t length)
+{
+  int ret;
+
+  ret = crypt_buffer_at(stream->context, output, input, length,
+                        stream->offset);
+  if (ret == 0)
+    {
+      stream->offset += length;
+    }
+
+  return ret;
+}
+
 /**
  * @brief Get the cryptolib version number
  *
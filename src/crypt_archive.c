@@ -0,0 +1,724 @@
+/****************************************************************************
+ * @file  src/crypt_archive.c
+ *
+ * @brief Archive of many encrypted files with a central index.
+ *
+ * Layout of an archive:
+ *
+ *   header  "ACRARCH1", index offset (u64), index length (u64)
+ *   data    every file encrypted as if it was a crypt file on its own
+ *   index   encrypted, entry count (u32) then for every entry:
+ *           name length (u16), name, offset (u64), length (u64),
+ *           CRC-32 of the plaintext (u32)
+ *
+ * All numbers are big endian. Files are packed by parallel workers at
+ * offsets known in advance, and any of them can be extracted through
+ * the index without reading the others.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "crypt_tool.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define ARCHIVE_MAGIC        "ACRARCH1"
+#define ARCHIVE_MAGIC_LEN    8
+#define ARCHIVE_HEADER_SIZE  (ARCHIVE_MAGIC_LEN + 2 * 8)
+#define ARCHIVE_ENTRY_SIZE   (2 + 8 + 8 + 4) /* Without the name */
+#define ARCHIVE_MAX_INDEX    (256 * 1024 * 1024)
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @struct entry_s
+ *  @brief One file inside the archive
+ *  @var entry_s::name
+ *  Member 'name' is the name stored in the index
+ *  @var entry_s::path
+ *  Member 'path' is the file read when packing
+ *  @var entry_s::offset
+ *  Member 'offset' is the position of the data in the archive
+ *  @var entry_s::length
+ *  Member 'length' is the size of the file
+ *  @var entry_s::crc
+ *  Member 'crc' is the CRC-32 of the plaintext
+ */
+
+struct entry_s
+{
+  char *name;      /* name stored in the index          */
+  char *path;      /* file read when packing            */
+  uint64_t offset; /* position of the data in archive   */
+  uint64_t length; /* size of the file                  */
+  uint32_t crc;    /* CRC-32 of the plaintext           */
+};
+
+/** @struct archive_s
+ *  @brief State shared by the archive workers
+ *  @var archive_s::context
+ *  Member 'context' is the key context
+ *  @var archive_s::fd
+ *  Member 'fd' is the archive file
+ *  @var archive_s::dir
+ *  Member 'dir' is where files are extracted, NULL for current dir
+ *  @var archive_s::entries
+ *  Member 'entries' is the list of files
+ *  @var archive_s::selected
+ *  Member 'selected' are the entries to extract
+ *  @var archive_s::mode
+ *  Member 'mode' is the mode of the extracted files
+ */
+
+struct archive_s
+{
+  struct crypt_context *context; /* key context                    */
+  int fd;                        /* archive file                   */
+  const char *dir;               /* extraction directory or NULL   */
+  struct entry_s *entries;       /* list of files                  */
+  unsigned *selected;            /* entries to extract             */
+  mode_t mode;                   /* mode of the extracted files    */
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Worker packing one file into the archive.
+ *
+ * @param arg pointer to the shared archive_s state
+ * @param idx index of the entry
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int pack_worker(void *arg, unsigned idx)
+{
+  struct archive_s *archive = arg;
+  struct entry_s *entry = &archive->entries[idx];
+  int ret;
+  int fd;
+
+  fd = open(entry->path, O_RDONLY);
+  if (fd < 0)
+    {
+      fprintf(stderr, "Error: failed to open file %s\n", entry->path);
+      return -ENOENT;
+    }
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  /* Every entry uses the keystream of a file on its own */
+
+  entry->crc = 0;
+  ret = crypt_copy(archive->context, fd, 0, archive->fd, entry->offset,
+                   entry->length, 0, &entry->crc, NULL);
+  if (ret < 0)
+    {
+      fprintf(stderr, "Error: failed to pack file %s\n", entry->path);
+    }
+
+  close(fd);
+
+  return ret;
+}
+
+/**
+ * @brief Create the parent directories of a path.
+ *
+ * @param path file path, it is modified and restored
+ */
+
+static void make_parents(char *path)
+{
+  char *p;
+
+  for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/'))
+    {
+      *p = '\0';
+      mkdir(path, 0777);
+      *p = '/';
+    }
+}
+
+/**
+ * @brief Check a name from the index can't escape the extraction dir.
+ *
+ * @param name name stored in the index
+ * @return true if it is a safe relative path
+ */
+
+static bool safe_name(const char *name)
+{
+  const char *p = name;
+
+  if (name[0] == '\0' || name[0] == '/')
+    {
+      return false;
+    }
+
+  while (p != NULL)
+    {
+      if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+        {
+          return false;
+        }
+
+      p = strchr(p, '/');
+      if (p != NULL)
+        {
+          p++;
+        }
+    }
+
+  return true;
+}
+
+/**
+ * @brief Order entries by name, for qsort().
+ *
+ * @param a pointer to the first entry pointer
+ * @param b pointer to the second entry pointer
+ * @return strcmp() of the names
+ */
+
+static int compare_names(const void *a, const void *b)
+{
+  const struct entry_s *const *x = a;
+  const struct entry_s *const *y = b;
+
+  return strcmp((*x)->name, (*y)->name);
+}
+
+/**
+ * @brief Find a name given to more than one entry.
+ *
+ * @param entries list of files
+ * @param nentries amount of entries
+ * @param dup pointer to save the repeated name
+ * @return Success (OK = 0), -EEXIST if a name repeats or -ENOMEM
+ */
+
+static int find_duplicate(struct entry_s *entries, uint32_t nentries,
+                          const char **dup)
+{
+  struct entry_s **sorted;
+  uint32_t i;
+  int ret = 0;
+
+  if (nentries < 2)
+    {
+      return 0;
+    }
+
+  sorted = malloc(nentries * sizeof(struct entry_s *));
+  if (sorted == NULL)
+    {
+      return -ENOMEM;
+    }
+
+  for (i = 0; i < nentries; i++)
+    {
+      sorted[i] = &entries[i];
+    }
+
+  qsort(sorted, nentries, sizeof(struct entry_s *), compare_names);
+
+  for (i = 1; i < nentries; i++)
+    {
+      if (strcmp(sorted[i - 1]->name, sorted[i]->name) == 0)
+        {
+          *dup = sorted[i]->name;
+          ret = -EEXIST;
+          break;
+        }
+    }
+
+  free(sorted);
+
+  return ret;
+}
+
+/**
+ * @brief Worker extracting one file from the archive.
+ *
+ * The file is written under a temporary name and only renamed once its
+ * CRC matches, so a corrupted member never shows up.
+ *
+ * @param arg pointer to the shared archive_s state
+ * @param idx index in the list of selected entries
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int extract_worker(void *arg, unsigned idx)
+{
+  struct archive_s *archive = arg;
+  struct entry_s *entry = &archive->entries[archive->selected[idx]];
+  uint32_t crc = 0;
+  char *path;
+  char *tmp;
+  int ret;
+  int fd;
+
+  if (!safe_name(entry->name))
+    {
+      fprintf(stderr, "Error: refusing to extract %s\n", entry->name);
+      return -EINVAL;
+    }
+
+  path = malloc((archive->dir ? strlen(archive->dir) : 0) +
+                strlen(entry->name) + 2);
+  if (path == NULL)
+    {
+      return -ENOMEM;
+    }
+
+  if (archive->dir != NULL)
+    {
+      sprintf(path, "%s/%s", archive->dir, entry->name);
+    }
+  else
+    {
+      strcpy(path, entry->name);
+    }
+
+  make_parents(path);
+
+  tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+  if (tmp == NULL)
+    {
+      free(path);
+      return -ENOMEM;
+    }
+
+  sprintf(tmp, "%s.XXXXXX", path);
+
+  fd = mkstemp(tmp);
+  if (fd < 0)
+    {
+      fprintf(stderr, "Error: failed to create file %s\n", path);
+      free(tmp);
+      free(path);
+      return -EAGAIN;
+    }
+
+  fchmod(fd, archive->mode);
+
+  ret = crypt_copy(archive->context, archive->fd, entry->offset, fd, 0,
+                   entry->length, 0, NULL, &crc);
+  if (ret == 0 && crc != entry->crc)
+    {
+      fprintf(stderr, "Error: %s is corrupted or the key is wrong\n", path);
+      ret = -EBADMSG;
+    }
+  else if (ret < 0)
+    {
+      fprintf(stderr, "Error: failed to extract file %s\n", path);
+    }
+
+  if (close(fd) < 0 && ret == 0)
+    {
+      fprintf(stderr, "Error: failed to write file %s\n", path);
+      ret = -EIO;
+    }
+
+  if (ret == 0 && rename(tmp, path) < 0)
+    {
+      fprintf(stderr, "Error: failed to create file %s\n", path);
+      ret = -EIO;
+    }
+
+  if (ret < 0)
+    {
+      unlink(tmp);
+    }
+
+  free(tmp);
+  free(path);
+
+  return ret;
+}
+
+/**
+ * @brief Read, decrypt and parse the index of an archive.
+ *
+ * @param archive archive state, fd must be open, entries are filled
+ * @param nentries pointer to save the amount of entries
+ * @param index pointer to save the index buffer the names point into
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int read_index(struct archive_s *archive, uint32_t *nentries,
+                      uint8_t **index)
+{
+  uint8_t header[ARCHIVE_HEADER_SIZE];
+  uint64_t offset;
+  uint64_t length;
+  uint8_t *p;
+  uint8_t *end;
+  uint32_t i;
+
+  if (pread(archive->fd, header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN) != 0)
+    {
+      return -EINVAL;
+    }
+
+  offset = be_decode(header + ARCHIVE_MAGIC_LEN, 8);
+  length = be_decode(header + ARCHIVE_MAGIC_LEN + 8, 8);
+  if (length < 4 || length > ARCHIVE_MAX_INDEX)
+    {
+      return -EINVAL;
+    }
+
+  *index = malloc(length);
+  if (*index == NULL)
+    {
+      return -ENOMEM;
+    }
+
+  if (pread(archive->fd, *index, length, offset) != (ssize_t)length)
+    {
+      return -EIO;
+    }
+
+  crypt_file_at(archive->context, *index, *index, length, 0);
+
+  /* A wrong key or a corrupted index must not size the allocation */
+
+  *nentries = be_decode(*index, 4);
+  if (*nentries > (length - 4) / ARCHIVE_ENTRY_SIZE)
+    {
+      return -EINVAL;
+    }
+
+  archive->entries = calloc(*nentries, sizeof(struct entry_s));
+  if (archive->entries == NULL)
+    {
+      return -ENOMEM;
+    }
+
+  p   = *index + 4;
+  end = *index + length;
+
+  for (i = 0; i < *nentries; i++)
+    {
+      struct entry_s *entry = &archive->entries[i];
+      size_t namelen;
+
+      if (end - p < ARCHIVE_ENTRY_SIZE)
+        {
+          return -EINVAL;
+        }
+
+      namelen = be_decode(p, 2);
+      if ((size_t)(end - p) < ARCHIVE_ENTRY_SIZE + namelen)
+        {
+          return -EINVAL;
+        }
+
+      /* Move the name over its length field, leaving room to terminate
+       * it in place.
+       */
+
+      entry->offset = be_decode(p + 2 + namelen, 8);
+      entry->length = be_decode(p + 2 + namelen + 8, 8);
+      entry->crc    = be_decode(p + 2 + namelen + 16, 4);
+      memmove(p, p + 2, namelen);
+      p[namelen] = '\0';
+      entry->name = (char *)p;
+
+      p += ARCHIVE_ENTRY_SIZE + namelen;
+    }
+
+  return 0;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Pack files into an encrypted archive, in parallel.
+ *
+ * @param context key context used to encrypt
+ * @param files files to pack
+ * @param nfiles amount of files
+ * @param ofile archive file name
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_archive(struct crypt_context *context, char **files, int nfiles,
+                  const char *ofile)
+{
+  struct archive_s archive;
+  uint8_t header[ARCHIVE_HEADER_SIZE];
+  uint64_t offset = ARCHIVE_HEADER_SIZE;
+  size_t indexlen = 4;
+  uint8_t *index = NULL;
+  uint8_t *p;
+  const char *dup;
+  struct stat sb;
+  int ret = 0;
+  int i;
+
+  if (nfiles <= 0 || ofile == NULL)
+    {
+      fprintf(stderr, "Error: --archive needs -o file and input files\n");
+      return -EINVAL;
+    }
+
+  archive.context  = context;
+  archive.dir      = NULL;
+  archive.selected = NULL;
+  archive.entries  = calloc(nfiles, sizeof(struct entry_s));
+  if (archive.entries == NULL)
+    {
+      return -ENOMEM;
+    }
+
+  /* Sizes are known upfront, so every file gets its place in advance */
+
+  for (i = 0; i < nfiles; i++)
+    {
+      struct entry_s *entry = &archive.entries[i];
+
+      if (stat(files[i], &sb) < 0 || !S_ISREG(sb.st_mode))
+        {
+          fprintf(stderr, "Error: %s is not a regular file\n", files[i]);
+          free(archive.entries);
+          return -ENOENT;
+        }
+
+      /* Store relative names */
+
+      entry->path = files[i];
+      entry->name = files[i];
+      while (entry->name[0] == '/' ||
+             (entry->name[0] == '.' && entry->name[1] == '/'))
+        {
+          entry->name += entry->name[0] == '/' ? 1 : 2;
+        }
+
+      if (strlen(entry->name) > UINT16_MAX)
+        {
+          free(archive.entries);
+          return -ENAMETOOLONG;
+        }
+
+      entry->offset = offset;
+      entry->length = sb.st_size;
+      offset   += sb.st_size;
+      indexlen += ARCHIVE_ENTRY_SIZE + strlen(entry->name);
+    }
+
+  /* "a" and "./a" are stored as the same name */
+
+  ret = find_duplicate(archive.entries, nfiles, &dup);
+  if (ret < 0)
+    {
+      if (ret == -EEXIST)
+        {
+          fprintf(stderr, "Error: %s is given more than once\n", dup);
+        }
+
+      free(archive.entries);
+      return ret;
+    }
+
+  archive.fd = open(ofile, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (archive.fd < 0)
+    {
+      fprintf(stderr, "Error: failed to open output file %s\n", ofile);
+      free(archive.entries);
+      return -EAGAIN;
+    }
+
+  ret = run_parallel(nfiles, pack_worker, &archive);
+
+  if (ret == 0)
+    {
+      index = malloc(indexlen);
+      if (index == NULL)
+        {
+          ret = -ENOMEM;
+        }
+    }
+
+  if (ret == 0)
+    {
+      /* Index goes after the data, the header points to it */
+
+      be_encode(index, nfiles, 4);
+      for (p = index + 4, i = 0; i < nfiles; i++)
+        {
+          struct entry_s *entry = &archive.entries[i];
+          size_t namelen = strlen(entry->name);
+
+          be_encode(p, namelen, 2);
+          memcpy(p + 2, entry->name, namelen);
+          p += 2 + namelen;
+          be_encode(p, entry->offset, 8);
+          be_encode(p + 8, entry->length, 8);
+          be_encode(p + 16, entry->crc, 4);
+          p += 20;
+        }
+
+      crypt_file_at(context, index, index, indexlen, 0);
+
+      memcpy(header, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN);
+      be_encode(header + ARCHIVE_MAGIC_LEN, offset, 8);
+      be_encode(header + ARCHIVE_MAGIC_LEN + 8, indexlen, 8);
+
+      if (pwrite(archive.fd, index, indexlen, offset) != (ssize_t)indexlen ||
+          pwrite(archive.fd, header, sizeof(header), 0) != sizeof(header))
+        {
+          fprintf(stderr, "Error: failed to write archive index\n");
+          ret = -EIO;
+        }
+    }
+
+  close(archive.fd);
+  free(archive.entries);
+  free(index);
+
+  return ret;
+}
+
+/**
+ * @brief Extract files from an encrypted archive, in parallel.
+ *
+ * @param context key context used to decrypt
+ * @param ifile archive file name
+ * @param names names to extract, all the files if nnames is 0
+ * @param nnames amount of names
+ * @param dir directory to extract to, NULL for the current one
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_extract(struct crypt_context *context, const char *ifile,
+                  char **names, int nnames, const char *dir)
+{
+  struct archive_s archive;
+  uint8_t *index = NULL;
+  uint32_t nentries = 0;
+  unsigned nselected = 0;
+  const char *dup;
+  mode_t mask;
+  uint32_t i;
+  unsigned k;
+  int ret;
+  int j;
+
+  if (ifile == NULL)
+    {
+      fprintf(stderr, "Error: --extract needs the -i archive\n");
+      return -EINVAL;
+    }
+
+  archive.context  = context;
+  archive.dir      = dir;
+  archive.entries  = NULL;
+  archive.selected = NULL;
+
+  /* mkstemp() creates 0600 files, give them the mode open() would */
+
+  mask = umask(0);
+  umask(mask);
+  archive.mode = 0666 & ~mask;
+
+  archive.fd = open(ifile, O_RDONLY);
+  if (archive.fd < 0)
+    {
+      fprintf(stderr, "Error: failed to open archive %s\n", ifile);
+      return -ENOENT;
+    }
+
+  ret = read_index(&archive, &nentries, &index);
+  if (ret < 0)
+    {
+      fprintf(stderr, "Error: %s is not an archive or the key is wrong\n",
+              ifile);
+      goto out;
+    }
+
+  /* Two workers must never write the same file */
+
+  ret = find_duplicate(archive.entries, nentries, &dup);
+  if (ret < 0)
+    {
+      if (ret == -EEXIST)
+        {
+          fprintf(stderr, "Error: %s is in the archive more than once\n",
+                  dup);
+        }
+
+      goto out;
+    }
+
+  archive.selected = malloc((nentries + 1) * sizeof(unsigned));
+  if (archive.selected == NULL)
+    {
+      ret = -ENOMEM;
+      goto out;
+    }
+
+  if (nnames == 0)
+    {
+      for (i = 0; i < nentries; i++)
+        {
+          archive.selected[nselected++] = i;
+        }
+    }
+
+  /* Look up the requested names in the index only */
+
+  for (j = 0; j < nnames; j++)
+    {
+      for (i = 0; i < nentries; i++)
+        {
+          if (strcmp(archive.entries[i].name, names[j]) == 0)
+            {
+              break;
+            }
+        }
+
+      if (i == nentries)
+        {
+          fprintf(stderr, "Error: %s not found in archive\n", names[j]);
+          ret = -ENOENT;
+          goto out;
+        }
+
+      for (k = 0; k < nselected && archive.selected[k] != i; k++);
+
+      if (k == nselected)
+        {
+          archive.selected[nselected++] = i;
+        }
+    }
+
+  ret = run_parallel(nselected, extract_worker, &archive);
+
+out:
+  close(archive.fd);
+  free(archive.selected);
+  free(archive.entries);
+  free(index);
+
+  return ret;
+}
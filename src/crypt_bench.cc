@@ -0,0 +1,431 @@
+/****************************************************************************
+ * @file  src/crypt_bench.cc
+ *
+ * @brief Compare the C++ interface of acrypt.hpp with the C library.
+ *
+ * For every buffer size, check crypt_buffer(), crypt_buffer_at(),
+ * acrypt::context::encrypt() and acrypt::cipher::encrypt() produce the
+ * same bytes, then print the time each of them takes per call and its
+ * throughput. The lazy view of
+ * acrypt_view.hpp is measured iterated byte by byte and through
+ * acrypt::copy(), acrypt::crypt_ostream written to a null sink, and a
+ * memory to memory acrypt::pipe pipeline.
+ *
+ * Then requests, each with its own context and output buffer, are run on
+ * several threads at once, allocated with malloc or from a per request
+ * std::pmr arena.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory_resource>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "acrypt.hpp"
+#include "acrypt_execution.hpp"
+#include "acrypt_pipe.hpp"
+#include "acrypt_stream.hpp"
+#include "acrypt_view.hpp"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define BENCH_BYTES  (64u * 1024 * 1024)  /* Processed per measurement */
+#define BENCH_CALLS  1000u                /* Minimum calls per size    */
+#define BENCH_REQS   100000u              /* Requests per thread       */
+#define BENCH_REQ    256u                 /* Bytes per request         */
+#define BENCH_SMALL  1000000u             /* Calls per small message   */
+
+/* The misuses acrypt.hpp must reject at compile time */
+
+static_assert(!std::is_copy_constructible_v<acrypt::context>);
+static_assert(!std::is_copy_assignable_v<acrypt::context>);
+static_assert(std::is_nothrow_move_constructible_v<acrypt::context>);
+static_assert(std::is_nothrow_move_assignable_v<acrypt::context>);
+static_assert(!std::is_convertible_v<std::string_view, acrypt::context>);
+static_assert(!std::is_copy_constructible_v<acrypt::cipher<16>>);
+static_assert(!std::is_invocable_v<decltype(&acrypt::encrypt),
+                                   const acrypt::context &,
+                                   std::span<const std::byte>,
+                                   std::span<const std::byte>,
+                                   std::uint64_t>);
+
+/* The view keeps the category of its range, up to random access */
+
+static_assert(std::ranges::random_access_range<
+                decltype(std::declval<std::vector<std::byte> &>() |
+                         acrypt::views::crypt(
+                           std::declval<const acrypt::context &>()))>);
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @class null_streambuf
+ *  @brief Stream buffer dropping everything, to time only the encryption
+ */
+
+class null_streambuf : public std::streambuf
+{
+protected:
+  std::streamsize xsputn(const char *, std::streamsize n) override
+  {
+    return n;
+  }
+
+  int_type overflow(int_type c) override
+  {
+    return traits_type::not_eof(c);
+  }
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Time 'calls' runs of 'fn' and print the result.
+ *
+ * @param name name of the measured function
+ * @param size bytes processed per call
+ * @param calls amount of calls
+ * @param fn function to measure
+ * @return Nanoseconds per call
+ */
+
+template <class Fn>
+static double bench(const char *name, std::size_t size, unsigned calls,
+                    Fn fn)
+{
+  auto start = std::chrono::steady_clock::now();
+
+  for (unsigned i = 0; i < calls; i++)
+    {
+      fn();
+
+      /* Don't let the compiler merge or drop the calls */
+
+      asm volatile("" ::: "memory");
+    }
+
+  std::chrono::duration<double, std::nano> ns =
+    std::chrono::steady_clock::now() - start;
+
+  std::printf("%-18s %8zu %12.1f %10.1f\n", name, size, ns.count() / calls,
+              size * calls / ns.count() * 1e3);
+
+  return ns.count() / calls;
+}
+
+/**
+ * @brief Run 'fn' as requests on 'threads' threads and print the result.
+ *
+ * @param name name of the measured allocation
+ * @param threads amount of threads
+ * @param fn one request
+ */
+
+template <class Fn>
+static void bench_requests(const char *name, unsigned threads, Fn fn)
+{
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+
+  for (unsigned t = 0; t < threads; t++)
+    {
+      workers.emplace_back([&fn]
+        {
+          for (unsigned i = 0; i < BENCH_REQS; i++)
+            {
+              fn();
+              asm volatile("" ::: "memory");
+            }
+        });
+    }
+
+  for (auto &worker : workers)
+    {
+      worker.join();
+    }
+
+  std::chrono::duration<double, std::nano> ns =
+    std::chrono::steady_clock::now() - start;
+  double requests = double(threads) * BENCH_REQS;
+
+  std::printf("%-18s %8u %12.1f %10.1f\n", name, threads,
+              ns.count() / requests, requests / ns.count() * 1e6);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main()
+{
+  static const std::size_t sizes[] =
+  {
+    16, 64, 256, 1024, 4096, 65536, 1024 * 1024
+  };
+
+  acrypt::context ctx(std::string_view("acrypt bench key"));
+  acrypt::cipher<16> cipher(ctx);
+  struct crypt_context cctx = *ctx.get();
+  std::uint8_t chacha_key[CRYPT_CHACHA20_KEY + CRYPT_CHACHA20_NONCE] = {};
+  struct crypt_context chacha = { chacha_key, sizeof(chacha_key),
+                                  &crypt_engine_chacha20 };
+  std::uint8_t aes_key[CRYPT_AES256_KEY + CRYPT_AES256_IV] = {};
+  struct crypt_context aes = { aes_key, sizeof(aes_key),
+                               &crypt_engine_aes256_ctr };
+  std::uint8_t tag[CRYPT_AEAD_TAG];
+  std::vector<std::byte> in(sizes[std::size(sizes) - 1]);
+  std::vector<std::byte> ref(in.size());
+  std::vector<std::byte> out(in.size());
+  auto *pin  = reinterpret_cast<const std::uint8_t *>(in.data());
+  auto *pref = reinterpret_cast<std::uint8_t *>(ref.data());
+  auto *pout = reinterpret_cast<std::uint8_t *>(out.data());
+  null_streambuf null;
+  acrypt::crypt_ostream os(&null, ctx);
+
+  for (std::size_t i = 0; i < in.size(); i++)
+    {
+      in[i] = std::byte(i * 131 + 7);
+    }
+
+  std::printf("%-18s %8s %12s %10s\n", "function", "bytes", "ns/call",
+              "MB/s");
+
+  for (std::size_t size : sizes)
+    {
+      std::span<const std::byte> src(in.data(), size);
+      std::span<std::byte> dst(out.data(), size);
+      unsigned calls = BENCH_BYTES / size;
+
+      if (calls < BENCH_CALLS)
+        {
+          calls = BENCH_CALLS;
+        }
+
+      /* All of them must agree before their speed means anything */
+
+      crypt_buffer(&cctx, pref, pin, size);
+      ctx.encrypt(src, dst);
+      if (std::memcmp(pref, pout, size) != 0)
+        {
+          std::fprintf(stderr, "Error: acrypt::encrypt differs at %zu\n",
+                       size);
+          return 1;
+        }
+
+      crypt_buffer_at(&cctx, pout, pin, size, 0);
+      if (std::memcmp(pref, pout, size) != 0)
+        {
+          std::fprintf(stderr, "Error: crypt_buffer_at differs at %zu\n",
+                       size);
+          return 1;
+        }
+
+      cipher.encrypt(src, dst);
+      if (std::memcmp(pref, pout, size) != 0)
+        {
+          std::fprintf(stderr, "Error: acrypt::cipher differs at %zu\n",
+                       size);
+          return 1;
+        }
+
+      std::ranges::copy(src | acrypt::views::crypt(ctx), dst.begin());
+      if (std::memcmp(pref, pout, size) != 0)
+        {
+          std::fprintf(stderr, "Error: views::crypt differs at %zu\n",
+                       size);
+          return 1;
+        }
+
+      (acrypt::pipe::memory_source(src) | acrypt::pipe::encrypt(ctx) |
+       acrypt::pipe::memory_sink(dst)).run();
+      if (std::memcmp(pref, pout, size) != 0)
+        {
+          std::fprintf(stderr, "Error: acrypt::pipe differs at %zu\n",
+                       size);
+          return 1;
+        }
+
+      acrypt::transform(std::execution::par_unseq, ctx, src, dst);
+      if (std::memcmp(pref, pout, size) != 0)
+        {
+          std::fprintf(stderr, "Error: acrypt::transform differs at %zu\n",
+                       size);
+          return 1;
+        }
+
+      bench("crypt_buffer", size, calls, [&]
+        {
+          crypt_buffer(&cctx, pout, pin, size);
+        });
+
+      bench("crypt_buffer_at", size, calls, [&]
+        {
+          crypt_buffer_at(&cctx, pout, pin, size, 0);
+        });
+
+      bench("chacha20", size, calls, [&]
+        {
+          crypt_buffer_at(&chacha, pout, pin, size, 0);
+        });
+
+      bench("chacha20-poly1305", size, calls, [&]
+        {
+          crypt_aead_seal(&chacha, pout, pin, size, 0, nullptr, 0, tag);
+        });
+
+      bench("aes256-ctr", size, calls, [&]
+        {
+          crypt_buffer_at(&aes, pout, pin, size, 0);
+        });
+
+      bench("acrypt::encrypt", size, calls, [&]
+        {
+          ctx.encrypt(src, dst);
+        });
+
+      bench("acrypt::cipher<16>", size, calls, [&]
+        {
+          cipher.encrypt(src, dst);
+        });
+
+      bench("transform(seq)", size, calls, [&]
+        {
+          acrypt::transform(std::execution::seq, ctx, src, dst);
+        });
+
+      bench("transform(unseq)", size, calls, [&]
+        {
+          acrypt::transform(std::execution::unseq, ctx, src, dst);
+        });
+
+      bench("transform(par)", size, calls, [&]
+        {
+          acrypt::transform(std::execution::par, ctx, src, dst);
+        });
+
+      bench("transform(par_uns)", size, calls, [&]
+        {
+          acrypt::transform(std::execution::par_unseq, ctx, src, dst);
+        });
+
+      auto view = src | acrypt::views::crypt(ctx);
+
+      bench("views::crypt", size, calls, [&]
+        {
+          std::ranges::copy(view, dst.begin());
+        });
+
+      bench("acrypt::copy", size, calls, [&]
+        {
+          acrypt::copy(view, dst.begin());
+        });
+
+      bench("acrypt::pipe", size, calls, [&]
+        {
+          (acrypt::pipe::memory_source(src) | acrypt::pipe::encrypt(ctx) |
+           acrypt::pipe::memory_sink(dst)).run();
+        });
+
+      bench("crypt_ostream", size, calls, [&]
+        {
+          os.write(reinterpret_cast<const char *>(pin), size);
+        });
+    }
+
+  std::printf("\n%-18s %8s %12s %10s\n", "small message", "bytes",
+              "ns/call", "MB/s");
+
+  for (std::size_t size = 1; size <= 256; size *= 2)
+    {
+      crypt_buffer_at(&cctx, pref, pin, size, 5);
+      crypt_small_at(&cctx, pout, pin, size, 5);
+      if (std::memcmp(pref, pout, size) != 0)
+        {
+          std::fprintf(stderr, "Error: crypt_small_at differs at %zu\n",
+                       size);
+          return 1;
+        }
+
+      bench("crypt_buffer", size, BENCH_SMALL, [&]
+        {
+          crypt_buffer(&cctx, pout, pin, size);
+        });
+
+      bench("crypt_buffer_at", size, BENCH_SMALL, [&]
+        {
+          crypt_buffer_at(&cctx, pout, pin, size, 0);
+        });
+
+      bench("crypt_small", size, BENCH_SMALL, [&]
+        {
+          crypt_small(&cctx, pout, pin, size);
+        });
+
+      bench("aes256-ctr", size, BENCH_SMALL, [&]
+        {
+          crypt_buffer_at(&aes, pout, pin, size, 0);
+        });
+    }
+
+  /* aes256-ctr expands its key on every call: what a block costs alone,
+   * less what it costs inside 64 KiB, is that expansion
+   */
+
+  {
+    double one = bench("aes256-ctr", 16, BENCH_SMALL, [&]
+      {
+        crypt_buffer_at(&aes, pout, pin, 16, 0);
+      });
+    double bulk = bench("aes256-ctr", 65536, BENCH_CALLS, [&]
+      {
+        crypt_buffer_at(&aes, pout, pin, 65536, 0);
+      });
+
+    std::printf("%-18s %8s %12.1f\n", "aes256 key setup", "-",
+                one - bulk / 4096);
+  }
+
+  /* A constant length is unrolled at the call site */
+
+  bench("crypt_small(16)", 16, BENCH_SMALL, [&]
+    {
+      crypt_small(&cctx, pout, pin, 16);
+    });
+
+  std::printf("\n%-18s %8s %12s %10s\n", "context + buffer", "threads",
+              "ns/request", "k req/s");
+
+  std::span<const std::byte> request(in.data(), BENCH_REQ);
+  std::span<const std::byte> key(in.data() + BENCH_REQ, 32);
+
+  for (unsigned threads = 1; threads <= 8; threads *= 2)
+    {
+      bench_requests("malloc", threads, [&]
+        {
+          acrypt::context rctx(key);
+          auto out = acrypt::encrypted(rctx, request);
+        });
+
+      bench_requests("pmr arena", threads, [&]
+        {
+          alignas(64) std::byte storage[1024];
+          std::pmr::monotonic_buffer_resource arena(storage, sizeof(storage));
+          acrypt::context rctx(key, &arena);
+          auto out = acrypt::encrypted(rctx, request, 0, &arena);
+        });
+    }
+
+  return 0;
+}
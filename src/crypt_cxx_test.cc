@@ -0,0 +1,906 @@
+/****************************************************************************
+ * @file  src/crypt_cxx_test.cc
+ *
+ * @brief Unit test validation for the C++ interface of libacrypt.
+ *
+ * Every wrapper of the include/acrypt_*.hpp headers is checked against
+ * what crypt_buffer_at() and crypt_file_at() give for the same bytes.
+ * The coroutines of acrypt_async.hpp run on a pool of one worker, so a
+ * job blocked in its completion keeps the next ones queued.
+ *
+ * The literal sealed by acrypt_sealed.hpp is only compared with a
+ * reversed copy, so the plaintext never gets into the binary.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <execution>
+#include <future>
+#include <latch>
+#include <list>
+#include <mutex>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+/* Throw The Switch Unity */
+
+#include "unity.h"
+
+#include "acrypt.hpp"
+#include "acrypt_async.hpp"
+#include "acrypt_execution.hpp"
+#include "acrypt_pipe.hpp"
+#include "acrypt_sealed.hpp"
+#include "acrypt_stream.hpp"
+#include "acrypt_view.hpp"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define PLAIN_SZ (1024 * 1024 + 4099) /* Enough for par to use threads */
+
+/* Sealing happens at compile time */
+
+static_assert(acrypt::seal("abc", "ky")[0] == ('a' ^ 'k'));
+static_assert(acrypt::seal("abc", "ky")[1] == ('b' ^ std::uint8_t('y' + 1)));
+static_assert(acrypt::seal("abc", "ky")[2] == ('c' ^ 'k'));
+
+/* test/sealed_test.sh checks this text is not in the binary */
+
+using sealed_literal = ACRYPT_SEALED("acrypt sealed literal", "sealed key");
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @struct task
+ *  @brief Coroutine started at once and never awaited, see await_crypt()
+ */
+
+struct task
+{
+  struct promise_type
+  {
+    task get_return_object() noexcept
+    {
+      return {};
+    }
+
+    std::suspend_never initial_suspend() noexcept
+    {
+      return {};
+    }
+
+    std::suspend_never final_suspend() noexcept
+    {
+      return {};
+    }
+
+    void return_void() noexcept
+    {
+    }
+
+    void unhandled_exception() noexcept
+    {
+      std::terminate();
+    }
+  };
+};
+
+/** @struct await_state
+ *  @brief What a coroutine of await_crypt() saw, and its end
+ */
+
+struct await_state
+{
+  int result = 1;            /* 0 or negative errno, 1 while running */
+  std::thread::id thread;    /* thread it was resumed on             */
+  std::latch done {1};       /* counted down when it returns         */
+};
+
+/** @struct queue_executor
+ *  @brief Executor keeping the handles, resumed later by drain()
+ */
+
+struct queue_executor
+{
+  struct queue
+  {
+    std::mutex lock;
+    std::deque<std::coroutine_handle<>> handles;
+    unsigned calls = 0;
+  };
+
+  queue *q;
+
+  void execute(std::coroutine_handle<> h) const
+  {
+    std::lock_guard<std::mutex> guard(q->lock);
+
+    q->handles.push_back(h);
+    q->calls++;
+  }
+
+  /* Resume what was queued so far on the calling thread */
+
+  unsigned drain() const
+  {
+    unsigned n = 0;
+
+    for (; ; n++)
+      {
+        std::coroutine_handle<> h;
+
+        {
+          std::lock_guard<std::mutex> guard(q->lock);
+
+          if (q->handles.empty())
+            {
+              return n;
+            }
+
+          h = q->handles.front();
+          q->handles.pop_front();
+        }
+
+        h.resume();
+      }
+  }
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* 16 bytes, so cipher<16> takes it too */
+
+static acrypt::context ctx(std::string_view("cxx test key 16b"));
+
+static std::vector<std::byte> plain(PLAIN_SZ);
+
+/* Keystream positions, the last one past 4 GiB */
+
+static const std::uint64_t offsets[] =
+{
+  0, 1, 15, 1023, 1024, 4097, (std::uint64_t(1) << 32) + 7
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* Is run before every test, put unit init calls here. */
+
+void setUp (void)
+{
+}
+
+/* Is run after every test, put unit clean-up calls here. */
+
+void tearDown (void)
+{
+}
+
+/**
+ * @brief Encrypt 'in' with the C library, the reference of the tests.
+ *
+ * @param in input bytes
+ * @param offset keystream position, or file offset when 'file' is true
+ * @param file use crypt_file_at() instead of crypt_buffer_at()
+ * @return The encrypted bytes
+ */
+
+static std::vector<std::byte> expect(std::span<const std::byte> in,
+                                     std::uint64_t offset,
+                                     bool file = false)
+{
+  std::vector<std::byte> out(in.size());
+  auto *o = reinterpret_cast<std::uint8_t *>(out.data());
+  auto *i = reinterpret_cast<const std::uint8_t *>(in.data());
+
+  if (file)
+    {
+      TEST_ASSERT_EQUAL(0, crypt_file_at(ctx.get(), o, i, in.size(),
+                                         offset));
+    }
+  else
+    {
+      TEST_ASSERT_EQUAL(0, crypt_buffer_at(ctx.get(), o, i, in.size(),
+                                           offset));
+    }
+
+  return out;
+}
+
+/**
+ * @brief Await one encryption and record how it ended in 'state'.
+ *
+ * @param batch batch to queue the job to, or nullptr
+ * @param in input bytes
+ * @param out output bytes
+ * @param offset keystream position of the first byte
+ * @param exec executor resuming the coroutine
+ * @param stop token cancelling the job
+ * @param state result of the await, alive until 'done' is counted down
+ */
+
+template <acrypt::executor Executor = acrypt::inline_executor>
+static task await_crypt(acrypt::async_batch *batch,
+                        std::span<const std::byte> in,
+                        std::span<std::byte> out, std::uint64_t offset,
+                        Executor exec, std::stop_token stop,
+                        await_state &state)
+{
+  try
+    {
+      if (batch != nullptr)
+        {
+          co_await acrypt::encrypt_async(*batch, ctx, in, out, offset, exec,
+                                         stop);
+        }
+      else
+        {
+          co_await acrypt::encrypt_async(ctx, in, out, offset, exec, stop);
+        }
+
+      state.result = 0;
+    }
+  catch (const std::system_error &e)
+    {
+      state.result = -e.code().value();
+    }
+
+  state.thread = std::this_thread::get_id();
+  state.done.count_down();
+}
+
+/* Completion of a C job holding the only worker until 'release' */
+
+static void pool_block(struct crypt_job *job, int result)
+{
+  auto *gates = static_cast<std::latch *>(job->arg);
+
+  (void)result;
+
+  gates[0].count_down();
+  gates[1].wait();
+}
+
+/**
+ * @brief View the bytes of a string.
+ */
+
+static std::span<const std::byte> text_bytes(const std::string &s)
+{
+  return std::as_bytes(std::span(s.data(), s.size()));
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+void run_test_context(void)
+{
+  std::span<const std::byte> in(plain.data(), 5000);
+  std::vector<std::byte> out(in.size());
+  acrypt::cipher<16> cipher(ctx);
+
+  for (std::uint64_t offset : offsets)
+    {
+      auto ref = expect(in, offset);
+
+      ctx.encrypt(in, out, offset);
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+      cipher.encrypt(in, out, offset);
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+      /* In place, then back to the plaintext */
+
+      cipher.encrypt(out, offset);
+      TEST_ASSERT_EQUAL_MEMORY(in.data(), out.data(), out.size());
+
+      ref = expect(in, offset, true);
+      ctx.encrypt_file(in, out, offset);
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+    }
+
+  /* Allocator aware copies */
+
+  auto ref = expect(in, 77);
+  auto copy = acrypt::encrypted(ctx, in, 77);
+
+  TEST_ASSERT_EQUAL(in.size(), copy.size());
+  TEST_ASSERT_EQUAL_MEMORY(ref.data(), copy.data(), copy.size());
+
+  /* A moved context keeps the key, the one it left can't be used */
+
+  std::pmr::monotonic_buffer_resource arena;
+  acrypt::context key(std::string_view("moved key"));
+  acrypt::context owner(std::move(key), &arena);
+
+  owner.encrypt(in, out, 9);
+  TEST_ASSERT_EQUAL_MEMORY(acrypt::encrypted(owner, in, 9).data(),
+                           out.data(), out.size());
+
+  try
+    {
+      key.encrypt(out);
+      TEST_FAIL_MESSAGE("moved context used");
+    }
+  catch (const std::logic_error &)
+    {
+    }
+
+  /* Misuses are reported */
+
+  try
+    {
+      ctx.encrypt(in, std::span(out.data(), in.size() - 1));
+      TEST_FAIL_MESSAGE("short output accepted");
+    }
+  catch (const std::length_error &)
+    {
+    }
+
+  try
+    {
+      acrypt::cipher<8> wrong(ctx);
+      TEST_FAIL_MESSAGE("key of the wrong size accepted");
+    }
+  catch (const std::invalid_argument &)
+    {
+    }
+}
+
+void run_test_view(void)
+{
+  std::span<const std::byte> in(plain.data(), 3000);
+  std::vector<std::byte> out(in.size());
+
+  for (std::uint64_t offset : offsets)
+    {
+      auto ref = expect(in, offset);
+      auto view = in | acrypt::views::crypt(ctx, offset);
+
+      /* Iterated, copied whole and at random positions */
+
+      std::ranges::copy(view, out.begin());
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+      std::ranges::fill(out, std::byte(0));
+      TEST_ASSERT_TRUE(acrypt::copy(view, out.begin()) == out.end());
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+      for (std::size_t i : { std::size_t(2999), std::size_t(1024),
+                             std::size_t(0), std::size_t(17) })
+        {
+          TEST_ASSERT_TRUE(view[i] == ref[i]);
+          TEST_ASSERT_TRUE(*(view.begin() + i) == ref[i]);
+        }
+
+      ref = expect(in, offset, true);
+      acrypt::copy(in | acrypt::views::crypt_file(ctx, offset),
+                   out.begin());
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+    }
+
+  /* A range that isn't contiguous, of chars */
+
+  std::string text(1500, 'x');
+  std::list<char> list(text.begin(), text.end());
+  std::string coded;
+  auto ref = expect(text_bytes(text), 5);
+
+  acrypt::copy(list | acrypt::views::crypt(ctx, 5),
+               std::back_inserter(coded));
+  TEST_ASSERT_EQUAL(ref.size(), coded.size());
+  TEST_ASSERT_EQUAL_MEMORY(ref.data(), coded.data(), coded.size());
+}
+
+void run_test_streambuf(void)
+{
+  std::span<const std::byte> in(plain.data(), 5000);
+  std::string patch(300, 'p');
+  std::string text(reinterpret_cast<const char *>(in.data()), in.size());
+  std::string back(700, '\0');
+
+  for (bool file : { false, true })
+    {
+      std::stringbuf sb;
+
+      /* A block smaller than the writes and not a power of two */
+
+      {
+        acrypt::crypt_ostream os(&sb, ctx, file, 100);
+
+        os.write(text.data(), 3000);
+        os.write(text.data() + 3000, text.size() - 3000);
+
+        /* Overwrite across blocks, then append at the end */
+
+        os.seekp(1234);
+        TEST_ASSERT_EQUAL(1234, os.tellp());
+        os.write(patch.data(), patch.size());
+        os.seekp(0, std::ios_base::end);
+        TEST_ASSERT_EQUAL(5000, os.tellp());
+        os << "tail";
+        os.flush();
+        TEST_ASSERT_TRUE(os.good());
+      }
+
+      std::string want = text;
+
+      want.replace(1234, patch.size(), patch);
+      want += "tail";
+
+      auto ref = expect(text_bytes(want), 0, file);
+
+      TEST_ASSERT_EQUAL(ref.size(), sb.str().size());
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), sb.str().data(), ref.size());
+
+      /* Read back from anywhere */
+
+      acrypt::crypt_istream is(&sb, ctx, file, 100);
+
+      is.seekg(3000);
+      is.read(back.data(), back.size());
+      TEST_ASSERT_EQUAL_MEMORY(want.data() + 3000, back.data(), back.size());
+      TEST_ASSERT_EQUAL(3700, is.tellg());
+
+      is.seekg(-2500, std::ios_base::cur);
+      is.read(back.data(), back.size());
+      TEST_ASSERT_EQUAL_MEMORY(want.data() + 1200, back.data(), back.size());
+
+      /* Back inside the block just read */
+
+      is.seekg(1890);
+      is.read(back.data(), 10);
+      TEST_ASSERT_EQUAL_MEMORY(want.data() + 1890, back.data(), 10);
+
+      is.seekg(-4, std::ios_base::end);
+      is.read(back.data(), 4);
+      TEST_ASSERT_EQUAL_MEMORY("tail", back.data(), 4);
+      TEST_ASSERT_EQUAL(EOF, is.get());
+    }
+
+  /* A pipe whose writer waits for the reader, 5 s at most, before it
+   * closes: the message must come out without a full block
+   */
+
+  {
+    std::string msg("request");
+    auto coded = expect(text_bytes(msg), 0);
+    std::promise<void> got;
+    ssize_t written = -1;
+    bool timeout = false;
+    int fds[2];
+
+    TEST_ASSERT_EQUAL(0, pipe(fds));
+
+    std::thread writer([&, answer = got.get_future()]
+      {
+        written = write(fds[1], coded.data(), coded.size());
+        timeout = answer.wait_for(std::chrono::seconds(5)) ==
+                  std::future_status::timeout;
+        close(fds[1]);
+      });
+
+    {
+      acrypt::crypt_istream is(fds[0], ctx);
+
+      is.read(back.data(), msg.size());
+      got.set_value();
+      TEST_ASSERT_TRUE(is.good());
+      TEST_ASSERT_EQUAL_MEMORY(msg.data(), back.data(), msg.size());
+    }
+
+    writer.join();
+    close(fds[0]);
+    TEST_ASSERT_EQUAL(coded.size(), written);
+    TEST_ASSERT_FALSE(timeout);
+  }
+}
+
+void run_test_pipe(void)
+{
+  std::span<const std::byte> in(plain.data(), 100000);
+  std::vector<std::byte> out;
+  std::vector<std::byte> buf(in.size());
+  acrypt::cipher<16> cipher(ctx);
+  std::uint32_t crc = 0;
+  std::uint32_t crc_ref = 0;
+  char dir[] = "/tmp/cryptest_cxx.XXXXXX";
+  std::string src;
+  std::string dst;
+
+  /* CRC-32 check value */
+
+  std::string check("123456789");
+  acrypt::pipe::crc32 sum(crc);
+
+  sum(std::as_writable_bytes(std::span(check)));
+  TEST_ASSERT_EQUAL_HEX32(0xcbf43926, crc);
+
+  /* Tiles that don't divide the input, the CRC of what is written */
+
+  for (std::uint64_t offset : offsets)
+    {
+      auto ref = expect(in, offset);
+
+      out.clear();
+      crc = 0;
+      crc_ref = 0;
+      TEST_ASSERT_EQUAL(in.size(),
+                        (acrypt::pipe::memory_source(in) |
+                         acrypt::pipe::encrypt(ctx, offset) |
+                         acrypt::pipe::crc32(crc) |
+                         acrypt::pipe::vector_sink(out)).run(4000));
+      TEST_ASSERT_EQUAL(ref.size(), out.size());
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+      acrypt::pipe::crc32 sum_ref(crc_ref);
+
+      sum_ref(ref);
+      TEST_ASSERT_EQUAL_HEX32(crc_ref, crc);
+
+      /* And back with a cipher */
+
+      (acrypt::pipe::memory_source(ref) |
+       acrypt::pipe::decrypt(cipher, offset) |
+       acrypt::pipe::memory_sink(buf)).run(333);
+      TEST_ASSERT_EQUAL_MEMORY(in.data(), buf.data(), in.size());
+    }
+
+  /* A full memory sink */
+
+  try
+    {
+      (acrypt::pipe::memory_source(in) | acrypt::pipe::encrypt(ctx) |
+       acrypt::pipe::memory_sink(std::span(buf.data(), 1000))).run();
+      TEST_FAIL_MESSAGE("memory sink overflowed");
+    }
+  catch (const std::length_error &)
+    {
+    }
+
+  /* Files, as the crypt program writes them */
+
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  src = std::string(dir) + "/plain";
+  dst = std::string(dir) + "/coded";
+
+  (acrypt::pipe::memory_source(in) |
+   acrypt::pipe::file_sink(src.c_str())).run();
+  (acrypt::pipe::file_source(src.c_str()) | acrypt::pipe::crypt_file(ctx) |
+   acrypt::pipe::file_sink(dst.c_str())).run(5000);
+
+  auto ref = expect(in, 0, true);
+
+  out.clear();
+  (acrypt::pipe::mmap_source(dst.c_str()) |
+   acrypt::pipe::vector_sink(out)).run();
+  TEST_ASSERT_EQUAL(ref.size(), out.size());
+  TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+  (acrypt::pipe::file_source(dst.c_str()) | acrypt::pipe::crypt_file(ctx) |
+   acrypt::pipe::mmap_sink(src.c_str())).run();
+  out.clear();
+  (acrypt::pipe::file_source(src.c_str()) |
+   acrypt::pipe::vector_sink(out)).run();
+  TEST_ASSERT_EQUAL(in.size(), out.size());
+  TEST_ASSERT_EQUAL_MEMORY(in.data(), out.data(), out.size());
+
+  unlink(src.c_str());
+  unlink(dst.c_str());
+  rmdir(dir);
+}
+
+void run_test_transform(void)
+{
+  std::vector<std::byte> out(plain.size());
+  acrypt::cipher<16> cipher(ctx);
+
+  for (std::uint64_t offset : offsets)
+    {
+      auto ref = expect(plain, offset);
+
+      acrypt::transform(std::execution::seq, ctx, plain, out, offset);
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+      acrypt::transform(std::execution::unseq, ctx, plain, out, offset);
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+      acrypt::transform(std::execution::par, ctx, plain, out, offset);
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+      acrypt::transform(std::execution::par_unseq, ctx, plain, out,
+                        offset);
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+      acrypt::transform(std::execution::par_unseq, cipher, plain, out,
+                        offset);
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+      acrypt::transform(std::execution::par, cipher, plain, out, offset);
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+
+      /* In place, back to the plaintext */
+
+      acrypt::transform(std::execution::par_unseq, ctx, out, offset);
+      TEST_ASSERT_EQUAL_MEMORY(plain.data(), out.data(), out.size());
+    }
+}
+
+void run_test_async(void)
+{
+  std::span<const std::byte> in(plain.data(), 200000);
+  std::vector<std::byte> out(in.size());
+
+  for (std::uint64_t offset : offsets)
+    {
+      auto ref = expect(in, offset);
+      await_state state;
+
+      await_crypt(nullptr, in, out, offset, acrypt::inline_executor {},
+                  {}, state);
+      state.done.wait();
+
+      TEST_ASSERT_EQUAL(0, state.result);
+      TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), out.size());
+    }
+
+  /* Misuses throw before the coroutine is suspended */
+
+  try
+    {
+      (void)acrypt::encrypt_async(ctx, in, std::span(out.data(), 10));
+      TEST_FAIL_MESSAGE("short output accepted");
+    }
+  catch (const std::length_error &)
+    {
+    }
+}
+
+void run_test_async_batch(void)
+{
+  static const std::size_t sizes[] = { 70000, 1, 0, 4099, 100000 };
+  constexpr std::size_t n = sizeof(sizes) / sizeof(sizes[0]);
+  std::vector<std::byte> out(plain.size(), std::byte(0));
+  std::vector<std::byte> untouched = out;
+  acrypt::async_batch batch;
+  await_state states[n];
+  std::size_t pos = 0;
+
+  for (std::size_t i = 0; i < n; i++)
+    {
+      await_crypt(&batch, std::span(plain.data() + pos, sizes[i]),
+                  std::span(out.data() + pos, sizes[i]), 3 + pos,
+                  acrypt::inline_executor {}, {}, states[i]);
+      pos += sizes[i];
+    }
+
+  /* Nothing runs before submit() */
+
+  TEST_ASSERT_EQUAL(n, batch.size());
+  for (std::size_t i = 0; i < n; i++)
+    {
+      TEST_ASSERT_FALSE(states[i].done.try_wait());
+    }
+
+  TEST_ASSERT_EQUAL_MEMORY(untouched.data(), out.data(), out.size());
+
+  batch.submit();
+  TEST_ASSERT_EQUAL(0, batch.size());
+
+  for (std::size_t i = 0; i < n; i++)
+    {
+      states[i].done.wait();
+      TEST_ASSERT_EQUAL(0, states[i].result);
+    }
+
+  auto ref = expect(std::span(plain.data(), pos), 3);
+
+  TEST_ASSERT_EQUAL_MEMORY(ref.data(), out.data(), pos);
+}
+
+void run_test_async_cancel(void)
+{
+  std::span<const std::byte> in(plain.data(), 5000);
+  std::vector<std::byte> out(in.size(), std::byte(0));
+  std::vector<std::byte> untouched = out;
+  std::byte scratch[1];
+
+  /* Stopped before the await: the job never reaches the pool */
+
+  {
+    std::stop_source source;
+    await_state state;
+
+    source.request_stop();
+    await_crypt(nullptr, in, out, 0, acrypt::inline_executor {},
+                source.get_token(), state);
+    state.done.wait();
+
+    TEST_ASSERT_EQUAL(-ECANCELED, state.result);
+    TEST_ASSERT_EQUAL_MEMORY(untouched.data(), out.data(), out.size());
+  }
+
+  /* Stopped while waiting for submit(), the rest of the batch runs */
+
+  {
+    std::vector<std::byte> other(in.size());
+    acrypt::async_batch batch;
+    std::stop_source source;
+    await_state cancelled;
+    await_state state;
+
+    await_crypt(&batch, in, out, 0, acrypt::inline_executor {},
+                source.get_token(), cancelled);
+    await_crypt(&batch, in, other, 0, acrypt::inline_executor {}, {},
+                state);
+    source.request_stop();
+    batch.submit();
+    cancelled.done.wait();
+    state.done.wait();
+
+    TEST_ASSERT_EQUAL(-ECANCELED, cancelled.result);
+    TEST_ASSERT_EQUAL_MEMORY(untouched.data(), out.data(), out.size());
+    TEST_ASSERT_EQUAL(0, state.result);
+    TEST_ASSERT_EQUAL_MEMORY(expect(in, 0).data(), other.data(),
+                             other.size());
+  }
+
+  /* Stopped while queued behind a job holding the only worker: it
+   * resumes on the thread requesting the stop
+   */
+
+  {
+    std::latch gates[2] { std::latch(1), std::latch(1) };
+    struct crypt_job block {};
+    struct crypt_job *job = &block;
+    std::stop_source source;
+    await_state state;
+    bool resumed;
+
+    block.context = ctx.get();
+    block.output  = reinterpret_cast<std::uint8_t *>(scratch);
+    block.input   = reinterpret_cast<const std::uint8_t *>(plain.data());
+    block.length  = sizeof(scratch);
+    block.done    = pool_block;
+    block.arg     = gates;
+
+    TEST_ASSERT_EQUAL(0, crypt_pool_submit(&job, 1));
+    gates[0].wait();
+
+    await_crypt(nullptr, in, out, 0, acrypt::inline_executor {},
+                source.get_token(), state);
+    TEST_ASSERT_FALSE(state.done.try_wait());
+
+    source.request_stop();
+    resumed = state.done.try_wait();
+
+    /* Released before checking, a failure must not leave it blocked */
+
+    gates[1].count_down();
+    state.done.wait();
+
+    TEST_ASSERT_TRUE(resumed);
+    TEST_ASSERT_EQUAL(-ECANCELED, state.result);
+    TEST_ASSERT_TRUE(state.thread == std::this_thread::get_id());
+    TEST_ASSERT_EQUAL_MEMORY(untouched.data(), out.data(), out.size());
+  }
+}
+
+void run_test_async_executor(void)
+{
+  std::span<const std::byte> in(plain.data(), 100000);
+  std::vector<std::byte> out(in.size());
+  std::vector<std::byte> other(in.size());
+  queue_executor::queue q;
+  queue_executor exec { &q };
+  acrypt::async_batch batch;
+  await_state state;
+  await_state batched;
+  unsigned resumed = 0;
+
+  await_crypt(nullptr, in, out, 11, exec, {}, state);
+  await_crypt(&batch, in, other, 12, exec, {}, batched);
+  batch.submit();
+
+  /* Finished jobs wait in the executor until this thread resumes them */
+
+  while (resumed < 2)
+    {
+      resumed += exec.drain();
+      std::this_thread::yield();
+    }
+
+  TEST_ASSERT_EQUAL(2, q.calls);
+  TEST_ASSERT_TRUE(state.done.try_wait());
+  TEST_ASSERT_TRUE(batched.done.try_wait());
+  TEST_ASSERT_EQUAL(0, state.result);
+  TEST_ASSERT_EQUAL(0, batched.result);
+  TEST_ASSERT_TRUE(state.thread == std::this_thread::get_id());
+  TEST_ASSERT_TRUE(batched.thread == std::this_thread::get_id());
+  TEST_ASSERT_EQUAL_MEMORY(expect(in, 11).data(), out.data(), out.size());
+  TEST_ASSERT_EQUAL_MEMORY(expect(in, 12).data(), other.data(),
+                           other.size());
+}
+
+void run_test_sealed(void)
+{
+  static const char reversed[] = "laretil delaes tpyrca";
+  std::string text(std::rbegin(reversed) + 1, std::rend(reversed));
+  acrypt::context key(std::string_view("sealed key"));
+  struct crypt_context sctx = *key.get();
+  auto opened = sealed_literal::open();
+  std::uint8_t out[sealed_literal::size];
+
+  TEST_ASSERT_EQUAL(text.size(), sealed_literal::size);
+  TEST_ASSERT_TRUE(std::memcmp(sealed_literal::ciphertext.data(),
+                               text.data(), text.size()) != 0);
+
+  /* The compile time kernel must match the library */
+
+  crypt_buffer(&sctx, out, sealed_literal::ciphertext.data(),
+               sealed_literal::size);
+  TEST_ASSERT_EQUAL_MEMORY(text.data(), out, text.size());
+
+  TEST_ASSERT_TRUE(sealed_literal::view() == text);
+  TEST_ASSERT_EQUAL_STRING(text.c_str(), sealed_literal::c_str());
+  TEST_ASSERT_TRUE(opened.view() == text);
+  TEST_ASSERT_EQUAL_STRING(text.c_str(), opened.c_str());
+}
+
+int main()
+{
+  for (std::size_t i = 0; i < plain.size(); i++)
+    {
+      plain[i] = std::byte(i * 7 + (i >> 9));
+    }
+
+  /* One worker, so a job blocked in its completion holds the pool */
+
+  if (crypt_pool_start(1) < 0)
+    {
+      std::fprintf(stderr, "Error: can't start the worker pool\n");
+      return EXIT_FAILURE;
+    }
+
+  /* Run the testing */
+
+  UNITY_BEGIN();
+
+  RUN_TEST(run_test_context);
+  RUN_TEST(run_test_view);
+  RUN_TEST(run_test_streambuf);
+  RUN_TEST(run_test_pipe);
+  RUN_TEST(run_test_transform);
+  RUN_TEST(run_test_async);
+  RUN_TEST(run_test_async_batch);
+  RUN_TEST(run_test_async_cancel);
+  RUN_TEST(run_test_async_executor);
+  RUN_TEST(run_test_sealed);
+
+  return UNITY_END();
+}
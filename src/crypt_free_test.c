@@ -0,0 +1,509 @@
+/****************************************************************************
+ * @file  src/crypt_free_test.c
+ *
+ * @brief Host test of the freestanding profile of libacrypt.
+ *
+ * Linked with libacrypt_free.a, built with -DCRYPT_FREESTANDING as for
+ * an MCU. The keystream is checked against a plain reference here, so
+ * the word kernel is not compared with itself. A thread plays the DMA
+ * of the ping-pong buffers.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+/* Throw The Switch Unity */
+
+#include "unity.h"
+
+#include "acrypt.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define MAX_KEY_SZ 300
+#define MAX_BUF_SZ 5000
+#define DMA_BUF_SZ 700
+#define DMA_CHUNK  128
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+uint8_t key[MAX_KEY_SZ];
+uint8_t plain[MAX_BUF_SZ];
+uint8_t expect[MAX_BUF_SZ];
+uint8_t coded[MAX_BUF_SZ];
+
+/* Ping-pong buffers and what came out of them */
+
+struct crypt_pingpong pp;
+uint8_t dma[2][DMA_BUF_SZ];
+size_t received;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* Is run before every test, put unit init calls here. */
+
+void setUp (void)
+{
+}
+
+/* Is run after every test, put unit clean-up calls here. */
+
+void tearDown (void)
+{
+}
+
+/* Byte 'n' of the keystream is key byte n % keylen bumped n / keylen + 1
+ * times by its index, as crypt_buffer() does it.
+ */
+
+void reference(const uint8_t *k, size_t keylen, uint8_t *output,
+               const uint8_t *input, size_t length, uint64_t offset)
+{
+  size_t cnt;
+  uint64_t n;
+
+  for (cnt = 0; cnt < length; cnt++)
+    {
+      n = offset + cnt;
+      output[cnt] = input[cnt] ^
+                    (uint8_t)(k[n % keylen] +
+                              (n / keylen + 1) * (n % keylen));
+    }
+}
+
+/* Fake DMA: fill the buffers in turn with 'plain', as they are given
+ * back, with some shorter transfers.
+ */
+
+void *dma_producer(void *arg)
+{
+  unsigned index = 0;
+  size_t pos = 0;
+  size_t n;
+
+  (void)arg;
+
+  while (pos < MAX_BUF_SZ)
+    {
+      while (!crypt_pingpong_idle(&pp, index))
+        {
+          sched_yield();
+        }
+
+      n = DMA_BUF_SZ - pos % 97;
+      if (n > MAX_BUF_SZ - pos)
+        {
+          n = MAX_BUF_SZ - pos;
+        }
+
+      memcpy(dma[index], plain + pos, n);
+      if (crypt_pingpong_complete(&pp, index, n) < 0)
+        {
+          return "overrun";
+        }
+
+      pos += n;
+      index ^= 1;
+    }
+
+  return NULL;
+}
+
+/* Consumer side of the ping-pong buffers, keeps the encrypted bytes */
+
+void dma_ready(struct crypt_pingpong *state, uint8_t *data, size_t length)
+{
+  TEST_ASSERT_EQUAL_PTR(&pp, state);
+  TEST_ASSERT_TRUE(received + length <= MAX_BUF_SZ);
+
+  memcpy(coded + received, data, length);
+  received += length;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+void run_test_kernel(void)
+{
+  static const size_t keylens[] =
+  {
+    1, 3, 6, 8, 16, 31, 64, 100, 255, 256, 257, 300
+  };
+
+  static const size_t lengths[] =
+  {
+    0, 1, 511, 512, 513, 1000, 4097, MAX_BUF_SZ
+  };
+
+  static const uint64_t offsets[] =
+  {
+    0, 1, 7, 1000003
+  };
+
+  struct crypt_context ctx;
+  unsigned i;
+  unsigned j;
+  unsigned l;
+
+  ctx.key    = key;
+  ctx.engine = NULL;
+
+  /* Both the byte loop and the word kernel, on either side of a pass */
+
+  for (i = 0; i < sizeof(keylens) / sizeof(keylens[0]); i++)
+    {
+      ctx.keylen = keylens[i];
+
+      for (j = 0; j < sizeof(offsets) / sizeof(offsets[0]); j++)
+        {
+          for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+            {
+              reference(key, keylens[i], expect, plain, lengths[l],
+                        offsets[j]);
+              memset(coded, 0, sizeof(coded));
+              TEST_ASSERT_EQUAL(0, crypt_buffer_at(&ctx, coded, plain,
+                                                   lengths[l],
+                                                   offsets[j]));
+              if (lengths[l] > 0)
+                {
+                  TEST_ASSERT_EQUAL_MEMORY(expect, coded, lengths[l]);
+                }
+            }
+        }
+    }
+
+  /* In place */
+
+  ctx.keylen = 6;
+  reference(key, 6, expect, plain, MAX_BUF_SZ, 0);
+  memcpy(coded, plain, MAX_BUF_SZ);
+  TEST_ASSERT_EQUAL(0, crypt_buffer(&ctx, coded, coded, MAX_BUF_SZ));
+  TEST_ASSERT_EQUAL_MEMORY(expect, coded, MAX_BUF_SZ);
+}
+
+void run_test_chacha20(void)
+{
+  /* RFC 8439 A.1 #1, all zero key and nonce, block 0 */
+
+  static const uint8_t zero_block[] =
+  {
+    0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90,
+    0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+    0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a,
+    0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+    0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d,
+    0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+    0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c,
+    0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86
+  };
+
+  static struct crypt_static sctx;
+  uint8_t zero[CRYPT_CHACHA20_KEY];
+  size_t pos;
+
+  memset(zero, 0, sizeof(zero));
+  TEST_ASSERT_EQUAL(0, crypt_static_init(&sctx, zero, sizeof(zero)));
+  sctx.context.engine = crypt_engine_find("chacha20");
+  TEST_ASSERT_NOT_NULL(sctx.context.engine);
+
+  TEST_ASSERT_EQUAL(0, crypt_buffer(&sctx.context, coded, zero, 32));
+  TEST_ASSERT_EQUAL(0, crypt_buffer_at(&sctx.context, coded + 32, zero,
+                                       32, 32));
+  TEST_ASSERT_EQUAL_MEMORY(zero_block, coded, 64);
+
+  /* The kernel built in against one block at a time */
+
+  TEST_ASSERT_EQUAL(0, crypt_static_init(&sctx, key, CRYPT_CHACHA20_KEY +
+                                         CRYPT_CHACHA20_NONCE));
+  sctx.context.engine = &crypt_engine_chacha20;
+  TEST_ASSERT_EQUAL(0, crypt_buffer_at(&sctx.context, expect, plain,
+                                       MAX_BUF_SZ, 99));
+  for (pos = 0; pos < MAX_BUF_SZ; pos += 64)
+    {
+      crypt_buffer_at(&sctx.context, coded + pos, plain + pos,
+                      MAX_BUF_SZ - pos < 64 ? MAX_BUF_SZ - pos : 64,
+                      99 + pos);
+    }
+
+  TEST_ASSERT_EQUAL_MEMORY(expect, coded, MAX_BUF_SZ);
+
+  crypt_static_wipe(&sctx);
+}
+
+void run_test_aes256_ctr(void)
+{
+  /* NIST SP 800-38A F.5.5, first two blocks of CTR-AES256.Encrypt */
+
+  static const uint8_t nist_key[CRYPT_AES256_KEY + CRYPT_AES256_IV] =
+  {
+    0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe,
+    0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+    0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
+    0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4,
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+    0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+  };
+  static const uint8_t nist_plain[32] =
+  {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+    0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+    0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51
+  };
+  static const uint8_t nist_coded[32] =
+  {
+    0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5,
+    0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28,
+    0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a,
+    0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5
+  };
+
+  static struct crypt_static sctx;
+  size_t pos;
+
+  TEST_ASSERT_EQUAL(0, crypt_static_init(&sctx, nist_key,
+                                         sizeof(nist_key)));
+  sctx.context.engine = crypt_engine_find("aes256-ctr");
+  TEST_ASSERT_NOT_NULL(sctx.context.engine);
+
+  TEST_ASSERT_EQUAL(0, crypt_buffer(&sctx.context, coded, nist_plain, 32));
+  TEST_ASSERT_EQUAL_MEMORY(nist_coded, coded, 32);
+
+  /* The kernel built in against one block at a time */
+
+  TEST_ASSERT_EQUAL(0, crypt_static_init(&sctx, key, CRYPT_AES256_KEY +
+                                         CRYPT_AES256_IV));
+  sctx.context.engine = &crypt_engine_aes256_ctr;
+  TEST_ASSERT_EQUAL(0, crypt_buffer_at(&sctx.context, expect, plain,
+                                       MAX_BUF_SZ, 99));
+  for (pos = 0; pos < MAX_BUF_SZ; pos += 16)
+    {
+      crypt_buffer_at(&sctx.context, coded + pos, plain + pos,
+                      MAX_BUF_SZ - pos < 16 ? MAX_BUF_SZ - pos : 16,
+                      99 + pos);
+    }
+
+  TEST_ASSERT_EQUAL_MEMORY(expect, coded, MAX_BUF_SZ);
+
+  crypt_static_wipe(&sctx);
+}
+
+void run_test_poly1305(void)
+{
+  /* Built with 26-bit limbs, tag from another implementation */
+
+  static const uint8_t long_tag[CRYPT_AEAD_TAG] =
+  {
+    0xba, 0xe6, 0xdb, 0x97, 0x29, 0x72, 0x79, 0xe2,
+    0xac, 0x7b, 0x24, 0x39, 0x3a, 0x8a, 0x8a, 0x6e
+  };
+
+  static struct crypt_static sctx;
+  struct crypt_poly1305 poly;
+  uint8_t tag[CRYPT_AEAD_TAG];
+  uint8_t rkey[CRYPT_POLY1305_KEY];
+  size_t pos;
+  size_t n;
+  unsigned i;
+
+  for (i = 0; i < sizeof(rkey); i++)
+    {
+      rkey[i] = i;
+    }
+
+  crypt_poly1305_init(&poly, rkey);
+  for (pos = 0, n = 1; pos < MAX_BUF_SZ; pos += n, n = n * 3 + 1)
+    {
+      if (n > MAX_BUF_SZ - pos)
+        {
+          n = MAX_BUF_SZ - pos;
+        }
+
+      crypt_poly1305_update(&poly, plain + pos, n);
+    }
+
+  crypt_poly1305_final(&poly, tag);
+  TEST_ASSERT_EQUAL_MEMORY(long_tag, tag, sizeof(tag));
+
+  /* Sealed and opened in place, a changed byte is caught */
+
+  TEST_ASSERT_EQUAL(0, crypt_static_init(&sctx, key, CRYPT_CHACHA20_KEY));
+  sctx.context.engine = &crypt_engine_chacha20;
+
+  memcpy(coded, plain, MAX_BUF_SZ);
+  TEST_ASSERT_EQUAL(0, crypt_aead_seal(&sctx.context, coded, coded,
+                                       MAX_BUF_SZ, 640, key, 13, tag));
+  memcpy(expect, coded, MAX_BUF_SZ);
+  TEST_ASSERT_EQUAL(0, crypt_aead_open(&sctx.context, coded, coded,
+                                       MAX_BUF_SZ, 640, key, 13, tag));
+  TEST_ASSERT_EQUAL_MEMORY(plain, coded, MAX_BUF_SZ);
+
+  expect[MAX_BUF_SZ - 1] ^= 1;
+  TEST_ASSERT_EQUAL(-EBADMSG, crypt_aead_open(&sctx.context, expect, expect,
+                                              MAX_BUF_SZ, 640, key, 13,
+                                              tag));
+
+  crypt_static_wipe(&sctx);
+}
+
+void run_test_static(void)
+{
+  static struct crypt_static sctx;
+  unsigned i;
+
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_static_init(&sctx, key, 0));
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_static_init(&sctx, key,
+                                               CRYPT_STATIC_KEY_MAX + 1));
+  TEST_ASSERT_EQUAL(0, crypt_static_init(&sctx, key, 16));
+
+  /* The context has its own copy */
+
+  reference(key, 16, expect, plain, 1000, 3);
+  key[0] ^= 0xff;
+  TEST_ASSERT_EQUAL(0, crypt_buffer_at(&sctx.context, coded, plain, 1000,
+                                       3));
+  key[0] ^= 0xff;
+  TEST_ASSERT_EQUAL_MEMORY(expect, coded, 1000);
+
+  crypt_static_wipe(&sctx);
+  for (i = 0; i < CRYPT_STATIC_KEY_MAX; i++)
+    {
+      TEST_ASSERT_EQUAL_HEX8(0, sctx.key[i]);
+    }
+
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_buffer_at(&sctx.context, coded, plain,
+                                             1, 0));
+}
+
+void run_test_stream(void)
+{
+  struct crypt_context ctx;
+  struct crypt_stream stream;
+  size_t pos = 0;
+  size_t n = 1;
+
+  ctx.key    = key;
+  ctx.keylen = 31;
+  ctx.engine = NULL;
+
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_stream_init(&stream, NULL, 0));
+  TEST_ASSERT_EQUAL(0, crypt_stream_init(&stream, &ctx, 77));
+
+  /* Growing pieces, small ones take the byte loop and large the words */
+
+  while (pos < MAX_BUF_SZ)
+    {
+      if (n > MAX_BUF_SZ - pos)
+        {
+          n = MAX_BUF_SZ - pos;
+        }
+
+      TEST_ASSERT_EQUAL(0, crypt_stream_update(&stream, coded + pos,
+                                               plain + pos, n));
+      pos += n;
+      n = n * 3 + 1;
+    }
+
+  reference(key, 31, expect, plain, MAX_BUF_SZ, 77);
+  TEST_ASSERT_EQUAL_MEMORY(expect, coded, MAX_BUF_SZ);
+  TEST_ASSERT_EQUAL_UINT64(77 + MAX_BUF_SZ, stream.offset);
+}
+
+void run_test_pingpong(void)
+{
+  struct crypt_context ctx;
+  pthread_t producer;
+  void *result;
+  int ret;
+
+  ctx.key    = key;
+  ctx.keylen = 13;
+  ctx.engine = NULL;
+
+  pp.buffer[0] = dma[0];
+  pp.buffer[1] = dma[1];
+  pp.size      = DMA_BUF_SZ;
+  pp.chunk     = DMA_CHUNK;
+  pp.ready     = dma_ready;
+
+  /* Misuse first */
+
+  TEST_ASSERT_EQUAL(0, crypt_pingpong_start(&pp, &ctx, 0));
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_pingpong_complete(&pp, 2, 1));
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_pingpong_complete(&pp, 0,
+                                                     DMA_BUF_SZ + 1));
+  TEST_ASSERT_EQUAL(0, crypt_pingpong_complete(&pp, 0, 1));
+  TEST_ASSERT_EQUAL(-EBUSY, crypt_pingpong_complete(&pp, 0, 1));
+  TEST_ASSERT_EQUAL(0, crypt_pingpong_idle(&pp, 0));
+  TEST_ASSERT_EQUAL(1, crypt_pingpong_idle(&pp, 1));
+
+  /* The whole transfer, the keystream going on across the buffers */
+
+  received = 0;
+  memset(coded, 0, sizeof(coded));
+  TEST_ASSERT_EQUAL(0, crypt_pingpong_start(&pp, &ctx, 12345));
+  TEST_ASSERT_EQUAL(0, crypt_pingpong_poll(&pp));
+  TEST_ASSERT_EQUAL(0, pthread_create(&producer, NULL, dma_producer,
+                                      NULL));
+
+  while (received < MAX_BUF_SZ)
+    {
+      ret = crypt_pingpong_poll(&pp);
+      TEST_ASSERT_TRUE(ret >= 0 && ret <= DMA_CHUNK);
+      if (ret == 0)
+        {
+          sched_yield();
+        }
+    }
+
+  pthread_join(producer, &result);
+  TEST_ASSERT_NULL(result);
+
+  reference(key, 13, expect, plain, MAX_BUF_SZ, 12345);
+  TEST_ASSERT_EQUAL_MEMORY(expect, coded, MAX_BUF_SZ);
+  TEST_ASSERT_EQUAL_UINT64(12345 + MAX_BUF_SZ, pp.stream.offset);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned i;
+
+  for (i = 0; i < MAX_KEY_SZ; i++)
+    {
+      key[i] = i * 151 + 17;
+    }
+
+  for (i = 0; i < MAX_BUF_SZ; i++)
+    {
+      plain[i] = i * 7 + (i >> 8);
+    }
+
+  printf("libacrypt Version %s (freestanding)\n", crypt_version());
+
+  /* Run the testing */
+
+  UNITY_BEGIN();
+
+  RUN_TEST(run_test_kernel);
+  RUN_TEST(run_test_static);
+  RUN_TEST(run_test_chacha20);
+  RUN_TEST(run_test_aes256_ctr);
+  RUN_TEST(run_test_poly1305);
+  RUN_TEST(run_test_stream);
+  RUN_TEST(run_test_pingpong);
+
+  UNITY_END();
+}
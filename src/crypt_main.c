@@ -20,7 +20,7 @@
 #include <stdbool.h>
 #include <limits.h>
 
-#include "acrypt.h"
+#include "crypt_tool.h"
 
 /****************************************************************************
  * Preprocessor and Macros
@@ -31,6 +31,25 @@
 #define MAX_OUTPUT_SIZE  1024 /* Max output size to allocate buffer */
 #define MAX_READ_RETRY   15   /* Case read() fails, retry X times */
 
+/* Long only options, outside of the range of the short ones */
+
+#define OPT_SEARCH       256
+#define OPT_RECORDS      257
+#define OPT_RANGE        258
+#define OPT_MERGE        259
+#define OPT_SPLIT        260
+#define OPT_JOIN         261
+#define OPT_ARCHIVE      262
+#define OPT_EXTRACT      263
+#define OPT_WRITEBACK    264
+#define OPT_SYNC         265
+#define OPT_LIMIT_READ   266
+#define OPT_LIMIT_WRITE  267
+#define OPT_LIMIT_CPU    268
+#define OPT_LIMIT_FILE   269
+#define OPT_SEAL         270
+#define OPT_OPEN         271
+
 /****************************************************************************
  * Private Types
  ****************************************************************************/
@@ -59,6 +78,48 @@
  *  Member 'ibuf' pointer to input buffer
  *  @var user_data_args_s::obuf
  *  Member 'obuf' pointer to output buffer
+ *  @var user_data_args_s::pattern
+ *  Member 'pattern' pointer to the pattern of --search mode
+ *  @var user_data_args_s::files
+ *  Member 'files' list of input files given after the options
+ *  @var user_data_args_s::nfiles
+ *  Member 'nfiles' amount of input files given after the options
+ *  @var user_data_args_s::records
+ *  Member 'records' input is made of sequence numbered records
+ *  @var user_data_args_s::range
+ *  Member 'range' pointer to the OFFSET:LEN of --range mode
+ *  @var user_data_args_s::merge
+ *  Member 'merge' check the --range manifest of the output
+ *  @var user_data_args_s::split
+ *  Member 'split' pointer to the shard size of --split mode
+ *  @var user_data_args_s::join
+ *  Member 'join' rebuild the output from the shard input files
+ *  @var user_data_args_s::archive
+ *  Member 'archive' pack the input files into the output archive
+ *  @var user_data_args_s::extract
+ *  Member 'extract' extract files from the input archive
+ *  @var user_data_args_s::outs
+ *  Member 'outs' list of all the output files given with -o
+ *  @var user_data_args_s::nouts
+ *  Member 'nouts' amount of output files given with -o
+ *  @var user_data_args_s::writeback
+ *  Member 'writeback' pointer to the --writeback window size
+ *  @var user_data_args_s::sync
+ *  Member 'sync' pointer to the --sync durability mode
+ *  @var user_data_args_s::wb
+ *  Member 'wb' writeback state of the output file
+ *  @var user_data_args_s::limit_read
+ *  Member 'limit_read' pointer to the --limit-read bandwidth
+ *  @var user_data_args_s::limit_write
+ *  Member 'limit_write' pointer to the --limit-write bandwidth
+ *  @var user_data_args_s::limit_cpu
+ *  Member 'limit_cpu' pointer to the --limit-cpu share
+ *  @var user_data_args_s::limit_file
+ *  Member 'limit_file' pointer to the --limit-file control file
+ *  @var user_data_args_s::seal
+ *  Member 'seal' encrypt and authenticate with ChaCha20-Poly1305
+ *  @var user_data_args_s::open
+ *  Member 'open' check and decrypt the output of --seal
  */
 
 struct user_data_args_s
@@ -75,6 +136,27 @@ struct user_data_args_s
   char *kbuf;      /* pointer to user key buffer              */
   char *ibuf;      /* pointer to user input buffer            */
   char *obuf;      /* pointer to user output buffer           */
+  char *pattern;   /* pointer to the --search pattern         */
+  char **files;    /* input files given after the options     */
+  int nfiles;      /* amount of input files after the options */
+  bool records;    /* input is made of numbered records       */
+  char *range;     /* pointer to the --range OFFSET:LEN       */
+  bool merge;      /* check the --range manifest of output    */
+  char *split;     /* pointer to the --split shard size       */
+  bool join;       /* rebuild output from the given shards    */
+  bool archive;    /* pack input files into output archive    */
+  bool extract;    /* extract files from the input archive    */
+  char **outs;     /* all the output files given with -o      */
+  int nouts;       /* amount of output files given with -o    */
+  char *writeback; /* pointer to the --writeback window size  */
+  char *sync;      /* pointer to the --sync durability mode   */
+  struct writeback_s wb; /* writeback state of output file    */
+  char *limit_read;  /* pointer to the --limit-read bandwidth  */
+  char *limit_write; /* pointer to the --limit-write bandwidth */
+  char *limit_cpu;   /* pointer to the --limit-cpu share       */
+  char *limit_file;  /* pointer to the --limit-file path       */
+  bool seal;       /* encrypt and authenticate the input      */
+  bool open;       /* check and decrypt a sealed input        */
 };
 
 /****************************************************************************
@@ -97,9 +179,52 @@ static void show_help(void)
   printf("-f <key_file>     Used to provide the algorithm key in a file.\n");
   printf("-o <output_file>  Write the results in <output_file>. Standard\n"
          "                  output shall be used if this parameter is not\n"
-         "                  provided, or if it is a dash sign (-).\n");
+         "                  provided, or if it is a dash sign (-). Give\n"
+         "                  it many times to write the same results to\n"
+         "                  all of them, encrypting only once.\n");
   printf("-i <input_file>:  Read the input from <input_file>. Stand input\n"
          "                  shall be used if this param is not given.\n");
+  printf("--search <text>   Print <file>:<offset> of every <text> found in\n"
+         "                  the encrypted <input_file>s, without writing\n"
+         "                  the decrypted data anywhere.\n");
+  printf("--records         Input is a stream of records made of a 64-bit\n"
+         "                  sequence number, a 32-bit length and payload\n"
+         "                  (big endian). Each payload is encrypted by its\n"
+         "                  sequence number so it decrypts in any order.\n");
+  printf("--range <off:len> Encrypt only that slice of <input_file> into\n"
+         "                  the same place of <output_file>, which isn't\n"
+         "                  truncated, and log it in <output_file>.manifest\n"
+         "                  so many processes can share the work.\n");
+  printf("--merge           Check <output_file>.manifest covers the whole\n"
+         "                  <input_file>, print missing slices if not.\n");
+  printf("--split <size>    Encrypt <input_file> in parallel into shards\n"
+         "                  <output_file>.000, .001, ... of <size> bytes\n"
+         "                  that can each be decrypted on their own.\n");
+  printf("--join            Decrypt the shards given as input files in\n"
+         "                  parallel and rebuild <output_file>.\n");
+  printf("--archive         Pack the input files in parallel into the\n"
+         "                  encrypted archive <output_file>.\n");
+  printf("--extract         Extract from the archive <input_file> the\n"
+         "                  files named after the options, or all of\n"
+         "                  them, in parallel into the <output_file> dir.\n");
+  printf("--writeback <size> Hand every <size> bytes written to the disk\n"
+         "                  right away and drop them from the page cache,\n"
+         "                  instead of letting dirty pages pile up.\n");
+  printf("--sync <mode>     Durability of the output: none (default), end\n"
+         "                  for fdatasync() when done, or a size for one\n"
+         "                  fdatasync() every <size> bytes and at the end.\n");
+  printf("--limit-read <size> Read at most <size> bytes per second.\n");
+  printf("--limit-write <size> Write at most <size> bytes per second.\n");
+  printf("--limit-cpu <pct> Keep every worker thread under <pct> percent\n"
+         "                  of a CPU, sleeping as needed.\n");
+  printf("--limit-file <file> Read the limits again from <file> when it\n"
+         "                  changes or on SIGHUP. Lines are 'read <size>',\n"
+         "                  'write <size>' or 'cpu <pct>', 0 for no limit.\n");
+  printf("--seal            Encrypt with ChaCha20 and a random nonce,\n"
+         "                  adding a Poly1305 tag to every chunk so any\n"
+         "                  change is detected. Needs a 32-byte key.\n");
+  printf("--open            Check and decrypt the output of --seal, fail\n"
+         "                  without writing a chunk that was changed.\n");
 }
 
 /**
@@ -114,6 +239,27 @@ static void parse_args(struct user_data_args_s *args,
                        int argc, char **argv)
 {
   int c;
+  char **outs;
+  static const struct option long_options[] =
+  {
+    { "search", required_argument, NULL, OPT_SEARCH },
+    { "records", no_argument,      NULL, OPT_RECORDS },
+    { "range",  required_argument, NULL, OPT_RANGE  },
+    { "merge",  no_argument,       NULL, OPT_MERGE  },
+    { "split",  required_argument, NULL, OPT_SPLIT  },
+    { "join",   no_argument,       NULL, OPT_JOIN   },
+    { "archive", no_argument,      NULL, OPT_ARCHIVE },
+    { "extract", no_argument,      NULL, OPT_EXTRACT },
+    { "writeback", required_argument, NULL, OPT_WRITEBACK },
+    { "sync",   required_argument, NULL, OPT_SYNC   },
+    { "limit-read", required_argument, NULL, OPT_LIMIT_READ },
+    { "limit-write", required_argument, NULL, OPT_LIMIT_WRITE },
+    { "limit-cpu", required_argument, NULL, OPT_LIMIT_CPU },
+    { "limit-file", required_argument, NULL, OPT_LIMIT_FILE },
+    { "seal",   no_argument,       NULL, OPT_SEAL   },
+    { "open",   no_argument,       NULL, OPT_OPEN   },
+    { NULL,     0,                 NULL, 0          }
+  };
 
   /* Is there a dash to indicate | read from stdin? */
 
@@ -123,7 +269,8 @@ static void parse_args(struct user_data_args_s *args,
       args->ifile = strdup("stdin");
     }
 
-  while ((c = getopt(argc, argv, ":hk:f:i:o:")) != -1)
+  while ((c = getopt_long(argc, argv, ":hk:f:i:o:", long_options,
+                          NULL)) != -1)
     {
       switch (c)
       {
@@ -141,7 +288,65 @@ static void parse_args(struct user_data_args_s *args,
             args->ifile = strdup(optarg);
             break;
         case 'o':
-            args->ofile = strdup(optarg);
+            if (args->ofile == NULL)
+              {
+                args->ofile = strdup(optarg);
+              }
+
+            outs = realloc(args->outs, (args->nouts + 1) * sizeof(char *));
+            if (outs != NULL)
+              {
+                args->outs = outs;
+                args->outs[args->nouts++] = optarg;
+              }
+            break;
+        case OPT_SEARCH:
+            args->pattern = strdup(optarg);
+            break;
+        case OPT_RECORDS:
+            args->records = true;
+            break;
+        case OPT_RANGE:
+            args->range = strdup(optarg);
+            break;
+        case OPT_MERGE:
+            args->merge = true;
+            break;
+        case OPT_SPLIT:
+            args->split = strdup(optarg);
+            break;
+        case OPT_JOIN:
+            args->join = true;
+            break;
+        case OPT_ARCHIVE:
+            args->archive = true;
+            break;
+        case OPT_EXTRACT:
+            args->extract = true;
+            break;
+        case OPT_WRITEBACK:
+            args->writeback = strdup(optarg);
+            break;
+        case OPT_SYNC:
+            args->sync = strdup(optarg);
+            break;
+        case OPT_LIMIT_READ:
+            args->limit_read = strdup(optarg);
+            break;
+        case OPT_LIMIT_WRITE:
+            args->limit_write = strdup(optarg);
+            break;
+        case OPT_LIMIT_CPU:
+            args->limit_cpu = strdup(optarg);
+            break;
+        case OPT_LIMIT_FILE:
+            args->limit_file = strdup(optarg);
+            break;
+        case OPT_SEAL:
+            args->seal = true;
+            break;
+        case OPT_OPEN:
+            args->open = true;
             break;
         case ':':       /* -k or -f without operand */
             fprintf(stderr,
@@ -152,6 +357,18 @@ static void parse_args(struct user_data_args_s *args,
                 "Unrecognized option: '-%c'\n", optopt);
       }
     }
+
+  /* Remaining arguments are input files */
+
+  args->files  = &argv[optind];
+  args->nfiles = argc - optind;
+
+  /* The dash is not a file name */
+
+  if (args->ispipe && args->nfiles > 0)
+    {
+      args->nfiles--;
+    }
 }
 
 /**
@@ -174,6 +391,27 @@ static int init_alloc_args(struct user_data_args_s *args)
   args->fd_key  = -1;
   args->fd_out  = -1;
   args->ispipe  = false;
+  args->pattern = NULL;
+  args->files   = NULL;
+  args->nfiles  = 0;
+  args->records = false;
+  args->range   = NULL;
+  args->merge   = false;
+  args->split   = NULL;
+  args->join    = false;
+  args->archive = false;
+  args->extract = false;
+  args->outs    = NULL;
+  args->nouts   = 0;
+  args->writeback = NULL;
+  args->sync    = NULL;
+  args->wb.enabled = false;
+  args->limit_read  = NULL;
+  args->limit_write = NULL;
+  args->limit_cpu   = NULL;
+  args->limit_file  = NULL;
+  args->seal    = false;
+  args->open    = false;
 
   args->kbuf = malloc(MAX_KEY_SIZE + 1);
   if (args->kbuf == NULL)
@@ -234,6 +472,56 @@ void free_close_alloc(struct user_data_args_s *args)
       free(args->obuf);
     }
 
+  if (args->pattern != NULL)
+    {
+      free(args->pattern);
+    }
+
+  if (args->range != NULL)
+    {
+      free(args->range);
+    }
+
+  if (args->split != NULL)
+    {
+      free(args->split);
+    }
+
+  if (args->outs != NULL)
+    {
+      free(args->outs);
+    }
+
+  if (args->writeback != NULL)
+    {
+      free(args->writeback);
+    }
+
+  if (args->sync != NULL)
+    {
+      free(args->sync);
+    }
+
+  if (args->limit_read != NULL)
+    {
+      free(args->limit_read);
+    }
+
+  if (args->limit_write != NULL)
+    {
+      free(args->limit_write);
+    }
+
+  if (args->limit_cpu != NULL)
+    {
+      free(args->limit_cpu);
+    }
+
+  if (args->limit_file != NULL)
+    {
+      free(args->limit_file);
+    }
+
   if (args->fd_in != -1)
     {
       close(args->fd_in);
@@ -434,6 +722,8 @@ static int store_file(struct user_data_args_s *args, char *buf, int maxsize)
                       "Error: failed to open output file %s\n", args->ofile);
               return -EAGAIN;
             }
+
+          writeback_begin(&args->wb, args->fd_out, 0);
         }
 
       ret = write(args->fd_out, buf, maxsize);
@@ -445,9 +735,93 @@ static int store_file(struct user_data_args_s *args, char *buf, int maxsize)
         }
     }
 
+  throttle_io(THROTTLE_WRITE, ret);
+
+  /* Keep the writeback of the output steady */
+
+  if (writeback_update(&args->wb, ret) < 0)
+    {
+      fprintf(stderr, "Error: failed to sync output file\n");
+      return -EIO;
+    }
+
   return 0;
 }
 
+/**
+ * @brief Apply the --writeback and --sync options.
+ *
+ * @param args pointer to user args struct
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int setup_writeback(struct user_data_args_s *args)
+{
+  uint64_t window = 0;
+  uint64_t every = 0;
+  bool atend = false;
+
+  if (args->writeback != NULL &&
+      (parse_size(args->writeback, &window) < 0 || window == 0))
+    {
+      fprintf(stderr, "Error: invalid writeback size '%s'\n",
+              args->writeback);
+      return -EINVAL;
+    }
+
+  if (args->sync != NULL)
+    {
+      if (strcmp(args->sync, "end") == 0)
+        {
+          atend = true;
+        }
+      else if (strcmp(args->sync, "none") != 0 &&
+               (parse_size(args->sync, &every) < 0 || every == 0))
+        {
+          fprintf(stderr, "Error: invalid sync mode '%s', use none, end"
+                  " or a size\n", args->sync);
+          return -EINVAL;
+        }
+    }
+
+  writeback_setup(window, every, atend);
+
+  return 0;
+}
+
+/**
+ * @brief Apply the --limit-* options.
+ *
+ * @param args pointer to user args struct
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int setup_throttle(struct user_data_args_s *args)
+{
+  uint64_t read_rate = 0;
+  uint64_t write_rate = 0;
+  uint64_t cpu = 0;
+
+  if ((args->limit_read != NULL &&
+       parse_size(args->limit_read, &read_rate) < 0) ||
+      (args->limit_write != NULL &&
+       parse_size(args->limit_write, &write_rate) < 0))
+    {
+      fprintf(stderr, "Error: invalid bandwidth limit\n");
+      return -EINVAL;
+    }
+
+  if (args->limit_cpu != NULL &&
+      (parse_size(args->limit_cpu, &cpu) < 0 || cpu > 100))
+    {
+      fprintf(stderr, "Error: invalid CPU limit '%s', use 1 to 100\n",
+              args->limit_cpu);
+      return -EINVAL;
+    }
+
+  return throttle_setup(read_rate, write_rate, cpu, args->limit_file);
+}
+
 /****************************************************************************
  * Public Functions
  ****************************************************************************/
@@ -485,6 +859,33 @@ int main(int argc, char *argv[])
 
   parse_args(args, argc, argv);
 
+  /* Writeback and durability apply to the output of every mode */
+
+  ret = setup_writeback(args);
+  if (ret < 0)
+    {
+      free_close_alloc(args);
+      return ret;
+    }
+
+  /* Background jobs may be limited not to starve the rest of the host */
+
+  ret = setup_throttle(args);
+  if (ret < 0)
+    {
+      free_close_alloc(args);
+      return ret;
+    }
+
+  /* Merging only checks the manifest, it doesn't need the key */
+
+  if (args->merge)
+    {
+      ret = crypt_merge(args->ifile, args->ofile);
+      free_close_alloc(args);
+      return ret;
+    }
+
   /* Verify if user provided the key or key file */
 
   if (args->keylen == 0 & args->kfile == NULL)
@@ -536,6 +937,64 @@ int main(int argc, char *argv[])
 
   context->key = args->kbuf;
   context->keylen = args->keylen;
+  context->engine = NULL;
+
+  /* Search mode only decrypts in memory, it doesn't write anything */
+
+  if (args->pattern != NULL)
+    {
+      if (args->nfiles == 0 && args->ifile != NULL && !args->ispipe)
+        {
+          args->files  = &args->ifile;
+          args->nfiles = 1;
+        }
+
+      ret = crypt_search(context, args->pattern, args->files, args->nfiles);
+      free_close_alloc(args);
+      return ret;
+    }
+
+  /* Each --range process writes its own slice of the shared output */
+
+  if (args->range != NULL)
+    {
+      ret = crypt_range(context, args->range, args->ifile, args->ofile);
+      free_close_alloc(args);
+      return ret;
+    }
+
+  /* Shards are written and read back in parallel */
+
+  if (args->split != NULL)
+    {
+      ret = crypt_split(context, args->split, args->ifile, args->ofile);
+      free_close_alloc(args);
+      return ret;
+    }
+
+  if (args->join)
+    {
+      ret = crypt_join(context, args->files, args->nfiles, args->ofile);
+      free_close_alloc(args);
+      return ret;
+    }
+
+  /* Archive members are packed and extracted in parallel */
+
+  if (args->archive)
+    {
+      ret = crypt_archive(context, args->files, args->nfiles, args->ofile);
+      free_close_alloc(args);
+      return ret;
+    }
+
+  if (args->extract)
+    {
+      ret = crypt_extract(context, args->ifile, args->files, args->nfiles,
+                          args->ofile);
+      free_close_alloc(args);
+      return ret;
+    }
 
   /* If your didn't supply input file, read from stdin */
 
@@ -555,6 +1014,77 @@ int main(int argc, char *argv[])
       return -EAGAIN;
     }
 
+  /* Many outputs share one encryption of the input */
+
+  if (args->nouts > 1)
+    {
+      if (args->records)
+        {
+          fprintf(stderr, "Error: --records takes a single output\n");
+          free_close_alloc(args);
+          return -EINVAL;
+        }
+
+      if (args->seal || args->open)
+        {
+          fprintf(stderr, "Error: --seal and --open take a single output\n");
+          free_close_alloc(args);
+          return -EINVAL;
+        }
+
+      ret = crypt_tee(context, args->fd_in, args->outs, args->nouts);
+      free_close_alloc(args);
+      return ret;
+    }
+
+  /* Records are encrypted by their own sequence number, not by offset,
+   * sealed files by chunks that carry their tag.
+   */
+
+  if (args->records || args->seal || args->open)
+    {
+      if (args->ofile != NULL)
+        {
+          umask(0);
+          args->fd_out = open(args->ofile, O_RDWR | O_TRUNC | O_CREAT, 0666);
+          if (args->fd_out < 0)
+            {
+              fprintf(stderr,
+                      "Error: failed to open output file %s\n", args->ofile);
+              free_close_alloc(args);
+              return -EAGAIN;
+            }
+        }
+
+      if (args->seal)
+        {
+          ret = crypt_seal(context, args->fd_in,
+                           args->fd_out != -1 ? args->fd_out : 1);
+        }
+      else if (args->open)
+        {
+          ret = crypt_open(context, args->fd_in,
+                           args->fd_out != -1 ? args->fd_out : 1);
+        }
+      else
+        {
+          ret = crypt_records(context, args->fd_in,
+                              args->fd_out != -1 ? args->fd_out : 1);
+        }
+
+      free_close_alloc(args);
+      return ret;
+    }
+
+  /* Standard output may be redirected to a file, keep its position */
+
+  if (args->ofile == NULL)
+    {
+      off_t pos = lseek(1, 0, SEEK_CUR);
+
+      writeback_begin(&args->wb, 1, pos > 0 ? pos : 0);
+    }
+
   /* Read and process blocks of data until end of file */
 
   remaining = args->filelen;
@@ -576,6 +1106,8 @@ int main(int argc, char *argv[])
 
       remaining -= blocks_read;
 
+      throttle_io(THROTTLE_READ, nread);
+
       /* Encrypt the input buffer and save it on output buffer */
 
       ret = crypt_buffer(context, args->obuf, args->ibuf, nread);
@@ -604,6 +1136,15 @@ int main(int argc, char *argv[])
         }
     }
 
+  /* Flush what is left of the output, as the durability mode asks */
+
+  if (writeback_end(&args->wb) < 0)
+    {
+      fprintf(stderr, "Error: failed to sync output file\n");
+      free_close_alloc(args);
+      return -EIO;
+    }
+
   return 0;
 }
 
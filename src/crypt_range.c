@@ -0,0 +1,353 @@
+/****************************************************************************
+ * @file  src/crypt_range.c
+ *
+ * @brief Encrypt a byte range of a file into a shared output.
+ *
+ * Several processes, possibly on different hosts sharing the storage,
+ * each encrypt a slice of the same input with the keystream of its file
+ * offset and pwrite() it into the same output. Every finished slice is
+ * appended to <output>.manifest, which the merge step checks for full
+ * coverage of the input.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "crypt_tool.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define MANIFEST_SUFFIX    ".manifest"
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @struct range_s
+ *  @brief One slice of the file recorded in the manifest
+ *  @var range_s::offset
+ *  Member 'offset' is the first byte of the slice
+ *  @var range_s::length
+ *  Member 'length' is the size of the slice
+ */
+
+struct range_s
+{
+  uint64_t offset; /* first byte of the slice */
+  uint64_t length; /* size of the slice       */
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Build the manifest file name of an output file.
+ *
+ * @param ofile output file name
+ * @return Allocated manifest name or NULL
+ */
+
+static char *manifest_name(const char *ofile)
+{
+  char *name = malloc(strlen(ofile) + sizeof(MANIFEST_SUFFIX));
+
+  if (name != NULL)
+    {
+      strcpy(name, ofile);
+      strcat(name, MANIFEST_SUFFIX);
+    }
+
+  return name;
+}
+
+/**
+ * @brief Order slices by offset, for qsort().
+ */
+
+static int range_compare(const void *a, const void *b)
+{
+  const struct range_s *ra = a;
+  const struct range_s *rb = b;
+
+  if (ra->offset != rb->offset)
+    {
+      return ra->offset < rb->offset ? -1 : 1;
+    }
+
+  return 0;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypt the byte range 'spec' (OFFSET:LEN) of ifile into ofile.
+ *
+ * @param context key context used to encrypt
+ * @param spec range given by the user, sizes accept K/M/G/T suffixes
+ * @param ifile input file name
+ * @param ofile shared output file name
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_range(struct crypt_context *context, const char *spec,
+                const char *ifile, const char *ofile)
+{
+  uint64_t offset;
+  uint64_t length;
+  struct stat sb;
+  char *manifest = NULL;
+  char line[64];
+  const char *sep;
+  int fd_in = -1;
+  int fd_out = -1;
+  int fd_man = -1;
+  int ret = 0;
+
+  sep = strchr(spec, ':');
+  if (sep == NULL || parse_size(spec, &offset) < 0 ||
+      parse_size(sep + 1, &length) < 0)
+    {
+      fprintf(stderr, "Error: invalid range '%s', use OFFSET:LEN\n", spec);
+      return -EINVAL;
+    }
+
+  if (ifile == NULL || ofile == NULL)
+    {
+      fprintf(stderr, "Error: --range needs -i and -o files\n");
+      return -EINVAL;
+    }
+
+  fd_in = open(ifile, O_RDONLY);
+  if (fd_in < 0 || fstat(fd_in, &sb) < 0)
+    {
+      fprintf(stderr, "Error: failed to open input file %s\n", ifile);
+      ret = -ENOENT;
+      goto out;
+    }
+
+  /* The last slice is allowed to run past the end of the input */
+
+  if (offset > (uint64_t)sb.st_size)
+    {
+      offset = sb.st_size;
+    }
+
+  if (length > sb.st_size - offset)
+    {
+      length = sb.st_size - offset;
+    }
+
+  /* Other processes write other slices, so never truncate it */
+
+  fd_out = open(ofile, O_WRONLY | O_CREAT, 0666);
+  if (fd_out < 0)
+    {
+      fprintf(stderr, "Error: failed to open output file %s\n", ofile);
+      ret = -EAGAIN;
+      goto out;
+    }
+
+  manifest = manifest_name(ofile);
+  if (manifest == NULL)
+    {
+      fprintf(stderr, "Error: failed to allocate range buffers\n");
+      ret = -ENOMEM;
+      goto out;
+    }
+
+  posix_fadvise(fd_in, offset, length, POSIX_FADV_SEQUENTIAL);
+
+  ret = crypt_copy(context, fd_in, offset, fd_out, offset, length, offset,
+                   NULL, NULL);
+  if (ret < 0)
+    {
+      fprintf(stderr, "Error: failed to encrypt %s into %s\n", ifile,
+              ofile);
+      goto out;
+    }
+
+  /* Only record the slice once its data is stable on the storage */
+
+  if (fdatasync(fd_out) < 0)
+    {
+      fprintf(stderr, "Error: failed to sync file %s\n", ofile);
+      ret = -errno;
+      goto out;
+    }
+
+  fd_man = open(manifest, O_WRONLY | O_CREAT | O_APPEND, 0666);
+  if (fd_man < 0)
+    {
+      fprintf(stderr, "Error: failed to open manifest %s\n", manifest);
+      ret = -EAGAIN;
+      goto out;
+    }
+
+  /* A single small O_APPEND write can't interleave with other writers */
+
+  snprintf(line, sizeof(line), "%" PRIu64 " %" PRIu64 "\n", offset, length);
+  ret = write(fd_man, line, strlen(line)) == (ssize_t)strlen(line) ?
+        0 : -EIO;
+  if (ret == 0)
+    {
+      ret = fdatasync(fd_man) < 0 ? -errno : 0;
+    }
+
+out:
+  if (fd_man != -1)
+    {
+      close(fd_man);
+    }
+
+  if (fd_out != -1)
+    {
+      close(fd_out);
+    }
+
+  if (fd_in != -1)
+    {
+      close(fd_in);
+    }
+
+  free(manifest);
+
+  return ret;
+}
+
+/**
+ * @brief Check that the manifest of ofile covers all of ifile.
+ *
+ * Missing slices are printed as OFFSET:LEN, ready to be given to --range.
+ * When the output is complete it is truncated to the input size and the
+ * manifest is removed.
+ *
+ * @param ifile input file name
+ * @param ofile shared output file name
+ * @return Success (OK = 0), 1 if incomplete or a negative error
+ */
+
+int crypt_merge(const char *ifile, const char *ofile)
+{
+  struct range_s *ranges = NULL;
+  struct stat sb;
+  uint64_t covered = 0;
+  unsigned long long off;
+  unsigned long long len;
+  size_t nranges = 0;
+  size_t size = 0;
+  char *manifest;
+  FILE *fp;
+  size_t i;
+  int missing = 0;
+  int ret;
+
+  if (ifile == NULL || ofile == NULL || stat(ifile, &sb) < 0)
+    {
+      fprintf(stderr, "Error: --merge needs existing -i and -o files\n");
+      return -EINVAL;
+    }
+
+  manifest = manifest_name(ofile);
+  if (manifest == NULL)
+    {
+      return -ENOMEM;
+    }
+
+  fp = fopen(manifest, "r");
+  if (fp == NULL)
+    {
+      fprintf(stderr, "Error: failed to open manifest %s\n", manifest);
+      free(manifest);
+      return -ENOENT;
+    }
+
+  while (fscanf(fp, "%llu %llu", &off, &len) == 2)
+    {
+      if (nranges == size)
+        {
+          struct range_s *tmp;
+
+          size = size > 0 ? size * 2 : 64;
+          tmp = realloc(ranges, size * sizeof(struct range_s));
+          if (tmp == NULL)
+            {
+              fclose(fp);
+              free(ranges);
+              free(manifest);
+              return -ENOMEM;
+            }
+
+          ranges = tmp;
+        }
+
+      ranges[nranges].offset = off;
+      ranges[nranges].length = len;
+      nranges++;
+    }
+
+  fclose(fp);
+
+  qsort(ranges, nranges, sizeof(struct range_s), range_compare);
+
+  /* Walk the slices in order looking for holes */
+
+  for (i = 0; i < nranges; i++)
+    {
+      if (ranges[i].offset > covered)
+        {
+          printf("%" PRIu64 ":%" PRIu64 "\n", covered,
+                 ranges[i].offset - covered);
+          missing = 1;
+        }
+
+      if (ranges[i].offset + ranges[i].length > covered)
+        {
+          covered = ranges[i].offset + ranges[i].length;
+        }
+    }
+
+  if (covered < (uint64_t)sb.st_size)
+    {
+      printf("%" PRIu64 ":%" PRIu64 "\n", covered, sb.st_size - covered);
+      missing = 1;
+    }
+
+  ret = missing;
+  if (!missing)
+    {
+      if (truncate(ofile, sb.st_size) < 0)
+        {
+          fprintf(stderr, "Error: failed to truncate %s\n", ofile);
+          ret = -errno;
+        }
+      else
+        {
+          unlink(manifest);
+        }
+    }
+  else
+    {
+      fprintf(stderr, "Error: %s is incomplete, missing ranges above\n",
+              ofile);
+    }
+
+  free(ranges);
+  free(manifest);
+
+  return ret;
+}
@@ -0,0 +1,207 @@
+/****************************************************************************
+ * @file  src/crypt_records.c
+ *
+ * @brief Encrypt a stream of sequence numbered records.
+ *
+ * Every record is a CRYPT_PACKET_HEADER big endian sequence number, a
+ * 32-bit big endian payload length and the payload. Only the payload is
+ * encrypted, with crypt_packet(), so records can be decrypted on their
+ * own and in any order.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "crypt_tool.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define RECORD_HEADER    (CRYPT_PACKET_HEADER + 4)
+#define RECORD_BUF_SIZE  (4 * (RECORD_HEADER + CRYPT_PACKET_MAX))
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @struct record_buf_s
+ *  @brief Buffered input or output of records
+ *  @var record_buf_s::fd
+ *  Member 'fd' is the file descriptor being read or written
+ *  @var record_buf_s::pos
+ *  Member 'pos' is the first unused byte of the buffer
+ *  @var record_buf_s::len
+ *  Member 'len' is the amount of valid bytes in the buffer
+ *  @var record_buf_s::data
+ *  Member 'data' is the buffer
+ */
+
+struct record_buf_s
+{
+  int fd;          /* file descriptor being read or written */
+  size_t pos;      /* first unused byte of the buffer        */
+  size_t len;      /* amount of valid bytes in the buffer    */
+  uint8_t *data;   /* the buffer                             */
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Make sure 'size' bytes are available in the input buffer.
+ *
+ * @param in pointer to the input buffer
+ * @param size amount of bytes needed
+ * @return 1 if available, 0 at EOF or a negative error
+ */
+
+static int record_fill(struct record_buf_s *in, size_t size)
+{
+  ssize_t ret;
+
+  if (in->len - in->pos >= size)
+    {
+      return 1;
+    }
+
+  memmove(in->data, in->data + in->pos, in->len - in->pos);
+  in->len -= in->pos;
+  in->pos  = 0;
+
+  ret = read_full(in->fd, in->data + in->len, RECORD_BUF_SIZE - in->len);
+  if (ret < 0)
+    {
+      return ret;
+    }
+
+  in->len += ret;
+
+  return in->len >= size ? 1 : 0;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypt a stream of sequence numbered records.
+ *
+ * @param context key context used to encrypt
+ * @param fd_in file descriptor of the input records
+ * @param fd_out file descriptor of the output records
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_records(struct crypt_context *context, int fd_in, int fd_out)
+{
+  struct record_buf_s in;
+  struct record_buf_s out;
+  struct writeback_s wb;
+  int ret;
+
+  in.fd    = fd_in;
+  in.pos   = 0;
+  in.len   = 0;
+  in.data  = malloc(RECORD_BUF_SIZE);
+  out.fd   = fd_out;
+  out.pos  = 0;
+  out.len  = 0;
+  out.data = malloc(RECORD_BUF_SIZE);
+
+  if (in.data == NULL || out.data == NULL)
+    {
+      fprintf(stderr, "Error: failed to allocate record buffers\n");
+      ret = -ENOMEM;
+      goto out;
+    }
+
+  writeback_begin(&wb, fd_out, 0);
+
+  while ((ret = record_fill(&in, RECORD_HEADER)) > 0)
+    {
+      const uint8_t *hdr = in.data + in.pos;
+      uint64_t seq = be_decode(hdr, CRYPT_PACKET_HEADER);
+      size_t len = be_decode(hdr + CRYPT_PACKET_HEADER, 4);
+
+      if (len > CRYPT_PACKET_MAX)
+        {
+          fprintf(stderr, "Error: record %llu is too big (%zu bytes)\n",
+                  (unsigned long long)seq, len);
+          ret = -EMSGSIZE;
+          goto out;
+        }
+
+      ret = record_fill(&in, RECORD_HEADER + len);
+      if (ret <= 0)
+        {
+          break;
+        }
+
+      /* Flush the output if this record doesn't fit anymore */
+
+      if (out.len + RECORD_HEADER + len > RECORD_BUF_SIZE)
+        {
+          ret = write_full(out.fd, out.data, out.len);
+          if (ret == 0)
+            {
+              ret = writeback_update(&wb, out.len);
+            }
+
+          if (ret < 0)
+            {
+              goto out;
+            }
+
+          out.len = 0;
+        }
+
+      memcpy(out.data + out.len, in.data + in.pos, RECORD_HEADER);
+      ret = crypt_packet(context, seq, out.data + out.len + RECORD_HEADER,
+                         in.data + in.pos + RECORD_HEADER, len);
+      if (ret < 0)
+        {
+          fprintf(stderr, "Error: invalid sequence number %llu\n",
+                  (unsigned long long)seq);
+          goto out;
+        }
+
+      out.len += RECORD_HEADER + len;
+      in.pos  += RECORD_HEADER + len;
+    }
+
+  if (ret == 0 && in.len != in.pos)
+    {
+      fprintf(stderr, "Error: truncated record at end of input\n");
+      ret = -EINVAL;
+    }
+
+  if (ret == 0)
+    {
+      ret = write_full(out.fd, out.data, out.len);
+    }
+
+  if (ret == 0)
+    {
+      ret = writeback_update(&wb, out.len);
+    }
+
+  if (ret == 0)
+    {
+      ret = writeback_end(&wb);
+    }
+
+out:
+  free(in.data);
+  free(out.data);
+
+  return ret;
+}
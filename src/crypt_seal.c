@@ -0,0 +1,610 @@
+/****************************************************************************
+ * @file  src/crypt_seal.c
+ *
+ * @brief Authenticated encryption of a file with ChaCha20-Poly1305.
+ *
+ * The output is a header holding a random nonce and the chunk size, then
+ * the input cut into chunks, each one encrypted and followed by its
+ * Poly1305 tag. The tag of a chunk also covers the header, the index of
+ * the chunk and whether it is the last one, so chunks cannot be changed,
+ * reordered, dropped or added. Chunks use disjoint parts of the keystream
+ * and are sealed and opened on their own: in parallel between regular
+ * files, one at a time with pipes, where a chunk is only written once it
+ * has been checked.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+#include "crypt_tool.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define SEAL_MAGIC        "ACRSEALD"
+#define SEAL_MAGIC_LEN    8
+#define SEAL_HEADER_SIZE  (SEAL_MAGIC_LEN + CRYPT_CHACHA20_NONCE + 8)
+
+/* Plaintext of every chunk but the last, a multiple of 64 */
+
+#define SEAL_CHUNK        65536
+
+/* Largest chunk size accepted from a header */
+
+#define SEAL_CHUNK_MAX    (16 * 1024 * 1024)
+
+/* Associated data of a chunk: header, index and last chunk flag */
+
+#define SEAL_AD_SIZE      (SEAL_HEADER_SIZE + 8 + 1)
+
+/* Chunks handled by a parallel worker at once */
+
+#define SEAL_BATCH        16
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @struct seal_s
+ *  @brief State shared by the seal and open workers
+ *  @var seal_s::context
+ *  Member 'context' is the ChaCha20 context, key and nonce of the file
+ *  @var seal_s::key
+ *  Member 'key' is the key material 'context' points to
+ *  @var seal_s::header
+ *  Member 'header' is the header of the sealed file
+ *  @var seal_s::chunk
+ *  Member 'chunk' is the plaintext size of every chunk but the last
+ *  @var seal_s::open
+ *  Member 'open' decrypt and check instead of encrypt
+ *  @var seal_s::fd_in
+ *  Member 'fd_in' is the input file
+ *  @var seal_s::fd_out
+ *  Member 'fd_out' is the output file
+ *  @var seal_s::in_base
+ *  Member 'in_base' is where the chunks start in the input (parallel)
+ *  @var seal_s::out_base
+ *  Member 'out_base' is where the chunks start in the output (parallel)
+ *  @var seal_s::length
+ *  Member 'length' is the plaintext size (parallel only)
+ *  @var seal_s::nchunks
+ *  Member 'nchunks' is the amount of chunks (parallel only)
+ */
+
+struct seal_s
+{
+  struct crypt_context context;     /* ChaCha20 with key and nonce */
+  uint8_t key[CRYPT_CHACHA20_KEY +
+              CRYPT_CHACHA20_NONCE]; /* key material of 'context'   */
+  uint8_t header[SEAL_HEADER_SIZE]; /* header of the sealed file   */
+  size_t chunk;                     /* plaintext of a chunk        */
+  bool open;                        /* decrypt and check           */
+  int fd_in;                        /* input file                  */
+  int fd_out;                       /* output file                 */
+  uint64_t in_base;                 /* chunks start in input       */
+  uint64_t out_base;                /* chunks start in output      */
+  uint64_t length;                  /* plaintext size (parallel)   */
+  uint64_t nchunks;                 /* amount of chunks (parallel) */
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Fill the key material and the header from a nonce.
+ *
+ * @param seal seal state
+ * @param context user key context, the key must be 32 bytes
+ * @param nonce nonce of the file
+ * @param chunk chunk size
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int seal_setup(struct seal_s *seal, struct crypt_context *context,
+                      const uint8_t *nonce, size_t chunk)
+{
+  if (context->keylen != CRYPT_CHACHA20_KEY)
+    {
+      fprintf(stderr, "Error: --seal and --open need a %d-byte key\n",
+              CRYPT_CHACHA20_KEY);
+      return -EINVAL;
+    }
+
+  memcpy(seal->key, context->key, CRYPT_CHACHA20_KEY);
+  memcpy(seal->key + CRYPT_CHACHA20_KEY, nonce, CRYPT_CHACHA20_NONCE);
+  seal->context.key    = seal->key;
+  seal->context.keylen = sizeof(seal->key);
+  seal->context.engine = &crypt_engine_chacha20;
+  seal->chunk          = chunk;
+
+  memcpy(seal->header, SEAL_MAGIC, SEAL_MAGIC_LEN);
+  memcpy(seal->header + SEAL_MAGIC_LEN, nonce, CRYPT_CHACHA20_NONCE);
+  be_encode(seal->header + SEAL_MAGIC_LEN + CRYPT_CHACHA20_NONCE, chunk, 4);
+  be_encode(seal->header + SEAL_MAGIC_LEN + CRYPT_CHACHA20_NONCE + 4, 0, 4);
+
+  return 0;
+}
+
+/**
+ * @brief Seal or open one chunk.
+ *
+ * A chunk gets its own keystream, which starts with the block of its
+ * Poly1305 key, so it is worked on without the others.
+ *
+ * @param seal seal state
+ * @param idx index of the chunk
+ * @param last this is the last chunk of the file
+ * @param out output: ciphertext and tag, or plaintext
+ * @param in input: plaintext, or ciphertext and tag
+ * @param length plaintext size of the chunk
+ * @return Success (OK = 0), -EBADMSG if a chunk is not authentic, or a
+ *         negative error
+ */
+
+static int seal_chunk(struct seal_s *seal, uint64_t idx, bool last,
+                      uint8_t *out, const uint8_t *in, size_t length)
+{
+  uint8_t ad[SEAL_AD_SIZE];
+  uint64_t offset = idx * (seal->chunk + 64);
+
+  memcpy(ad, seal->header, SEAL_HEADER_SIZE);
+  be_encode(ad + SEAL_HEADER_SIZE, idx, 8);
+  ad[SEAL_HEADER_SIZE + 8] = last;
+
+  if (seal->open)
+    {
+      return crypt_aead_open(&seal->context, out, in, length, offset,
+                             ad, sizeof(ad), in + length);
+    }
+
+  return crypt_aead_seal(&seal->context, out, in, length, offset,
+                         ad, sizeof(ad), out + length);
+}
+
+/**
+ * @brief Seal or open a stream one chunk at a time.
+ *
+ * A chunk is last when the input ends right after it, so the next one is
+ * read before it is handled.
+ *
+ * @param seal seal state
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int seal_stream(struct seal_s *seal)
+{
+  struct writeback_s wb;
+  size_t insize = seal->chunk + (seal->open ? CRYPT_AEAD_TAG : 0);
+  size_t outsize = seal->chunk + (seal->open ? 0 : CRYPT_AEAD_TAG);
+  uint8_t *cur;
+  uint8_t *next;
+  uint8_t *out;
+  uint8_t *swap;
+  uint64_t idx;
+  ssize_t nread;
+  ssize_t nnext;
+  size_t length;
+  off_t out_pos;
+  bool last;
+  int ret;
+
+  cur  = malloc(insize);
+  next = malloc(insize);
+  out  = malloc(outsize);
+  if (cur == NULL || next == NULL || out == NULL)
+    {
+      fprintf(stderr, "Error: failed to allocate seal buffers\n");
+      ret = -ENOMEM;
+      goto out;
+    }
+
+  out_pos = lseek(seal->fd_out, 0, SEEK_CUR);
+  writeback_begin(&wb, seal->fd_out, out_pos > 0 ? out_pos : 0);
+
+  nread = read_full(seal->fd_in, cur, insize);
+  for (idx = 0; ; idx++)
+    {
+      if (nread < 0)
+        {
+          fprintf(stderr, "Error: failed to read input\n");
+          ret = nread;
+          goto out;
+        }
+
+      throttle_io(THROTTLE_READ, nread);
+
+      nnext = 0;
+      if ((size_t)nread == insize)
+        {
+          nnext = read_full(seal->fd_in, next, insize);
+          if (nnext < 0)
+            {
+              fprintf(stderr, "Error: failed to read input\n");
+              ret = nnext;
+              goto out;
+            }
+        }
+
+      last = nnext == 0;
+
+      if (seal->open && nread < (ssize_t)CRYPT_AEAD_TAG)
+        {
+          fprintf(stderr, "Error: sealed input is truncated\n");
+          ret = -EBADMSG;
+          goto out;
+        }
+
+      length = (size_t)nread - (seal->open ? CRYPT_AEAD_TAG : 0);
+
+      ret = seal_chunk(seal, idx, last, out, cur, length);
+      if (ret == -EBADMSG)
+        {
+          fprintf(stderr, "Error: chunk %llu is not authentic\n",
+                  (unsigned long long)idx);
+        }
+
+      if (ret < 0)
+        {
+          goto out;
+        }
+
+      length += seal->open ? 0 : CRYPT_AEAD_TAG;
+
+      ret = write_full(seal->fd_out, out, length);
+      if (ret == 0)
+        {
+          throttle_io(THROTTLE_WRITE, length);
+          ret = writeback_update(&wb, length);
+        }
+
+      if (ret < 0)
+        {
+          fprintf(stderr, "Error: failed to write output\n");
+          goto out;
+        }
+
+      if (last)
+        {
+          break;
+        }
+
+      swap  = cur;
+      cur   = next;
+      next  = swap;
+      nread = nnext;
+    }
+
+  ret = writeback_end(&wb);
+
+out:
+  free(cur);
+  free(next);
+  free(out);
+
+  return ret;
+}
+
+/**
+ * @brief Worker sealing or opening SEAL_BATCH chunks between files.
+ *
+ * @param arg pointer to the shared seal_s state
+ * @param idx index of the batch
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int seal_worker(void *arg, unsigned idx)
+{
+  struct seal_s *seal = arg;
+  struct writeback_s wb;
+  size_t stride = seal->chunk + CRYPT_AEAD_TAG;
+  uint64_t first = (uint64_t)idx * SEAL_BATCH;
+  uint64_t end = first + SEAL_BATCH;
+  uint8_t *in;
+  uint8_t *out;
+  uint64_t i;
+  size_t length;
+  size_t insize;
+  size_t outsize;
+  off_t in_off;
+  off_t out_off;
+  ssize_t nread;
+  bool last;
+  int ret = 0;
+
+  in  = malloc(stride);
+  out = malloc(stride);
+  if (in == NULL || out == NULL)
+    {
+      free(in);
+      free(out);
+      return -ENOMEM;
+    }
+
+  if (end > seal->nchunks)
+    {
+      end = seal->nchunks;
+    }
+
+  /* The chunks of a batch are next to each other in the output */
+
+  writeback_begin(&wb, seal->fd_out, seal->out_base +
+                  first * (seal->open ? seal->chunk : stride));
+
+  for (i = first; i < end && ret == 0; i++)
+    {
+      last   = i == seal->nchunks - 1;
+      length = last ? seal->length - i * seal->chunk : seal->chunk;
+
+      if (seal->open)
+        {
+          in_off  = seal->in_base + i * stride;
+          out_off = seal->out_base + i * seal->chunk;
+          insize  = length + CRYPT_AEAD_TAG;
+          outsize = length;
+        }
+      else
+        {
+          in_off  = seal->in_base + i * seal->chunk;
+          out_off = seal->out_base + i * stride;
+          insize  = length;
+          outsize = length + CRYPT_AEAD_TAG;
+        }
+
+      nread = pread(seal->fd_in, in, insize, in_off);
+      if (nread != (ssize_t)insize)
+        {
+          fprintf(stderr, "Error: failed to read chunk %llu\n",
+                  (unsigned long long)i);
+          ret = nread < 0 ? -errno : -EIO;
+          break;
+        }
+
+      throttle_io(THROTTLE_READ, insize);
+
+      ret = seal_chunk(seal, i, last, out, in, length);
+      if (ret == -EBADMSG)
+        {
+          fprintf(stderr, "Error: chunk %llu is not authentic\n",
+                  (unsigned long long)i);
+        }
+
+      if (ret == 0 && pwrite(seal->fd_out, out, outsize, out_off) !=
+                      (ssize_t)outsize)
+        {
+          fprintf(stderr, "Error: failed to write chunk %llu\n",
+                  (unsigned long long)i);
+          ret = -EIO;
+        }
+
+      if (ret == 0)
+        {
+          throttle_io(THROTTLE_WRITE, outsize);
+          ret = writeback_update(&wb, outsize);
+        }
+    }
+
+  if (writeback_end(&wb) < 0 && ret == 0)
+    {
+      ret = -EIO;
+    }
+
+  free(in);
+  free(out);
+
+  return ret;
+}
+
+/**
+ * @brief Seal or open all the chunks of a regular file in parallel.
+ *
+ * @param seal seal state, 'length' and 'nchunks' filled
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int seal_parallel(struct seal_s *seal)
+{
+  uint64_t nbatches = (seal->nchunks + SEAL_BATCH - 1) / SEAL_BATCH;
+  int ret;
+
+  posix_fadvise(seal->fd_in, seal->in_base, 0, POSIX_FADV_SEQUENTIAL);
+
+  ret = run_parallel(nbatches, seal_worker, seal);
+
+  /* Don't leave the plaintext of a forged file behind */
+
+  if (ret < 0 && seal->open && ftruncate(seal->fd_out, seal->out_base) < 0)
+    {
+      fprintf(stderr, "Error: failed to truncate the output\n");
+    }
+
+  return ret;
+}
+
+/**
+ * @brief Tell whether both files can be worked on in parallel.
+ *
+ * Standard input and output may be redirected files, the chunks start at
+ * their current positions.
+ *
+ * @param seal seal state, 'in_base' and 'out_base' filled
+ * @param size pointer to save the size of the input left
+ * @return true if both are regular files
+ */
+
+static bool seal_seekable(struct seal_s *seal, uint64_t *size)
+{
+  struct stat sb_in;
+  struct stat sb_out;
+  off_t in_pos;
+  off_t out_pos;
+
+  if (fstat(seal->fd_in, &sb_in) < 0 || fstat(seal->fd_out, &sb_out) < 0 ||
+      !S_ISREG(sb_in.st_mode) || !S_ISREG(sb_out.st_mode) ||
+      (fcntl(seal->fd_out, F_GETFL) & O_APPEND) != 0)
+    {
+      return false;
+    }
+
+  in_pos  = lseek(seal->fd_in, 0, SEEK_CUR);
+  out_pos = lseek(seal->fd_out, 0, SEEK_CUR);
+  if (in_pos < 0 || out_pos < 0)
+    {
+      return false;
+    }
+
+  seal->in_base  = in_pos;
+  seal->out_base = out_pos;
+  *size = sb_in.st_size > in_pos ? sb_in.st_size - in_pos : 0;
+
+  return true;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypt and authenticate the input with a new random nonce.
+ *
+ * @param context key context, the key must be 32 bytes
+ * @param fd_in input file descriptor
+ * @param fd_out output file descriptor
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_seal(struct crypt_context *context, int fd_in, int fd_out)
+{
+  struct seal_s seal;
+  uint8_t nonce[CRYPT_CHACHA20_NONCE];
+  uint64_t size;
+  int ret;
+
+  /* A nonce must never repeat under a key, so it is never reused */
+
+  if (getrandom(nonce, sizeof(nonce), 0) != sizeof(nonce))
+    {
+      fprintf(stderr, "Error: failed to get a random nonce\n");
+      return -EIO;
+    }
+
+  ret = seal_setup(&seal, context, nonce, SEAL_CHUNK);
+  if (ret < 0)
+    {
+      return ret;
+    }
+
+  seal.open   = false;
+  seal.fd_in  = fd_in;
+  seal.fd_out = fd_out;
+
+  ret = write_full(fd_out, seal.header, SEAL_HEADER_SIZE);
+  if (ret < 0)
+    {
+      fprintf(stderr, "Error: failed to write output\n");
+    }
+  else if (seal_seekable(&seal, &size))
+    {
+      seal.length  = size;
+      seal.nchunks = size == 0 ? 1 : (size + SEAL_CHUNK - 1) / SEAL_CHUNK;
+      ret = seal_parallel(&seal);
+    }
+  else
+    {
+      ret = seal_stream(&seal);
+    }
+
+  wipe(seal.key, sizeof(seal.key));
+  wipe(&seal.context, sizeof(seal.context));
+
+  return ret;
+}
+
+/**
+ * @brief Check and decrypt the output of crypt_seal().
+ *
+ * @param context key context, the key must be 32 bytes
+ * @param fd_in input file descriptor
+ * @param fd_out output file descriptor
+ * @return Success (OK = 0), -EBADMSG if the input is not authentic, or a
+ *         negative error
+ */
+
+int crypt_open(struct crypt_context *context, int fd_in, int fd_out)
+{
+  struct seal_s seal;
+  uint8_t header[SEAL_HEADER_SIZE];
+  uint64_t chunk;
+  uint64_t size;
+  uint64_t stride;
+  uint64_t tail;
+  ssize_t nread;
+  int ret;
+
+  nread = read_full(fd_in, header, sizeof(header));
+  if (nread != sizeof(header) ||
+      memcmp(header, SEAL_MAGIC, SEAL_MAGIC_LEN) != 0)
+    {
+      fprintf(stderr, "Error: input is not a sealed file\n");
+      return nread < 0 ? nread : -EINVAL;
+    }
+
+  chunk = be_decode(header + SEAL_MAGIC_LEN + CRYPT_CHACHA20_NONCE, 4);
+  if (chunk == 0 || chunk % 64 != 0 || chunk > SEAL_CHUNK_MAX)
+    {
+      fprintf(stderr, "Error: invalid chunk size %llu\n",
+              (unsigned long long)chunk);
+      return -EINVAL;
+    }
+
+  ret = seal_setup(&seal, context, header + SEAL_MAGIC_LEN, chunk);
+  if (ret < 0)
+    {
+      return ret;
+    }
+
+  /* The reserved bytes are checked by the tags, as part of the header */
+
+  memcpy(seal.header, header, SEAL_HEADER_SIZE);
+  seal.open   = true;
+  seal.fd_in  = fd_in;
+  seal.fd_out = fd_out;
+
+  if (seal_seekable(&seal, &size))
+    {
+      stride = chunk + CRYPT_AEAD_TAG;
+      tail   = size % stride;
+
+      if (size < CRYPT_AEAD_TAG || (tail > 0 && tail < CRYPT_AEAD_TAG))
+        {
+          fprintf(stderr, "Error: sealed input is truncated\n");
+          ret = -EBADMSG;
+        }
+      else
+        {
+          seal.nchunks = (size + stride - 1) / stride;
+          seal.length  = size - seal.nchunks * CRYPT_AEAD_TAG;
+          ret = seal_parallel(&seal);
+        }
+    }
+  else
+    {
+      ret = seal_stream(&seal);
+    }
+
+  wipe(seal.key, sizeof(seal.key));
+  wipe(&seal.context, sizeof(seal.context));
+
+  return ret;
+}
@@ -0,0 +1,196 @@
+/****************************************************************************
+ * @file  src/crypt_search.c
+ *
+ * @brief Search for a pattern inside encrypted files.
+ *
+ * The ciphertext is read in windows, decrypted in memory and searched
+ * there, so the plaintext never reaches the disk.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "crypt_tool.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+/* Window read and decrypted at once. Sized to stay in L2 cache while it
+ * is searched and must be a multiple of CRYPT_BLOCK_SIZE.
+ */
+
+#define SEARCH_WINDOW_SIZE (256 * 1024)
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @struct search_s
+ *  @brief This structure saves the state shared by the search threads
+ *  @var search_s::context
+ *  Member 'context' is the key context used to decrypt
+ *  @var search_s::pattern
+ *  Member 'pattern' is the plaintext pattern to look for
+ *  @var search_s::patlen
+ *  Member 'patlen' is the length of the pattern
+ *  @var search_s::files
+ *  Member 'files' is the list of files to search
+ *  @var search_s::found
+ *  Member 'found' is set when some file matched
+ */
+
+struct search_s
+{
+  struct crypt_context *context; /* key context used to decrypt     */
+  const char *pattern;           /* plaintext pattern to look for   */
+  size_t patlen;                 /* length of the pattern           */
+  char **files;                  /* list of files to search         */
+  int found;                     /* set when some file matched      */
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Search one encrypted file and print the offset of every match.
+ *
+ * @param arg pointer to the shared search_s state
+ * @param idx index of the file to search
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int search_file(void *arg, unsigned idx)
+{
+  struct search_s *search = arg;
+  const char *filename = search->files[idx];
+  uint8_t *cbuf;
+  uint8_t *pbuf;
+  uint64_t offset = 0; /* file offset of the next window             */
+  uint64_t base = 0;   /* file offset of pbuf[0]                     */
+  size_t keep = 0;     /* bytes carried over from the previous window */
+  ssize_t nread;
+  int ret = 0;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    {
+      fprintf(stderr, "Error: failed to open file %s\n", filename);
+      return -ENOENT;
+    }
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  /* The plaintext buffer also holds the tail of the previous window, so
+   * a match crossing the window boundary is still found.
+   */
+
+  cbuf = malloc(SEARCH_WINDOW_SIZE);
+  pbuf = malloc(SEARCH_WINDOW_SIZE + search->patlen);
+  if (cbuf == NULL || pbuf == NULL)
+    {
+      fprintf(stderr, "Error: failed to allocate search buffers\n");
+      ret = -ENOMEM;
+      goto out;
+    }
+
+  while ((nread = read_full(fd, cbuf, SEARCH_WINDOW_SIZE)) > 0)
+    {
+      uint8_t *p = pbuf;
+      size_t avail = keep + nread;
+
+      crypt_file_at(search->context, pbuf + keep, cbuf, nread, offset);
+      offset += nread;
+
+      while ((p = memmem(p, avail - (p - pbuf), search->pattern,
+                         search->patlen)) != NULL)
+        {
+          printf("%s:%llu\n", filename,
+                 (unsigned long long)(base + (p - pbuf)));
+          __atomic_store_n(&search->found, 1, __ATOMIC_RELAXED);
+          p++;
+        }
+
+      /* Keep what could still be the start of a match */
+
+      keep = avail < search->patlen ? avail : search->patlen - 1;
+      memmove(pbuf, pbuf + avail - keep, keep);
+      base += avail - keep;
+    }
+
+  if (nread < 0)
+    {
+      fprintf(stderr, "Error: failed to read file %s\n", filename);
+      ret = nread;
+    }
+
+out:
+
+  /* Don't leave plaintext behind in freed memory */
+
+  if (pbuf != NULL)
+    {
+      wipe(pbuf, SEARCH_WINDOW_SIZE + search->patlen);
+    }
+
+  free(cbuf);
+  free(pbuf);
+  close(fd);
+
+  return ret;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Search a pattern inside encrypted files without storing plaintext.
+ *
+ * @param context key context used to decrypt the files
+ * @param pattern plaintext pattern to look for
+ * @param files list of encrypted files
+ * @param nfiles amount of files in the list
+ * @return 0 if found, 1 if not found or a negative error
+ */
+
+int crypt_search(struct crypt_context *context, const char *pattern,
+                 char **files, int nfiles)
+{
+  struct search_s search;
+  int ret;
+
+  if (pattern[0] == '\0' || nfiles <= 0)
+    {
+      fprintf(stderr, "Error: search needs a pattern and input files\n");
+      return -EINVAL;
+    }
+
+  search.context = context;
+  search.pattern = pattern;
+  search.patlen  = strlen(pattern);
+  search.files   = files;
+  search.found   = 0;
+
+  /* Every file is searched by its own worker */
+
+  ret = run_parallel(nfiles, search_file, &search);
+  if (ret < 0)
+    {
+      return ret;
+    }
+
+  return search.found ? 0 : 1;
+}
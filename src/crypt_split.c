@@ -0,0 +1,413 @@
+/****************************************************************************
+ * @file  src/crypt_split.c
+ *
+ * @brief Split a file into independently decryptable encrypted shards.
+ *
+ * Every shard starts with a header telling which slice of the original
+ * file it holds, followed by that slice encrypted with the keystream of
+ * its original offset. Shards are written and joined in parallel.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "crypt_tool.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define SHARD_MAGIC        "ACRSHARD"
+#define SHARD_MAGIC_LEN    8
+#define SHARD_HEADER_SIZE  (SHARD_MAGIC_LEN + 3 * 8)
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @struct shard_s
+ *  @brief Slice of the original file held by a shard
+ *  @var shard_s::offset
+ *  Member 'offset' is the position of the slice in the original file
+ *  @var shard_s::length
+ *  Member 'length' is the size of the slice
+ *  @var shard_s::total
+ *  Member 'total' is the size of the original file
+ */
+
+struct shard_s
+{
+  uint64_t offset; /* position of the slice in the original file */
+  uint64_t length; /* size of the slice                          */
+  uint64_t total;  /* size of the original file                  */
+};
+
+/** @struct split_s
+ *  @brief State shared by the split and join workers
+ *  @var split_s::context
+ *  Member 'context' is the key context
+ *  @var split_s::fd
+ *  Member 'fd' is the original file, read by split, written by join
+ *  @var split_s::prefix
+ *  Member 'prefix' is the shard name prefix used by split
+ *  @var split_s::files
+ *  Member 'files' is the list of shards given to join
+ *  @var split_s::shards
+ *  Member 'shards' is the slice of every shard
+ */
+
+struct split_s
+{
+  struct crypt_context *context; /* key context                     */
+  int fd;                        /* original file                   */
+  const char *prefix;            /* shard name prefix (split)       */
+  char **files;                  /* list of shards (join)           */
+  struct shard_s *shards;        /* slice of every shard            */
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encode the header of a shard.
+ *
+ * @param shard slice held by the shard
+ * @param header buffer of SHARD_HEADER_SIZE bytes
+ */
+
+static void shard_encode(const struct shard_s *shard, uint8_t *header)
+{
+  memcpy(header, SHARD_MAGIC, SHARD_MAGIC_LEN);
+  be_encode(header + SHARD_MAGIC_LEN, shard->offset, 8);
+  be_encode(header + SHARD_MAGIC_LEN + 8, shard->length, 8);
+  be_encode(header + SHARD_MAGIC_LEN + 16, shard->total, 8);
+}
+
+/**
+ * @brief Read and decode the header of a shard.
+ *
+ * @param fd file descriptor of the shard
+ * @param shard pointer to save the slice held by the shard
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int shard_decode(int fd, struct shard_s *shard)
+{
+  uint8_t header[SHARD_HEADER_SIZE];
+
+  if (pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header, SHARD_MAGIC, SHARD_MAGIC_LEN) != 0)
+    {
+      return -EINVAL;
+    }
+
+  shard->offset = be_decode(header + SHARD_MAGIC_LEN, 8);
+  shard->length = be_decode(header + SHARD_MAGIC_LEN + 8, 8);
+  shard->total  = be_decode(header + SHARD_MAGIC_LEN + 16, 8);
+
+  return 0;
+}
+
+/**
+ * @brief Worker writing one shard.
+ *
+ * @param arg pointer to the shared split_s state
+ * @param idx index of the shard
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int split_worker(void *arg, unsigned idx)
+{
+  struct split_s *split = arg;
+  struct shard_s *shard = &split->shards[idx];
+  uint8_t header[SHARD_HEADER_SIZE];
+  char *name;
+  int ret;
+  int fd;
+
+  name = malloc(strlen(split->prefix) + 16);
+  if (name == NULL)
+    {
+      return -ENOMEM;
+    }
+
+  sprintf(name, "%s.%03u", split->prefix, idx);
+
+  fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    {
+      fprintf(stderr, "Error: failed to open shard %s\n", name);
+      free(name);
+      return -EAGAIN;
+    }
+
+  shard_encode(shard, header);
+  ret = write_full(fd, header, sizeof(header));
+  if (ret == 0)
+    {
+      ret = crypt_copy(split->context, split->fd, shard->offset, fd,
+                       SHARD_HEADER_SIZE, shard->length, shard->offset,
+                       NULL, NULL);
+    }
+
+  if (ret < 0)
+    {
+      fprintf(stderr, "Error: failed to write shard %s\n", name);
+    }
+
+  close(fd);
+  free(name);
+
+  return ret;
+}
+
+/**
+ * @brief Worker decrypting one shard into the original file.
+ *
+ * @param arg pointer to the shared split_s state
+ * @param idx index of the shard
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int join_worker(void *arg, unsigned idx)
+{
+  struct split_s *split = arg;
+  struct shard_s *shard = &split->shards[idx];
+  int ret;
+  int fd;
+
+  fd = open(split->files[idx], O_RDONLY);
+  if (fd < 0)
+    {
+      return -ENOENT;
+    }
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  ret = crypt_copy(split->context, fd, SHARD_HEADER_SIZE, split->fd,
+                   shard->offset, shard->length, shard->offset, NULL, NULL);
+  if (ret < 0)
+    {
+      fprintf(stderr, "Error: failed to join shard %s\n", split->files[idx]);
+    }
+
+  close(fd);
+
+  return ret;
+}
+
+/**
+ * @brief Order shards by offset, for qsort().
+ */
+
+static int shard_compare(const void *a, const void *b)
+{
+  const struct shard_s *sa = a;
+  const struct shard_s *sb = b;
+
+  if (sa->offset != sb->offset)
+    {
+      return sa->offset < sb->offset ? -1 : 1;
+    }
+
+  return 0;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypt ifile into shards of 'spec' bytes named <prefix>.NNN.
+ *
+ * @param context key context used to encrypt
+ * @param spec shard size, accepts K/M/G/T suffixes
+ * @param ifile input file name
+ * @param prefix shard name prefix
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_split(struct crypt_context *context, const char *spec,
+                const char *ifile, const char *prefix)
+{
+  struct split_s split;
+  struct stat sb;
+  uint64_t size;
+  uint64_t nshards;
+  uint64_t i;
+  int ret;
+
+  if (parse_size(spec, &size) < 0 || size == 0 || strchr(spec, ':'))
+    {
+      fprintf(stderr, "Error: invalid shard size '%s'\n", spec);
+      return -EINVAL;
+    }
+
+  if (ifile == NULL || prefix == NULL)
+    {
+      fprintf(stderr, "Error: --split needs -i and -o files\n");
+      return -EINVAL;
+    }
+
+  split.fd = open(ifile, O_RDONLY);
+  if (split.fd < 0 || fstat(split.fd, &sb) < 0)
+    {
+      fprintf(stderr, "Error: failed to open input file %s\n", ifile);
+      return -ENOENT;
+    }
+
+  /* An empty file still gets one (empty) shard */
+
+  nshards = sb.st_size > 0 ? (sb.st_size + size - 1) / size : 1;
+  if (nshards > 100000)
+    {
+      fprintf(stderr, "Error: too many shards, use a bigger size\n");
+      close(split.fd);
+      return -EINVAL;
+    }
+
+  split.context = context;
+  split.prefix  = prefix;
+  split.files   = NULL;
+  split.shards  = malloc(nshards * sizeof(struct shard_s));
+  if (split.shards == NULL)
+    {
+      close(split.fd);
+      return -ENOMEM;
+    }
+
+  for (i = 0; i < nshards; i++)
+    {
+      split.shards[i].offset = i * size;
+      split.shards[i].length = sb.st_size - i * size < size ?
+                               sb.st_size - i * size : size;
+      split.shards[i].total  = sb.st_size;
+    }
+
+  ret = run_parallel(nshards, split_worker, &split);
+
+  free(split.shards);
+  close(split.fd);
+
+  return ret;
+}
+
+/**
+ * @brief Decrypt shards concurrently and rebuild the original file.
+ *
+ * @param context key context used to decrypt
+ * @param files shard files, in any order
+ * @param nfiles amount of shard files
+ * @param ofile output file name
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_join(struct crypt_context *context, char **files, int nfiles,
+               const char *ofile)
+{
+  struct split_s split;
+  struct shard_s *sorted;
+  uint64_t covered = 0;
+  int ret = 0;
+  int i;
+  int fd;
+
+  if (nfiles <= 0 || ofile == NULL)
+    {
+      fprintf(stderr, "Error: --join needs -o file and shard files\n");
+      return -EINVAL;
+    }
+
+  split.context = context;
+  split.prefix  = NULL;
+  split.files   = files;
+  split.shards  = malloc(nfiles * sizeof(struct shard_s));
+  sorted        = malloc(nfiles * sizeof(struct shard_s));
+  if (split.shards == NULL || sorted == NULL)
+    {
+      free(split.shards);
+      free(sorted);
+      return -ENOMEM;
+    }
+
+  /* Read all headers first, so a missing shard is found before writing */
+
+  for (i = 0; i < nfiles && ret == 0; i++)
+    {
+      fd = open(files[i], O_RDONLY);
+      if (fd < 0 || shard_decode(fd, &split.shards[i]) < 0)
+        {
+          fprintf(stderr, "Error: %s is not a shard\n", files[i]);
+          ret = -EINVAL;
+        }
+
+      if (fd >= 0)
+        {
+          close(fd);
+        }
+    }
+
+  if (ret == 0)
+    {
+      memcpy(sorted, split.shards, nfiles * sizeof(struct shard_s));
+      qsort(sorted, nfiles, sizeof(struct shard_s), shard_compare);
+
+      for (i = 0; i < nfiles; i++)
+        {
+          if (sorted[i].offset != covered || sorted[i].total != sorted[0].total)
+            {
+              break;
+            }
+
+          covered += sorted[i].length;
+        }
+
+      if (i < nfiles || covered != sorted[0].total)
+        {
+          fprintf(stderr, "Error: shards are missing or don't match, "
+                          "first missing byte at %llu\n",
+                  (unsigned long long)covered);
+          ret = -EINVAL;
+        }
+    }
+
+  if (ret == 0)
+    {
+      split.fd = open(ofile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (split.fd < 0)
+        {
+          fprintf(stderr, "Error: failed to open output file %s\n", ofile);
+          ret = -EAGAIN;
+        }
+      else
+        {
+          /* Size it upfront so the workers fill it in any order */
+
+          if (ftruncate(split.fd, sorted[0].total) < 0)
+            {
+              ret = -errno;
+            }
+          else
+            {
+              ret = run_parallel(nfiles, join_worker, &split);
+            }
+
+          close(split.fd);
+        }
+    }
+
+  free(split.shards);
+  free(sorted);
+
+  return ret;
+}
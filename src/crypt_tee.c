@@ -0,0 +1,394 @@
+/****************************************************************************
+ * @file  src/crypt_tee.c
+ *
+ * @brief Encrypt once and write the result to several outputs.
+ *
+ * The ciphertext of every window is produced a single time. Regular files
+ * are written from that same buffer, while pipes share one copy of it:
+ * the window is written once into an internal pipe, duplicated to all the
+ * output pipes but the last with tee(2) and moved to the last with
+ * splice(2), so the kernel pages are shared instead of copied again.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "crypt_tool.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+/* Multiple of CRYPT_BLOCK_SIZE, so windows keep the block keystream */
+
+#define TEE_WINDOW_SIZE  (1024 * 1024)
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @struct tee_sink_s
+ *  @brief One output of the tee
+ *  @var tee_sink_s::fd
+ *  Member 'fd' is the file descriptor of the output
+ *  @var tee_sink_s::ispipe
+ *  Member 'ispipe' the output is a pipe, fed by tee(2) or splice(2)
+ *  @var tee_sink_s::name
+ *  Member 'name' is the output name, for error messages
+ *  @var tee_sink_s::wb
+ *  Member 'wb' is the writeback state of the output
+ */
+
+struct tee_sink_s
+{
+  int fd;                /* file descriptor of the output          */
+  bool ispipe;           /* output is a pipe, fed by tee or splice */
+  const char *name;      /* output name, for error messages        */
+  struct writeback_s wb; /* writeback state of the output          */
+};
+
+/** @struct tee_s
+ *  @brief State of the tee
+ *  @var tee_s::sinks
+ *  Member 'sinks' is the list of outputs
+ *  @var tee_s::nsinks
+ *  Member 'nsinks' is the amount of outputs
+ *  @var tee_s::npipes
+ *  Member 'npipes' is the amount of outputs that are pipes
+ *  @var tee_s::pipe
+ *  Member 'pipe' internal pipe holding the window shared by the outputs
+ *  @var tee_s::pipesize
+ *  Member 'pipesize' is the capacity of the internal pipe
+ */
+
+struct tee_s
+{
+  struct tee_sink_s *sinks; /* list of outputs                      */
+  int nsinks;               /* amount of outputs                    */
+  int npipes;               /* amount of outputs that are pipes     */
+  int pipe[2];              /* internal pipe shared by the outputs  */
+  size_t pipesize;          /* capacity of the internal pipe        */
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Open the outputs, a dash is the standard output.
+ *
+ * @param state tee state to fill
+ * @param names output names
+ * @param nnames amount of outputs
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int tee_open(struct tee_s *state, char **names, int nnames)
+{
+  struct stat sb;
+  int pipesize;
+  int i;
+
+  state->sinks = calloc(nnames, sizeof(struct tee_sink_s));
+  if (state->sinks == NULL)
+    {
+      return -ENOMEM;
+    }
+
+  umask(0);
+
+  for (i = 0; i < nnames; i++)
+    {
+      struct tee_sink_s *sink = &state->sinks[i];
+
+      sink->name = names[i];
+      if (strcmp(names[i], "-") == 0)
+        {
+          sink->fd = dup(1);
+        }
+      else
+        {
+          sink->fd = open(names[i], O_WRONLY | O_TRUNC | O_CREAT, 0666);
+        }
+
+      if (sink->fd < 0)
+        {
+          fprintf(stderr, "Error: failed to open output file %s\n",
+                  names[i]);
+          return -errno;
+        }
+
+      state->nsinks++;
+      writeback_begin(&sink->wb, sink->fd, 0);
+
+      if (fstat(sink->fd, &sb) == 0 && S_ISFIFO(sb.st_mode))
+        {
+          sink->ispipe = true;
+          state->npipes++;
+        }
+    }
+
+  /* A single pipe is written directly, only share with two or more */
+
+  if (state->npipes < 2)
+    {
+      return 0;
+    }
+
+  if (pipe(state->pipe) < 0)
+    {
+      return -errno;
+    }
+
+  fcntl(state->pipe[1], F_SETPIPE_SZ, TEE_WINDOW_SIZE);
+  pipesize = fcntl(state->pipe[1], F_GETPIPE_SZ);
+  state->pipesize = pipesize > 0 ? pipesize : 65536;
+
+  return 0;
+}
+
+/**
+ * @brief Close the outputs and the internal pipe.
+ *
+ * @param state tee state
+ */
+
+static void tee_close(struct tee_s *state)
+{
+  int i;
+
+  for (i = 0; i < state->nsinks; i++)
+    {
+      close(state->sinks[i].fd);
+    }
+
+  if (state->pipe[0] != -1)
+    {
+      close(state->pipe[0]);
+      close(state->pipe[1]);
+    }
+
+  free(state->sinks);
+}
+
+/**
+ * @brief Share a chunk between the output pipes.
+ *
+ * The chunk is copied once into the internal pipe. tee(2) duplicates its
+ * pages to every output pipe but the last, without consuming them, then
+ * splice(2) moves them to the last one, which empties the internal pipe.
+ * When tee(2) could only duplicate part of the chunk, the rest is written
+ * from the buffer.
+ *
+ * @param state tee state
+ * @param buf chunk of ciphertext, up to the internal pipe capacity
+ * @param len size of the chunk
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int tee_pipes(struct tee_s *state, const uint8_t *buf, size_t len)
+{
+  struct tee_sink_s *last = NULL;
+  ssize_t ret;
+  size_t done;
+  int i;
+
+  ret = write_full(state->pipe[1], buf, len);
+  if (ret < 0)
+    {
+      return ret;
+    }
+
+  for (i = 0; i < state->nsinks; i++)
+    {
+      struct tee_sink_s *sink = &state->sinks[i];
+
+      if (!sink->ispipe)
+        {
+          continue;
+        }
+
+      if (last != NULL)
+        {
+          /* tee(2) always starts from the head of the internal pipe */
+
+          ret = tee(state->pipe[0], last->fd, len, 0);
+          done = ret > 0 ? ret : 0;
+          if (done < len && write_full(last->fd, buf + done, len - done) < 0)
+            {
+              fprintf(stderr, "Error: failed to write %s\n", last->name);
+              return -EIO;
+            }
+        }
+
+      last = sink;
+    }
+
+  for (done = 0; done < len; done += ret)
+    {
+      ret = splice(state->pipe[0], NULL, last->fd, NULL, len - done,
+                   SPLICE_F_MOVE);
+      if (ret <= 0)
+        {
+          fprintf(stderr, "Error: failed to write %s\n", last->name);
+          return ret < 0 ? -errno : -EIO;
+        }
+    }
+
+  /* The write to the internal pipe was accounted for one of them */
+
+  throttle_io(THROTTLE_WRITE, len * (state->npipes - 1));
+
+  return 0;
+}
+
+/**
+ * @brief Write a window of ciphertext to all the outputs.
+ *
+ * @param state tee state
+ * @param buf window of ciphertext
+ * @param len size of the window
+ * @return Success (OK = 0) or a negative error
+ */
+
+static int tee_write(struct tee_s *state, const uint8_t *buf, size_t len)
+{
+  size_t chunk;
+  size_t done;
+  int ret;
+  int i;
+
+  /* Files, and a lone pipe, are written from the same buffer */
+
+  for (i = 0; i < state->nsinks; i++)
+    {
+      struct tee_sink_s *sink = &state->sinks[i];
+
+      if (sink->ispipe && state->npipes >= 2)
+        {
+          continue;
+        }
+
+      if (write_full(sink->fd, buf, len) < 0 ||
+          writeback_update(&sink->wb, len) < 0)
+        {
+          fprintf(stderr, "Error: failed to write %s\n", sink->name);
+          return -EIO;
+        }
+    }
+
+  if (state->npipes < 2)
+    {
+      return 0;
+    }
+
+  for (done = 0; done < len; done += chunk)
+    {
+      chunk = len - done < state->pipesize ? len - done : state->pipesize;
+
+      ret = tee_pipes(state, buf + done, chunk);
+      if (ret < 0)
+        {
+          return ret;
+        }
+    }
+
+  return 0;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Encrypt the input once and write it to several outputs.
+ *
+ * @param context key context used to encrypt
+ * @param fd_in input file descriptor
+ * @param outs output names, a dash is the standard output
+ * @param nouts amount of outputs
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_tee(struct crypt_context *context, int fd_in, char **outs,
+              int nouts)
+{
+  struct tee_s state;
+  uint8_t *ibuf;
+  uint8_t *obuf;
+  uint64_t offset = 0;
+  ssize_t nread;
+  int ret;
+  int i;
+
+  memset(&state, 0, sizeof(state));
+  state.pipe[0] = -1;
+  state.pipe[1] = -1;
+
+  ibuf = malloc(TEE_WINDOW_SIZE);
+  obuf = malloc(TEE_WINDOW_SIZE);
+  if (ibuf == NULL || obuf == NULL)
+    {
+      fprintf(stderr, "Error: failed to allocate tee buffers\n");
+      ret = -ENOMEM;
+      goto errout;
+    }
+
+  ret = tee_open(&state, outs, nouts);
+  if (ret < 0)
+    {
+      goto errout;
+    }
+
+  while ((nread = read_full(fd_in, ibuf, TEE_WINDOW_SIZE)) > 0)
+    {
+      ret = crypt_file_at(context, obuf, ibuf, nread, offset);
+      if (ret < 0)
+        {
+          fprintf(stderr, "Error: failed to encrypt, errno = %d\n", ret);
+          goto errout;
+        }
+
+      ret = tee_write(&state, obuf, nread);
+      if (ret < 0)
+        {
+          goto errout;
+        }
+
+      offset += nread;
+    }
+
+  if (nread < 0)
+    {
+      fprintf(stderr, "Error: failed to read input\n");
+      ret = nread;
+      goto errout;
+    }
+
+  for (i = 0; i < state.nsinks; i++)
+    {
+      if (writeback_end(&state.sinks[i].wb) < 0)
+        {
+          fprintf(stderr, "Error: failed to sync %s\n", state.sinks[i].name);
+          ret = -EIO;
+        }
+    }
+
+errout:
+  tee_close(&state);
+  free(ibuf);
+  free(obuf);
+  return ret;
+}
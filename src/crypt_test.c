@@ -8,7 +8,15 @@
  * Included Files
  ****************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 /* Throw The Switch Unity */
 
@@ -34,6 +42,13 @@ uint8_t decbuf[MAX_BUF_SZ];
 
 struct crypt_context ctx;
 
+/* Completions of the pool test, 'hold' blocks the workers in 'done' */
+
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+unsigned pool_done;
+int pool_hold;
+
 /****************************************************************************
  * Private Functions
  ****************************************************************************/
@@ -191,6 +206,932 @@ void run_test_coded5(void)
   TEST_ASSERT_EQUAL_MEMORY(decbuf, expected, sizeof(coded5));
 }
 
+void run_test_offset(void)
+{
+  uint8_t plain[3 * MAX_BUF_SZ];
+  uint8_t whole[3 * MAX_BUF_SZ];
+  uint8_t part[3 * MAX_BUF_SZ];
+  unsigned i;
+
+  for (i = 0; i < sizeof(plain); i++)
+    {
+      plain[i] = i * 7 + 3;
+    }
+
+  /* Any split of the buffer must give the same bytes as one call */
+
+  crypt_buffer(&ctx, whole, plain, sizeof(plain));
+
+  crypt_buffer_at(&ctx, part, plain, 37, 0);
+  crypt_buffer_at(&ctx, part + 37, plain + 37, 1500, 37);
+  crypt_buffer_at(&ctx, part + 1537, plain + 1537,
+                  sizeof(plain) - 1537, 1537);
+
+  TEST_ASSERT_EQUAL_MEMORY(whole, part, sizeof(plain));
+}
+
+void run_test_file_offset(void)
+{
+  uint8_t plain[3 * MAX_BUF_SZ];
+  uint8_t whole[3 * MAX_BUF_SZ];
+  uint8_t part[3 * MAX_BUF_SZ];
+  unsigned i;
+
+  for (i = 0; i < sizeof(plain); i++)
+    {
+      plain[i] = i * 13 + 1;
+    }
+
+  /* The crypt program restarts the keystream every CRYPT_BLOCK_SIZE */
+
+  for (i = 0; i < sizeof(plain); i += CRYPT_BLOCK_SIZE)
+    {
+      crypt_buffer(&ctx, whole + i, plain + i, CRYPT_BLOCK_SIZE);
+    }
+
+  crypt_file_at(&ctx, part, plain, 1000, 0);
+  crypt_file_at(&ctx, part + 1000, plain + 1000, 1100, 1000);
+  crypt_file_at(&ctx, part + 2100, plain + 2100,
+                sizeof(plain) - 2100, 2100);
+
+  TEST_ASSERT_EQUAL_MEMORY(whole, part, sizeof(plain));
+}
+
+void run_test_cache(void)
+{
+  static uint8_t plain[50000];
+  static uint8_t cipher[50000];
+  uint8_t buf[3 * CRYPT_CACHE_PAGE_SIZE];
+  struct crypt_cache *cache;
+  char path[] = "/tmp/cryptest_XXXXXX";
+  uint64_t offset;
+  unsigned i;
+  int fd;
+
+  for (i = 0; i < sizeof(plain); i++)
+    {
+      plain[i] = i * 31 + (i >> 8);
+    }
+
+  crypt_file_at(&ctx, cipher, plain, sizeof(plain), 0);
+
+  fd = mkstemp(path);
+  TEST_ASSERT_TRUE(fd >= 0);
+  unlink(path);
+  TEST_ASSERT_EQUAL(sizeof(cipher), write(fd, cipher, sizeof(cipher)));
+
+  /* A tiny cache forces evictions on every shard */
+
+  TEST_ASSERT_EQUAL(0, crypt_cache_open(&cache, &ctx, fd, 16));
+
+  /* Sequential reads crossing pages, triggering readahead */
+
+  for (offset = 0; offset < sizeof(plain); offset += 1000)
+    {
+      ssize_t n = crypt_cache_pread(cache, buf, 1000, offset);
+
+      TEST_ASSERT_EQUAL(sizeof(plain) - offset < 1000 ?
+                        sizeof(plain) - offset : 1000, n);
+      TEST_ASSERT_EQUAL_MEMORY(plain + offset, buf, n);
+    }
+
+  /* Random reads, some past EOF */
+
+  for (i = 0; i < 200; i++)
+    {
+      size_t count = 1 + (i * 7919) % (sizeof(buf) - 1);
+      ssize_t n;
+
+      offset = (i * 104729) % (sizeof(plain) + 100);
+      n = crypt_cache_pread(cache, buf, count, offset);
+
+      if (offset >= sizeof(plain))
+        {
+          TEST_ASSERT_EQUAL(0, n);
+          continue;
+        }
+
+      TEST_ASSERT_EQUAL(sizeof(plain) - offset < count ?
+                        sizeof(plain) - offset : count, n);
+      TEST_ASSERT_EQUAL_MEMORY(plain + offset, buf, n);
+    }
+
+  crypt_cache_close(cache);
+  close(fd);
+}
+
+void run_test_packet(void)
+{
+  uint8_t plain[4][100];
+  uint8_t wire[4][CRYPT_PACKET_HEADER + 100];
+  uint64_t seqs[4] = { 7, 1000000, 8, 3 };
+  struct mmsghdr msgs[4];
+  struct iovec iov[4][2];
+  unsigned i;
+  int j;
+
+  /* Seal every packet with its sequence number in front */
+
+  for (i = 0; i < 4; i++)
+    {
+      memset(plain[i], 'a' + i, sizeof(plain[i]));
+      for (j = 0; j < CRYPT_PACKET_HEADER; j++)
+        {
+          wire[i][j] = seqs[i] >> (8 * (CRYPT_PACKET_HEADER - 1 - j));
+        }
+
+      crypt_packet(&ctx, seqs[i], wire[i] + CRYPT_PACKET_HEADER,
+                   plain[i], sizeof(plain[i]));
+    }
+
+  /* Receive them out of order, split in two buffers inside the header */
+
+  for (i = 0; i < 4; i++)
+    {
+      unsigned k = 3 - i;
+
+      iov[i][0].iov_base = wire[k];
+      iov[i][0].iov_len  = 5;
+      iov[i][1].iov_base = wire[k] + 5;
+      iov[i][1].iov_len  = sizeof(wire[k]) - 5;
+
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_iov    = iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 2;
+      msgs[i].msg_len            = sizeof(wire[k]);
+    }
+
+  TEST_ASSERT_EQUAL(4, crypt_packet_mmsg(&ctx, msgs, 4));
+
+  for (i = 0; i < 4; i++)
+    {
+      TEST_ASSERT_EQUAL_MEMORY(plain[i], wire[i] + CRYPT_PACKET_HEADER,
+                               sizeof(plain[i]));
+    }
+
+  /* Past CRYPT_PACKET_SEQ_MAX the keystream would be the one of 0 */
+
+  TEST_ASSERT_EQUAL(0, crypt_packet(&ctx, CRYPT_PACKET_SEQ_MAX,
+                                    wire[0] + CRYPT_PACKET_HEADER,
+                                    plain[0], sizeof(plain[0])));
+  TEST_ASSERT_EQUAL(-EOVERFLOW,
+                    crypt_packet(&ctx, CRYPT_PACKET_SEQ_MAX + 1,
+                                 wire[0] + CRYPT_PACKET_HEADER, plain[0],
+                                 sizeof(plain[0])));
+
+  memset(wire[0], 0xff, CRYPT_PACKET_HEADER);
+  memcpy(wire[0] + CRYPT_PACKET_HEADER, plain[0], sizeof(plain[0]));
+  msgs[0].msg_hdr.msg_iov    = iov[0];
+  msgs[0].msg_hdr.msg_iovlen = 1;
+  msgs[0].msg_len            = sizeof(wire[0]);
+  iov[0][0].iov_base = wire[0];
+  iov[0][0].iov_len  = sizeof(wire[0]);
+
+  TEST_ASSERT_EQUAL(0, crypt_packet_mmsg(&ctx, msgs, 1));
+  TEST_ASSERT_EQUAL(0, msgs[0].msg_len);
+  TEST_ASSERT_EQUAL_MEMORY(plain[0], wire[0] + CRYPT_PACKET_HEADER,
+                           sizeof(plain[0]));
+}
+
+void run_test_small(void)
+{
+  uint8_t plain[CRYPT_SMALL_MAX + 10];
+  uint8_t expect[sizeof(plain)];
+  uint8_t small[sizeof(plain)];
+  uint64_t offsets[4] = { 0, 1, 5, 1000001 };
+  size_t len;
+  unsigned i;
+
+  for (i = 0; i < sizeof(plain); i++)
+    {
+      plain[i] = i * 29 + 1;
+    }
+
+  /* Inline and library paths must agree, below and above the limit */
+
+  for (i = 0; i < 4; i++)
+    {
+      for (len = 0; len <= sizeof(plain); len++)
+        {
+          crypt_buffer_at(&ctx, expect, plain, len, offsets[i]);
+          memset(small, 0, sizeof(small));
+          TEST_ASSERT_EQUAL(0, crypt_small_at(&ctx, small, plain, len,
+                                              offsets[i]));
+          if (len > 0)
+            {
+              TEST_ASSERT_EQUAL_MEMORY(expect, small, len);
+            }
+        }
+    }
+
+  crypt_buffer(&ctx, expect, plain, 1);
+  TEST_ASSERT_EQUAL(0, crypt_small(&ctx, small, plain, 1));
+  TEST_ASSERT_EQUAL_HEX8(expect[0], small[0]);
+
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_small(NULL, small, plain, 1));
+}
+
+/* Engine registered by the test, copies the input */
+
+int copy_crypt(const struct crypt_context *context, uint8_t *output,
+               const uint8_t *input, size_t length, uint64_t offset)
+{
+  (void)context;
+  (void)offset;
+
+  memmove(output, input, length);
+  return 0;
+}
+
+void pool_finish(struct crypt_job *job, int result)
+{
+  pthread_mutex_lock(&pool_lock);
+
+  job->arg = (void *)(intptr_t)(result == 0 ? 1 : -1);
+  pool_done++;
+  pthread_cond_broadcast(&pool_cond);
+
+  while (pool_hold)
+    {
+      pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void pool_wait(unsigned count)
+{
+  pthread_mutex_lock(&pool_lock);
+
+  while (pool_done < count)
+    {
+      pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void run_test_pool(void)
+{
+  static uint8_t plain[3 * CRYPT_POOL_SLICE + 77];
+  static uint8_t coded[sizeof(plain)];
+  static uint8_t expect[sizeof(plain)];
+  struct crypt_job jobs[5];
+  struct crypt_job *batch[5];
+  size_t sizes[5] = { sizeof(plain), 1, 0, 1000, CRYPT_POOL_SLICE };
+  size_t pos = 0;
+  unsigned i;
+
+  for (i = 0; i < sizeof(plain); i++)
+    {
+      plain[i] = i * 7 + (i >> 9);
+    }
+
+  crypt_buffer_at(&ctx, expect, plain, sizeof(plain), 12345);
+
+  TEST_ASSERT_EQUAL(0, crypt_pool_start(2));
+  TEST_ASSERT_EQUAL(-EBUSY, crypt_pool_start(2));
+
+  /* A batch of jobs over consecutive parts of the buffer */
+
+  memset(jobs, 0, sizeof(jobs));
+  for (i = 0; i < 5; i++)
+    {
+      if (pos + sizes[i] > sizeof(plain))
+        {
+          pos = 0;
+        }
+
+      jobs[i].context = &ctx;
+      jobs[i].output  = coded + pos;
+      jobs[i].input   = plain + pos;
+      jobs[i].length  = sizes[i];
+      jobs[i].offset  = 12345 + pos;
+      jobs[i].done    = pool_finish;
+      batch[i]        = &jobs[i];
+      pos += sizes[i];
+    }
+
+  /* The first job covers everything, the others only overlap it */
+
+  TEST_ASSERT_EQUAL(0, crypt_pool_submit(batch, 1));
+  pool_wait(1);
+  TEST_ASSERT_EQUAL(0, crypt_pool_submit(batch + 1, 4));
+  pool_wait(5);
+
+  for (i = 0; i < 5; i++)
+    {
+      TEST_ASSERT_EQUAL(1, (intptr_t)jobs[i].arg);
+    }
+
+  TEST_ASSERT_EQUAL_MEMORY(expect, coded, sizeof(plain));
+
+  /* Keep both workers busy so a third job stays queued, then cancel it */
+
+  pool_done = 0;
+  pool_hold = 1;
+  TEST_ASSERT_EQUAL(0, crypt_pool_submit(batch + 1, 2));
+  pool_wait(2);
+  TEST_ASSERT_EQUAL(0, crypt_pool_submit(batch + 3, 1));
+  TEST_ASSERT_EQUAL(0, crypt_pool_cancel(&jobs[3]));
+  TEST_ASSERT_EQUAL(-EBUSY, crypt_pool_cancel(&jobs[3]));
+
+  pthread_mutex_lock(&pool_lock);
+  pool_hold = 0;
+  pthread_cond_broadcast(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+
+  jobs[0].done = NULL;
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_pool_submit(batch, 1));
+}
+
+void run_test_engine(void)
+{
+  static struct crypt_engine engines[CRYPT_ENGINE_MAX];
+  static char names[CRYPT_ENGINE_MAX][8];
+  struct crypt_context copy = { ctx.key, ctx.keylen, NULL };
+  uint8_t plain[100];
+  uint8_t expect[sizeof(plain)];
+  uint8_t coded[sizeof(plain)];
+  unsigned i;
+  int ret;
+
+  for (i = 0; i < sizeof(plain); i++)
+    {
+      plain[i] = i * 3 + 5;
+    }
+
+  TEST_ASSERT_EQUAL_PTR(&crypt_engine_xor, crypt_engine_find("xor"));
+  TEST_ASSERT_EQUAL_PTR(&crypt_engine_chacha20,
+                        crypt_engine_find("chacha20"));
+  TEST_ASSERT_NULL(crypt_engine_find("chacha"));
+  TEST_ASSERT_NULL(crypt_engine_find(NULL));
+
+  /* No engine and "xor" are the same cipher, file format included */
+
+  crypt_file_at(&ctx, expect, plain, sizeof(plain), 1000);
+  copy.engine = &crypt_engine_xor;
+  TEST_ASSERT_EQUAL(0, crypt_file_at(&copy, coded, plain, sizeof(plain),
+                                     1000));
+  TEST_ASSERT_EQUAL_MEMORY(expect, coded, sizeof(plain));
+
+  /* Registration until the table is full */
+
+  engines[0].name  = "xor";
+  engines[0].crypt = copy_crypt;
+  TEST_ASSERT_EQUAL(-EEXIST, crypt_engine_register(&engines[0]));
+  engines[0].crypt = NULL;
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_engine_register(&engines[0]));
+
+  for (i = 0, ret = 0; i < CRYPT_ENGINE_MAX && ret == 0; i++)
+    {
+      snprintf(names[i], sizeof(names[i]), "copy%u", i);
+      engines[i].name  = names[i];
+      engines[i].crypt = copy_crypt;
+      ret = crypt_engine_register(&engines[i]);
+    }
+
+  TEST_ASSERT_EQUAL(-ENOSPC, ret);
+  TEST_ASSERT_EQUAL_PTR(&engines[0], crypt_engine_find("copy0"));
+
+  /* Every entry point goes through the engine of the context */
+
+  copy.engine = crypt_engine_find("copy0");
+  TEST_ASSERT_EQUAL(0, crypt_buffer_at(&copy, coded, plain, sizeof(plain),
+                                       7));
+  TEST_ASSERT_EQUAL_MEMORY(plain, coded, sizeof(plain));
+  memset(coded, 0, sizeof(coded));
+  TEST_ASSERT_EQUAL(0, crypt_small(&copy, coded, plain, 10));
+  TEST_ASSERT_EQUAL_MEMORY(plain, coded, 10);
+}
+
+void run_test_chacha20(void)
+{
+  /* RFC 8439 2.4.2, its 96-bit nonce is counter word 13 and our nonce */
+
+  static const char sunscreen[] = "Ladies and Gentlemen of the class of "
+                                  "'99: If I could offer you only one "
+                                  "tip for the future, sunscreen would "
+                                  "be it.";
+  static const uint8_t expected[] =
+                       {
+                         0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80,
+                         0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81,
+                         0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2,
+                         0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b,
+                         0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab,
+                         0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+                         0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab,
+                         0x8f, 0x53, 0x0c, 0x35, 0x9f, 0x08, 0x61, 0xd8,
+                         0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61,
+                         0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+                         0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06,
+                         0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+                         0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6,
+                         0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42,
+                         0x87, 0x4d
+                       };
+
+  /* RFC 8439 A.1 #1, all zero key and nonce, block 0 */
+
+  static const uint8_t zero_block[] =
+                       {
+                         0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90,
+                         0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+                         0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a,
+                         0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+                         0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d,
+                         0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+                         0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c,
+                         0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86
+                       };
+
+  static uint8_t plain[40 * 64 + 7];
+  static uint8_t whole[sizeof(plain)];
+  static uint8_t part[sizeof(plain)];
+  uint8_t key[CRYPT_CHACHA20_KEY + CRYPT_CHACHA20_NONCE];
+  struct crypt_context chacha = { key, sizeof(key), &crypt_engine_chacha20 };
+  struct crypt_stream stream;
+  uint64_t offsets[3] = { 5, ((uint64_t)1 << 32) * 64 - 1000, 0 };
+  size_t pos;
+  size_t n;
+  unsigned i;
+
+  for (i = 0; i < CRYPT_CHACHA20_KEY; i++)
+    {
+      key[i] = i;
+    }
+
+  memcpy(key + CRYPT_CHACHA20_KEY, "\0\0\0\x4a\0\0\0\0",
+         CRYPT_CHACHA20_NONCE);
+
+  TEST_ASSERT_EQUAL(0, crypt_buffer_at(&chacha, part,
+                                       (const uint8_t *)sunscreen,
+                                       sizeof(expected), 64));
+  TEST_ASSERT_EQUAL_MEMORY(expected, part, sizeof(expected));
+
+  /* The 32-byte form has a zero nonce */
+
+  memset(key, 0, sizeof(key));
+  memset(plain, 0, 64);
+  chacha.keylen = CRYPT_CHACHA20_KEY;
+  TEST_ASSERT_EQUAL(0, crypt_buffer(&chacha, part, plain, 64));
+  TEST_ASSERT_EQUAL_MEMORY(zero_block, part, 64);
+
+  chacha.keylen = CRYPT_CHACHA20_KEY + 1;
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_buffer(&chacha, part, plain, 64));
+  chacha.keylen = sizeof(key);
+
+  /* The kernels of 16, 8 and 4 blocks against byte by byte, then
+   * growing pieces of a stream, the second offset wraps the low
+   * counter word.
+   */
+
+  for (i = 0; i < sizeof(key); i++)
+    {
+      key[i] = i * 37 + 11;
+    }
+
+  for (i = 0; i < sizeof(plain); i++)
+    {
+      plain[i] = i * 7 + (i >> 8);
+    }
+
+  for (i = 0; i < 3; i++)
+    {
+      TEST_ASSERT_EQUAL(0, crypt_buffer_at(&chacha, whole, plain,
+                                           sizeof(plain), offsets[i]));
+
+      for (pos = 0; pos < sizeof(plain); pos++)
+        {
+          crypt_buffer_at(&chacha, part + pos, plain + pos, 1,
+                          offsets[i] + pos);
+        }
+
+      TEST_ASSERT_EQUAL_MEMORY(whole, part, sizeof(plain));
+
+      memset(part, 0, sizeof(part));
+      crypt_stream_init(&stream, &chacha, offsets[i]);
+      for (pos = 0, n = 1; pos < sizeof(plain); pos += n, n = n * 2 + 1)
+        {
+          if (n > sizeof(plain) - pos)
+            {
+              n = sizeof(plain) - pos;
+            }
+
+          TEST_ASSERT_EQUAL(0, crypt_stream_update(&stream, part + pos,
+                                                   plain + pos, n));
+        }
+
+      TEST_ASSERT_EQUAL_MEMORY(whole, part, sizeof(plain));
+    }
+
+  /* A file is one keystream, restarting it every block would reuse it */
+
+  memset(part, 0, sizeof(part));
+  TEST_ASSERT_EQUAL(0, crypt_file_at(&chacha, part, plain, sizeof(plain),
+                                     0));
+  TEST_ASSERT_EQUAL_MEMORY(whole, part, sizeof(plain));
+}
+
+void run_test_aes256_ctr(void)
+{
+  /* NIST SP 800-38A F.5.5, CTR-AES256.Encrypt */
+
+  static const uint8_t nist_key[CRYPT_AES256_KEY + CRYPT_AES256_IV] =
+                       {
+                         0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe,
+                         0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+                         0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
+                         0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4,
+                         0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+                         0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+                       };
+  static const uint8_t nist_plain[64] =
+                       {
+                         0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+                         0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+                         0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+                         0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+                         0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+                         0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+                         0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+                         0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+                       };
+  static const uint8_t nist_coded[64] =
+                       {
+                         0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5,
+                         0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28,
+                         0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a,
+                         0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5,
+                         0x2b, 0x09, 0x30, 0xda, 0xa2, 0x3d, 0xe9, 0x4c,
+                         0xe8, 0x70, 0x17, 0xba, 0x2d, 0x84, 0x98, 0x8d,
+                         0xdf, 0xc9, 0xc5, 0x8d, 0xb6, 0x7a, 0xad, 0xa6,
+                         0x13, 0xc2, 0xdd, 0x08, 0x45, 0x79, 0x41, 0xa6
+                       };
+
+  /* FIPS-197 C.3: its plaintext as the counter block, zero input */
+
+  static const uint8_t fips_block[16] =
+                       {
+                         0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+                         0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89
+                       };
+
+  static uint8_t plain[40 * 16 + 7];
+  static uint8_t whole[sizeof(plain)];
+  static uint8_t part[sizeof(plain)];
+  static uint8_t big[2 * CRYPT_POOL_SLICE + 9];
+  static uint8_t big_coded[sizeof(big)];
+  static uint8_t big_expect[sizeof(big)];
+  uint8_t key[CRYPT_AES256_KEY + CRYPT_AES256_IV];
+  struct crypt_context aes = { key, sizeof(key), &crypt_engine_aes256_ctr };
+  struct crypt_stream stream;
+  struct crypt_job job;
+  struct crypt_job *batch = &job;
+  uint64_t offsets[3] = { 5, 256 * 16 - 300, 0 };
+  size_t pos;
+  size_t n;
+  unsigned i;
+
+  TEST_ASSERT_EQUAL_PTR(&crypt_engine_aes256_ctr,
+                        crypt_engine_find("aes256-ctr"));
+
+  memcpy(key, nist_key, sizeof(key));
+  TEST_ASSERT_EQUAL(0, crypt_buffer(&aes, part, nist_plain, 64));
+  TEST_ASSERT_EQUAL_MEMORY(nist_coded, part, 64);
+
+  /* Seeking to the third block, its counter wrapped the low byte */
+
+  TEST_ASSERT_EQUAL(0, crypt_buffer_at(&aes, part, nist_coded + 37, 27,
+                                       37));
+  TEST_ASSERT_EQUAL_MEMORY(nist_plain + 37, part, 27);
+
+  for (i = 0; i < CRYPT_AES256_KEY; i++)
+    {
+      key[i] = i;
+    }
+
+  for (i = 0; i < CRYPT_AES256_IV; i++)
+    {
+      key[CRYPT_AES256_KEY + i] = i * 0x11;
+    }
+
+  memset(plain, 0, 16);
+  TEST_ASSERT_EQUAL(0, crypt_buffer(&aes, part, plain, 16));
+  TEST_ASSERT_EQUAL_MEMORY(fips_block, part, 16);
+
+  /* The 32-byte form has a zero initial counter */
+
+  memset(key + CRYPT_AES256_KEY, 0, CRYPT_AES256_IV);
+  memset(plain, 0x5a, 100);
+  TEST_ASSERT_EQUAL(0, crypt_buffer(&aes, whole, plain, 100));
+  aes.keylen = CRYPT_AES256_KEY;
+  TEST_ASSERT_EQUAL(0, crypt_buffer(&aes, part, plain, 100));
+  TEST_ASSERT_EQUAL_MEMORY(whole, part, 100);
+
+  aes.keylen = CRYPT_AES256_KEY + 1;
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_buffer(&aes, part, plain, 64));
+  aes.keylen = sizeof(key);
+
+  /* The kernels of 16, 8 and 4 blocks against byte by byte, then
+   * growing pieces of a stream. The low counter word carries into the
+   * high one after 256 blocks: from the second offset the buffer covers
+   * blocks 237 to 277, so a run of 16 blocks straddles the carry.
+   */
+
+  for (i = 0; i < sizeof(key); i++)
+    {
+      key[i] = i * 37 + 11;
+    }
+
+  memset(key + CRYPT_AES256_KEY + 8, 0xff, 7);
+  key[CRYPT_AES256_KEY + 15] = 0;
+
+  for (i = 0; i < sizeof(plain); i++)
+    {
+      plain[i] = i * 7 + (i >> 8);
+    }
+
+  for (i = 0; i < 3; i++)
+    {
+      TEST_ASSERT_EQUAL(0, crypt_buffer_at(&aes, whole, plain,
+                                           sizeof(plain), offsets[i]));
+
+      for (pos = 0; pos < sizeof(plain); pos++)
+        {
+          crypt_buffer_at(&aes, part + pos, plain + pos, 1,
+                          offsets[i] + pos);
+        }
+
+      TEST_ASSERT_EQUAL_MEMORY(whole, part, sizeof(plain));
+
+      memset(part, 0, sizeof(part));
+      crypt_stream_init(&stream, &aes, offsets[i]);
+      for (pos = 0, n = 1; pos < sizeof(plain); pos += n, n = n * 2 + 1)
+        {
+          if (n > sizeof(plain) - pos)
+            {
+              n = sizeof(plain) - pos;
+            }
+
+          TEST_ASSERT_EQUAL(0, crypt_stream_update(&stream, part + pos,
+                                                   plain + pos, n));
+        }
+
+      TEST_ASSERT_EQUAL_MEMORY(whole, part, sizeof(plain));
+    }
+
+  /* Packets and files are seeks into the same keystream */
+
+  TEST_ASSERT_EQUAL(0, crypt_packet(&aes, 3, part, plain, sizeof(plain)));
+  crypt_buffer_at(&aes, whole, plain, sizeof(plain), 3 * CRYPT_PACKET_MAX);
+  TEST_ASSERT_EQUAL_MEMORY(whole, part, sizeof(plain));
+
+  TEST_ASSERT_EQUAL(0, crypt_file_at(&aes, part, plain, sizeof(plain),
+                                     0));
+  crypt_buffer_at(&aes, whole, plain, sizeof(plain), 0);
+  TEST_ASSERT_EQUAL_MEMORY(whole, part, sizeof(plain));
+
+  /* A job split in slices by the worker pool */
+
+  for (i = 0; i < sizeof(big); i++)
+    {
+      big[i] = i * 13 + (i >> 11);
+    }
+
+  crypt_buffer_at(&aes, big_expect, big, sizeof(big), 77);
+
+  memset(&job, 0, sizeof(job));
+  job.context = &aes;
+  job.output  = big_coded;
+  job.input   = big;
+  job.length  = sizeof(big);
+  job.offset  = 77;
+  job.done    = pool_finish;
+
+  pool_done = 0;
+  TEST_ASSERT_EQUAL(0, crypt_pool_submit(&batch, 1));
+  pool_wait(1);
+  TEST_ASSERT_EQUAL(1, (intptr_t)job.arg);
+  TEST_ASSERT_EQUAL_MEMORY(big_expect, big_coded, sizeof(big));
+}
+
+void run_test_poly1305(void)
+{
+  /* RFC 8439 2.5.2 */
+
+  static const uint8_t rfc_key[CRYPT_POLY1305_KEY] =
+                       {
+                         0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33,
+                         0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+                         0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd,
+                         0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b
+                       };
+  static const uint8_t rfc_tag[CRYPT_AEAD_TAG] =
+                       {
+                         0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6,
+                         0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9
+                       };
+
+  /* Long enough for the vectors, tag from another implementation */
+
+  static const uint8_t long_tag[CRYPT_AEAD_TAG] =
+                       {
+                         0xba, 0xe6, 0xdb, 0x97, 0x29, 0x72, 0x79, 0xe2,
+                         0xac, 0x7b, 0x24, 0x39, 0x3a, 0x8a, 0x8a, 0x6e
+                       };
+
+  static const char msg[] = "Cryptographic Forum Research Group";
+  static uint8_t plain[5000];
+  struct crypt_poly1305 poly;
+  uint8_t key[CRYPT_POLY1305_KEY];
+  uint8_t tag[CRYPT_AEAD_TAG];
+  size_t pos;
+  size_t n;
+  unsigned i;
+
+  crypt_poly1305_init(&poly, rfc_key);
+  crypt_poly1305_update(&poly, (const uint8_t *)msg, strlen(msg));
+  crypt_poly1305_final(&poly, tag);
+  TEST_ASSERT_EQUAL_MEMORY(rfc_tag, tag, sizeof(tag));
+
+  for (i = 0; i < sizeof(key); i++)
+    {
+      key[i] = i;
+    }
+
+  for (i = 0; i < sizeof(plain); i++)
+    {
+      plain[i] = i * 7 + (i >> 8);
+    }
+
+  crypt_poly1305_init(&poly, key);
+  crypt_poly1305_update(&poly, plain, sizeof(plain));
+  crypt_poly1305_final(&poly, tag);
+  TEST_ASSERT_EQUAL_MEMORY(long_tag, tag, sizeof(tag));
+
+  /* Pieces leave partial blocks and runs too short for the vectors */
+
+  crypt_poly1305_init(&poly, key);
+  for (pos = 0, n = 1; pos < sizeof(plain); pos += n, n = n * 3 + 1)
+    {
+      if (n > sizeof(plain) - pos)
+        {
+          n = sizeof(plain) - pos;
+        }
+
+      crypt_poly1305_update(&poly, plain + pos, n);
+    }
+
+  crypt_poly1305_final(&poly, tag);
+  TEST_ASSERT_EQUAL_MEMORY(long_tag, tag, sizeof(tag));
+}
+
+void run_test_aead(void)
+{
+  /* RFC 8439 2.8.2, nonce 07 00 00 00 40 .. 47 is counter word 13 = 7 */
+
+  static const char sunscreen[] = "Ladies and Gentlemen of the class of "
+                                  "'99: If I could offer you only one "
+                                  "tip for the future, sunscreen would "
+                                  "be it.";
+  static const uint8_t ad[] =
+                       {
+                         0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3,
+                         0xc4, 0xc5, 0xc6, 0xc7
+                       };
+  static const uint8_t expected[] =
+                       {
+                         0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb,
+                         0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2,
+                         0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe,
+                         0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6,
+                         0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12,
+                         0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+                         0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29,
+                         0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36,
+                         0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c,
+                         0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58,
+                         0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94,
+                         0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+                         0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d,
+                         0xe5, 0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b,
+                         0x61, 0x16
+                       };
+  static const uint8_t expected_tag[CRYPT_AEAD_TAG] =
+                       {
+                         0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a,
+                         0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91
+                       };
+
+  static uint8_t plain[20000];
+  static uint8_t whole[sizeof(plain)];
+  static uint8_t part[sizeof(plain)];
+  uint8_t key[CRYPT_CHACHA20_KEY + CRYPT_CHACHA20_NONCE];
+  struct crypt_context chacha = { key, sizeof(key), &crypt_engine_chacha20 };
+  struct crypt_aead aead;
+  uint64_t offset = ((uint64_t)7 << 32) * 64;
+  uint8_t tag[CRYPT_AEAD_TAG];
+  uint8_t tag2[CRYPT_AEAD_TAG];
+  size_t pos;
+  size_t n;
+  unsigned i;
+
+  for (i = 0; i < CRYPT_CHACHA20_KEY; i++)
+    {
+      key[i] = 0x80 + i;
+    }
+
+  memcpy(key + CRYPT_CHACHA20_KEY, "\x40\x41\x42\x43\x44\x45\x46\x47",
+         CRYPT_CHACHA20_NONCE);
+
+  TEST_ASSERT_EQUAL(0, crypt_aead_seal(&chacha, part,
+                                       (const uint8_t *)sunscreen,
+                                       sizeof(expected), offset, ad,
+                                       sizeof(ad), tag));
+  TEST_ASSERT_EQUAL_MEMORY(expected, part, sizeof(expected));
+  TEST_ASSERT_EQUAL_MEMORY(expected_tag, tag, sizeof(tag));
+
+  TEST_ASSERT_EQUAL(0, crypt_aead_open(&chacha, whole, part,
+                                       sizeof(expected), offset, ad,
+                                       sizeof(ad), tag));
+  TEST_ASSERT_EQUAL_MEMORY(sunscreen, whole, sizeof(expected));
+
+  /* Any changed bit is caught and leaves no plaintext behind */
+
+  part[40] ^= 0x10;
+  TEST_ASSERT_EQUAL(-EBADMSG, crypt_aead_open(&chacha, whole, part,
+                                              sizeof(expected), offset, ad,
+                                              sizeof(ad), tag));
+  TEST_ASSERT_EACH_EQUAL_UINT8(0, whole, sizeof(expected));
+  part[40] ^= 0x10;
+
+  tag[15] ^= 0x80;
+  TEST_ASSERT_EQUAL(-EBADMSG, crypt_aead_open(&chacha, whole, part,
+                                              sizeof(expected), offset, ad,
+                                              sizeof(ad), tag));
+  tag[15] ^= 0x80;
+
+  TEST_ASSERT_EQUAL(-EBADMSG, crypt_aead_open(&chacha, whole, part,
+                                              sizeof(expected), offset, ad,
+                                              sizeof(ad) - 1, tag));
+  TEST_ASSERT_EQUAL(-EBADMSG, crypt_aead_open(&chacha, whole, part,
+                                              sizeof(expected), offset + 64,
+                                              ad, sizeof(ad), tag));
+
+  /* Only ChaCha20 and block aligned offsets */
+
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_aead_init(&aead, &chacha, offset + 1,
+                                             ad, sizeof(ad)));
+  chacha.engine = NULL;
+  TEST_ASSERT_EQUAL(-EINVAL, crypt_aead_init(&aead, &chacha, offset,
+                                             ad, sizeof(ad)));
+  chacha.engine = &crypt_engine_chacha20;
+
+  /* Pieces of a long message, sealed and opened in place */
+
+  for (i = 0; i < sizeof(plain); i++)
+    {
+      plain[i] = i * 7 + (i >> 8);
+    }
+
+  TEST_ASSERT_EQUAL(0, crypt_aead_seal(&chacha, whole, plain, sizeof(plain),
+                                       0, NULL, 0, tag));
+
+  memcpy(part, plain, sizeof(plain));
+  TEST_ASSERT_EQUAL(0, crypt_aead_init(&aead, &chacha, 0, NULL, 0));
+  for (pos = 0, n = 1; pos < sizeof(plain); pos += n, n = n * 3 + 1)
+    {
+      if (n > sizeof(plain) - pos)
+        {
+          n = sizeof(plain) - pos;
+        }
+
+      TEST_ASSERT_EQUAL(0, crypt_aead_seal_update(&aead, part + pos,
+                                                  part + pos, n));
+    }
+
+  TEST_ASSERT_EQUAL(0, crypt_aead_seal_final(&aead, tag2));
+  TEST_ASSERT_EQUAL_MEMORY(whole, part, sizeof(plain));
+  TEST_ASSERT_EQUAL_MEMORY(tag, tag2, sizeof(tag));
+
+  TEST_ASSERT_EQUAL(0, crypt_aead_init(&aead, &chacha, 0, NULL, 0));
+  for (pos = 0, n = 5000; pos < sizeof(plain); pos += n)
+    {
+      if (n > sizeof(plain) - pos)
+        {
+          n = sizeof(plain) - pos;
+        }
+
+      TEST_ASSERT_EQUAL(0, crypt_aead_open_update(&aead, part + pos,
+                                                  part + pos, n));
+    }
+
+  TEST_ASSERT_EQUAL(0, crypt_aead_open_final(&aead, tag));
+  TEST_ASSERT_EQUAL_MEMORY(plain, part, sizeof(plain));
+}
+
 int main(int argc, char *argv[])
 {
   uint8_t key[]    = {
@@ -213,6 +1154,17 @@ int main(int argc, char *argv[])
   RUN_TEST(run_test_coded3);
   RUN_TEST(run_test_coded4);
   RUN_TEST(run_test_coded5);
+  RUN_TEST(run_test_offset);
+  RUN_TEST(run_test_file_offset);
+  RUN_TEST(run_test_cache);
+  RUN_TEST(run_test_packet);
+  RUN_TEST(run_test_small);
+  RUN_TEST(run_test_pool);
+  RUN_TEST(run_test_engine);
+  RUN_TEST(run_test_chacha20);
+  RUN_TEST(run_test_aes256_ctr);
+  RUN_TEST(run_test_poly1305);
+  RUN_TEST(run_test_aead);
 
   UNITY_END();
 }
@@ -0,0 +1,343 @@
+/****************************************************************************
+ * @file  src/crypt_throttle.c
+ *
+ * @brief Read/write bandwidth and CPU share limits of background jobs.
+ *
+ * Bandwidth is limited by token buckets shared by all the threads: every
+ * read or write takes its size from the bucket of its direction, and the
+ * thread sleeps when the bucket is empty. The CPU share is kept per
+ * thread: after using some CPU time a worker sleeps long enough for its
+ * utilization to stay at the target.
+ *
+ * The limits can be changed while running through a control file, read
+ * again when it is modified or when the process gets SIGHUP.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "crypt_tool.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define NSEC_PER_SEC      1000000000ULL
+#define THROTTLE_BURST    (NSEC_PER_SEC / 10) /* Idle time given back    */
+#define THROTTLE_MIN_NAP  1000000ULL          /* Shorter sleeps add up   */
+#define THROTTLE_POLL     NSEC_PER_SEC        /* Control file check rate */
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @struct bucket_s
+ *  @brief Token bucket of one direction
+ *  @var bucket_s::rate
+ *  Member 'rate' is the limit in bytes per second, 0 for no limit
+ *  @var bucket_s::next
+ *  Member 'next' is the time the bucket holds tokens again
+ */
+
+struct bucket_s
+{
+  uint64_t rate;   /* limit in bytes per second, 0 for none */
+  uint64_t next;   /* time the bucket holds tokens again    */
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bucket_s g_buckets[2];   /* read and write buckets      */
+static unsigned g_cpu;                 /* CPU share in percent        */
+static bool g_enabled;                 /* any limit, now or later     */
+static const char *g_ctlfile;          /* control file, may be NULL   */
+static struct timespec g_ctlmtime;     /* mtime of its last reading   */
+static uint64_t g_ctlcheck;            /* time of its next check      */
+static volatile sig_atomic_t g_reload; /* SIGHUP asked to read it     */
+
+static __thread uint64_t t_cputime;    /* CPU time of the last check  */
+static __thread uint64_t t_debt;       /* sleep owed for the CPU used */
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Read a clock in nanoseconds.
+ *
+ * @param clock clock to read
+ * @return The clock time in nanoseconds
+ */
+
+static uint64_t throttle_now(clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief Sleep for some nanoseconds.
+ *
+ * @param ns time to sleep
+ */
+
+static void throttle_sleep(uint64_t ns)
+{
+  struct timespec ts;
+
+  ts.tv_sec  = ns / NSEC_PER_SEC;
+  ts.tv_nsec = ns % NSEC_PER_SEC;
+
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    {
+    }
+}
+
+/**
+ * @brief Ask to read the control file again.
+ *
+ * @param signo signal number, unused
+ */
+
+static void throttle_sighup(int signo)
+{
+  (void)signo;
+  g_reload = 1;
+}
+
+/**
+ * @brief Read the limits from the control file, with the lock held.
+ *
+ * Every line is "read <size>", "write <size>" or "cpu <percent>", a size
+ * being bytes per second with an optional K, M, G or T suffix, and 0
+ * meaning no limit. Missing lines leave their limit unchanged.
+ */
+
+static void throttle_load(void)
+{
+  char line[128];
+  char key[16];
+  char value[64];
+  uint64_t size;
+  FILE *fp;
+
+  fp = fopen(g_ctlfile, "r");
+  if (fp == NULL)
+    {
+      return;
+    }
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+    {
+      if (line[0] == '#' || sscanf(line, "%15s %63s", key, value) != 2)
+        {
+          continue;
+        }
+
+      if (parse_size(value, &size) < 0)
+        {
+          fprintf(stderr, "Error: invalid limit '%s' in %s\n", value,
+                  g_ctlfile);
+        }
+      else if (strcmp(key, "read") == 0)
+        {
+          g_buckets[THROTTLE_READ].rate = size;
+        }
+      else if (strcmp(key, "write") == 0)
+        {
+          g_buckets[THROTTLE_WRITE].rate = size;
+        }
+      else if (strcmp(key, "cpu") == 0 && size <= 100)
+        {
+          g_cpu = size;
+        }
+      else
+        {
+          fprintf(stderr, "Error: invalid limit '%s' in %s\n", key,
+                  g_ctlfile);
+        }
+    }
+
+  fclose(fp);
+}
+
+/**
+ * @brief Read the control file again if it changed or SIGHUP was got.
+ *
+ * @param now current monotonic time
+ */
+
+static void throttle_poll(uint64_t now)
+{
+  struct stat sb;
+  bool changed;
+
+  if (g_ctlfile == NULL || (!g_reload && now < g_ctlcheck))
+    {
+      return;
+    }
+
+  g_ctlcheck = now + THROTTLE_POLL;
+  if (stat(g_ctlfile, &sb) < 0)
+    {
+      return;
+    }
+
+  changed = sb.st_mtim.tv_sec != g_ctlmtime.tv_sec ||
+            sb.st_mtim.tv_nsec != g_ctlmtime.tv_nsec;
+  if (changed || g_reload)
+    {
+      g_reload   = 0;
+      g_ctlmtime = sb.st_mtim;
+      throttle_load();
+    }
+}
+
+/**
+ * @brief Keep the CPU share of the calling thread under the limit.
+ *
+ * @param cpu CPU share in percent
+ */
+
+static void throttle_cpu(unsigned cpu)
+{
+  uint64_t cputime;
+
+  if (cpu == 0 || cpu >= 100)
+    {
+      t_cputime = 0;
+      return;
+    }
+
+  cputime = throttle_now(CLOCK_THREAD_CPUTIME_ID);
+  if (t_cputime != 0)
+    {
+      t_debt += (cputime - t_cputime) * (100 - cpu) / cpu;
+    }
+
+  t_cputime = cputime;
+
+  if (t_debt >= THROTTLE_MIN_NAP)
+    {
+      throttle_sleep(t_debt);
+      t_debt = 0;
+    }
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Set the initial limits and the control file.
+ *
+ * @param read_rate read limit in bytes per second, 0 for none
+ * @param write_rate write limit in bytes per second, 0 for none
+ * @param cpu CPU share of every thread in percent, 0 for none
+ * @param ctlfile control file to change the limits, may be NULL
+ * @return Success (OK = 0) or a negative error
+ */
+
+int throttle_setup(uint64_t read_rate, uint64_t write_rate, unsigned cpu,
+                   const char *ctlfile)
+{
+  struct sigaction sa;
+
+  if (cpu > 100)
+    {
+      return -EINVAL;
+    }
+
+  g_buckets[THROTTLE_READ].rate  = read_rate;
+  g_buckets[THROTTLE_WRITE].rate = write_rate;
+  g_cpu     = cpu;
+  g_ctlfile = ctlfile;
+  g_enabled = read_rate != 0 || write_rate != 0 || cpu != 0 ||
+              ctlfile != NULL;
+
+  if (ctlfile != NULL)
+    {
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = throttle_sighup;
+      sa.sa_flags   = SA_RESTART;
+      sigemptyset(&sa.sa_mask);
+      if (sigaction(SIGHUP, &sa, NULL) < 0)
+        {
+          return -errno;
+        }
+
+      g_reload = 1;
+      throttle_poll(throttle_now(CLOCK_MONOTONIC));
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Account for bytes read or written, sleeping to meet the limits.
+ *
+ * @param dir THROTTLE_READ or THROTTLE_WRITE
+ * @param len amount of bytes just transferred
+ */
+
+void throttle_io(int dir, size_t len)
+{
+  struct bucket_s *bucket = &g_buckets[dir];
+  uint64_t wait = 0;
+  uint64_t now;
+  unsigned cpu;
+
+  if (!g_enabled)
+    {
+      return;
+    }
+
+  now = throttle_now(CLOCK_MONOTONIC);
+
+  pthread_mutex_lock(&g_lock);
+
+  throttle_poll(now);
+  cpu = g_cpu;
+
+  if (bucket->rate != 0)
+    {
+      /* An idle bucket only saves up a short burst */
+
+      if (bucket->next + THROTTLE_BURST < now)
+        {
+          bucket->next = now - THROTTLE_BURST;
+        }
+
+      bucket->next += len * NSEC_PER_SEC / bucket->rate;
+      if (bucket->next > now)
+        {
+          wait = bucket->next - now;
+        }
+    }
+
+  pthread_mutex_unlock(&g_lock);
+
+  if (wait > 0)
+    {
+      throttle_sleep(wait);
+    }
+
+  throttle_cpu(cpu);
+}
@@ -0,0 +1,370 @@
+/****************************************************************************
+ * @file  src/crypt_tool.h
+ *
+ * @brief Definitions shared by the crypt program modules.
+ ****************************************************************************/
+
+#ifndef __CRYPT_TOOL_H
+#define __CRYPT_TOOL_H
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "acrypt.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define THROTTLE_READ   0 /* throttle_io() direction of reads  */
+#define THROTTLE_WRITE  1 /* throttle_io() direction of writes */
+
+/****************************************************************************
+ * Public Types
+ ****************************************************************************/
+
+/**
+ * @brief Work function run by run_parallel() for every item.
+ *
+ * @param arg user argument given to run_parallel()
+ * @param idx index of the item to process
+ * @return Success (OK = 0) or a negative error
+ */
+
+typedef int (*parallel_worker_t)(void *arg, unsigned idx);
+
+/** @struct writeback_s
+ *  @brief Writeback state of one output, see writeback_begin()
+ *  @var writeback_s::fd
+ *  Member 'fd' is the output file descriptor
+ *  @var writeback_s::pos
+ *  Member 'pos' is the position after the last byte written
+ *  @var writeback_s::started
+ *  Member 'started' first byte not yet handed to the disk
+ *  @var writeback_s::dropped
+ *  Member 'dropped' first byte not yet waited for and dropped
+ *  @var writeback_s::unsynced
+ *  Member 'unsynced' bytes written since the last fdatasync()
+ *  @var writeback_s::enabled
+ *  Member 'enabled' the output is a regular file and there is work to do
+ */
+
+struct writeback_s
+{
+  int fd;            /* output file descriptor                    */
+  uint64_t pos;      /* position after the last byte written      */
+  uint64_t started;  /* first byte not yet handed to the disk     */
+  uint64_t dropped;  /* first byte not yet waited for and dropped */
+  uint64_t unsynced; /* bytes written since the last fdatasync()  */
+  bool enabled;      /* regular file and there is work to do      */
+};
+
+/****************************************************************************
+ * Public Function Prototypes
+ ****************************************************************************/
+
+/**
+ * @brief Parse a size with an optional K, M, G or T (power of 1024) suffix.
+ *
+ * @param str string to parse, may be followed by ':' and more text
+ * @param size pointer to save the size
+ * @return Success (OK = 0) or a negative error
+ */
+
+int parse_size(const char *str, uint64_t *size);
+
+/**
+ * @brief Read up to 'size' bytes, retrying on short reads.
+ *
+ * @param fd file descriptor to read from
+ * @param buf buffer to store the data
+ * @param size amount of bytes to read
+ * @return Amount of read bytes (less than size at EOF) or a negative error
+ */
+
+ssize_t read_full(int fd, void *buf, size_t size);
+
+/**
+ * @brief Write 'size' bytes, retrying on short writes.
+ *
+ * @param fd file descriptor to write to
+ * @param buf buffer with the data
+ * @param size amount of bytes to write
+ * @return Success (OK = 0) or a negative error
+ */
+
+int write_full(int fd, const void *buf, size_t size);
+
+/**
+ * @brief Store a number as 'size' big endian bytes.
+ *
+ * @param p pointer to the first byte
+ * @param value number to store
+ * @param size amount of bytes, up to 8
+ */
+
+void be_encode(uint8_t *p, uint64_t value, int size);
+
+/**
+ * @brief Load a number stored as 'size' big endian bytes.
+ *
+ * @param p pointer to the first byte
+ * @param size amount of bytes, up to 8
+ * @return The number
+ */
+
+uint64_t be_decode(const uint8_t *p, int size);
+
+/**
+ * @brief Update a CRC-32 (the one of zlib and gzip) with more data.
+ *
+ * @param crc CRC of the previous data, 0 to start
+ * @param buf data to add
+ * @param size amount of bytes
+ * @return The updated CRC
+ */
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t size);
+
+/**
+ * @brief Clear a buffer that held keys or plaintext, even right before
+ *        it is freed or goes out of scope.
+ *
+ * @param buf buffer to clear
+ * @param size amount of bytes
+ */
+
+void wipe(void *buf, size_t size);
+
+/**
+ * @brief Copy a slice between files, encrypting it on the way.
+ *
+ * @param context key context
+ * @param fd_in file to read from
+ * @param in_off first byte to read
+ * @param fd_out file to write to
+ * @param out_off where to write the first byte
+ * @param length amount of bytes to copy
+ * @param offset keystream offset (crypt_file_at()) of the first byte
+ * @param crc_in if not NULL, updated with the CRC-32 of the read data
+ * @param crc_out if not NULL, updated with the CRC-32 of the written data
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_copy(struct crypt_context *context, int fd_in, uint64_t in_off,
+               int fd_out, uint64_t out_off, uint64_t length,
+               uint64_t offset, uint32_t *crc_in, uint32_t *crc_out);
+
+/**
+ * @brief Run 'worker' for items 0 .. nitems - 1 on all online CPUs.
+ *
+ * @param nitems amount of items to process
+ * @param worker function called once per item
+ * @param arg user argument passed to worker
+ * @return Success (OK = 0) or the first negative error of a worker
+ */
+
+int run_parallel(unsigned nitems, parallel_worker_t worker, void *arg);
+
+/**
+ * @brief Search a pattern inside encrypted files without storing plaintext.
+ *
+ * @param context key context used to decrypt the files
+ * @param pattern plaintext pattern to look for
+ * @param files list of encrypted files
+ * @param nfiles amount of files in the list
+ * @return 0 if found, 1 if not found or a negative error
+ */
+
+int crypt_search(struct crypt_context *context, const char *pattern,
+                 char **files, int nfiles);
+
+/**
+ * @brief Encrypt a stream of sequence numbered records.
+ *
+ * @param context key context used to encrypt
+ * @param fd_in file descriptor of the input records
+ * @param fd_out file descriptor of the output records
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_records(struct crypt_context *context, int fd_in, int fd_out);
+
+/**
+ * @brief Encrypt the byte range 'spec' (OFFSET:LEN) of ifile into ofile.
+ *
+ * @param context key context used to encrypt
+ * @param spec range given by the user, sizes accept K/M/G/T suffixes
+ * @param ifile input file name
+ * @param ofile shared output file name
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_range(struct crypt_context *context, const char *spec,
+                const char *ifile, const char *ofile);
+
+/**
+ * @brief Check that the manifest of ofile covers all of ifile.
+ *
+ * @param ifile input file name
+ * @param ofile shared output file name
+ * @return Success (OK = 0), 1 if incomplete or a negative error
+ */
+
+int crypt_merge(const char *ifile, const char *ofile);
+
+/**
+ * @brief Encrypt ifile into shards of 'spec' bytes named <prefix>.NNN.
+ *
+ * @param context key context used to encrypt
+ * @param spec shard size, accepts K/M/G/T suffixes
+ * @param ifile input file name
+ * @param prefix shard name prefix
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_split(struct crypt_context *context, const char *spec,
+                const char *ifile, const char *prefix);
+
+/**
+ * @brief Decrypt shards concurrently and rebuild the original file.
+ *
+ * @param context key context used to decrypt
+ * @param files shard files, in any order
+ * @param nfiles amount of shard files
+ * @param ofile output file name
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_join(struct crypt_context *context, char **files, int nfiles,
+               const char *ofile);
+
+/**
+ * @brief Set the writeback window and the durability mode of all outputs.
+ *
+ * @param window steady writeback window in bytes, 0 to disable it
+ * @param sync_every fdatasync() every that many bytes, 0 to disable it
+ * @param sync_end fdatasync() when an output is done
+ */
+
+void writeback_setup(uint64_t window, uint64_t sync_every, bool sync_end);
+
+/**
+ * @brief Start tracking the writes to an output.
+ *
+ * @param wb writeback state to initialize
+ * @param fd output file descriptor
+ * @param offset position of the first byte that will be written
+ */
+
+void writeback_begin(struct writeback_s *wb, int fd, uint64_t offset);
+
+/**
+ * @brief Account for bytes written to an output, after the write.
+ *
+ * @param wb writeback state
+ * @param len amount of bytes just written
+ * @return Success (OK = 0) or a negative error
+ */
+
+int writeback_update(struct writeback_s *wb, size_t len);
+
+/**
+ * @brief Finish tracking an output, flushing what is left.
+ *
+ * @param wb writeback state
+ * @return Success (OK = 0) or a negative error
+ */
+
+int writeback_end(struct writeback_s *wb);
+
+/**
+ * @brief Set the initial limits and the control file.
+ *
+ * @param read_rate read limit in bytes per second, 0 for none
+ * @param write_rate write limit in bytes per second, 0 for none
+ * @param cpu CPU share of every thread in percent, 0 for none
+ * @param ctlfile control file to change the limits, may be NULL
+ * @return Success (OK = 0) or a negative error
+ */
+
+int throttle_setup(uint64_t read_rate, uint64_t write_rate, unsigned cpu,
+                   const char *ctlfile);
+
+/**
+ * @brief Account for bytes read or written, sleeping to meet the limits.
+ *
+ * @param dir THROTTLE_READ or THROTTLE_WRITE
+ * @param len amount of bytes just transferred
+ */
+
+void throttle_io(int dir, size_t len);
+
+/**
+ * @brief Pack files into an encrypted archive, in parallel.
+ *
+ * @param context key context used to encrypt
+ * @param files files to pack
+ * @param nfiles amount of files
+ * @param ofile archive file name
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_archive(struct crypt_context *context, char **files, int nfiles,
+                  const char *ofile);
+
+/**
+ * @brief Extract files from an encrypted archive, in parallel.
+ *
+ * @param context key context used to decrypt
+ * @param ifile archive file name
+ * @param names names to extract, all the files if nnames is 0
+ * @param nnames amount of names
+ * @param dir directory to extract to, NULL for the current one
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_extract(struct crypt_context *context, const char *ifile,
+                  char **names, int nnames, const char *dir);
+
+/**
+ * @brief Encrypt the input once and write it to several outputs.
+ *
+ * @param context key context used to encrypt
+ * @param fd_in input file descriptor
+ * @param outs output names, a dash is the standard output
+ * @param nouts amount of outputs
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_tee(struct crypt_context *context, int fd_in, char **outs,
+              int nouts);
+
+/**
+ * @brief Encrypt and authenticate the input with a new random nonce.
+ *
+ * @param context key context, the key must be 32 bytes
+ * @param fd_in input file descriptor
+ * @param fd_out output file descriptor
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_seal(struct crypt_context *context, int fd_in, int fd_out);
+
+/**
+ * @brief Check and decrypt the output of crypt_seal().
+ *
+ * @param context key context, the key must be 32 bytes
+ * @param fd_in input file descriptor
+ * @param fd_out output file descriptor
+ * @return Success (OK = 0), -EBADMSG if the input is not authentic, or a
+ *         negative error
+ */
+
+int crypt_open(struct crypt_context *context, int fd_in, int fd_out);
+
+#endif /* __CRYPT_TOOL_H */
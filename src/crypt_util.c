@@ -0,0 +1,485 @@
+/****************************************************************************
+ * @file  src/crypt_util.c
+ *
+ * @brief Helper functions shared by the crypt program modules.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "crypt_tool.h"
+#include "crypt_internal.h"
+
+/****************************************************************************
+ * Preprocessor and Macros
+ ****************************************************************************/
+
+#define COPY_WINDOW_SIZE (1024 * 1024) /* Multiple of CRYPT_BLOCK_SIZE */
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/** @struct parallel_s
+ *  @brief State shared by the run_parallel() threads
+ *  @var parallel_s::worker
+ *  Member 'worker' function called for every item
+ *  @var parallel_s::arg
+ *  Member 'arg' user argument passed to worker
+ *  @var parallel_s::nitems
+ *  Member 'nitems' amount of items to process
+ *  @var parallel_s::next
+ *  Member 'next' next item to be taken by a thread
+ *  @var parallel_s::error
+ *  Member 'error' first error returned by a worker
+ */
+
+struct parallel_s
+{
+  parallel_worker_t worker; /* function called for every item   */
+  void *arg;                /* user argument passed to worker    */
+  unsigned nitems;          /* amount of items to process        */
+  unsigned next;            /* next item to be taken by a thread */
+  int error;                /* first error returned by a worker  */
+};
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static uint32_t g_crc_table[256];
+static pthread_once_t g_crc_once = PTHREAD_ONCE_INIT;
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Build the CRC-32 (IEEE 802.3, reflected) lookup table.
+ */
+
+static void crc32_init(void)
+{
+  uint32_t crc;
+  int i;
+  int j;
+
+  for (i = 0; i < 256; i++)
+    {
+      crc = i;
+      for (j = 0; j < 8; j++)
+        {
+          crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+
+      g_crc_table[i] = crc;
+    }
+}
+
+/**
+ * @brief Thread loop: take the next free item until all are done.
+ *
+ * @param arg pointer to the shared parallel_s state
+ * @return Always NULL
+ */
+
+static void *parallel_thread(void *arg)
+{
+  struct parallel_s *par = arg;
+  unsigned idx;
+  int ret;
+
+  while ((idx = __atomic_fetch_add(&par->next, 1, __ATOMIC_RELAXED))
+         < par->nitems)
+    {
+      ret = par->worker(par->arg, idx);
+      if (ret < 0)
+        {
+          int expected = 0;
+
+          __atomic_compare_exchange_n(&par->error, &expected, ret, false,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+
+  return NULL;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Parse a size with an optional K, M, G or T (power of 1024) suffix.
+ *
+ * @param str string to parse, may be followed by ':' and more text
+ * @param size pointer to save the size
+ * @return Success (OK = 0) or a negative error
+ */
+
+int parse_size(const char *str, uint64_t *size)
+{
+  unsigned long long value;
+  char *end;
+  int shift = 0;
+
+  if (*str < '0' || *str > '9')
+    {
+      return -EINVAL;
+    }
+
+  errno = 0;
+  value = strtoull(str, &end, 0);
+  if (errno != 0)
+    {
+      return -EINVAL;
+    }
+
+  switch (*end)
+    {
+      case 'T':
+      case 't':
+        shift += 10;
+        /* Fall through */
+      case 'G':
+      case 'g':
+        shift += 10;
+        /* Fall through */
+      case 'M':
+      case 'm':
+        shift += 10;
+        /* Fall through */
+      case 'K':
+      case 'k':
+        shift += 10;
+        end++;
+        break;
+    }
+
+  if ((*end != '\0' && *end != ':') || (value << shift) >> shift != value)
+    {
+      return -EINVAL;
+    }
+
+  *size = value << shift;
+
+  return 0;
+}
+
+/**
+ * @brief Read up to 'size' bytes, retrying on short reads.
+ *
+ * @param fd file descriptor to read from
+ * @param buf buffer to store the data
+ * @param size amount of bytes to read
+ * @return Amount of read bytes (less than size at EOF) or a negative error
+ */
+
+ssize_t read_full(int fd, void *buf, size_t size)
+{
+  uint8_t *p = buf;
+  size_t total = 0;
+  ssize_t ret;
+
+  while (total < size)
+    {
+      ret = read(fd, p + total, size - total);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+
+          return -errno;
+        }
+
+      if (ret == 0)
+        {
+          break;
+        }
+
+      throttle_io(THROTTLE_READ, ret);
+      total += ret;
+    }
+
+  return total;
+}
+
+/**
+ * @brief Write 'size' bytes, retrying on short writes.
+ *
+ * @param fd file descriptor to write to
+ * @param buf buffer with the data
+ * @param size amount of bytes to write
+ * @return Success (OK = 0) or a negative error
+ */
+
+int write_full(int fd, const void *buf, size_t size)
+{
+  const uint8_t *p = buf;
+  ssize_t ret;
+
+  while (size > 0)
+    {
+      ret = write(fd, p, size);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+
+          return -errno;
+        }
+
+      throttle_io(THROTTLE_WRITE, ret);
+      p    += ret;
+      size -= ret;
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Store a number as 'size' big endian bytes.
+ *
+ * @param p pointer to the first byte
+ * @param value number to store
+ * @param size amount of bytes, up to 8
+ */
+
+void be_encode(uint8_t *p, uint64_t value, int size)
+{
+  while (size-- > 0)
+    {
+      p[size] = value;
+      value >>= 8;
+    }
+}
+
+/**
+ * @brief Load a number stored as 'size' big endian bytes.
+ *
+ * @param p pointer to the first byte
+ * @param size amount of bytes, up to 8
+ * @return The number
+ */
+
+uint64_t be_decode(const uint8_t *p, int size)
+{
+  uint64_t value = 0;
+
+  while (size-- > 0)
+    {
+      value = (value << 8) | *p++;
+    }
+
+  return value;
+}
+
+/**
+ * @brief Update a CRC-32 (the one of zlib and gzip) with more data.
+ *
+ * @param crc CRC of the previous data, 0 to start
+ * @param buf data to add
+ * @param size amount of bytes
+ * @return The updated CRC
+ */
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t size)
+{
+  const uint8_t *p = buf;
+
+  pthread_once(&g_crc_once, crc32_init);
+
+  crc = ~crc;
+  while (size-- > 0)
+    {
+      crc = g_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+  return ~crc;
+}
+
+/**
+ * @brief Clear a buffer that held keys or plaintext.
+ *
+ * @param buf buffer to clear
+ * @param size amount of bytes
+ */
+
+void wipe(void *buf, size_t size)
+{
+  crypt_wipe(buf, size);
+}
+
+/**
+ * @brief Copy a slice between files, encrypting it on the way.
+ *
+ * @param context key context
+ * @param fd_in file to read from
+ * @param in_off first byte to read
+ * @param fd_out file to write to
+ * @param out_off where to write the first byte
+ * @param length amount of bytes to copy
+ * @param offset keystream offset (crypt_file_at()) of the first byte
+ * @param crc_in if not NULL, updated with the CRC-32 of the read data
+ * @param crc_out if not NULL, updated with the CRC-32 of the written data
+ * @return Success (OK = 0) or a negative error
+ */
+
+int crypt_copy(struct crypt_context *context, int fd_in, uint64_t in_off,
+               int fd_out, uint64_t out_off, uint64_t length,
+               uint64_t offset, uint32_t *crc_in, uint32_t *crc_out)
+{
+  struct writeback_s wb;
+  uint8_t *buf;
+  uint64_t done = 0;
+  int ret = 0;
+
+  buf = malloc(COPY_WINDOW_SIZE);
+  if (buf == NULL)
+    {
+      return -ENOMEM;
+    }
+
+  writeback_begin(&wb, fd_out, out_off);
+
+  while (done < length)
+    {
+      size_t n = length - done < COPY_WINDOW_SIZE ?
+                 length - done : COPY_WINDOW_SIZE;
+      size_t nwritten = 0;
+      ssize_t nread;
+
+      nread = pread(fd_in, buf, n, in_off + done);
+      if (nread <= 0)
+        {
+          ret = nread < 0 ? -errno : -EIO;
+          break;
+        }
+
+      throttle_io(THROTTLE_READ, nread);
+
+      if (crc_in != NULL)
+        {
+          *crc_in = crc32_update(*crc_in, buf, nread);
+        }
+
+      crypt_file_at(context, buf, buf, nread, offset + done);
+
+      if (crc_out != NULL)
+        {
+          *crc_out = crc32_update(*crc_out, buf, nread);
+        }
+
+      while (nwritten < (size_t)nread)
+        {
+          ssize_t w = pwrite(fd_out, buf + nwritten, nread - nwritten,
+                             out_off + done + nwritten);
+          if (w < 0)
+            {
+              ret = -errno;
+              goto out;
+            }
+
+          nwritten += w;
+        }
+
+      throttle_io(THROTTLE_WRITE, nread);
+
+      ret = writeback_update(&wb, nread);
+      if (ret < 0)
+        {
+          goto out;
+        }
+
+      done += nread;
+    }
+
+  if (ret == 0)
+    {
+      ret = writeback_end(&wb);
+    }
+
+out:
+  free(buf);
+
+  return ret;
+}
+
+/**
+ * @brief Run 'worker' for items 0 .. nitems - 1 on all online CPUs.
+ *
+ * @param nitems amount of items to process
+ * @param worker function called once per item
+ * @param arg user argument passed to worker
+ * @return Success (OK = 0) or the first negative error of a worker
+ */
+
+int run_parallel(unsigned nitems, parallel_worker_t worker, void *arg)
+{
+  struct parallel_s par;
+  pthread_t *threads;
+  long ncpus;
+  unsigned nthreads;
+  unsigned i;
+
+  par.worker = worker;
+  par.arg    = arg;
+  par.nitems = nitems;
+  par.next   = 0;
+  par.error  = 0;
+
+  ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  nthreads = ncpus > 0 && ncpus < nitems ? ncpus : nitems;
+
+  /* Nothing to gain from a thread for a single item */
+
+  if (nthreads <= 1)
+    {
+      parallel_thread(&par);
+      return par.error;
+    }
+
+  threads = malloc(nthreads * sizeof(pthread_t));
+  if (threads == NULL)
+    {
+      fprintf(stderr, "Error: failed to allocate threads\n");
+      return -ENOMEM;
+    }
+
+  for (i = 0; i < nthreads; i++)
+    {
+      if (pthread_create(&threads[i], NULL, parallel_thread, &par) != 0)
+        {
+          break;
+        }
+    }
+
+  /* If some thread could not be created the others do its share */
+
+  if (i == 0)
+    {
+      parallel_thread(&par);
+    }
+
+  nthreads = i;
+  for (i = 0; i < nthreads; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+
+  free(threads);
+
+  return par.error;
+}
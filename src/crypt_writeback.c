@@ -0,0 +1,174 @@
+/****************************************************************************
+ * @file  src/crypt_writeback.c
+ *
+ * @brief Steady writeback and durability of the output files.
+ *
+ * Left alone, the kernel keeps the written data dirty in the page cache
+ * and flushes gigabytes of it at once, stalling every other writer of the
+ * disk. With a writeback window, every window completed by a writer is
+ * handed to the disk right away with sync_file_range(), the window before
+ * it is waited for and its pages are dropped from the cache. Durability
+ * is independent: no sync, an fdatasync() at the end or one every N
+ * bytes written.
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "crypt_tool.h"
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static uint64_t g_window;      /* steady writeback window, 0 disables */
+static uint64_t g_sync_every;  /* fdatasync() every that many bytes   */
+static bool g_sync_end;        /* fdatasync() when the output is done */
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * @brief Wait for the written back range and drop its pages.
+ *
+ * @param wb writeback state
+ * @param end first byte not to drop
+ */
+
+static void writeback_drop(struct writeback_s *wb, uint64_t end)
+{
+  if (end <= wb->dropped)
+    {
+      return;
+    }
+
+  sync_file_range(wb->fd, wb->dropped, end - wb->dropped,
+                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                  SYNC_FILE_RANGE_WAIT_AFTER);
+  posix_fadvise(wb->fd, wb->dropped, end - wb->dropped,
+                POSIX_FADV_DONTNEED);
+  wb->dropped = end;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * @brief Set the writeback window and the durability mode of all outputs.
+ *
+ * @param window steady writeback window in bytes, 0 to disable it
+ * @param sync_every fdatasync() every that many bytes, 0 to disable it
+ * @param sync_end fdatasync() when an output is done
+ */
+
+void writeback_setup(uint64_t window, uint64_t sync_every, bool sync_end)
+{
+  g_window     = window;
+  g_sync_every = sync_every;
+  g_sync_end   = sync_end || sync_every != 0;
+}
+
+/**
+ * @brief Start tracking the writes to an output.
+ *
+ * Pipes and terminals are left alone, they have no page cache.
+ *
+ * @param wb writeback state to initialize
+ * @param fd output file descriptor
+ * @param offset position of the first byte that will be written
+ */
+
+void writeback_begin(struct writeback_s *wb, int fd, uint64_t offset)
+{
+  struct stat sb;
+
+  wb->fd       = fd;
+  wb->pos      = offset;
+  wb->started  = offset;
+  wb->dropped  = offset;
+  wb->unsynced = 0;
+  wb->enabled  = (g_window != 0 || g_sync_end) &&
+                 fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode);
+}
+
+/**
+ * @brief Account for bytes written to an output, after the write.
+ *
+ * Writes must be sequential, from the offset given to writeback_begin().
+ *
+ * @param wb writeback state
+ * @param len amount of bytes just written
+ * @return Success (OK = 0) or a negative error
+ */
+
+int writeback_update(struct writeback_s *wb, size_t len)
+{
+  if (!wb->enabled)
+    {
+      return 0;
+    }
+
+  wb->pos      += len;
+  wb->unsynced += len;
+
+  /* Hand every completed window to the disk, drop the previous one */
+
+  while (g_window != 0 && wb->pos - wb->started >= g_window)
+    {
+      sync_file_range(wb->fd, wb->started, g_window,
+                      SYNC_FILE_RANGE_WRITE);
+      writeback_drop(wb, wb->started);
+      wb->started += g_window;
+    }
+
+  if (g_sync_every != 0 && wb->unsynced >= g_sync_every)
+    {
+      wb->unsynced = 0;
+      if (fdatasync(wb->fd) < 0)
+        {
+          return -errno;
+        }
+    }
+
+  return 0;
+}
+
+/**
+ * @brief Finish tracking an output, flushing what is left.
+ *
+ * @param wb writeback state
+ * @return Success (OK = 0) or a negative error
+ */
+
+int writeback_end(struct writeback_s *wb)
+{
+  if (!wb->enabled)
+    {
+      return 0;
+    }
+
+  wb->enabled = false;
+
+  if (g_window != 0)
+    {
+      writeback_drop(wb, wb->pos);
+    }
+
+  if (g_sync_end && fdatasync(wb->fd) < 0)
+    {
+      return -errno;
+    }
+
+  return 0;
+}
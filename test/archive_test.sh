@@ -0,0 +1,105 @@
+#!/bin/sh
+#
+# Pack files into an archive and extract them all or one by one, then
+# check that duplicate names, a wrong key and a corrupted member are
+# refused without leaving extracted garbage behind.
+#
+# Usage: archive_test.sh <path to crypt>
+
+CRYPT=${1:-./src/crypt}
+CRYPT=$(cd "$(dirname "$CRYPT")" && pwd)/$(basename "$CRYPT")
+TMP=$(mktemp -d)
+KEY="archive test k3y"
+
+trap 'rm -rf "$TMP"' EXIT
+
+fail()
+{
+  echo "FAIL: $1"
+  exit 1
+}
+
+# Names are stored relative to the current directory
+
+mkdir -p "$TMP/in/sub/dir"
+cd "$TMP/in" || fail "cd"
+head -c 5242883 /dev/urandom > big.bin
+echo "small archive member" > small.txt
+: > empty.bin
+head -c 70000 /dev/urandom > sub/dir/nested.bin
+
+FILES="big.bin small.txt empty.bin sub/dir/nested.bin"
+
+"$CRYPT" -k "$KEY" --archive -o "$TMP/files.arc" $FILES ||
+  fail "archive"
+
+# Round trip of every member
+
+"$CRYPT" -k "$KEY" --extract -i "$TMP/files.arc" -o "$TMP/all" ||
+  fail "extract all"
+for f in $FILES; do
+  cmp -s "$f" "$TMP/all/$f" || fail "$f differs"
+done
+
+# A single member, asked for twice, and a missing one
+
+"$CRYPT" -k "$KEY" --extract -i "$TMP/files.arc" -o "$TMP/one" \
+  sub/dir/nested.bin sub/dir/nested.bin || fail "extract one"
+cmp -s sub/dir/nested.bin "$TMP/one/sub/dir/nested.bin" ||
+  fail "single member differs"
+[ "$(find "$TMP/one" -type f | wc -l)" -eq 1 ] ||
+  fail "more than the asked member extracted"
+
+"$CRYPT" -k "$KEY" --extract -i "$TMP/files.arc" -o "$TMP/none" \
+  missing.bin 2>/dev/null && fail "missing member extracted"
+
+# The same name twice is refused
+
+"$CRYPT" -k "$KEY" --archive -o "$TMP/dup.arc" small.txt ./small.txt \
+  2>/dev/null && fail "duplicate names archived"
+
+# Wrong key: nothing extracted
+
+"$CRYPT" -k "archive test k3Y" --extract -i "$TMP/files.arc" \
+  -o "$TMP/wrong" 2>/dev/null && fail "extracted with a wrong key"
+[ -n "$(find "$TMP/wrong" -type f 2>/dev/null)" ] &&
+  fail "files left by a wrong key"
+
+# A corrupted byte in big.bin: it isn't left on disk, the rest is fine
+
+cp "$TMP/files.arc" "$TMP/bad.arc"
+byte=$(od -An -tu1 -j 1000000 -N 1 "$TMP/bad.arc")
+printf "\\$(printf %o $((byte ^ 1)))" |
+  dd of="$TMP/bad.arc" bs=1 seek=1000000 conv=notrunc 2>/dev/null
+cmp -s "$TMP/files.arc" "$TMP/bad.arc" && fail "corruption not written"
+"$CRYPT" -k "$KEY" --extract -i "$TMP/bad.arc" -o "$TMP/bad" \
+  2>/dev/null && fail "corrupted archive extracted"
+[ -n "$(find "$TMP/bad" -name 'big.bin*')" ] &&
+  fail "corrupted member left on disk"
+cmp -s small.txt "$TMP/bad/small.txt" || fail "intact member not extracted"
+
+# A corrupted entry count in the index is refused before anything is
+# allocated for it: flip the top bit of its first byte
+
+cp "$TMP/files.arc" "$TMP/count.arc"
+index=0
+for b in $(od -An -tu1 -j 8 -N 8 "$TMP/count.arc"); do
+  index=$((index * 256 + b))
+done
+byte=$(od -An -tu1 -j "$index" -N 1 "$TMP/count.arc")
+printf "\\$(printf %o $((byte ^ 128)))" |
+  dd of="$TMP/count.arc" bs=1 seek="$index" conv=notrunc 2>/dev/null
+cmp -s "$TMP/files.arc" "$TMP/count.arc" && fail "count not corrupted"
+"$CRYPT" -k "$KEY" --extract -i "$TMP/count.arc" -o "$TMP/count" \
+  2>/dev/null
+status=$?
+
+# The exit status is the negative errno: -EINVAL, not -ENOMEM
+
+[ "$status" -ne 0 ] || fail "corrupted entry count extracted"
+[ "$status" -eq $((256 - 22)) ] ||
+  fail "corrupted entry count not refused as invalid: $status"
+[ -n "$(find "$TMP/count" -type f 2>/dev/null)" ] &&
+  fail "files left by a corrupted entry count"
+
+echo "archive_test: PASS"
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Check the freestanding profile of libacrypt only needs what a
+# freestanding C environment provides: the compiler may call memcpy,
+# memset, memmove and memcmp, anything else (malloc, stdio, ...) fails.
+#
+# Usage: freestanding_test.sh <path to libacrypt_free.a>
+
+LIB=${1:-lib/libacrypt_free.a}
+NM=${NM:-nm}
+
+if [ ! -f "$LIB" ]; then
+  echo "FAIL: $LIB not found"
+  exit 1
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Symbols of one member of the archive used by another are fine
+
+"$NM" --defined-only "$LIB" | awk 'NF == 3 { print $3 }' | sort -u \
+  > "$TMP/defined"
+"$NM" -u "$LIB" | awk 'NF == 2 { print $2 }' | sort -u > "$TMP/undefined"
+
+# __stack_chk_fail comes from distributions enabling -fstack-protector
+
+EXTRA=$(comm -23 "$TMP/undefined" "$TMP/defined" | \
+        grep -v -x -e memcpy -e memset -e memmove -e memcmp \
+                   -e __stack_chk_fail)
+
+if [ -n "$EXTRA" ]; then
+  echo "FAIL: freestanding library needs:" $EXTRA
+  exit 1
+fi
+
+echo "freestanding_test: PASS"
@@ -0,0 +1,112 @@
+#!/bin/sh
+#
+# Write and read selected files through the LD_PRELOAD shim with
+# unmodified programs, check that only ciphertext reaches the disk and
+# that the crypt program decrypts it.
+#
+# Usage: preload_test.sh <path to libacrypt_preload.so> <path to crypt>
+
+PRELOAD=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+CRYPT=${2:-./src/crypt}
+TMP=$(mktemp -d)
+KEY="preload test k3y"
+
+trap 'rm -rf "$TMP"' EXIT
+
+fail()
+{
+  echo "FAIL: $1"
+  exit 1
+}
+
+shim()
+{
+  LD_PRELOAD="$PRELOAD" ACRYPT_PRELOAD_PATTERN="*.secret:*.vault" \
+    ACRYPT_PRELOAD_KEY="$KEY" "$@"
+}
+
+# Check that a selected file holds the expected plaintext, encrypted
+
+check()
+{
+  grep -q "preload-marker" "$1" && fail "plaintext in $1"
+  "$CRYPT" -k "$KEY" -i "$1" -o "$TMP/check.bin" || fail "decrypt $1"
+  cmp -s "$2" "$TMP/check.bin" || fail "$1 differs"
+}
+
+head -c 300000 /dev/urandom > "$TMP/random.bin"
+{
+  i=0
+  while [ $i -lt 2000 ]; do
+    echo "line $i preload-marker"
+    i=$((i + 1))
+  done
+} > "$TMP/plain.txt"
+cat "$TMP/plain.txt" "$TMP/random.bin" > "$TMP/plain.bin"
+
+# open() and write() in the shell and in cat, and a dup2() redirection
+
+shim sh -c 'cat "$1" > "$2"' sh "$TMP/plain.bin" "$TMP/a.secret" ||
+  fail "write through a redirection"
+check "$TMP/a.secret" "$TMP/plain.bin"
+
+shim cp "$TMP/plain.bin" "$TMP/b.vault" || fail "cp to a selected file"
+check "$TMP/b.vault" "$TMP/plain.bin"
+
+# Appending continues the keystream at the end of the file
+
+shim sh -c 'cat "$1" >> "$2"' sh "$TMP/plain.txt" "$TMP/a.secret" ||
+  fail "append"
+cat "$TMP/plain.bin" "$TMP/plain.txt" > "$TMP/appended.bin"
+check "$TMP/a.secret" "$TMP/appended.bin"
+
+# stdio: an inherited stdout and stderr, fdopen() of a redirected
+# stdout, fopen() and an inherited stdin for reading
+
+shim env printf '%s\n' "printf preload-marker" > "$TMP/c.secret" ||
+  fail "printf to a selected stdout"
+printf '%s\n' "printf preload-marker" > "$TMP/expect.txt"
+check "$TMP/c.secret" "$TMP/expect.txt"
+
+shim ls "$TMP/missing-preload-marker" 2> "$TMP/d.secret" &&
+  fail "ls of a missing file"
+ls "$TMP/missing-preload-marker" 2> "$TMP/expect.txt"
+check "$TMP/d.secret" "$TMP/expect.txt"
+
+shim sort -o "$TMP/e.secret" "$TMP/plain.txt" || fail "sort -o"
+sort "$TMP/plain.txt" > "$TMP/sorted.txt"
+check "$TMP/e.secret" "$TMP/sorted.txt"
+
+shim sort "$TMP/e.secret" > "$TMP/out.bin" || fail "sort of a selected file"
+cmp -s "$TMP/sorted.txt" "$TMP/out.bin" || fail "sort read back differs"
+
+shim sort < "$TMP/e.secret" > "$TMP/out.bin" || fail "sort of stdin"
+cmp -s "$TMP/sorted.txt" "$TMP/out.bin" || fail "sort stdin differs"
+
+# Reading back through the shim, from a path and from an inherited fd
+
+shim cat "$TMP/b.vault" > "$TMP/out.bin" || fail "read a selected file"
+cmp -s "$TMP/plain.bin" "$TMP/out.bin" || fail "read back differs"
+
+shim cat < "$TMP/b.vault" > "$TMP/out.bin" || fail "read from stdin"
+cmp -s "$TMP/plain.bin" "$TMP/out.bin" || fail "stdin read back differs"
+
+# Seeks: the tail of the file read back from an lseek() offset
+
+shim tail -c 1000 "$TMP/b.vault" > "$TMP/out.bin" || fail "tail"
+tail -c 1000 "$TMP/plain.bin" | cmp -s - "$TMP/out.bin" ||
+  fail "tail differs"
+
+# Unselected files are left alone
+
+shim cp "$TMP/plain.bin" "$TMP/copy.bin" || fail "unselected copy"
+cmp -s "$TMP/plain.bin" "$TMP/copy.bin" || fail "unselected file changed"
+
+# Without a key a selected file can't be opened
+
+LD_PRELOAD="$PRELOAD" ACRYPT_PRELOAD_PATTERN="*.secret" \
+  sh -c 'cat "$1" > "$2"' sh "$TMP/plain.txt" "$TMP/nokey.secret" \
+  2>/dev/null && fail "written without a key"
+[ -s "$TMP/nokey.secret" ] && fail "plaintext written without a key"
+
+echo "preload_test: PASS"
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Encrypt one file with several concurrent "crypt --range" processes
+# writing to the same output and check the merged result is identical
+# to encrypting the whole file at once.
+#
+# Usage: range_test.sh <path to crypt>
+
+CRYPT=${1:-./src/crypt}
+TMP=$(mktemp -d)
+KEY="range test k3y"
+
+trap 'rm -rf "$TMP"' EXIT
+
+# Not a multiple of any slice size on purpose
+
+head -c 5243003 /dev/urandom > "$TMP/plain.bin"
+
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/whole.bin" || exit 1
+
+# Leave a hole first, merge must report it and fail
+
+"$CRYPT" -k "$KEY" --range 0:1M -i "$TMP/plain.bin" -o "$TMP/split.bin" || exit 1
+if "$CRYPT" --merge -i "$TMP/plain.bin" -o "$TMP/split.bin" \
+     > "$TMP/missing" 2> /dev/null; then
+  echo "FAIL: merge accepted an incomplete output"
+  exit 1
+fi
+
+if [ "$(cat "$TMP/missing")" != "1048576:4194427" ]; then
+  echo "FAIL: wrong missing range: $(cat "$TMP/missing")"
+  exit 1
+fi
+
+# Fill the rest with overlapping slices in parallel, last one past EOF
+
+for range in 1M:1500K 2500K:1M 3M:1111111 4000000:8M; do
+  "$CRYPT" -k "$KEY" --range $range -i "$TMP/plain.bin" -o "$TMP/split.bin" &
+done
+wait
+
+"$CRYPT" --merge -i "$TMP/plain.bin" -o "$TMP/split.bin" || exit 1
+
+if ! cmp "$TMP/whole.bin" "$TMP/split.bin"; then
+  echo "FAIL: range encryption differs from whole file encryption"
+  exit 1
+fi
+
+echo "range_test: PASS"
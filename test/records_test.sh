@@ -0,0 +1,155 @@
+#!/bin/sh
+#
+# Encrypt a stream of length-prefixed records, then decrypt the records
+# back, in order, shuffled and one alone, and check that truncated or
+# oversized records and too large sequence numbers are refused.
+#
+# Usage: records_test.sh <path to crypt>
+
+CRYPT=${1:-./src/crypt}
+TMP=$(mktemp -d)
+
+# 13 bytes: with a power of 2 length every sequence number would start
+# the xor keystream at the same key byte and step, hiding mixed up records
+
+KEY="records k3y!!"
+
+trap 'rm -rf "$TMP"' EXIT
+
+fail()
+{
+  echo "FAIL: $1"
+  exit 1
+}
+
+# Print <value> as <bytes> big endian bytes
+
+be()
+{
+  i=$(($1 - 1))
+  while [ $i -ge 0 ]; do
+    printf "\\$(printf %o $((($2 >> (8 * i)) & 255)))"
+    i=$((i - 1))
+  done
+}
+
+# Print a record: 64-bit sequence number, 32-bit length, payload file
+
+record()
+{
+  be 8 "$1"
+  be 4 "$(wc -c < "$2")"
+  cat "$2"
+}
+
+# Print <length> bytes of <file> from <offset>
+
+slice()
+{
+  tail -c +$(($2 + 1)) "$1" | head -c "$3"
+}
+
+# A full sized payload, an empty one, the same payload twice and a
+# sequence number past 32 bits
+
+head -c 100 /dev/urandom > "$TMP/p1"
+head -c 65536 /dev/urandom > "$TMP/p2"
+: > "$TMP/p3"
+
+{
+  record 7 "$TMP/p1"
+  record 1099511627779 "$TMP/p2"
+  record 0 "$TMP/p3"
+  record 8 "$TMP/p1"
+} > "$TMP/plain.rec"
+
+# Offsets and sizes of the four records
+
+O1=0;     S1=112
+O2=112;   S2=65548
+O3=65660; S3=12
+O4=65672; S4=112
+
+[ "$(wc -c < "$TMP/plain.rec")" -eq $((O4 + S4)) ] || fail "records size"
+
+"$CRYPT" -k "$KEY" --records -i "$TMP/plain.rec" -o "$TMP/coded.rec" ||
+  fail "encrypt"
+[ "$(wc -c < "$TMP/coded.rec")" -eq $((O4 + S4)) ] || fail "output size"
+
+# Headers are kept, payloads are encrypted by sequence number
+
+for r in "$O1" "$O2" "$O3" "$O4"; do
+  [ "$(slice "$TMP/plain.rec" "$r" 12 | od -An -tx1)" = \
+    "$(slice "$TMP/coded.rec" "$r" 12 | od -An -tx1)" ] ||
+    fail "header at $r changed"
+done
+
+slice "$TMP/coded.rec" 12 100 | cmp -s - "$TMP/p1" &&
+  fail "payload not encrypted"
+slice "$TMP/coded.rec" $((O2 + 12)) 65536 | cmp -s - "$TMP/p2" &&
+  fail "full sized payload not encrypted"
+[ "$(slice "$TMP/coded.rec" 12 100 | od -An -tx1)" = \
+  "$(slice "$TMP/coded.rec" $((O4 + 12)) 100 | od -An -tx1)" ] &&
+  fail "two sequence numbers gave the same ciphertext"
+
+# Round trip in order
+
+"$CRYPT" -k "$KEY" --records -i "$TMP/coded.rec" -o "$TMP/back.rec" ||
+  fail "decrypt"
+cmp -s "$TMP/plain.rec" "$TMP/back.rec" || fail "round trip differs"
+
+# Out of order, and a record on its own
+
+{
+  slice "$TMP/coded.rec" "$O4" "$S4"
+  slice "$TMP/coded.rec" "$O2" "$S2"
+  slice "$TMP/coded.rec" "$O1" "$S1"
+  slice "$TMP/coded.rec" "$O3" "$S3"
+} > "$TMP/shuffled.rec"
+{
+  slice "$TMP/plain.rec" "$O4" "$S4"
+  slice "$TMP/plain.rec" "$O2" "$S2"
+  slice "$TMP/plain.rec" "$O1" "$S1"
+  slice "$TMP/plain.rec" "$O3" "$S3"
+} > "$TMP/expect.rec"
+
+"$CRYPT" -k "$KEY" --records -i "$TMP/shuffled.rec" -o "$TMP/out.rec" ||
+  fail "decrypt shuffled"
+cmp -s "$TMP/expect.rec" "$TMP/out.rec" || fail "shuffled records differ"
+
+slice "$TMP/coded.rec" "$O2" "$S2" > "$TMP/one.rec"
+"$CRYPT" -k "$KEY" --records -i "$TMP/one.rec" -o "$TMP/out.rec" ||
+  fail "decrypt one record"
+slice "$TMP/plain.rec" "$O2" "$S2" | cmp -s - "$TMP/out.rec" ||
+  fail "single record differs"
+
+# A truncated record and a payload over CRYPT_PACKET_MAX are refused
+
+head -c $((O4 + S4 - 1)) "$TMP/coded.rec" > "$TMP/short.rec"
+"$CRYPT" -k "$KEY" --records -i "$TMP/short.rec" -o "$TMP/out.rec" \
+  2>/dev/null && fail "truncated record accepted"
+
+head -c 65537 /dev/urandom > "$TMP/big"
+record 1 "$TMP/big" > "$TMP/big.rec"
+"$CRYPT" -k "$KEY" --records -i "$TMP/big.rec" -o "$TMP/out.rec" \
+  2>/dev/null && fail "oversized record accepted"
+
+# The largest sequence number, and the first one whose keystream would
+# wrap onto the one of record 0
+
+record 281474976710655 "$TMP/p1" > "$TMP/last.rec"
+"$CRYPT" -k "$KEY" --records -i "$TMP/last.rec" -o "$TMP/out.rec" ||
+  fail "largest sequence number refused"
+
+record 281474976710656 "$TMP/p1" > "$TMP/wrap.rec"
+"$CRYPT" -k "$KEY" --records -i "$TMP/wrap.rec" -o "$TMP/out.rec" \
+  2>/dev/null && fail "wrapping sequence number accepted"
+
+# No records at all
+
+: > "$TMP/empty.rec"
+"$CRYPT" -k "$KEY" --records -i "$TMP/empty.rec" -o "$TMP/out.rec" ||
+  fail "empty input"
+[ -f "$TMP/out.rec" ] && [ ! -s "$TMP/out.rec" ] || fail "empty output"
+
+echo "records_test: PASS"
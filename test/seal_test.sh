@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Seal and open files and pipes of several sizes, then check that changed,
+# truncated or wrongly keyed sealed files are refused.
+#
+# Usage: seal_test.sh <path to crypt>
+
+CRYPT=${1:-./src/crypt}
+TMP=$(mktemp -d)
+KEY="seal test key of 32 bytes ......"
+
+trap 'rm -rf "$TMP"' EXIT
+
+fail()
+{
+  echo "FAIL: $1"
+  exit 1
+}
+
+# Empty, exactly one chunk, and many chunks with a partial last one
+
+: > "$TMP/plain0.bin"
+head -c 65536 /dev/urandom > "$TMP/plain1.bin"
+head -c 3145739 /dev/urandom > "$TMP/plain2.bin"
+
+for n in 0 1 2; do
+  # Regular files, in parallel
+
+  "$CRYPT" -k "$KEY" --seal -i "$TMP/plain$n.bin" -o "$TMP/sealed$n.bin" ||
+    fail "seal of file $n"
+  "$CRYPT" -k "$KEY" --open -i "$TMP/sealed$n.bin" -o "$TMP/open$n.bin" ||
+    fail "open of file $n"
+  cmp -s "$TMP/plain$n.bin" "$TMP/open$n.bin" || fail "file $n differs"
+
+  # Pipes, one chunk at a time, opening what the files sealed
+
+  cat "$TMP/sealed$n.bin" | "$CRYPT" -k "$KEY" --open - | cat \
+    > "$TMP/pipe$n.bin"
+  cmp -s "$TMP/plain$n.bin" "$TMP/pipe$n.bin" || fail "pipe $n differs"
+
+  cat "$TMP/plain$n.bin" | "$CRYPT" -k "$KEY" --seal - | cat \
+    > "$TMP/psealed$n.bin"
+  "$CRYPT" -k "$KEY" --open -i "$TMP/psealed$n.bin" -o "$TMP/open$n.bin" ||
+    fail "open of pipe $n"
+  cmp -s "$TMP/plain$n.bin" "$TMP/open$n.bin" || fail "pipe $n round trip"
+done
+
+# Every file gets its own nonce
+
+cmp -s "$TMP/sealed2.bin" "$TMP/psealed2.bin" && fail "nonce reused"
+
+# A changed byte: no plaintext is left in the output file
+
+cp "$TMP/sealed2.bin" "$TMP/bad.bin"
+printf 'X' | dd of="$TMP/bad.bin" bs=1 seek=1000000 conv=notrunc 2>/dev/null
+"$CRYPT" -k "$KEY" --open -i "$TMP/bad.bin" -o "$TMP/open.bin" \
+  2>/dev/null && fail "changed file opened"
+[ -s "$TMP/open.bin" ] && fail "plaintext of a changed file left behind"
+
+cat "$TMP/bad.bin" | "$CRYPT" -k "$KEY" --open - 2>/dev/null > /dev/null &&
+  fail "changed pipe opened"
+
+# One or two whole chunks dropped from the end, or only a few bytes
+
+size=$(wc -c < "$TMP/sealed2.bin")
+for cut in 27 65579 7; do
+  head -c $((size - cut)) "$TMP/sealed2.bin" > "$TMP/short.bin"
+  "$CRYPT" -k "$KEY" --open -i "$TMP/short.bin" -o "$TMP/open.bin" \
+    2>/dev/null && fail "file cut by $cut opened"
+  cat "$TMP/short.bin" | "$CRYPT" -k "$KEY" --open - 2>/dev/null \
+    > /dev/null && fail "pipe cut by $cut opened"
+done
+
+# Wrong key, and a key of the wrong size
+
+"$CRYPT" -k "seal test key of 32 bytes .....!" --open \
+  -i "$TMP/sealed1.bin" -o "$TMP/open.bin" 2>/dev/null &&
+  fail "opened with a wrong key"
+"$CRYPT" -k "short" --seal -i "$TMP/plain1.bin" -o "$TMP/open.bin" \
+  2>/dev/null && fail "sealed with a short key"
+
+echo "seal_test: PASS"
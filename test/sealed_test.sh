@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# Check that the literal sealed by cryptest_cxx is only in its binary as
+# ciphertext, while the reversed copy the test compares with is found.
+#
+# Usage: sealed_test.sh <path to cryptest_cxx>
+
+BIN=${1:-./src/cryptest_cxx}
+
+fail()
+{
+  echo "FAIL: $1"
+  exit 1
+}
+
+# libtool leaves a wrapper script in place of a dynamically linked program
+
+LT="$(dirname "$BIN")/.libs/$(basename "$BIN")"
+[ -f "$LT" ] && BIN=$LT
+[ -f "$BIN" ] || fail "$BIN not found"
+
+grep -q -a "laretil delaes tpyrca" "$BIN" ||
+  fail "reference text not found in $BIN"
+grep -q -a "acrypt sealed literal" "$BIN" && fail "sealed text in $BIN"
+
+echo "sealed_test: PASS"
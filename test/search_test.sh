@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Search encrypted files for a pattern, one match crossing the boundary
+# of two decrypted windows, and check nothing matches in another file or
+# with a wrong key.
+#
+# Usage: search_test.sh <path to crypt>
+
+CRYPT=${1:-./src/crypt}
+TMP=$(mktemp -d)
+KEY="search test key"
+NEEDLE="needle-5f3a9c"
+
+trap 'rm -rf "$TMP"' EXIT
+
+fail()
+{
+  echo "FAIL: $1"
+  exit 1
+}
+
+# Matches at 1000, across the 256 KiB window at 262140, and at the end
+
+head -c 600000 /dev/zero > "$TMP/plain.bin"
+for off in 1000 262140 599987; do
+  printf '%s' "$NEEDLE" | dd of="$TMP/plain.bin" bs=1 seek=$off \
+    conv=notrunc 2>/dev/null
+done
+
+head -c 70000 /dev/zero > "$TMP/other.bin"
+
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/a.enc" || fail "encrypt a"
+"$CRYPT" -k "$KEY" -i "$TMP/other.bin" -o "$TMP/b.enc" || fail "encrypt b"
+
+"$CRYPT" -k "$KEY" --search "$NEEDLE" "$TMP/a.enc" "$TMP/b.enc" \
+  > "$TMP/found.txt" || fail "pattern not found"
+sort "$TMP/found.txt" > "$TMP/sorted.txt"
+printf '%s\n' "$TMP/a.enc:1000" "$TMP/a.enc:262140" "$TMP/a.enc:599987" \
+  | sort > "$TMP/expect.txt"
+cmp -s "$TMP/expect.txt" "$TMP/sorted.txt" || fail "wrong matches"
+
+# No match: exit status 1, nothing printed
+
+"$CRYPT" -k "$KEY" --search "$NEEDLE" "$TMP/b.enc" > "$TMP/none.txt" &&
+  fail "match in a file without the pattern"
+[ -s "$TMP/none.txt" ] && fail "output without a match"
+
+"$CRYPT" -k "wrong key" --search "$NEEDLE" "$TMP/a.enc" > /dev/null &&
+  fail "match with a wrong key"
+
+echo "search_test: PASS"
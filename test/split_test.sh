@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# Split files into encrypted shards and join them back, in order or not,
+# then check that a missing shard or a file that isn't a shard is refused.
+#
+# Usage: split_test.sh <path to crypt>
+
+CRYPT=${1:-./src/crypt}
+TMP=$(mktemp -d)
+KEY="split test k3y"
+
+trap 'rm -rf "$TMP"' EXIT
+
+fail()
+{
+  echo "FAIL: $1"
+  exit 1
+}
+
+# Not a multiple of the shard size on purpose
+
+head -c 3145739 /dev/urandom > "$TMP/plain.bin"
+
+"$CRYPT" -k "$KEY" --split 1M -i "$TMP/plain.bin" -o "$TMP/shard" ||
+  fail "split"
+[ "$(ls "$TMP" | grep -c '^shard\.')" -eq 4 ] || fail "not 4 shards"
+[ "$(wc -c < "$TMP/shard.003")" -lt 1048576 ] || fail "last shard size"
+
+# Shards are encrypted, and each one decrypts on its own
+
+cmp -s "$TMP/plain.bin" "$TMP/shard.000" && fail "shard not encrypted"
+
+"$CRYPT" -k "$KEY" --join -o "$TMP/one.bin" "$TMP/shard.001" 2>/dev/null &&
+  fail "a lone middle shard joined"
+
+# Round trip, in order and shuffled
+
+"$CRYPT" -k "$KEY" --join -o "$TMP/join.bin" "$TMP"/shard.* ||
+  fail "join"
+cmp -s "$TMP/plain.bin" "$TMP/join.bin" || fail "join differs"
+
+"$CRYPT" -k "$KEY" --join -o "$TMP/shuffled.bin" "$TMP/shard.002" \
+  "$TMP/shard.000" "$TMP/shard.003" "$TMP/shard.001" || fail "shuffled join"
+cmp -s "$TMP/plain.bin" "$TMP/shuffled.bin" || fail "shuffled join differs"
+
+# A missing shard is refused and no output is written
+
+"$CRYPT" -k "$KEY" --join -o "$TMP/missing.bin" "$TMP/shard.000" \
+  "$TMP/shard.001" "$TMP/shard.003" 2>/dev/null &&
+  fail "joined with a missing shard"
+[ -e "$TMP/missing.bin" ] && fail "output written with a missing shard"
+
+# Something that isn't a shard
+
+"$CRYPT" -k "$KEY" --join -o "$TMP/bad.bin" "$TMP/shard.000" \
+  "$TMP/plain.bin" 2>/dev/null && fail "joined a file that isn't a shard"
+
+# Empty input, and a shard size bigger than the input
+
+: > "$TMP/empty.bin"
+"$CRYPT" -k "$KEY" --split 1M -i "$TMP/empty.bin" -o "$TMP/empty" ||
+  fail "split of an empty file"
+"$CRYPT" -k "$KEY" --join -o "$TMP/empty.out" "$TMP"/empty.0* ||
+  fail "join of an empty file"
+[ -f "$TMP/empty.out" ] && [ ! -s "$TMP/empty.out" ] ||
+  fail "empty file round trip"
+
+head -c 1000 "$TMP/plain.bin" > "$TMP/small.bin"
+"$CRYPT" -k "$KEY" --split 64K -i "$TMP/small.bin" -o "$TMP/small" ||
+  fail "split of a small file"
+[ -e "$TMP/small.001" ] && fail "more than one shard for a small file"
+"$CRYPT" -k "$KEY" --join -o "$TMP/small.out" "$TMP/small.000" ||
+  fail "join of a small file"
+cmp -s "$TMP/small.bin" "$TMP/small.out" || fail "small file differs"
+
+# A bad size
+
+"$CRYPT" -k "$KEY" --split 0 -i "$TMP/plain.bin" -o "$TMP/zero" \
+  2>/dev/null && fail "shard size 0 accepted"
+
+echo "split_test: PASS"
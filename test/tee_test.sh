@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Encrypt one file to several outputs at once, regular files and pipes,
+# and check each of them is identical to a single output run.
+#
+# Usage: tee_test.sh <path to crypt>
+
+CRYPT=${1:-./src/crypt}
+TMP=$(mktemp -d)
+KEY="tee test k3y"
+
+trap 'rm -rf "$TMP"' EXIT
+
+head -c 3145739 /dev/urandom > "$TMP/plain.bin"
+
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/whole.bin" || exit 1
+
+# Two pipes, so they are fed by tee(2) and splice(2)
+
+mkfifo "$TMP/fifo1" "$TMP/fifo2"
+cat "$TMP/fifo1" > "$TMP/pipe1.bin" &
+cat "$TMP/fifo2" > "$TMP/pipe2.bin" &
+
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/file1.bin" \
+  -o "$TMP/fifo1" -o "$TMP/file2.bin" -o "$TMP/fifo2" || exit 1
+wait
+
+for out in file1 file2 pipe1 pipe2; do
+  if ! cmp -s "$TMP/whole.bin" "$TMP/$out.bin"; then
+    echo "FAIL: $out differs from the single output"
+    exit 1
+  fi
+done
+
+echo "tee_test: PASS"
@@ -0,0 +1,125 @@
+#!/bin/sh
+#
+# Run crypt under read, write and CPU limits and check that they slow it
+# down, then lift a limit while it runs through the control file, once by
+# changing it and once by SIGHUP, and check that it speeds up. Every
+# output must still be right.
+#
+# Usage: throttle_test.sh <path to crypt>
+
+CRYPT=${1:-./src/crypt}
+TMP=$(mktemp -d)
+KEY="throttle test k3y"
+PID=
+
+trap '[ -n "$PID" ] && kill "$PID" 2>/dev/null; rm -rf "$TMP"' EXIT
+
+fail()
+{
+  echo "FAIL: $1"
+  exit 1
+}
+
+# Milliseconds since an arbitrary point
+
+now()
+{
+  echo $(($(date +%s%N) / 1000000))
+}
+
+# Run crypt on plain.bin with some options, 'ms' is how long it took
+
+timed()
+{
+  start=$(now)
+  "$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/out.bin" "$@" ||
+    fail "crypt $*"
+  ms=$(($(now) - start))
+  cmp -s "$TMP/ref.bin" "$TMP/out.bin" || fail "crypt $* differs"
+}
+
+# Wait for the background crypt, 'ms' is how long it took since 'start'
+
+finish()
+{
+  wait "$PID" || fail "$1"
+  ms=$(($(now) - start))
+  PID=
+  cmp -s "$TMP/ref.bin" "$TMP/out.bin" || fail "$1 differs"
+}
+
+head -c 3145728 /dev/urandom > "$TMP/plain.bin"
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/ref.bin" || fail "encrypt"
+
+# 3 MiB at 2 MiB/s, less the 0.1 s burst of an idle bucket: 1.4 s
+
+timed --limit-read 2M
+[ "$ms" -ge 1200 ] || fail "read limit: 3M in $ms ms"
+
+timed --limit-write 2M
+[ "$ms" -ge 1200 ] || fail "write limit: 3M in $ms ms"
+
+# 0 is no limit
+
+timed --limit-read 0 --limit-write 0
+[ "$ms" -lt 1200 ] || fail "no limit: 3M in $ms ms"
+
+# A quarter of a CPU: at least twice as long as without limit
+
+head -c 33554432 /dev/urandom > "$TMP/plain.bin"
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/ref.bin" || fail "encrypt"
+
+timed
+free=$ms
+timed --limit-cpu 25
+[ "$ms" -ge $((2 * free)) ] ||
+  fail "CPU limit: $ms ms, $free ms without it"
+
+# The control file sets the limits, and lifting the read limit of an
+# 8 MiB run at 512 KiB/s lets it end well before its 16 s
+
+head -c 8388608 /dev/urandom > "$TMP/plain.bin"
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/ref.bin" || fail "encrypt"
+
+echo "read 512K" > "$TMP/limits"
+start=$(now)
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/out.bin" \
+  --limit-file "$TMP/limits" &
+PID=$!
+sleep 1
+kill -0 "$PID" 2>/dev/null || fail "control file limit not applied"
+echo "read 0" > "$TMP/limits"
+finish "control file"
+[ "$ms" -lt 8000 ] || fail "control file change ignored: $ms ms"
+
+# Same with SIGHUP, the new file keeping the old time so only the signal
+# tells crypt to read it again
+
+echo "# comment, then the limits
+read 512K
+write 0
+cpu 0" > "$TMP/limits"
+touch -r "$TMP/limits" "$TMP/stamp"
+start=$(now)
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/out.bin" \
+  --limit-file "$TMP/limits" &
+PID=$!
+sleep 1
+echo "read 0" > "$TMP/limits.new"
+touch -r "$TMP/stamp" "$TMP/limits.new"
+mv "$TMP/limits.new" "$TMP/limits"
+sleep 2
+kill -0 "$PID" 2>/dev/null || fail "limit lifted without SIGHUP"
+kill -HUP "$PID"
+finish "SIGHUP"
+[ "$ms" -lt 10000 ] || fail "SIGHUP ignored: $ms ms"
+
+# Bad limits
+
+for opt in "--limit-cpu 101" "--limit-cpu x" "--limit-read x" \
+           "--limit-write -1"; do
+  "$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/bad.bin" $opt \
+    2>/dev/null && fail "$opt accepted"
+done
+
+echo "throttle_test: PASS"
@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# Encrypt with a steady writeback window and every durability mode, to a
+# file, to a redirected stdout and to a pipe, check the output is the
+# same as without them, and that bad sizes and modes are refused.
+#
+# Usage: writeback_test.sh <path to crypt>
+
+CRYPT=${1:-./src/crypt}
+TMP=$(mktemp -d)
+KEY="writeback test k3y"
+
+trap 'rm -rf "$TMP"' EXIT
+
+fail()
+{
+  echo "FAIL: $1"
+  exit 1
+}
+
+# Several windows and syncs, the last ones partial
+
+head -c 5242887 /dev/urandom > "$TMP/plain.bin"
+
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/ref.bin" || fail "encrypt"
+cmp -s "$TMP/plain.bin" "$TMP/ref.bin" && fail "output not encrypted"
+
+# Every durability mode, with and without a writeback window
+
+for sync in none end 1M 3000000; do
+  for wb in "" 1M 64K; do
+    name="sync $sync${wb:+ writeback $wb}"
+
+    "$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/out.bin" \
+      --sync "$sync" ${wb:+--writeback "$wb"} || fail "$name"
+    cmp -s "$TMP/ref.bin" "$TMP/out.bin" || fail "$name differs"
+
+    "$CRYPT" -k "$KEY" -i "$TMP/out.bin" -o "$TMP/back.bin" \
+      --sync "$sync" ${wb:+--writeback "$wb"} || fail "$name decrypt"
+    cmp -s "$TMP/plain.bin" "$TMP/back.bin" || fail "$name round trip"
+  done
+done
+
+# Writeback alone, without --sync
+
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/out.bin" \
+  --writeback 100000 || fail "writeback only"
+cmp -s "$TMP/ref.bin" "$TMP/out.bin" || fail "writeback only differs"
+
+# A redirected stdout starting past the beginning of the file, and a
+# pipe, which has no page cache to write back
+
+printf 'header' > "$TMP/stdout.bin"
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" --writeback 1M --sync 2M \
+  >> "$TMP/stdout.bin" || fail "stdout"
+{ printf 'header'; cat "$TMP/ref.bin"; } | cmp -s - "$TMP/stdout.bin" ||
+  fail "stdout differs"
+
+"$CRYPT" -k "$KEY" -i "$TMP/plain.bin" --writeback 1M --sync end |
+  cat > "$TMP/pipe.bin" || fail "pipe"
+cmp -s "$TMP/ref.bin" "$TMP/pipe.bin" || fail "pipe differs"
+
+# The other modes use them too
+
+"$CRYPT" -k "$KEY" --split 2M -i "$TMP/plain.bin" -o "$TMP/shard" \
+  --writeback 512K --sync 1M || fail "split"
+"$CRYPT" -k "$KEY" --join -o "$TMP/join.bin" --sync end "$TMP"/shard.* ||
+  fail "join"
+cmp -s "$TMP/plain.bin" "$TMP/join.bin" || fail "split and join differ"
+
+# Bad sizes and modes
+
+for opt in "--writeback 0" "--writeback x" "--sync 0" "--sync always" \
+           "--sync -1"; do
+  "$CRYPT" -k "$KEY" -i "$TMP/plain.bin" -o "$TMP/bad.bin" $opt \
+    2>/dev/null && fail "$opt accepted"
+done
+
+echo "writeback_test: PASS"